@@ -102,9 +102,9 @@ errno_t get_stats_record( int id, struct kernel_stats *out );
 #define     OBJECT_FREE                             36
 #define     OBJECT_SATURATE                         37
 
-#define     STAT_skip7                              38
-#define     STAT_skip8                              39
-#define     STAT_skip9                              40
+#define     OBJECT_TLAB_REFILL                      38
+#define     OBJECT_ALLOC_LOCK_WAIT                  39
+#define     OBJECT_FREE_LIST_HIT                    40
 
 #define     STAT_CNT_THREAD_SW                      41
 #define     STAT_CNT_THREAD_SAME                    42
@@ -112,12 +112,34 @@ errno_t get_stats_record( int id, struct kernel_stats *out );
 #define     STAT_CNT_THREAD_BLOCK                   43
 #define     STAT_CNT_THREAD_IDLE                    44
 
-#define     STAT_skip10                             45
-#define     STAT_skip11                             46
+#define     OBJECT_CYCLE_CANDIDATES                 45
+#define     OBJECT_CYCLE_FREE                       46
 
 #define     STAT_CNT_INTERRUPT                      47
 #define     STAT_CNT_SOFTINT                        48
 
+// GC pause histogram
+#define     GC_PAUSE_100US                          49
+#define     GC_PAUSE_1MS                            50
+#define     GC_PAUSE_10MS                           51
+#define     GC_PAUSE_100MS                          52
+#define     GC_PAUSE_LONG                           53
+
+#define     VM_CALL_FRAME_REUSE                     54
+#define     VM_IC_HIT                               55
+#define     VM_IC_MISS                              56
+
+#define     VM_INTERN_HIT                           57
+#define     VM_INTERN_MISS                          58
+
+#define     VM_REFDEC_SPILL                         59
+#define     VM_REFDEC_WAIT                          60
+
+#define     VM_CLASS_LOAD                           61
+#define     VM_CLASS_LOAD_SHARED                    62
+
+#define     VM_ALLOC_PROF_SAMPLE                    63
+
 void stat_increment_counter( int nCounter );
 
 #define STAT_INC_CNT( ___nCounter ) do { \
@@ -15,4 +15,7 @@
 
 errno_t plain_lzma_decode( void *dest, size_t *dest_len, void *src, size_t *src_len, int logLevel );
 
+// .lzma (LZMA_Alone) stream - props and size header, then data
+errno_t lzma_alone_decode( void *dest, size_t *dest_len, void *src, size_t *src_len, int logLevel );
+
 #endif // LZMA_H
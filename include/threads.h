@@ -208,6 +208,9 @@ void hal_set_thread_death_handler(void (*handler)( phantom_thread_t * ));
 
 
 int phantom_vm_threads_get_count(void);
+// Kernel thread which runs VM code by itself, see vm/class_loader.c
+void phantom_vm_threads_add(void);
+void phantom_vm_threads_remove(void);
 
 void hal_set_thread_name(const char *name);
 
@@ -57,6 +57,16 @@ void ref_inc_p(pvm_object_storage_t *p);
 
 void do_ref_dec_p(pvm_object_storage_t *p); // for deferred refdec
 
+// Deferred refcount decrement, see refdec.c
+void deferred_refdec(pvm_object_storage_t *p);
+// VM threads wait at safepoint while set, refdec thread is behind
+extern volatile int refdec_backpressure;
+// Keep refdec thread from changing counts (cycle collector, GC roots scan)
+void pvm_refdec_pause(void);
+void pvm_refdec_resume(void);
+// Call func for each object with pending decrement, they are GC roots
+void pvm_refdec_gc_mark( void (*func)( pvm_object_storage_t *op ) );
+
 
 
 // ------------------------------------------------------------
@@ -70,12 +80,113 @@ void * get_pvm_object_space_start(void);
 void * get_pvm_object_space_end(void);
 
 void refzero_process_children( pvm_object_storage_t *o );
+
+// Ask threads to give allocation buffers back to arenas, called by GC
+void pvm_alloc_retire_all_tlabs(void);
+// Release thread local allocation buffers of dead thread
+void pvm_alloc_thread_exit( tid_t tid );
 void ref_saturate_p(pvm_object_storage_t *p);
 
 // called by refcount code - collapse free objects and attempt to 
 // unmap 'em
 void pvm_collapse_free(pvm_object_storage_t *op); 
 
+// called by refcount code and GC - remember free object for reuse
+void pvm_alloc_note_free(pvm_object_storage_t *op);
+
+
+// Heap and GC counters, see pvm_bench.c
+struct pvm_alloc_stats
+{
+    long                        allocs;         // objects ever allocated
+    long                        alloc_bytes;    // sizes as requested
+    long                        live_bytes;
+    long                        peak_bytes;     // max of live_bytes since reset
+
+    int                         gc_pauses;
+    bigtime_t                   gc_pause_total; // microseconds
+    bigtime_t                   gc_pause_max;   // since reset
+};
+
+void pvm_alloc_get_stats( struct pvm_alloc_stats *s );
+// Start new peak heap and max pause measurement
+void pvm_alloc_reset_peaks(void);
+
+void gc_get_pause_stats( struct pvm_alloc_stats *s );
+void gc_reset_pause_max(void);
+
+
+// Per class allocation profile, see alloc_prof.c
+
+#define PVM_ALLOC_PROF_NAME     48
+
+struct pvm_alloc_prof_rec
+{
+    char                        name[PVM_ALLOC_PROF_NAME];
+    long                        allocs;
+    long                        frees;
+    long                        alloc_bytes;
+    long                        free_bytes;
+};
+
+extern volatile int pvm_alloc_prof_enabled;
+
+void pvm_alloc_prof_enable( int on );
+void pvm_alloc_prof_reset(void);
+// Record n of the profile, ENOENT if no more
+errno_t pvm_alloc_prof_get( int n, struct pvm_alloc_prof_rec *out );
+
+// Called if pvm_alloc_prof_enabled, object class must be set
+void pvm_alloc_prof_note_alloc( pvm_object_storage_t *p );
+void pvm_alloc_prof_note_free( pvm_object_storage_t *p );
+
+
+// Cycle collector candidates buffer, kept in persistent binary object
+struct cycle_root_buffer
+{
+    int                         count;
+    pvm_object_storage_t *      roots[];
+};
+
+#define CYCLE_ROOT_BUFFER_SIZE 4096
+#define CYCLE_ROOT_BUFFER_DA_SIZE (sizeof(struct cycle_root_buffer) + CYCLE_ROOT_BUFFER_SIZE * sizeof(pvm_object_storage_t *))
+
+void gc_set_cycle_root_buffer( void *data, size_t size );
+// Collect garbage cycles from candidates buffer, VM threads must be stopped
+void gc_collect_cycles(void);
+
+
+// Mark/sweep GC, see gc.c
+
+extern volatile int gc_marking;
+
+void gc_shade_object( pvm_object_storage_t *p );
+
+// Write barrier - call for the old value of reference being overwritten or dropped
+static inline void gc_write_barrier( pvm_object_storage_t *old )
+{
+    if( gc_marking && old && !pvm_is_tagged_int_p( old ) ) gc_shade_object( old );
+}
+
+void gc_mark_bitmap_init( void *start, unsigned int size );
+int gc_is_marked( pvm_object_storage_t *p );
+// Nonzero if some arena is not swept after last marking
+int pvm_alloc_sweep_pending( void );
+void gc_mark_new_object( pvm_object_storage_t *p );
+// Called by allocator sweep for unmarked object, returns number of freed objects
+int gc_sweep_object( pvm_object_storage_t *p );
+// Ask GC thread to start a cycle
+void gc_request_run(void);
+
+// Lazy sweep, allocator lock must be taken
+void pvm_alloc_sweep_start(void);
+// Returns number of freed objects
+int pvm_alloc_sweep_finish(void);
+// Call func for each object of stack arena
+void pvm_alloc_scan_stacks( void (*func)( pvm_object_storage_t *op ) );
+// Call func for each allocated object
+void pvm_alloc_scan_objects( void (*func)( pvm_object_storage_t *op ) );
+
 
 
 
@@ -100,6 +211,19 @@ void pvm_collapse_free(pvm_object_storage_t *op);
 // and this is for objects already in cycle candidates buffer -
 #define PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER 0x08
 
+// Cycle collector colors, see gc.c. Set only while collector runs,
+// object is black (none of them) otherwise.
+#define PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY 0x20
+#define PVM_OBJECT_AH_ALLOCATOR_FLAG_WHITE 0x40
+
+// Free space which is a part of some thread's allocation buffer, see alloc.c.
+// Joined with 0x00, refCount keeps owner id. Allocator walk skips it.
+#define PVM_OBJECT_AH_ALLOCATOR_FLAG_RESERVED 0x10
+
+// Was set when refdec thread got decrement for object. Refcount and
+// flags are always changed atomically now, may be found in old snapshots.
+#define PVM_OBJECT_AH_ALLOCATOR_FLAG_SHARED 0x80
+
 
 // ------------------------------------------------------------
 // Persistent arenas machinery - in progress
@@ -22,12 +22,40 @@ typedef int (*pvm_bulk_seek_t)(int pos);
 
 #define PVM_BULK_CN_LENGTH 512
 
+// Old format: class head, class file, next class head...
 struct pvm_bulk_class_head
 {
     char        name[PVM_BULK_CN_LENGTH];
     u_int32_t   data_length;
 };
 
+
+// Indexed format: file head, index, class bodies.
+
+#define PVM_BULK_MAGIC          0x4B4C4250      // "PBLK"
+#define PVM_BULK_VERSION        1
+
+struct pvm_bulk_head
+{
+    u_int32_t   magic;
+    u_int32_t   version;
+    u_int32_t   n_classes;
+    u_int32_t   index_size;     // entries and names, follows this head
+};
+
+// Body is .lzma stream: 5 bytes of props, 8 bytes of size, data
+#define PVM_BULK_FLAG_LZMA      0x1
+
+// Entries are sorted by name. Name is '.' separated, no leading '.'.
+struct pvm_bulk_index_entry
+{
+    u_int32_t   name_offset;    // from index start, 0-terminated
+    u_int32_t   data_offset;    // from file start
+    u_int32_t   stored_length;  // in file
+    u_int32_t   data_length;    // class file, unpacked
+    u_int32_t   flags;
+};
+
 int pvm_load_class_from_module( const char *class_name, struct pvm_object *out );
 int pvm_load_class_from_memory( const void *data, int fsize, struct pvm_object *out );
 void pvm_bulk_init( pvm_bulk_seek_t sf, pvm_bulk_read_t rd );
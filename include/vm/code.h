@@ -8,6 +8,8 @@
  *
 **/
 
+#ifndef PVM_CODE_H
+#define PVM_CODE_H
 
 #include <vm/internal_da.h>
 
@@ -32,3 +34,59 @@ struct vm_code_linenum
 	int         line;
 };
 
+
+// Pre-decoded code, see code_cache.c
+
+// Static exception catcher: try body range and its handler
+struct pvm_code_catch
+{
+    unsigned int                begin;          // IP after push_catcher
+    unsigned int                end;            // IP of pop_catcher
+    unsigned int                handler;        // jump here on catch
+    int                         name;           // class name constant index
+    int                         parent;         // enclosing catch or -1
+};
+
+struct pvm_code_decoded
+{
+    struct pvm_code_decoded *   next;           // hash chain
+    const unsigned char *       code;           // key - code object bytes
+    unsigned int                size;
+    unsigned int                bytes;          // allocated for this entry
+    int                         invalid;        // can't be decoded, execute as is
+
+    int                         n_consts;
+    pvm_object_t *              consts;         // string constants
+
+    int                         n_catches;      // -1 if catchers are pushed at run time
+    struct pvm_code_catch *     catches;        // sorted by begin
+
+    int                         calls;          // counted by interpreter, see jit.c
+    void                        (*jit_entry)( struct data_area_4_thread *da ); // compiled code or 0
+    void *                      jit_mem;
+    unsigned int                jit_bytes;      // size of compiled code
+
+    int                         ops[];          // operands, indexed by IP
+};
+
+// Returns 0 if code can't be pre-decoded
+struct pvm_code_decoded * pvm_code_cache_get( const unsigned char *code, unsigned int size );
+
+// Code object is freed
+void                    pvm_code_cache_forget( const unsigned char *code );
+
+// Size of instruction at ip of checked code
+int                     pvm_code_cache_insn_size( const struct pvm_code_decoded *d, unsigned int ip );
+
+// Innermost static catch around ip, -1 if none
+int                     pvm_code_cache_find_catch( const struct pvm_code_decoded *d, unsigned int ip );
+
+// Decode, but don't keep in cache and don't look at budget. Free with pvm_code_cache_free_uncached()
+struct pvm_code_decoded * pvm_code_cache_get_uncached( const unsigned char *code, unsigned int size );
+void                    pvm_code_cache_free_uncached( struct pvm_code_decoded *d );
+
+// GC mark start - strings are referenced from here
+void                    pvm_code_cache_gc_mark( void (*shade)( pvm_object_storage_t *p ) );
+
+
+#endif // PVM_CODE_H
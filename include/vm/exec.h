@@ -15,6 +15,31 @@
 
 
 #include <vm/internal_da.h>
+#include <vm/syscall_tools.h>
+
+
+// Use GCC computed goto for the bytecode dispatch, see exec.c.
+// Build with -DPVM_EXEC_THREADED=0 to get plain switch.
+#ifndef PVM_EXEC_THREADED
+#  ifdef __GNUC__
+#    define PVM_EXEC_THREADED 1
+#  else
+#    define PVM_EXEC_THREADED 0
+#  endif
+#endif
+
+// Compile hot methods to native code, see jit.c. x86 only.
+// Build with -DPVM_JIT=0 to switch off.
+#ifndef PVM_JIT
+#  if defined(ARCH_ia32) || defined(ARCH_amd64)
+#    define PVM_JIT 1
+#  else
+#    define PVM_JIT 0
+#  endif
+#endif
+
+// Method is compiled on this call
+#define PVM_JIT_THRESHOLD 1000
 
 
 void pvm_exec(struct pvm_object current_thread);
@@ -27,10 +52,29 @@ void pvm_exec_load_fast_acc(struct data_area_4_thread *da);
 //! Save current thread data from fast access copy fields in thread object data area to actual places. In fact just IP is saved.
 void pvm_exec_save_fast_acc(struct data_area_4_thread *da);
 
+//! Drop volatile thread state (frame pool, decoded code) on restart, before thread is run
+void pvm_exec_restart_thread(struct pvm_object thread);
+
 
 struct pvm_object_storage * pvm_exec_find_method( struct pvm_object o, unsigned method_index );
 void pvm_exec_set_cs( struct data_area_4_call_frame* cfda, struct pvm_object_storage * code );
 
+// Inline caches, see icache.c. Site is call instruction address in bytecode.
+struct pvm_object_storage * pvm_ic_find_method( const void *site, struct pvm_object o, unsigned method_index );
+int pvm_ic_find_method_ordinal( const void *site, pvm_object_t tclass, pvm_object_t mname );
+//! Cached pvm_object_class_is()
+int pvm_ic_class_is( pvm_object_t o, pvm_object_t tclass );
+//! Forget everything, call if class or interface is freed
+void pvm_ic_flush(void);
+
+
+//! Syscall of object's internal class, 0 if class is not internal
+syscall_func_t pvm_exec_get_syscall( struct pvm_object o, unsigned int syscall_index );
+
+//! Call syscall from C code with args passed as for pvm_exec_run_method.
+//! Returns 0 if syscall throws, *ret is exception then.
+int pvm_exec_run_syscall( struct data_area_4_thread *da, struct pvm_object o, unsigned int syscall_index, int n_args, struct pvm_object args[], struct pvm_object *ret );
+
 
 struct pvm_object
 pvm_exec_run_method(
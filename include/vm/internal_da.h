@@ -15,6 +15,7 @@
 
 
 #include <vm/object.h>
+#include <vm/object_flags.h>
 #include <vm/exception.h>
 //#include <drv_video_screen.h>
 
@@ -121,8 +122,14 @@ struct data_area_4_int
     int				value;
 };
 
-// TODO: make sure it is not an lvalue for security reasons!
-#define pvm_get_int( o )  ( (int) (((struct data_area_4_int *)&(o.data->da))->value))
+// Int can be tagged or boxed, see object.h
+static inline int pvm_get_int( struct pvm_object o )
+{
+    if( pvm_is_tagged_int( o ) )
+        return pvm_tagged_int_value( o );
+
+    return ((struct data_area_4_int *)&(o.data->da))->value;
+}
 
 struct data_area_4_long
 {
@@ -140,10 +147,40 @@ struct data_area_4_string
     unsigned char		data[];
 };
 
+// String object with PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE, result of concatenation.
+// Has no data, it is copied to flat string on first access. See rope.c.
+struct data_area_4_rope
+{
+    int				length; // same place as in data_area_4_string
+    int				depth;  // longest path to flat string
+    pvm_object_t		left;
+    pvm_object_t		right;
+    pvm_object_t		flat;   // 0 till flattened, then left and right are 0
+};
+
+struct data_area_4_string * pvm_string_flatten( pvm_object_t s );
+
+// Use this and not pvm_object_da( s, string ) - string can be a rope
+static inline struct data_area_4_string * pvm_string_da( pvm_object_t s )
+{
+    if( s.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE )
+        return pvm_string_flatten( s );
+    return (struct data_area_4_string *)&(s.data->da);
+}
+
 #define pvm_get_str_len( o )  ( (int) (((struct data_area_4_string *)&(o.data->da))->length))
-#define pvm_get_str_data( o )  ( (char *) (((struct data_area_4_string *)&(o.data->da))->data))
+#define pvm_get_str_data( o )  ( (char *) (pvm_string_da( o )->data))
 
 int pvm_strcmp(pvm_object_t s1, pvm_object_t s2);
+int pvm_streq(pvm_object_t s1, pvm_object_t s2);
+pvm_object_t pvm_string_concat(pvm_object_t s1, pvm_object_t s2);
+
+// Interned strings, see intern.c
+pvm_object_t pvm_intern_binary(const char *data, int len);
+pvm_object_t pvm_intern_string(pvm_object_t s); // consumes s
+void pvm_intern_forget(pvm_object_storage_t *p);
+void pvm_intern_forget_dead(pvm_object_storage_t *p);
+pvm_object_t pvm_create_intern_table(void);
 
 
 // NB! See JIT assembly hardcode for object structure offsets
@@ -202,7 +239,14 @@ struct data_area_4_thread
 
 // fast access copies
 
-    struct pvm_object  				_this_object; 	// Loaded by load_fast_acc from call_frame
+    // These two are in place of _this_object copy, so that thread data
+    // area size is not changed. Both are dropped on restart, as old
+    // snapshots have this object here, see pvm_exec_restart_thread().
+
+    // Released call frames kept for reuse, linked through prev field.
+    // IP of pool head frame is number of frames in pool, see exec.c
+    pvm_object_storage_t *              frame_pool;
+    struct pvm_code_decoded *           _decoded;       // Loaded by load_fast_acc, 0 if code is not pre-decoded
 
     struct data_area_4_integer_stack *		_istack;        // Loaded by load_fast_acc from call_frame
     struct data_area_4_object_stack *		_ostack;        // Loaded by load_fast_acc from call_frame
@@ -236,20 +280,21 @@ struct pvm_stack_da_common
 
     /**
      *
-     * Current (last created) page of the stack.
+     * Current page of the stack, keeps all the cells. It is the root
+     * page itself or a bigger one which replaced it on overflow.
      * This field is used in root stack page only.
      *
      * See curr_da below - it is a shortcut to curr object's data area.
      *
-     * See also '#define set_me(to)' in stacks.c.
+     * See also general_stack_grow() in stacks.c.
      *
      */
     struct pvm_object           	curr;
 
-    /** Pointer to previous (older) stack page. */
+    /** Not used, stack is contiguous now. Kept for objects layout. */
     struct pvm_object  			prev;
 
-    /** Pointer to next (newer) stack page. */
+    /** Not used, stack is contiguous now. Kept for objects layout. */
     struct pvm_object  			next;
 
     /** number of cells used. */
@@ -456,20 +501,62 @@ struct data_area_4_window
 };
 
 
-// Very dumb implementation, redo with hash map or bin search or tree
-// Container entry has struct pvm_object at the beginning and the rest is 0-term name string
-struct data_area_4_directory
+// Open addressing hash table, see directory.c
+struct pvm_dir_slot
+{
+    u_int32_t                           hash;
+    struct pvm_object   		name;           // String, 0 if slot is free
+    struct pvm_object   		value;          // 0 in old container if entry is moved or removed
+};
+
+// Container is a binary object: resize state, then capacity slots
+struct pvm_dir_container
 {
-    u_int32_t                           elSize;         // size of one dir entry, bytes, defaults to 256
+    // Incremental resize: if old_container is not 0, each operation moves
+    // a few entries from it to this one. Old container is looked up while
+    // move_pos < old_capacity, then its names are released.
+    u_int32_t                           old_capacity;
+    u_int32_t                           move_pos;
+
+    struct pvm_object   		old_container;
+
+    struct pvm_dir_slot                 slot[];
+};
 
-    u_int32_t                           capacity;       // size of binary container in entries
-    u_int32_t                           nEntries;       // number of actual entries
+// Snapshots made before hash directory have elSize (256) in place of layout
+#define PVM_DIR_LAYOUT_HASH             1
+
+// Same size as old layout, so that old objects can be converted in place
+struct data_area_4_directory
+{
+    u_int32_t                           layout;         // PVM_DIR_LAYOUT_HASH
+    u_int32_t                           capacity;       // size of container in slots, power of 2
+    u_int32_t                           nEntries;       // number of actual entries, both containers
 
     struct pvm_object   		container;      // Where we actually hold it
 };
 
 
 
+// Hash map with any keys, see syscall_hashmap.c
+// Bucket is a binary object with an array of these
+struct pvm_hashmap_entry
+{
+    int                                 hash;
+    struct pvm_object   		key;
+    struct pvm_object   		value;
+};
+
+struct data_area_4_hashmap
+{
+    u_int32_t                           nEntries;
+    u_int32_t                           nBuckets;       // power of 2
+
+    struct pvm_object   		buckets;        // Binary, array of bucket binaries, 0 if bucket is empty
+};
+
+
+
 
 
 #define IO_DA_BUFSIZE 4
@@ -43,6 +43,23 @@ struct pvm_object
 
 typedef struct pvm_object pvm_object_t;
 
+
+// Small integers are kept right in the reference, with no object
+// allocated. Objects are 4 bytes aligned, so a real data pointer never
+// has bit 0 set. Value lives in the upper bits of data, interface is the
+// default one of int class, so method lookup works as usual. Ints which
+// don't fit are boxed in int objects as before.
+
+#define PVM_INT_TAG                     1
+#define PVM_TAGGED_INT_MIN              (INT_MIN/2)
+#define PVM_TAGGED_INT_MAX              (INT_MAX/2)
+
+#define pvm_is_tagged_int_p( p )        (((addr_t)(p)) & PVM_INT_TAG)
+#define pvm_is_tagged_int( o )          pvm_is_tagged_int_p( (o).data )
+#define pvm_tagged_int_value( o )       (((int)(addr_t)((o).data)) >> 1)
+#define pvm_tagged_int_fits( v )        ( ((v) >= PVM_TAGGED_INT_MIN) && ((v) <= PVM_TAGGED_INT_MAX) )
+#define pvm_make_tagged_int_p( v )      ((struct pvm_object_storage *)( (((addr_t)(unsigned)(v)) << 1) | PVM_INT_TAG ))
+
 // This is object itself.
 //
 //   	_ah is allocation header, used by allocator/gc
@@ -99,13 +116,37 @@ struct data_area_4_thread;
 
 pvm_object_t    pvm_get_class( pvm_object_t o );
 
+// Class of non-null object, tagged int aware
+#define pvm_object_class( o ) ( pvm_is_tagged_int( o ) ? pvm_get_int_class() : (o).data->_class )
+
 
 /**
- * Lookup class. TODO reimplement! Can block!
+ * Lookup class. Can block!
  */
 
 struct pvm_object pvm_exec_lookup_class_by_name( struct pvm_object name );
 
+// Run userland class loader on loader thread, see class_loader.c.
+// Returns new reference to class or null object.
+pvm_object_t    pvm_class_loader_load( pvm_object_t name );
+
+// Persistent class name cache used by lookup above, see class_cache.c
+pvm_object_t    pvm_create_class_cache(void);
+// Returns referenced class or null object
+pvm_object_t    pvm_class_cache_lookup( pvm_object_t name );
+void            pvm_class_cache_put( pvm_object_t name, pvm_object_t cls );
+// Call on class reload
+void            pvm_class_cache_remove( pvm_object_t name );
+void            pvm_class_cache_clear(void);
+
+// Directory (name -> object) access, see directory.c
+errno_t         directory_put( pvm_object_t dir, const char *name, pvm_object_t o );
+// Returns referenced object or null object
+pvm_object_t    directory_get( pvm_object_t dir, const char *name );
+errno_t         directory_remove( pvm_object_t dir, const char *name );
+// Returns array of names, in hash order or sorted
+pvm_object_t    directory_iterate( pvm_object_t dir, int sorted );
+
 /**
  *
  * Is equal
@@ -154,6 +195,14 @@ int                     get_array_size(struct pvm_object_storage *array);
 void 			pvm_append_array(struct pvm_object_storage *array, struct pvm_object value_to_append );
 void			pvm_pop_array(struct pvm_object_storage *array, struct pvm_object value_to_pop );
 
+// Bulk ops, slots are moved with memmove and refcount is updated once per element
+void                    pvm_array_insert_range(struct pvm_object_storage *array, unsigned int pos, unsigned int n );
+void                    pvm_array_remove_range(struct pvm_object_storage *array, unsigned int pos, unsigned int n );
+void                    pvm_array_copy_range(struct pvm_object_storage *dst, unsigned int dst_pos, struct pvm_object_storage *src, unsigned int src_pos, unsigned int n );
+void                    pvm_array_fill(struct pvm_object_storage *array, unsigned int pos, unsigned int n, struct pvm_object value );
+struct pvm_object       pvm_array_subarray(struct pvm_object_storage *array, unsigned int pos, unsigned int n );
+struct pvm_object *     pvm_array_slots(struct pvm_object_storage *array);
+
 // Debug
 
 void                    pvm_object_print( struct pvm_object );
@@ -192,6 +241,8 @@ struct pvm_object     pvm_get_mutex_class(void);
 struct pvm_object     pvm_get_cond_class(void);
 struct pvm_object     pvm_get_sema_class(void);
 
+struct pvm_object     pvm_get_hashmap_class(void);
+
 
 struct pvm_object     pvm_create_null_object(void);
 struct pvm_object     pvm_create_class_object(struct pvm_object name, struct pvm_object iface, int da_size);
@@ -223,6 +274,7 @@ struct pvm_object     pvm_create_weakref_object(struct pvm_object owned );
 
 struct pvm_object     pvm_create_directory_object(void);
 struct pvm_object     pvm_create_connection_object(void);
+struct pvm_object     pvm_create_hashmap_object(void);
 
 
 void     pvm_release_thread_object( struct pvm_object thread );
@@ -17,9 +17,9 @@
 //#define IS_PHANTOM_STRING(obj) (obj.my_data()->class_is(pvm_object_storage::get_string_class()))
 //#define IS_PHANTOM_INT(obj) (obj.my_data()->class_is(pvm_object_storage::get_int_class()))
 
-#define IS_PHANTOM_INT(obj) (obj.data->_class.data == pvm_get_int_class().data)
-#define IS_PHANTOM_STRING(obj) (obj.data->_class.data == pvm_get_string_class().data)
+#define IS_PHANTOM_INT(obj) (pvm_is_tagged_int(obj) || (obj.data->_class.data == pvm_get_int_class().data))
+#define IS_PHANTOM_STRING(obj) (!pvm_is_tagged_int(obj) && (obj.data->_class.data == pvm_get_string_class().data))
 
-#define EQ_STRING_P2C(obj,cstring) ((((unsigned)pvm_get_str_len(obj))==strlen((const char *)cstring))&&(0==strncmp((const char *)pvm_get_str_data(obj),(const char *)cstring,pvm_get_str_len(obj))))
+#define EQ_STRING_P2C(obj,cstring) ((((unsigned)pvm_get_str_len(obj))==strlen((const char *)cstring))&&(0==memcmp((const char *)pvm_get_str_data(obj),(const char *)cstring,pvm_get_str_len(obj))))
 
 #endif // P2C_H
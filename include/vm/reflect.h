@@ -43,6 +43,9 @@ struct json_parse_context
 void pvm_backtrace_current_thread(void);
 void pvm_backtrace(struct data_area_4_thread *tda);
 
+//! Class, method and IP of current thread's bytecode, for profiling
+errno_t pvm_backtrace_current_site( pvm_object_t *tclass, int *method_ordinal, int *ip );
+
 
 
 
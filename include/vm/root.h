@@ -72,6 +72,8 @@ struct pvm_root_t
     struct pvm_object           cond_class;
     struct pvm_object           sema_class;
 
+    struct pvm_object           hashmap_class;
+
 
     struct pvm_object           null_object;
     struct pvm_object           sys_interface_object;   // Each method is a consecutive syscall (sys 0 first, sys 1 second etc) + return
@@ -84,6 +86,9 @@ struct pvm_root_t
     struct pvm_object           root_dir;               // Root object directory
 
     struct pvm_object           kernel_stats;           // Persisent kernel statistics
+    struct pvm_object           cycle_roots;            // Cycle collector candidates, see gc.c
+    struct pvm_object           class_cache;            // Class name -> class hash table, see class_cache.c
+    struct pvm_object           intern_table;           // Interned strings, see intern.c
 
 };
 
@@ -191,6 +196,8 @@ extern struct pvm_root_t pvm_root;
 
 #define PVM_ROOT_OBJECT_SEMA_CLASS 32
 
+#define PVM_ROOT_OBJECT_HASHMAP_CLASS 33
+
 // Runtime restoration facilities
 
 
@@ -215,6 +222,15 @@ extern struct pvm_root_t pvm_root;
 
 #define PVM_ROOT_KERNEL_STATISTICS 72
 
+// Binary, cycle collector root buffer
+#define PVM_ROOT_OBJECT_CYCLE_ROOTS 73
+
+// Array, class name to class hash table
+#define PVM_ROOT_OBJECT_CLASS_CACHE 74
+
+// Binary, weak table of interned strings
+#define PVM_ROOT_OBJECT_INTERN_TABLE 75
+
 #define PVM_ROOT_OBJECTS_COUNT (PVM_ROOT_KERNEL_STATISTICS+31)
 
 
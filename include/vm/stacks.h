@@ -16,10 +16,54 @@
 
 #include "vm/internal_da.h"
 
-void pvm_ostack_push( struct data_area_4_object_stack* stack, struct pvm_object o );
-struct pvm_object pvm_ostack_pop( struct data_area_4_object_stack* stack );
-struct pvm_object pvm_ostack_top( struct data_area_4_object_stack* stack );
-int pvm_ostack_empty( struct data_area_4_object_stack* stack );
+
+/**
+ *
+ * Each stack is one contiguous array: all the cells live in the
+ * current page (rootda->curr_da). Page is replaced with a bigger
+ * one on overflow, so push/pop is a limit check, store and increment.
+ * See stacks.c.
+ *
+**/
+
+// Grow current page to have room for 'need' more cells, returns new current page
+struct data_area_4_object_stack *    pvm_ostack_grow( struct data_area_4_object_stack* stack, unsigned int need );
+struct data_area_4_integer_stack *   pvm_istack_grow( struct data_area_4_integer_stack* stack, unsigned int need );
+struct data_area_4_exception_stack * pvm_estack_grow( struct data_area_4_exception_stack* stack, unsigned int need );
+
+// Does not return
+void pvm_stack_underflow( void );
+
+// Make stacks of snapshots made before contiguous stacks contiguous
+void pvm_convert_thread_stacks( struct pvm_object thread );
+
+
+
+static inline void pvm_ostack_push( struct data_area_4_object_stack* stack, struct pvm_object o )
+{
+    struct data_area_4_object_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr >= s->common.__sSize ) s = pvm_ostack_grow( stack, 1 );
+    s->stack[s->common.free_cell_ptr++] = o;
+}
+
+static inline struct pvm_object pvm_ostack_pop( struct data_area_4_object_stack* stack )
+{
+    struct data_area_4_object_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[--(s->common.free_cell_ptr)];
+}
+
+static inline struct pvm_object pvm_ostack_top( struct data_area_4_object_stack* stack )
+{
+    struct data_area_4_object_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[s->common.free_cell_ptr-1];
+}
+
+static inline int pvm_ostack_empty( struct data_area_4_object_stack* stack )
+{
+    return stack->curr_da->common.free_cell_ptr == 0;
+}
 
 struct pvm_object  pvm_ostack_pull( struct data_area_4_object_stack* stack, int pos );
 
@@ -31,22 +75,147 @@ int pvm_istack_abs_get( struct data_area_4_integer_stack* rootda, int abs_pos );
 
 
 
-void pvm_istack_push( struct data_area_4_integer_stack* stack, int o );
-int pvm_istack_pop( struct data_area_4_integer_stack* stack );
-int pvm_istack_top( struct data_area_4_integer_stack* stack );
-int pvm_istack_empty( struct data_area_4_integer_stack* stack );
+static inline void pvm_istack_push( struct data_area_4_integer_stack* stack, int o )
+{
+    struct data_area_4_integer_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr >= s->common.__sSize ) s = pvm_istack_grow( stack, 1 );
+    s->stack[s->common.free_cell_ptr++] = o;
+}
+
+static inline int pvm_istack_pop( struct data_area_4_integer_stack* stack )
+{
+    struct data_area_4_integer_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[--(s->common.free_cell_ptr)];
+}
 
+static inline int pvm_istack_top( struct data_area_4_integer_stack* stack )
+{
+    struct data_area_4_integer_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[s->common.free_cell_ptr-1];
+}
 
-void pvm_lstack_push( struct data_area_4_integer_stack* rootda, int64_t o );
-int64_t pvm_lstack_pop( struct data_area_4_integer_stack* rootda );
-int pvm_lstack_top( struct data_area_4_integer_stack* rootda );
+static inline int pvm_istack_empty( struct data_area_4_integer_stack* stack )
+{
+    return stack->curr_da->common.free_cell_ptr == 0;
+}
 
 
 
-void pvm_estack_push( struct data_area_4_exception_stack* stack, struct pvm_exception_handler e );
-struct pvm_exception_handler pvm_estack_pop( struct data_area_4_exception_stack* stack );
-struct pvm_exception_handler pvm_estack_top( struct data_area_4_exception_stack* stack );
-int pvm_estack_empty( struct data_area_4_exception_stack* stack );
+/**
+ *
+ * Long and double values (see opcode_prefix_long/double) take two
+ * integer stack cells, low word first. Slot is accessed as a whole.
+ *
+**/
+
+union pvm_stack_slot64
+{
+    int                 cell[2];
+    int64_t             l;
+    double              d;
+};
+
+static inline void pvm_istack_push64( struct data_area_4_integer_stack* stack, union pvm_stack_slot64 v )
+{
+    struct data_area_4_integer_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr + 2 > s->common.__sSize ) s = pvm_istack_grow( stack, 2 );
+    s->stack[s->common.free_cell_ptr]   = v.cell[0];
+    s->stack[s->common.free_cell_ptr+1] = v.cell[1];
+    s->common.free_cell_ptr += 2;
+}
+
+static inline union pvm_stack_slot64 pvm_istack_top64( struct data_area_4_integer_stack* stack )
+{
+    struct data_area_4_integer_stack* s = stack->curr_da;
+    union pvm_stack_slot64 v;
+    if( s->common.free_cell_ptr < 2 ) pvm_stack_underflow();
+    v.cell[0] = s->stack[s->common.free_cell_ptr-2];
+    v.cell[1] = s->stack[s->common.free_cell_ptr-1];
+    return v;
+}
+
+static inline union pvm_stack_slot64 pvm_istack_pop64( struct data_area_4_integer_stack* stack )
+{
+    union pvm_stack_slot64 v = pvm_istack_top64( stack );
+    stack->curr_da->common.free_cell_ptr -= 2;
+    return v;
+}
+
+// Slot at abs_pos and abs_pos+1
+void pvm_istack_abs_set64( struct data_area_4_integer_stack* rootda, int abs_pos, union pvm_stack_slot64 val );
+union pvm_stack_slot64 pvm_istack_abs_get64( struct data_area_4_integer_stack* rootda, int abs_pos );
+
+
+static inline void pvm_lstack_push( struct data_area_4_integer_stack* stack, int64_t o )
+{
+    union pvm_stack_slot64 v;
+    v.l = o;
+    pvm_istack_push64( stack, v );
+}
+
+static inline int64_t pvm_lstack_pop( struct data_area_4_integer_stack* stack )
+{
+    return pvm_istack_pop64( stack ).l;
+}
+
+static inline int64_t pvm_lstack_top( struct data_area_4_integer_stack* stack )
+{
+    return pvm_istack_top64( stack ).l;
+}
+
+
+static inline void pvm_dstack_push( struct data_area_4_integer_stack* stack, double o )
+{
+    union pvm_stack_slot64 v;
+    v.d = o;
+    pvm_istack_push64( stack, v );
+}
+
+static inline double pvm_dstack_pop( struct data_area_4_integer_stack* stack )
+{
+    return pvm_istack_pop64( stack ).d;
+}
+
+static inline double pvm_dstack_top( struct data_area_4_integer_stack* stack )
+{
+    return pvm_istack_top64( stack ).d;
+}
+
+
+
+
+static inline void pvm_estack_push( struct data_area_4_exception_stack* stack, struct pvm_exception_handler e )
+{
+    struct data_area_4_exception_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr >= s->common.__sSize ) s = pvm_estack_grow( stack, 1 );
+    s->stack[s->common.free_cell_ptr++] = e;
+}
+
+static inline struct pvm_exception_handler pvm_estack_pop( struct data_area_4_exception_stack* stack )
+{
+    struct data_area_4_exception_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[--(s->common.free_cell_ptr)];
+}
+
+static inline struct pvm_exception_handler pvm_estack_top( struct data_area_4_exception_stack* stack )
+{
+    struct data_area_4_exception_stack* s = stack->curr_da;
+    if( s->common.free_cell_ptr == 0 ) pvm_stack_underflow();
+    return s->stack[s->common.free_cell_ptr-1];
+}
+
+static inline int pvm_estack_empty( struct data_area_4_exception_stack* stack )
+{
+    return stack->curr_da->common.free_cell_ptr == 0;
+}
+
+// Drop all the contents, keep current (biggest) page for reuse
+void pvm_ostack_reset( struct data_area_4_object_stack* stack );
+void pvm_istack_reset( struct data_area_4_integer_stack* stack );
+void pvm_estack_reset( struct data_area_4_exception_stack* stack );
 
 int pvm_estack_foreach(
                        struct data_area_4_exception_stack* stack,
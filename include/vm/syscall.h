@@ -20,6 +20,11 @@ void phantom_activate_thread(struct pvm_object new_thread);
 // returns 1 for regular return, 0 for throw. in both cases must push ret val / throwable
 int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_object_t (*syscall_worker)( pvm_object_t this, struct data_area_4_thread *tc, int nmethod, pvm_object_t arg ) );
 
+// VM thread will block out of bytecode, snapshot can be done meanwhile.
+// Persistent memory must not be touched between begin and end.
+void vm_syscall_block_begin(void);
+void vm_syscall_block_end(void);
+
 
 #endif // SYSCALL_H
 
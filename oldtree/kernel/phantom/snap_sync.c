@@ -286,9 +286,14 @@ void phantom_thread_wake_up( struct data_area_4_thread *thda )
 #endif // OLD_VM_SLEEP
 
 
+// VM threads stop at safepoint only, ie between bytecode instructions.
+// Used by deferred refdec, see vm/refdec.c
 void phantom_check_threads_pass_bytecode_instr_boundary( void )
 {
-    SHOW_ERROR0( 0, "unimpl!");
+#if !NEW_SNAP_SYNC
+    phantom_snapper_wait_4_threads();
+    phantom_snapper_reenable_threads();
+#endif
 }
 
 
@@ -319,26 +324,8 @@ void phantom_check_threads_pass_bytecode_instr_boundary( void )
 #include <vm/alloc.h>
 
 
-//#define MAX_SYS_ARG 16
-int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_object_t (*syscall_worker)( pvm_object_t , struct data_area_4_thread *, int nmethod, pvm_object_t arg ) )
+void vm_syscall_block_begin(void)
 {
-
-    // NB args must be popped before we push retcode
-
-    int n_param = POP_ISTACK;
-    CHECK_PARAM_COUNT(n_param, 2);
-
-    //if( n_param < 1 ) SYSCALL_THROW(pvm_create_string_object( "blocking: need at least 1 parameter" ));
-
-    int nmethod = POP_INT();
-    pvm_object_t arg = POP_ARG;
-
-    // push zero to obj stack
-
-    pvm_ostack_push( tc->_ostack, pvm_create_null_object() ); 
-
-    pvm_exec_save_fast_acc(tc); // Before snap
-
     if(phantom_virtual_machine_stop_request)
     {
         SHOW_FLOW0( 5, "VM thread will die now");
@@ -356,15 +343,10 @@ int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_obje
 
     hal_mutex_unlock( &interlock_mutex );
 #endif // NEW_SNAP_SYNC
+}
 
-
-    // now do syscall - can block
-
-    pvm_object_t ret = syscall_worker( this, tc, nmethod, arg );
-
-    ref_dec_o( arg );
-    // BUG FIXME snapper won't continue until this thread is unblocked: end of snap waits for all stooped threads to awake
-
+void vm_syscall_block_end(void)
+{
 #if NEW_SNAP_SYNC
     snap_lock();
 #else
@@ -382,6 +364,40 @@ int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_obje
     hal_mutex_unlock( &interlock_mutex );
     SHOW_FLOW0( 15, "VM thread awaken after blocking syscall");
 #endif // NEW_SNAP_SYNC
+}
+
+
+//#define MAX_SYS_ARG 16
+int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_object_t (*syscall_worker)( pvm_object_t , struct data_area_4_thread *, int nmethod, pvm_object_t arg ) )
+{
+
+    // NB args must be popped before we push retcode
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 2);
+
+    //if( n_param < 1 ) SYSCALL_THROW(pvm_create_string_object( "blocking: need at least 1 parameter" ));
+
+    int nmethod = POP_INT();
+    pvm_object_t arg = POP_ARG;
+
+    // push zero to obj stack
+
+    pvm_ostack_push( tc->_ostack, pvm_create_null_object() ); 
+
+    pvm_exec_save_fast_acc(tc); // Before snap
+
+    vm_syscall_block_begin();
+
+    // now do syscall - can block
+
+    pvm_object_t ret = syscall_worker( this, tc, nmethod, arg );
+
+    // BUG FIXME snapper won't continue until this thread is unblocked: end of snap waits for all stooped threads to awake
+
+    vm_syscall_block_end();
+
+    ref_dec_o( arg );
 
     // pop zero from obj stack
     // push ret val to obj stack
@@ -26,7 +26,22 @@
 //! Get cpu idle percentage
 #define CN_STS_OP_GET_CPU_IDLE  5
 
-#define CN_STS_OP_LAST          6
+// Per class allocation profile, arg is record number
+
+//! Turn profile on (arg 1), off (0) or reset it (2)
+#define CN_STS_OP_PROF_CTL      6
+//! Get class name of record
+#define CN_STS_OP_PROF_NAME     7
+//! Get objects allocated
+#define CN_STS_OP_PROF_ALLOCS   8
+//! Get objects freed
+#define CN_STS_OP_PROF_FREES    9
+//! Get bytes allocated
+#define CN_STS_OP_PROF_BYTES    10
+//! Get bytes allocated and not freed
+#define CN_STS_OP_PROF_LIVE     11
+
+#define CN_STS_OP_LAST          12
 
 
 
@@ -41,6 +56,54 @@ errno_t cn_stats_do_operation( int op_no, struct data_area_4_connection *c, stru
     return EINVAL;
 }
 
+static pvm_object_t cn_stats_prof( int nmethod, int arg )
+{
+    if( nmethod == CN_STS_OP_PROF_CTL )
+    {
+        if( arg == 2 )
+            pvm_alloc_prof_reset();
+        else
+            pvm_alloc_prof_enable( arg );
+
+        return pvm_create_int_object(0);
+    }
+
+    struct pvm_alloc_prof_rec r;
+
+    // No such record
+    if( pvm_alloc_prof_get( arg, &r ) )
+        return nmethod == CN_STS_OP_PROF_NAME ? pvm_create_null_object() : pvm_create_int_object(-1);
+
+    int ret = 0;
+    switch(nmethod)
+    {
+    case CN_STS_OP_PROF_NAME:
+        return pvm_create_string_object( r.name );
+
+    case CN_STS_OP_PROF_ALLOCS:
+        ret = r.allocs;
+        break;
+
+    case CN_STS_OP_PROF_FREES:
+        ret = r.frees;
+        break;
+
+    case CN_STS_OP_PROF_BYTES:
+        ret = r.alloc_bytes;
+        break;
+
+    case CN_STS_OP_PROF_LIVE:
+        ret = r.alloc_bytes - r.free_bytes;
+        break;
+
+    default:
+        SHOW_ERROR( 1, "wrong op %d", nmethod );
+        return pvm_create_int_object(-1);
+    }
+
+    return pvm_create_int_object(ret);
+}
+
 static pvm_object_t cn_stats_blocking_syscall_worker( pvm_object_t conn, struct data_area_4_thread *tc, int nmethod, pvm_object_t arg )
 {
     (void) conn;
@@ -62,6 +125,9 @@ static pvm_object_t cn_stats_blocking_syscall_worker( pvm_object_t conn, struct
     int n_stat_counter = pvm_get_int(arg);
     //ref_dec_o(o); wrapper does
 
+    if( nmethod >= CN_STS_OP_PROF_CTL )
+        return cn_stats_prof( nmethod, n_stat_counter );
+
     if( n_stat_counter >= MAX_STAT_COUNTERS )
     {
         SHOW_ERROR( 1, "counter num %d > max", n_stat_counter );
@@ -23,6 +23,7 @@
 #include <vm/exec.h>
 #include <vm/internal_da.h>
 #include <vm/root.h>
+#include <vm/alloc.h>
 
 #include <vm/syscall.h>
 
@@ -76,6 +77,9 @@ static void thread_death_handler( phantom_thread_t *t )
 
     printf("thread_death_handler called\n");
 
+    // Thread is dead, nobody uses its allocation buffers
+    pvm_alloc_thread_exit( t->tid );
+
     pvm_object_storage_t *os = t->owner;
     if( os == 0 )
     {
@@ -178,6 +182,9 @@ phantom_thread_t* vm_thread_2_kernel_thread(struct pvm_object vm_thread)
 
 int phantom_vm_threads_get_count() { return n_vm_threads; }
 
+void phantom_vm_threads_add(void) { n_vm_threads++; }
+void phantom_vm_threads_remove(void) { n_vm_threads--; }
+
 
 // -----------------------------------------------------------------------
 /*
@@ -1,20 +1,127 @@
 #include <string.h>
 #include <phantom_types.h>
 
+/*
+ * Find l2 bytes of s2 in l1 bytes of s1.
+ *
+ * Two-Way algorithm (Crochemore, Perrin): linear time, constant
+ * space. Needle is split at critical position into left and right
+ * parts, right part is compared first, mismatch shifts by the number
+ * of bytes matched, full match of right and mismatch in left shifts
+ * by the period.
+ */
+
+// Returns critical position, sets period of needle right part
+static size_t
+critical_factorization(const unsigned char *n, size_t nl, size_t *period)
+{
+	size_t ms[2], pr[2];
+	int rev;
+
+	for (rev = 0; rev < 2; rev++) {
+		size_t s = (size_t)-1;	// maximal suffix start - 1
+		size_t j = 0, k = 1, p = 1;
+
+		while (j + k < nl) {
+			unsigned char a = n[j + k];
+			unsigned char b = n[s + k];
+
+			if (rev ? (a > b) : (a < b)) {
+				j += k;
+				k = 1;
+				p = j - s;
+			} else if (a == b) {
+				if (k != p)
+					k++;
+				else {
+					j += p;
+					k = 1;
+				}
+			} else {
+				s = j++;
+				k = p = 1;
+			}
+		}
+
+		ms[rev] = s + 1;
+		pr[rev] = p;
+	}
+
+	// Longer suffix
+	rev = ms[1] >= ms[0];
+	*period = pr[rev];
+	return ms[rev];
+}
+
 char *
 strnstrn(char const *s1, int l1, char const *s2, int l2)
 {
-	//int l1, l2;
+	const unsigned char *h = (const unsigned char *)s1;
+	const unsigned char *n = (const unsigned char *)s2;
+	size_t hl, nl, suffix, period, i, j;
 
-	//l2 = strlen(s2);
-	if (!l2)
+	if (l2 <= 0)
 		return (char *)s1;
-	//l1 = strlen(s1);
-	while(l1 >= l2) {
-		l1--;
-		if (!memcmp(s1,s2,l2))
-			return (char *)s1;
-		s1++;
+	if (l1 < l2)
+		return 0;
+
+	if (l2 == 1)
+		return memchr(s1, *n, l1);
+
+	hl = l1;
+	nl = l2;
+
+	suffix = critical_factorization(n, nl, &period);
+
+	if (memcmp(n, n + period, suffix) == 0) {
+		// Periodic needle, remember matched part of the period
+		size_t memory = 0;
+
+		for (j = 0; j <= hl - nl; ) {
+			i = suffix > memory ? suffix : memory;
+			while (i < nl && n[i] == h[i + j])
+				i++;
+
+			if (i < nl) {
+				j += i - suffix + 1;
+				memory = 0;
+				continue;
+			}
+
+			i = suffix;
+			while (i > memory && n[i - 1] == h[i - 1 + j])
+				i--;
+
+			if (i <= memory)
+				return (char *)(h + j);
+
+			j += period;
+			memory = nl - period;
+		}
+	} else {
+		// Halves are distinct, any mismatch is a maximal shift
+		period = (suffix > nl - suffix ? suffix : nl - suffix) + 1;
+
+		for (j = 0; j <= hl - nl; ) {
+			i = suffix;
+			while (i < nl && n[i] == h[i + j])
+				i++;
+
+			if (i < nl) {
+				j += i - suffix + 1;
+				continue;
+			}
+
+			i = suffix;
+			while (i > 0 && n[i - 1] == h[i - 1 + j])
+				i--;
+
+			if (i == 0)
+				return (char *)(h + j);
+
+			j += period;
+		}
 	}
+
 	return 0;
 }
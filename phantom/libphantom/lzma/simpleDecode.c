@@ -27,13 +27,13 @@ static void *SzAlloc(void *p, size_t size) { p = p; return malloc(size); }
 static void SzFree(void *p, void *address) { p = p; free(address); }
 static ISzAlloc alloc = { SzAlloc, SzFree };
 
-errno_t plain_lzma_decode( void *dest, size_t *dest_len, void *src, size_t *src_len, int logLevel )
+static errno_t lzma_decode_props( void *dest, size_t *dest_len, void *src, size_t *src_len,
+                                  const Byte *propData, int nomark_ok, int logLevel )
 {
-    Byte 		propData[5];
     ELzmaStatus 	status;
 
     SRes rc = LzmaDecode( dest, dest_len, src, src_len,
-                          propData, sizeof(propData), LZMA_FINISH_END,
+                          propData, LZMA_PROPS_SIZE, LZMA_FINISH_END,
                           &status, &alloc);
 
     switch(rc)
@@ -62,10 +62,12 @@ errno_t plain_lzma_decode( void *dest, size_t *dest_len, void *src, size_t *src_
     {
     case LZMA_STATUS_FINISHED_WITH_MARK: break;
 
+    case LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK:
+        if( nomark_ok ) break;
+        // fall through
     case LZMA_STATUS_NOT_SPECIFIED: // impossible
     case LZMA_STATUS_NEEDS_MORE_INPUT:
     case LZMA_STATUS_NOT_FINISHED:
-    case LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK:
         SHOW_ERROR0( logLevel, "Premature data end" );
         return ENOSPC;
     }
@@ -73,3 +75,48 @@ errno_t plain_lzma_decode( void *dest, size_t *dest_len, void *src, size_t *src_
     return 0;
 }
 
+errno_t plain_lzma_decode( void *dest, size_t *dest_len, void *src, size_t *src_len, int logLevel )
+{
+    Byte 		propData[LZMA_PROPS_SIZE];
+
+    return lzma_decode_props( dest, dest_len, src, src_len, propData, 0, logLevel );
+}
+
+
+#define LZMA_ALONE_HEADER_SIZE (LZMA_PROPS_SIZE + 8)
+
+errno_t lzma_alone_decode( void *dest, size_t *dest_len, void *src, size_t *src_len, int logLevel )
+{
+    const Byte *hdr = src;
+    UInt64 size = 0;
+    int i;
+
+    if( *src_len < LZMA_ALONE_HEADER_SIZE )
+    {
+        SHOW_ERROR0( logLevel, "No header" );
+        return EFTYPE;
+    }
+
+    // Little endian, all ones if unknown and end mark is used
+    for( i = 7; i >= 0; i-- )
+        size = (size << 8) | hdr[LZMA_PROPS_SIZE + i];
+
+    int known = (size != (UInt64)-1);
+
+    if( known && size > *dest_len )
+    {
+        SHOW_ERROR0( logLevel, "No space for data" );
+        return ENOMEM;
+    }
+
+    if( known )
+        *dest_len = (size_t)size;
+
+    size_t len = *src_len - LZMA_ALONE_HEADER_SIZE;
+
+    errno_t rc = lzma_decode_props( dest, dest_len, (Byte *)src + LZMA_ALONE_HEADER_SIZE, &len, hdr, known, logLevel );
+
+    *src_len = len + LZMA_ALONE_HEADER_SIZE;
+    return rc;
+}
+
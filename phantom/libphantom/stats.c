@@ -165,9 +165,9 @@ const char *stat_counter_name[MAX_STAT_COUNTERS] =
     "Object saturate",
 
     // 38
-    "? 38",
-    "? 39",
-    "? 40",
+    "Obj TLAB refill",
+    "Obj alloc lck wait",
+    "Obj free list hit",
 
     // 41
     "Thread switches",
@@ -177,11 +177,32 @@ const char *stat_counter_name[MAX_STAT_COUNTERS] =
     "Switch 2 idle thr",
 
     // 45
-    "? 45",
-    "? 46",
+    "Obj cycle cands",
+    "Obj cycle free",
 
     "Interrupts",
     "SoftIRQ",
+
+    // 49
+    "GC pause < 100us",
+    "GC pause < 1ms",
+    "GC pause < 10ms",
+    "GC pause < 100ms",
+    "GC pause >= 100ms",
+
+    // 54
+    "Call frame reuse",
+    "Inline cache hit",
+    "Inline cache miss",
+    "Intern table hit",
+    "Intern table miss",
+    "Refdec spill",
+    "Refdec wait",
+    "Class load",
+    "Class load shared",
+
+    // 63
+    "Alloc prof sample",
 };
 
 
@@ -198,12 +219,12 @@ void stat_dump_all( int av, char **ac )
     int i;
     for( i = 0; i < MAX_STAT_COUNTERS; i++ )
     {
-        if(*stat_counter_name[i] == 0)
-            continue;
-
         if(stat_counter_name[i] == 0)
             break;
 
+        if(*stat_counter_name[i] == 0)
+            continue;
+
 #if COMPILE_PERSISTENT_STATS
         printf(" %-20s %5d %5ld %10ld %10ld\n",
                stat_counter_name[i],
@@ -241,6 +262,9 @@ void phantom_dump_stats_buf(char *buf, int len)
     int i;
     for( i = 0; i < MAX_STAT_COUNTERS; i++ )
     {
+        if(stat_counter_name[i] == 0)
+            break;
+
         if(*stat_counter_name[i] == 0)
             continue;
 #if COMPILE_PERSISTENT_STATS
@@ -258,10 +282,6 @@ void phantom_dump_stats_buf(char *buf, int len)
             continue;
 #endif
 
-
-        if(stat_counter_name[i] == 0)
-            break;
-
         char *scol = "\x1b[37m";
 
         if(stat_per_sec_counters[i])
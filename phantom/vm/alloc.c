@@ -14,9 +14,14 @@
 
 #include <vm/alloc.h>
 #include <vm/object_flags.h>
+#include <vm/code.h>
 #include <kernel/stats.h>
 #include <kernel/page.h>
 #include <kernel/vm.h>
+#include <kernel/debug.h>
+
+#include <threads.h>
+#include <malloc.h>
 
 
 #define debug_memory_leaks 0
@@ -30,10 +35,26 @@
 
 static void init_free_object_header( pvm_object_storage_t *op, unsigned int size );
 
+static pvm_object_storage_t * tlab_alloc(unsigned int size, int arena);
+static int tlab_reserved_is_live( pvm_object_storage_t *op );
+static void tlab_dump_stats( int ac, char **av );
+static void alloc_lock(void);
+static int alloc_sweep_step( int arena, int budget );
+
+static void sc_put( pvm_object_storage_t *op );
+static void sc_remove( pvm_object_storage_t *op, unsigned int size );
+static void sc_forget( pvm_object_storage_t *op );
+static pvm_object_storage_t * sc_get( unsigned int size );
+static void sc_dump_stats( int ac, char **av );
+
 // TODO Object alloc - gigant lock for now. This is to be redone with separate locks for buckets/arenas.
 static hal_mutex_t  _vm_alloc_mutex;
 hal_mutex_t  *vm_alloc_mutex; // used in gc.c
 
+// Small objects free lists, see sc_put()
+static hal_mutex_t  _sc_mutex;
+static hal_mutex_t  *sc_mutex; // 0 before threads start
+
 
 // Allocator and GC work in these bounds. NB! - pvm_object_space_end is OUT of arena
 static void * pvm_object_space_start;
@@ -49,6 +70,8 @@ static void * start_a[ARENAS];
 static void * end_a[ARENAS];
 // Last position where allocator finished looking for objects
 static void * curr_a[ARENAS];
+// Lazy sweep position, 0 if arena is swept
+static void * sweep_a[ARENAS];
 
 
 // Names helper
@@ -149,8 +172,7 @@ void pvm_alloc_init( void * _pvm_object_space_start, unsigned int size )
 
     init_arenas(_pvm_object_space_start, size);
 
-
-    //init_gc();  // here, if needed
+    gc_mark_bitmap_init(_pvm_object_space_start, size);
 }
 
 
@@ -160,6 +182,14 @@ void pvm_alloc_threaded_init(void)
         panic("Can't init allocator mutex");
 
     vm_alloc_mutex = &_vm_alloc_mutex;
+
+    if( hal_mutex_init( &_sc_mutex, "ObjFreeL" ) )
+        panic("Can't init free lists mutex");
+
+    sc_mutex = &_sc_mutex;
+
+    dbg_add_command( tlab_dump_stats, "tlab", "dump per-thread object allocation buffers statistics");
+    dbg_add_command( sc_dump_stats, "freelists", "dump small objects free lists statistics");
 }
 
 
@@ -168,10 +198,16 @@ static void init_object_header(pvm_object_storage_t *op, unsigned int size)
     assert( size >= sizeof(pvm_object_storage_t) );
 
     op->_ah.object_start_marker = PVM_OBJECT_START_MARKER;
-    op->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED;
-    op->_ah.gc_flags = 0;
+    op->_ah.gc_flags = 0; // unused, GC keeps mark bits aside
     op->_ah.refCount = 1;
     op->_ah.exact_size = size;
+    gc_mark_new_object(op); // born black
+
+    // Buffer allocation is done with no lock. Lazy sweep must not see
+    // allocated object which is not marked yet.
+    __sync_synchronize();
+
+    op->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED;
 }
 
 static void init_free_object_header(pvm_object_storage_t *op, unsigned int size)
@@ -195,15 +231,19 @@ static pvm_object_storage_t *alloc_eat_some(pvm_object_storage_t *op, unsigned i
     assert( op->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
     assert( op->_ah.alloc_flags == PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE );
 
-    assert(op->_ah.exact_size >= size);
-    unsigned int surplus = op->_ah.exact_size - size;
+    unsigned int old_size = op->_ah.exact_size;
+
+    assert(old_size >= size);
+    unsigned int surplus = old_size - size;
     if (surplus < PVM_MIN_FRAGMENT_SIZE) {
         // don't break in too small pieces
-        init_object_header(op, op->_ah.exact_size);  //update alloc_flags
+        init_object_header(op, old_size);  //update alloc_flags
+        sc_remove(op, old_size); // after header update, see sc_put()
         return op;
     }
 
     init_object_header(op, size);  //update size and alloc_flags
+    sc_remove(op, old_size);
 
     void *o = (void*)op + size;
     pvm_object_storage_t *opppa = (pvm_object_storage_t *)o;
@@ -226,19 +266,23 @@ static void alloc_collapse_with_next_free(pvm_object_storage_t *op, unsigned int
              ( o < end )  &&
              ( (void *)opppa < end )  &&
              ( opppa->_ah.alloc_flags == PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE )  &&
+             ( o != sweep_a[arena] )  && // sweep must find a header there
              ( size < need_size * 32 ) //limit page in amount
            )
         {
             size += opppa->_ah.exact_size;
+            sc_forget(opppa);
             DEBUG_PRINT("^");
         } else {
             break;
         }
     } while(1);
 
-    if (size > op->_ah.exact_size)
+    unsigned int old_size = op->_ah.exact_size;
+    if (size > old_size)
     {
         init_free_object_header(op, size);  //update exact_size
+        sc_remove(op, old_size);
         DEBUG_PRINT1("%d", arena);
     }
 }
@@ -285,6 +329,341 @@ void pvm_collapse_free(pvm_object_storage_t *op)
 }
 
 
+// -----------------------------------------------------------------------
+// Size class free lists for small arena.
+//
+// Free chunks of small arena are remembered here by exact size, so that
+// typical small allocation does not walk the arena. Lists are volatile
+// and just a cache over the object land: headers and sizes are the same
+// as before, and lists are rebuilt lazily by frees and pvm_find() walks
+// after OS restart.
+//
+// Invariant: list entry is always a free object header of the class size.
+// Everyone who changes free chunk (eat, collapse) removes it from list
+// after changing header, and sc_put() checks header under the lock.
+// -----------------------------------------------------------------------
+
+#define SC_ARENA                3
+
+#define SC_GRAIN                4       // see round_size()
+#define SC_MAX_SIZE             1024
+#define SC_CLASSES              (SC_MAX_SIZE/SC_GRAIN + 1)
+#define SC_DEPTH                32
+
+// How many bigger classes to look into before going linear
+#define SC_SEARCH               8
+
+struct size_class
+{
+    int                         n;
+    pvm_object_storage_t *      free[SC_DEPTH];
+
+    // Statistics
+    unsigned long               hits;
+    unsigned long               drops;  // list was full
+};
+
+static struct size_class        sc_list[SC_CLASSES];
+
+static unsigned long            sc_misses;
+
+#define SC_LOCK()   do { if(sc_mutex) hal_mutex_lock( sc_mutex ); } while(0)
+#define SC_UNLOCK() do { if(sc_mutex) hal_mutex_unlock( sc_mutex ); } while(0)
+
+
+static inline int sc_class( unsigned int size )
+{
+    return size / SC_GRAIN;
+}
+
+static inline int sc_in_arena( pvm_object_storage_t *op )
+{
+    return ((void *)op >= start_a[SC_ARENA]) && ((void *)op < end_a[SC_ARENA]);
+}
+
+
+// Lock must be taken
+static int sc_find_slot( struct size_class *sc, pvm_object_storage_t *op )
+{
+    int i;
+    for( i = 0; i < sc->n; i++ )
+    {
+        if( sc->free[i] == op )
+            return i;
+    }
+    return -1;
+}
+
+// Lock must be taken
+static void sc_drop_slot( struct size_class *sc, int i )
+{
+    sc->free[i] = sc->free[--sc->n];
+}
+
+
+static void sc_put( pvm_object_storage_t *op )
+{
+    if( !sc_in_arena( op ) )
+        return;
+
+    unsigned int size = op->_ah.exact_size;
+    if( size > SC_MAX_SIZE )
+        return;
+
+    struct size_class *sc = sc_list + sc_class( size );
+
+    SC_LOCK();
+
+    // Could be eaten or collapsed since freed
+    if( (op->_ah.object_start_marker != PVM_OBJECT_START_MARKER)
+        || (op->_ah.alloc_flags != PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE)
+        || (op->_ah.exact_size != size) )
+        goto done;
+
+    if( sc_find_slot( sc, op ) >= 0 )
+        goto done;
+
+    if( sc->n >= SC_DEPTH )
+    {
+        // Linear walk will find it
+        sc->drops++;
+        goto done;
+    }
+
+    sc->free[sc->n++] = op;
+
+done:
+    SC_UNLOCK();
+}
+
+// Chunk of given (previous) size is not a free one of that size anymore
+static void sc_remove( pvm_object_storage_t *op, unsigned int size )
+{
+    if( (size > SC_MAX_SIZE) || !sc_in_arena( op ) )
+        return;
+
+    struct size_class *sc = sc_list + sc_class( size );
+
+    SC_LOCK();
+    int i = sc_find_slot( sc, op );
+    if( i >= 0 )
+        sc_drop_slot( sc, i );
+    SC_UNLOCK();
+}
+
+// Chunk is swallowed by collapse. Kill header too - if sc_put()
+// for it is on the way, it must not see a valid free object.
+// Allocator lock must be taken.
+static void sc_forget( pvm_object_storage_t *op )
+{
+    if( !sc_in_arena( op ) )
+        return;
+
+    // Next fit position must point to a live header
+    if( curr_a[SC_ARENA] == op )
+        curr_a[SC_ARENA] = start_a[SC_ARENA];
+
+    unsigned int size = op->_ah.exact_size;
+
+    SC_LOCK();
+    if( size <= SC_MAX_SIZE )
+    {
+        struct size_class *sc = sc_list + sc_class( size );
+        int i = sc_find_slot( sc, op );
+        if( i >= 0 )
+            sc_drop_slot( sc, i );
+    }
+    op->_ah.object_start_marker = 0;
+    SC_UNLOCK();
+}
+
+// Allocator lock must be taken
+static pvm_object_storage_t * sc_get( unsigned int size )
+{
+    if( size > SC_MAX_SIZE )
+        return 0;
+
+    int c = sc_class( size );
+    int last = c + SC_SEARCH;
+    if( last >= SC_CLASSES )
+        last = SC_CLASSES - 1;
+
+    pvm_object_storage_t *op = 0;
+    struct size_class *sc = 0;
+
+    SC_LOCK();
+    for( ; c <= last; c++ )
+    {
+        sc = sc_list + c;
+        if( sc->n > 0 )
+        {
+            op = sc->free[--sc->n];
+            sc->hits++;
+            break;
+        }
+    }
+    SC_UNLOCK();
+
+    if( op == 0 )
+    {
+        sc_misses++;
+        return 0;
+    }
+
+    assert( op->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
+    assert( op->_ah.alloc_flags == PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE );
+
+    STAT_INC_CNT( OBJECT_FREE_LIST_HIT );
+
+    unsigned int have = op->_ah.exact_size;
+    alloc_eat_some( op, size );
+
+    // Broken in two? Keep the rest.
+    if( op->_ah.exact_size < have )
+        sc_put( (pvm_object_storage_t *) (((void *)op) + size) );
+
+    return op;
+}
+
+
+// Object sizes as requested, see pvm_alloc_get_stats()
+static volatile long alloc_count;
+static volatile long alloc_bytes;
+static volatile long live_bytes;
+static volatile long peak_bytes;
+
+
+// Called by refcount code when object is freed
+void pvm_alloc_note_free( pvm_object_storage_t *op )
+{
+    // Object is collapsed with free neighbours, exact size is lost
+    __sync_fetch_and_sub( &live_bytes, sizeof(pvm_object_storage_t) + op->_da_size );
+
+    // Same address can be a new code object soon
+    if( op->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CODE )
+        pvm_code_cache_forget( ((struct data_area_4_code *)op->da)->code );
+
+    sc_put( op );
+}
+
+
+static void sc_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    printf("size  entries        hits       drops\n");
+
+    unsigned long total = 0;
+    int c;
+    for( c = 0; c < SC_CLASSES; c++ )
+    {
+        struct size_class *sc = sc_list + c;
+        if( (sc->n == 0) && (sc->hits == 0) && (sc->drops == 0) )
+            continue;
+
+        printf("%4d %8d %11lu %11lu\n", c * SC_GRAIN, sc->n, sc->hits, sc->drops );
+        total += sc->hits;
+    }
+
+    printf("total hits %lu, misses %lu\n", total, sc_misses );
+}
+
+
+
+// -----------------------------------------------------------------------
+// Lazy sweep. After GC marking is done each arena is swept by allocator
+// itself, a piece per pvm_find() call, see gc.c
+// -----------------------------------------------------------------------
+
+// Objects to look at per pvm_find() call
+#define SWEEP_STEP 256
+
+
+// Lock must be taken
+void pvm_alloc_sweep_start(void)
+{
+    int i;
+    for( i = 0; i < ARENAS; i++ )
+        sweep_a[i] = start_a[i];
+}
+
+// No lock, value is a hint unless caller's lock orders it with gc_sweep_object()
+int pvm_alloc_sweep_pending(void)
+{
+    int i;
+    for( i = 0; i < ARENAS; i++ )
+        if( sweep_a[i] )
+            return 1;
+    return 0;
+}
+
+// Lock must be taken
+static int alloc_sweep_step( int arena, int budget )
+{
+    pvm_object_storage_t *curr = sweep_a[arena];
+    void *end = end_a[arena];
+    int freed = 0;
+
+    if( curr == 0 )
+        return 0;
+
+    while( (budget-- > 0) && ((void *)curr < end) )
+    {
+        assert( curr->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
+
+        if( (curr->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED) && !gc_is_marked( curr ) )
+            freed += gc_sweep_object( curr );
+
+        curr = (pvm_object_storage_t *) (((void *)curr) + curr->_ah.exact_size);
+    }
+
+    sweep_a[arena] = ((void *)curr < end) ? curr : 0;
+    return freed;
+}
+
+// Lock must be taken
+int pvm_alloc_sweep_finish(void)
+{
+    int freed = 0;
+    int i;
+    for( i = 0; i < ARENAS; i++ )
+        freed += alloc_sweep_step( i, INT_MAX );
+
+    return freed;
+}
+
+
+static void alloc_scan_arena( int arena, void (*func)( pvm_object_storage_t *op ) )
+{
+    void *end = end_a[arena];
+    pvm_object_storage_t *curr = start_a[arena];
+
+    while( (void *)curr < end )
+    {
+        if( curr->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED )
+            func( curr );
+
+        curr = (pvm_object_storage_t *) (((void *)curr) + curr->_ah.exact_size);
+    }
+}
+
+// Lock must be taken, VM threads stopped
+void pvm_alloc_scan_stacks( void (*func)( pvm_object_storage_t *op ) )
+{
+    alloc_scan_arena( 1, func );
+}
+
+// Lock must be taken, VM threads stopped
+void pvm_alloc_scan_objects( void (*func)( pvm_object_storage_t *op ) )
+{
+    int i;
+    for( i = 0; i < ARENAS; i++ )
+        alloc_scan_arena( i, func );
+}
+
+
+
 // walk through
 static pvm_object_storage_t *alloc_wrap_to_next_object(pvm_object_storage_t *op, void * start, void * end, int *wrap, int arena)
 {
@@ -367,6 +746,16 @@ static struct pvm_object_storage *pvm_find(unsigned int size, int arena)
 
     struct pvm_object_storage *result = 0;
 
+    if( sweep_a[arena] )
+        alloc_sweep_step( arena, SWEEP_STEP );
+
+    if( arena == SC_ARENA )
+    {
+        result = sc_get(size);
+        if( result )
+            return result;
+    }
+
     struct pvm_object_storage *start = start_a[arena];
     struct pvm_object_storage *end = end_a[arena];
 
@@ -387,6 +776,20 @@ static struct pvm_object_storage *pvm_find(unsigned int size, int arena)
             continue;
         }
 
+        if( PVM_OBJECT_AH_ALLOCATOR_FLAG_RESERVED & curr->_ah.alloc_flags )
+        {
+            if( tlab_reserved_is_live( curr ) )
+            {
+                DEBUG_PRINT("t");
+                // Belongs to some thread's allocation buffer, skip
+                curr = alloc_wrap_to_next_object(curr, start, end, &wrap, arena);
+                continue;
+            }
+            // Left from previous OS run or retired buffer - reclaim
+            curr->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+            curr->_ah.refCount = 0;
+        }
+
         if( PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE != curr->_ah.alloc_flags ) // refcount == 0, but refzero or in buffer or both
         {
             DEBUG_PRINT("(c)");
@@ -402,6 +805,8 @@ static struct pvm_object_storage *pvm_find(unsigned int size, int arena)
             // try again -
             if (curr->_ah.exact_size < size) {
                 DEBUG_PRINT("|");
+                // Too small for us, remember for others. Rebuilds lists after restart.
+                if( arena == SC_ARENA ) sc_put(curr);
                 curr = alloc_wrap_to_next_object(curr, start, end, &wrap, arena);
                 continue;
             }
@@ -428,7 +833,7 @@ static pvm_object_storage_t * pool_alloc(unsigned int size, int arena)
 {
     pvm_object_storage_t * data = 0;
 
-    if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );  // TODO avoid Giant lock
+    alloc_lock();
 
     int ngc = 1;
     do {
@@ -437,6 +842,13 @@ static pvm_object_storage_t * pool_alloc(unsigned int size, int arena)
         if(data)
             break;
 
+        // Unswept garbage left? Sweep it all and retry
+        if( sweep_a[arena] )
+        {
+            alloc_sweep_step( arena, INT_MAX );
+            continue;
+        }
+
         break; //skip GC, until we bring context to the allocator
 
         if(ngc-- <= 0)
@@ -462,6 +874,308 @@ static pvm_object_storage_t * pool_alloc(unsigned int size, int arena)
 }
 
 
+// -----------------------------------------------------------------------
+// Thread local allocation buffers.
+//
+// Each VM thread gets a private piece of stack, int and small arenas and
+// bump-allocates there with no lock. Allocator lock is taken only to get
+// a new buffer (refill) or for the objects which don't fit.
+//
+// Buffer remainder is kept as a free object with
+// PVM_OBJECT_AH_ALLOCATOR_FLAG_RESERVED flag and owner (tid+1) in refCount,
+// so that linear memory walk (GC, memcheck) is always possible. Owner
+// writes header of the remainder first and then header of the allocated
+// object, so walker never sees a broken chain.
+//
+// Buffers are volatile. After OS restart reserved chunks have no live
+// owner and are reclaimed by pvm_find().
+//
+// Only owner touches its buffer. GC asks owners to give buffers back by
+// bumping tlab_epoch, owner retires them on next allocation. Buffers of
+// dead thread are retired by pvm_alloc_thread_exit().
+// -----------------------------------------------------------------------
+
+#define TLAB_ARENA_FIRST        1
+#define TLAB_ARENA_LAST         3
+
+#define TLAB_SIZE               (16*1024)
+// Objects bigger than that are allocated in usual way
+#define TLAB_MAX_OBJECT         (TLAB_SIZE/8)
+
+// tid is used as index
+#define TLAB_MAX_THREADS        1024
+
+struct tlab_arena
+{
+    void *                      base;   // buffer start
+    void *                      end;    // buffer end, out of buffer
+    pvm_object_storage_t *      curr;   // reserved remainder, 0 if buffer is used up
+};
+
+struct tlab
+{
+    struct tlab_arena           a[ARENAS];
+
+    // Statistics
+    unsigned long               allocs;         // done from buffer
+    unsigned long               slow_allocs;    // done under allocator lock
+    unsigned long               refills;
+    unsigned long               lock_waits;     // found allocator lock busy
+
+    int                         epoch;          // tlab_epoch when buffers were taken
+};
+
+static struct tlab *            tlabs[TLAB_MAX_THREADS];
+static volatile int             tlab_epoch;
+
+
+
+static struct tlab * tlab_current(void)
+{
+    tid_t tid = get_current_tid();
+
+    if( (tid < 0) || (tid >= TLAB_MAX_THREADS) )
+        return 0;
+
+    return tlabs[tid];
+}
+
+
+static void alloc_lock(void)
+{
+    if(!vm_alloc_mutex) return;
+
+    if( hal_mutex_is_locked( vm_alloc_mutex ) )
+    {
+        struct tlab *t = tlab_current();
+        if( t ) t->lock_waits++;
+        STAT_INC_CNT( OBJECT_ALLOC_LOCK_WAIT );
+    }
+
+    hal_mutex_lock( vm_alloc_mutex );  // TODO avoid Giant lock
+}
+
+
+static void init_reserved_header(pvm_object_storage_t *op, unsigned int size, int owner)
+{
+    init_free_object_header( op, size );
+    op->_ah.refCount = owner;
+    op->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE|PVM_OBJECT_AH_ALLOCATOR_FLAG_RESERVED;
+}
+
+
+// Lock must be taken
+static int tlab_reserved_is_live( pvm_object_storage_t *op )
+{
+    int owner = op->_ah.refCount - 1;
+
+    if( (owner < 0) || (owner >= TLAB_MAX_THREADS) || (tlabs[owner] == 0) )
+        return 0;
+
+    int i;
+    for( i = TLAB_ARENA_FIRST; i <= TLAB_ARENA_LAST; i++ )
+    {
+        struct tlab_arena *ta = tlabs[owner]->a + i;
+        if( ((void *)op >= ta->base) && ((void *)op < ta->end) )
+            return 1;
+    }
+
+    return 0;
+}
+
+
+// Lock must be taken. Give unused part back to arena.
+static void tlab_retire(struct tlab_arena *ta)
+{
+    if( ta->curr )
+    {
+        ta->curr->_ah.refCount = 0;
+        ta->curr->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+        sc_put( ta->curr );
+    }
+
+    ta->curr = 0;
+    ta->base = 0;
+    ta->end = 0;
+}
+
+// Lock must be taken
+static void tlab_refill(struct tlab *t, int arena, int owner)
+{
+    struct tlab_arena *ta = t->a + arena;
+
+    tlab_retire( ta );
+
+    pvm_object_storage_t *op = pvm_find( TLAB_SIZE, arena );
+    if( op == 0 )
+        return; // Arena is too fragmented, will go usual way
+
+    unsigned int size = op->_ah.exact_size;
+    init_reserved_header( op, size, owner );
+
+    ta->base = op;
+    ta->end = ((void *)op) + size;
+    ta->curr = op;
+
+    t->refills++;
+    STAT_INC_CNT( OBJECT_TLAB_REFILL );
+}
+
+// No lock - buffer is ours
+static pvm_object_storage_t * tlab_bump(struct tlab_arena *ta, unsigned int size, int owner)
+{
+    pvm_object_storage_t *op = ta->curr;
+
+    if( op == 0 )
+        return 0;
+
+    unsigned int have = op->_ah.exact_size;
+    if( have < size )
+        return 0;
+
+    unsigned int surplus = have - size;
+    if( surplus < PVM_MIN_FRAGMENT_SIZE )
+    {
+        // don't break in too small pieces, eat it all
+        ta->curr = 0;
+        init_object_header( op, have );
+        return op;
+    }
+
+    pvm_object_storage_t *rest = (pvm_object_storage_t *) (((void *)op) + size);
+    init_reserved_header( rest, surplus, owner );
+    ta->curr = rest;
+
+    // Remainder header must be in place before we shrink op
+    __asm__ __volatile__ ("" : : : "memory");
+
+    init_object_header( op, size );
+    return op;
+}
+
+
+static pvm_object_storage_t * tlab_alloc(unsigned int size, int arena)
+{
+    if( (arena < TLAB_ARENA_FIRST) || (arena > TLAB_ARENA_LAST) || (size > TLAB_MAX_OBJECT) )
+        return 0;
+
+    // No threads yet or no thread context (hosted VM)
+    if( vm_alloc_mutex == 0 )
+        return 0;
+
+    tid_t tid = get_current_tid();
+    if( (tid < 0) || (tid >= TLAB_MAX_THREADS) )
+        return 0;
+
+    int owner = tid + 1;
+
+    pvm_object_storage_t *data;
+    struct tlab *t = tlabs[tid];
+
+    if( (t != 0) && (t->epoch == tlab_epoch) )
+    {
+        data = tlab_bump( t->a + arena, size, owner );
+        if( data )
+        {
+            t->allocs++;
+            return data;
+        }
+    }
+
+    alloc_lock();
+
+    if( t == 0 )
+    {
+        t = calloc( 1, sizeof(struct tlab) );
+        if( t ) t->epoch = tlab_epoch;
+        tlabs[tid] = t;
+    }
+
+    if( (t != 0) && (t->epoch != tlab_epoch) )
+    {
+        // GC asked to give buffers back
+        int i;
+        for( i = TLAB_ARENA_FIRST; i <= TLAB_ARENA_LAST; i++ )
+            tlab_retire( t->a + i );
+
+        t->epoch = tlab_epoch;
+    }
+
+    if( t != 0 )
+        tlab_refill( t, arena, owner );
+
+    hal_mutex_unlock( vm_alloc_mutex );
+
+    if( t == 0 )
+        return 0;
+
+    data = tlab_bump( t->a + arena, size, owner );
+
+    if( data )
+        t->allocs++;
+    else
+        t->slow_allocs++;
+
+    return data;
+}
+
+
+// Called by GC with allocator lock taken. Buffers which are in use
+// are not touched, owners retire them on next allocation.
+void pvm_alloc_retire_all_tlabs(void)
+{
+    tlab_epoch++;
+}
+
+// Called when thread is dead, so its buffers are not used anymore
+void pvm_alloc_thread_exit( tid_t tid )
+{
+    if( (tid < 0) || (tid >= TLAB_MAX_THREADS) || (tlabs[tid] == 0) )
+        return;
+
+    alloc_lock();
+
+    struct tlab *t = tlabs[tid];
+    tlabs[tid] = 0;
+
+    if( t != 0 )
+    {
+        int i;
+        for( i = TLAB_ARENA_FIRST; i <= TLAB_ARENA_LAST; i++ )
+            tlab_retire( t->a + i );
+    }
+
+    if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );
+
+    free( t );
+}
+
+
+static void tlab_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    printf(" tid       allocs   slow allocs      refills   lock waits\n");
+
+    int tid;
+    for( tid = 0; tid < TLAB_MAX_THREADS; tid++ )
+    {
+        struct tlab *t = tlabs[tid];
+        if( t == 0 )
+            continue;
+
+        printf("%4d %12lu %12lu %12lu %12lu\n", tid, t->allocs, t->slow_allocs, t->refills, t->lock_waits );
+    }
+}
+
+
+
+// Start incremental GC after that much allocations. Counted by all
+// threads with no lock, so atomic; power of 2 to wrap evenly.
+#define GC_ALLOC_TRIGGER (256*1024)
+static volatile unsigned int allocs_count = 0;
+
 //allocation statistics:
 #define max_stat_size 4096
 static long created_o[ARENAS][max_stat_size+1];
@@ -479,7 +1193,14 @@ pvm_object_storage_t * pvm_object_alloc( unsigned int data_area_size, unsigned i
     int arena = find_arena(size, flags, saturated);
     size = round_size(size, arena);
 
-    data = pool_alloc(size, arena);
+    // Exactly one thread sees each multiple
+    if( (__sync_add_and_fetch( &allocs_count, 1 ) % GC_ALLOC_TRIGGER) == 0 )
+        gc_request_run();
+
+    data = tlab_alloc(size, arena);
+
+    if( data == 0 )
+        data = pool_alloc(size, arena);
 
     if( data == 0 )
     {
@@ -506,10 +1227,34 @@ pvm_object_storage_t * pvm_object_alloc( unsigned int data_area_size, unsigned i
 
     // kern stat
     STAT_INC_CNT( OBJECT_ALLOC );
+
+    unsigned int req_size = sizeof(pvm_object_storage_t) + data_area_size;
+    long live = __sync_add_and_fetch( &live_bytes, req_size );
+    __sync_fetch_and_add( &alloc_bytes, req_size );
+    __sync_fetch_and_add( &alloc_count, 1 );
+    if( live > peak_bytes ) peak_bytes = live; // stat, race is ok
+
     return data;
 }
 
 
+void pvm_alloc_get_stats( struct pvm_alloc_stats *s )
+{
+    s->allocs = alloc_count;
+    s->alloc_bytes = alloc_bytes;
+    s->live_bytes = live_bytes;
+    s->peak_bytes = peak_bytes;
+
+    gc_get_pause_stats( s );
+}
+
+void pvm_alloc_reset_peaks(void)
+{
+    peak_bytes = live_bytes;
+    gc_reset_pause_max();
+}
+
+
 
 /*void object_delete( pvm_object_storage * o )
 {
@@ -0,0 +1,367 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Per class allocation profile.
+ *
+ * Off by default. When on, object creation (pvm_object_create_dynamic)
+ * and free (refcount zero, cycle collector and GC sweep) count objects
+ * and bytes for the object class. Each ALLOC_PROF_SAMPLE-th allocation
+ * of a class also records bytecode site which allocates, see
+ * pvm_backtrace_current_site(), up to ALLOC_PROF_SITES per class.
+ *
+ * Table is a static open addressing hash keyed by class address.
+ * Slot is taken with compare and swap and never released, counters
+ * are atomic, so any thread can count with no lock, including GC
+ * sweep under allocator lock. Reset clears counters, not keys.
+ * Class name is copied by the thread which took the slot, after the
+ * key is published, so readers of name wait for the ready flag.
+ *
+ * Class addresses are weak: free of class object is not tracked, and
+ * site class is checked to be class before use. Objects created before
+ * profile was turned on are counted when freed, so live count can be
+ * negative for a while.
+ *
+ * Profile is also read by stats connection, see vm_cn_stats.c
+ *
+ * Kernel debugger command: allocprof [on|off|reset]
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/object_flags.h>
+#include <vm/internal_da.h>
+#include <vm/reflect.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/stats.h>
+
+
+#define ALLOC_PROF_SLOTS        512     // power of 2
+#define ALLOC_PROF_SITES        4
+#define ALLOC_PROF_SAMPLE       64      // record site of each Nth allocation of class
+#define ALLOC_PROF_DUMP         24      // print that many top classes
+
+
+struct alloc_prof_site
+{
+    pvm_object_storage_t * volatile     tclass;         // weak, 0 if free
+    volatile int                        ordinal;
+    volatile int                        ip;
+    volatile int                        hits;
+};
+
+struct alloc_prof_class
+{
+    pvm_object_storage_t * volatile     cls;            // weak, 0 if free
+    volatile long                       allocs;
+    volatile long                       frees;
+    volatile long                       alloc_bytes;
+    volatile long                       free_bytes;
+    volatile int                        other_sites;    // no place for site
+    volatile int                        ready;          // name is set
+    struct alloc_prof_site              site[ALLOC_PROF_SITES];
+    char                                name[PVM_ALLOC_PROF_NAME];
+};
+
+
+volatile int                    pvm_alloc_prof_enabled = 0;
+
+static struct alloc_prof_class  prof[ALLOC_PROF_SLOTS];
+static volatile int             prof_used;
+static volatile int             prof_lost;      // table is full
+
+
+static void alloc_prof_dump( int ac, char **av );
+
+
+static u_int32_t prof_hash( pvm_object_storage_t *cls )
+{
+    return (((u_int32_t)(addr_t)cls) >> 4) * 2654435761u;
+}
+
+static void prof_set_name( struct alloc_prof_class *pc, pvm_object_storage_t *cls )
+{
+    struct data_area_4_class *cda = (struct data_area_4_class *)&(cls->da);
+    pvm_object_t name = cda->class_name;
+
+    // No allocation here, so rope can't be flattened
+    if( pvm_is_null( name ) || (name.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE) )
+    {
+        strlcpy( pc->name, "?", sizeof(pc->name) );
+        return;
+    }
+
+    struct data_area_4_string *sda = pvm_object_da( name, string );
+    int len = sda->length;
+
+    if( len >= PVM_ALLOC_PROF_NAME ) len = PVM_ALLOC_PROF_NAME - 1;
+
+    memcpy( pc->name, sda->data, len );
+    pc->name[len] = 0;
+}
+
+// Slot of class, taken if create is nonzero and class is new. 0 if none.
+static struct alloc_prof_class * prof_find( pvm_object_storage_t *cls, int create )
+{
+    u_int32_t i = prof_hash( cls ) & (ALLOC_PROF_SLOTS-1);
+    int n;
+
+    for( n = 0; n < ALLOC_PROF_SLOTS; n++, i = (i + 1) & (ALLOC_PROF_SLOTS-1) )
+    {
+        struct alloc_prof_class *pc = prof + i;
+        pvm_object_storage_t *c = pc->cls;
+
+        if( c == cls )
+            return pc;
+
+        if( c != 0 )
+            continue;
+
+        if( !create )
+            return 0;
+
+        if( __sync_bool_compare_and_swap( &pc->cls, 0, cls ) )
+        {
+            prof_set_name( pc, cls );
+            __sync_synchronize();
+            pc->ready = 1;
+            __sync_fetch_and_add( &prof_used, 1 );
+            return pc;
+        }
+
+        // Lost race, slot can be taken by the same class
+        if( pc->cls == cls )
+            return pc;
+    }
+
+    prof_lost++;
+    return 0;
+}
+
+
+static void prof_sample( struct alloc_prof_class *pc )
+{
+    pvm_object_t tclass;
+    int ordinal, ip;
+    int i;
+
+    if( pvm_backtrace_current_site( &tclass, &ordinal, &ip ) )
+        return;
+
+    STAT_INC_CNT(VM_ALLOC_PROF_SAMPLE);
+
+    for( i = 0; i < ALLOC_PROF_SITES; i++ )
+    {
+        struct alloc_prof_site *s = pc->site + i;
+
+        if( s->tclass == tclass.data && s->ordinal == ordinal && s->ip == ip )
+        {
+            __sync_fetch_and_add( &s->hits, 1 );
+            return;
+        }
+
+        if( s->tclass == 0 && __sync_bool_compare_and_swap( &s->tclass, 0, tclass.data ) )
+        {
+            s->ordinal = ordinal;
+            s->ip = ip;
+            s->hits = 1;
+            return;
+        }
+    }
+
+    __sync_fetch_and_add( &pc->other_sites, 1 );
+}
+
+
+void pvm_alloc_prof_note_alloc( pvm_object_storage_t *p )
+{
+    struct alloc_prof_class *pc = prof_find( p->_class.data, 1 );
+    if( pc == 0 )
+        return;
+
+    long n = __sync_add_and_fetch( &pc->allocs, 1 );
+    __sync_fetch_and_add( &pc->alloc_bytes, sizeof(pvm_object_storage_t) + p->_da_size );
+
+    if( (n % ALLOC_PROF_SAMPLE) == 1 )
+        prof_sample( pc );
+}
+
+void pvm_alloc_prof_note_free( pvm_object_storage_t *p )
+{
+    struct alloc_prof_class *pc = prof_find( p->_class.data, 0 );
+    if( pc == 0 )
+        return;
+
+    __sync_fetch_and_add( &pc->frees, 1 );
+    __sync_fetch_and_add( &pc->free_bytes, sizeof(pvm_object_storage_t) + p->_da_size );
+}
+
+
+void pvm_alloc_prof_enable( int on )
+{
+    pvm_alloc_prof_enabled = on;
+}
+
+void pvm_alloc_prof_reset(void)
+{
+    int i, j;
+
+    for( i = 0; i < ALLOC_PROF_SLOTS; i++ )
+    {
+        struct alloc_prof_class *pc = prof + i;
+
+        pc->allocs = pc->frees = 0;
+        pc->alloc_bytes = pc->free_bytes = 0;
+        pc->other_sites = 0;
+
+        for( j = 0; j < ALLOC_PROF_SITES; j++ )
+            pc->site[j].hits = 0;
+    }
+
+    prof_lost = 0;
+}
+
+
+errno_t pvm_alloc_prof_get( int n, struct pvm_alloc_prof_rec *out )
+{
+    int i;
+
+    if( n < 0 )
+        return ENOENT;
+
+    for( i = 0; i < ALLOC_PROF_SLOTS; i++ )
+    {
+        struct alloc_prof_class *pc = prof + i;
+
+        if( !pc->ready || n-- > 0 )
+            continue;
+
+        __sync_synchronize();
+
+        strlcpy( out->name, pc->name, sizeof(out->name) );
+        out->allocs = pc->allocs;
+        out->frees = pc->frees;
+        out->alloc_bytes = pc->alloc_bytes;
+        out->free_bytes = pc->free_bytes;
+        return 0;
+    }
+
+    return ENOENT;
+}
+
+
+
+static void alloc_prof_print_site( struct alloc_prof_site *s )
+{
+    pvm_object_storage_t *c = s->tclass;
+
+    if( c == 0 || s->hits == 0 )
+        return;
+
+    if( c->_ah.object_start_marker != PVM_OBJECT_START_MARKER ||
+        !(c->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS) )
+    {
+        printf("    site: class is gone, %d hits\n", s->hits );
+        return;
+    }
+
+    pvm_object_t tclass;
+    tclass.data = c;
+    tclass.interface = 0;
+
+    printf("    site: ");
+    pvm_object_print( pvm_object_da( tclass, class )->class_name );
+    printf(".");
+
+    pvm_object_t mname = pvm_get_method_name( tclass, s->ordinal );
+    if( pvm_is_null( mname ) )
+        printf("%d", s->ordinal );
+    else
+        pvm_object_print( mname );
+
+    int lineno = pvm_ip_to_linenum( tclass, s->ordinal, s->ip );
+    if( lineno >= 0 )
+        printf(":%d", lineno );
+    else
+        printf(" IP %d", s->ip );
+
+    printf(", %d hits\n", s->hits );
+}
+
+
+static void alloc_prof_dump( int ac, char **av )
+{
+    if( ac > 1 )
+    {
+        if( 0 == strcmp( av[1], "on" ) )            pvm_alloc_prof_enable( 1 );
+        else if( 0 == strcmp( av[1], "off" ) )      pvm_alloc_prof_enable( 0 );
+        else if( 0 == strcmp( av[1], "reset" ) )    pvm_alloc_prof_reset();
+        else
+        {
+            printf("usage: allocprof [on|off|reset]\n");
+            return;
+        }
+    }
+
+    printf("Allocation profile is %s, %d classes, %d lost, site sampled 1/%d\n",
+           pvm_alloc_prof_enabled ? "on" : "off", prof_used, prof_lost, ALLOC_PROF_SAMPLE );
+
+    // Top classes by allocated bytes
+    struct alloc_prof_class *top[ALLOC_PROF_DUMP];
+    int n_top = 0;
+    int i, j;
+
+    for( i = 0; i < ALLOC_PROF_SLOTS; i++ )
+    {
+        struct alloc_prof_class *pc = prof + i;
+
+        if( !pc->ready || pc->allocs + pc->frees == 0 )
+            continue;
+
+        for( j = n_top; j > 0 && top[j-1]->alloc_bytes < pc->alloc_bytes; j-- )
+            if( j < ALLOC_PROF_DUMP ) top[j] = top[j-1];
+
+        if( j < ALLOC_PROF_DUMP )
+        {
+            top[j] = pc;
+            if( n_top < ALLOC_PROF_DUMP ) n_top++;
+        }
+    }
+
+    if( n_top == 0 )
+        return;
+
+    printf(" %-32s %10s %10s %12s %12s\n", "class", "allocs", "frees", "bytes", "live bytes" );
+
+    for( i = 0; i < n_top; i++ )
+    {
+        struct alloc_prof_class *pc = top[i];
+
+        printf(" %-32s %10ld %10ld %12ld %12ld\n", pc->name,
+               pc->allocs, pc->frees, pc->alloc_bytes, pc->alloc_bytes - pc->free_bytes );
+
+        for( j = 0; j < ALLOC_PROF_SITES; j++ )
+            alloc_prof_print_site( pc->site + j );
+
+        if( pc->other_sites )
+            printf("    other sites: %d hits\n", pc->other_sites );
+    }
+}
+
+
+static void alloc_prof_init(void)
+{
+    dbg_add_command( alloc_prof_dump, "allocprof", "per class allocation profile: allocprof [on|off|reset]");
+}
+
+INIT_ME( 0, alloc_prof_init, 0 )
+
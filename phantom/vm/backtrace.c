@@ -38,18 +38,19 @@ void pvm_exec_panic( const char *reason )
 }
 
 
-void pvm_backtrace_current_thread(void)
+// VM thread object of current thread
+static errno_t current_thread_da( struct data_area_4_thread **out, int verbose )
 {
     errno_t e = ENOENT;
     int tid = get_current_tid();
-    if( tid < 0 ) goto nope;
+    if( tid < 0 ) return e;
 
     void *owner;
     if( 0 != (e=t_get_owner( tid, &owner )) )
-        goto nope;
+        return e;
 
     if( 0 == owner )
-        goto nope;
+        return ENOENT;
 
     pvm_object_storage_t *_ow = owner;
 
@@ -57,21 +58,58 @@ void pvm_backtrace_current_thread(void)
 
     if( _ow->_class.data != pvm_get_thread_class().data )
     {
-        printf("pvm_backtrace - not thread in owner!\n");
-        return;
+        if( verbose ) printf("pvm_backtrace - not thread in owner!\n");
+        return EINVAL;
     }
 
     if(tda->tid != tid)
     {
-        printf("pvm_backtrace VM thread TID doesn't match!\n");
+        if( verbose ) printf("pvm_backtrace VM thread TID doesn't match!\n");
+        return EINVAL;
+    }
+
+    *out = tda;
+    return 0;
+}
+
+
+void pvm_backtrace_current_thread(void)
+{
+    struct data_area_4_thread *tda;
+
+    errno_t e = current_thread_da( &tda, 1 );
+
+    if( e == EINVAL )
+        return;
+
+    if( e )
+    {
+        printf("Unable to print backtrace, e=%d\n", e);
         return;
     }
 
     pvm_backtrace(tda);
-    return;
+}
 
-    nope:
-        printf("Unable to print backtrace, e=%d\n", e);
+
+// Where current thread runs bytecode: class, method and IP. No output, no allocation.
+errno_t pvm_backtrace_current_site( pvm_object_t *tclass, int *method_ordinal, int *ip )
+{
+    struct data_area_4_thread *tda;
+
+    errno_t e = current_thread_da( &tda, 0 );
+    if( e ) return e;
+
+    if( pvm_is_null(tda->call_frame) )
+        return ENOENT;
+
+    struct data_area_4_call_frame *fda = pvm_object_da(tda->call_frame,call_frame);
+
+    *tclass = pvm_object_class( fda->this_object );
+    *method_ordinal = fda->ordinal;
+    *ip = tda->code.IP;
+
+    return 0;
 }
 
 
@@ -88,7 +126,7 @@ void pvm_backtrace(struct data_area_4_thread *tda)
     printf("pvm_backtrace thread IP %d\n", code->IP);
 
     printf("pvm_backtrace thread this:\n");
-    pvm_object_dump(tda->_this_object);
+    pvm_object_dump(pvm_object_da( tda->call_frame, call_frame )->this_object);
     printf("\n\n");
 
     pvm_object_t sframe = tda->call_frame;
@@ -110,7 +148,7 @@ void pvm_backtrace(struct data_area_4_thread *tda)
 
         printf("pvm_backtrace frame IP: %d\n", fda->IP);
 
-        pvm_object_t tclass = thiso.data->_class;
+        pvm_object_t tclass = pvm_object_class( thiso );
         int ord = fda->ordinal;
 
         int lineno = pvm_ip_to_linenum(tclass, ord, fda->IP);
@@ -219,8 +257,7 @@ int pvm_get_method_ordinal( pvm_object_t tclass, pvm_object_t mname )
     {
         pvm_object_t curr_mname = pvm_get_ofield( mnames, i );
 
-        int diff = pvm_strcmp( curr_mname, mname);
-        if( diff == 0 )
+        if( pvm_streq( curr_mname, mname ) )
             return i;
     }
 
@@ -270,5 +307,5 @@ pvm_object_t pvm_get_class( pvm_object_t o )
     if( pvm_is_null(o))
         return o;
 
-    return o.data->_class;
+    return pvm_object_class( o );
 }
@@ -11,10 +11,22 @@
  * a new OS to init itself from. List is to be stored on a CD or on a new system fresh
  * formatted disk in a boot module.
  *
+ * Indexed format (see struct pvm_bulk_head) has class names sorted
+ * in index at file start. Index is read once and binary searched,
+ * only the class needed is read and, if packed, decompressed. Old
+ * format, which is a list of classes, is scanned as before.
+ *
+ * Class loader threads come here in parallel, file position and index
+ * are shared, so loads are serialized.
+ *
  **/
 
 #include <phantom_libc.h>
 #include <assert.h>
+#include <lzma.h>
+#include <hal.h>
+
+#include <kernel/init.h>
 
 //#include "gcc_replacements.h"
 
@@ -30,27 +42,66 @@
 static pvm_bulk_read_t  readf;
 static pvm_bulk_seek_t  seekf;
 
+// Indexed format
+static int              index_checked;
+static int              n_classes;
+static char *           bulk_index;     // entries, then names
+
+static hal_mutex_t  _bulk_mutex;
+static hal_mutex_t  *bulk_mutex; // 0 before threads start
+
+#define BULK_LOCK()      do { if(bulk_mutex) hal_mutex_lock( bulk_mutex ); } while(0)
+#define BULK_UNLOCK()    do { if(bulk_mutex) hal_mutex_unlock( bulk_mutex ); } while(0)
+
 
 void pvm_bulk_init( pvm_bulk_seek_t sf, pvm_bulk_read_t rd )
 {
     readf = rd;
     seekf = sf;
+
+    // Can be called for a new module
+    free( bulk_index );
+    bulk_index = 0;
+    n_classes = 0;
+    index_checked = 0;
 }
 
 static int skip( int len );
 static int load( int len, struct pvm_object   *out );
 static int cncmp( const char *a, const char *b );
+static int read_index(void);
+static int find_indexed( const char *class_name, struct pvm_object *out );
+static int do_load_class( const char *class_name, struct pvm_object   *out );
 
 // Return 0 on success
 int pvm_load_class_from_module( const char *class_name, struct pvm_object   *out )
 {
-    seekf(0);
+    BULK_LOCK();
+    int ret = do_load_class( class_name, out );
+    BULK_UNLOCK();
+
+    return ret;
+}
 
+// Under lock
+static int do_load_class( const char *class_name, struct pvm_object   *out )
+{
     if(DEBUG) printf("Bulk: looking for class %s\n", class_name);
 
     if( 0 == load_class_from_file( class_name, out) )
         return 0;
 
+    if( !index_checked )
+    {
+        index_checked = 1;
+        read_index();
+    }
+
+    if( bulk_index )
+        return find_indexed( class_name, out );
+
+    seekf(0);
+
     while(1)
     {
         int rlen;
@@ -102,7 +153,10 @@ static int load( int len, struct pvm_object   *out )
 
     int rret = readf( len, buf );
     if( rret != len )
+    {
+        free( buf );
         return -1;
+    }
 
 
     int lret = pvm_load_class_from_memory( buf, len, out );
@@ -116,6 +170,171 @@ __inline__ static int issepa( char c )
     return c == '.' || c == '/';
 }
 
+
+// -----------------------------------------------------------------------
+// Indexed format
+// -----------------------------------------------------------------------
+
+
+// Nonzero if len bytes at off are within file. Seek returns nonzero
+// for position at or past file end.
+static int bulk_range_ok( u_int32_t off, u_int32_t len )
+{
+    if( len == 0 || len > INT_MAX || off > INT_MAX - len )
+        return 0;
+
+    return 0 == seekf( off + len - 1 );
+}
+
+// Sets bulk_index if file is in indexed format
+static int read_index(void)
+{
+    struct pvm_bulk_head h;
+
+    seekf(0);
+
+    if( readf( sizeof(h), &h ) != sizeof(h) || h.magic != PVM_BULK_MAGIC )
+        return -1; // Old format
+
+    if( h.version > PVM_BULK_VERSION )
+    {
+        printf("Bulk: unknown version %d\n", h.version );
+        return -1;
+    }
+
+    if( h.index_size > INT_MAX - 1 ||
+        h.n_classes > h.index_size / sizeof(struct pvm_bulk_index_entry) )
+    {
+        printf("Bulk: broken index\n");
+        return -1;
+    }
+
+    char *buf = malloc( h.index_size + 1 );
+    if( buf == 0 )
+        return -1;
+
+    if( readf( h.index_size, buf ) != (int)h.index_size )
+    {
+        printf("Bulk: can't read index\n");
+        free( buf );
+        return -1;
+    }
+
+    buf[h.index_size] = 0; // Broken name will not run away
+
+    struct pvm_bulk_index_entry *e = (struct pvm_bulk_index_entry *)buf;
+    u_int32_t i;
+
+    for( i = 0; i < h.n_classes; i++ )
+    {
+        // Checked once here, so class load can trust entry
+        if( e[i].name_offset < h.index_size &&
+            bulk_range_ok( e[i].data_offset, e[i].stored_length ) )
+            continue;
+
+        printf("Bulk: broken index\n");
+        free( buf );
+        return -1;
+    }
+
+    if(DEBUG) printf("Bulk: %d classes indexed\n", h.n_classes );
+
+    bulk_index = buf;
+    n_classes = h.n_classes;
+
+    return 0;
+}
+
+
+// Class name order as mkbulk sorts them: '/' is '.', leading one is skipped
+static int cnorder( const char *a, const char *b )
+{
+    if( issepa( *a ) ) a++;
+    if( issepa( *b ) ) b++;
+
+    for( ;; a++, b++ )
+    {
+        unsigned char ca = issepa( *a ) ? '.' : *a;
+        unsigned char cb = issepa( *b ) ? '.' : *b;
+
+        if( ca != cb )
+            return (int)ca - (int)cb;
+
+        if( ca == 0 )
+            return 0;
+    }
+}
+
+
+static int load_indexed( struct pvm_bulk_index_entry *e, struct pvm_object *out )
+{
+    if( !(e->flags & PVM_BULK_FLAG_LZMA) )
+    {
+        seekf( e->data_offset );
+        return load( e->stored_length, out );
+    }
+
+    void *packed = malloc( e->stored_length );
+    void *buf = malloc( e->data_length );
+    int ret = -1;
+
+    if( packed == 0 || buf == 0 )
+        goto done;
+
+    seekf( e->data_offset );
+    if( readf( e->stored_length, packed ) != (int)e->stored_length )
+        goto done;
+
+    size_t dest_len = e->data_length;
+    size_t src_len = e->stored_length;
+
+    if( lzma_alone_decode( buf, &dest_len, packed, &src_len, 0 ) || dest_len != e->data_length )
+    {
+        printf("Bulk: can't unpack class\n");
+        goto done;
+    }
+
+    ret = pvm_load_class_from_memory( buf, e->data_length, out );
+
+done:
+    free( packed );
+    free( buf );
+
+    return ret;
+}
+
+
+static int find_indexed( const char *class_name, struct pvm_object *out )
+{
+    struct pvm_bulk_index_entry *e = (struct pvm_bulk_index_entry *)bulk_index;
+    int lo = 0, hi = n_classes - 1;
+
+    while( lo <= hi )
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = cnorder( class_name, bulk_index + e[mid].name_offset );
+
+        if( cmp == 0 )
+        {
+            if(DEBUG) printf("Bulk: found class %s\n", bulk_index + e[mid].name_offset );
+            return load_indexed( e + mid, out );
+        }
+
+        if( cmp < 0 )
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+
+    return -1;
+}
+
+
+// -----------------------------------------------------------------------
+// Old format
+// -----------------------------------------------------------------------
+
+
 static int cncmp( const char *a, const char *b )
 {
     if( issepa( *a ) ) a++;
@@ -136,5 +355,12 @@ static int cncmp( const char *a, const char *b )
 
 
 
+static void bulk_init(void)
+{
+    if( hal_mutex_init( &_bulk_mutex, "Bulk" ) )
+        panic("Can't init bulk mutex");
 
+    bulk_mutex = &_bulk_mutex;
+}
 
+INIT_ME( 0, bulk_init, 0 )
@@ -0,0 +1,226 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Class name to class object cache. Consulted by
+ * pvm_exec_lookup_class_by_name() before internal classes table and
+ * userland class loader, filled by it.
+ *
+ * Persistent, lives in root object. It is an open addressing hash
+ * table in an array object: slot 2*i is name string, 2*i+1 is class,
+ * last slot is number of entries. Linear probing, table is rebuilt
+ * to grow and to remove an entry (class reload is rare).
+ *
+**/
+
+#include <phantom_libc.h>
+#include <hashfunc.h>
+#include <hal.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/object_flags.h>
+#include <vm/internal_da.h>
+#include <vm/alloc.h>
+#include <vm/p2c.h>
+
+#include <kernel/init.h>
+
+
+#define CC_INITIAL_CAPACITY     64
+
+
+static hal_mutex_t  _cc_mutex;
+static hal_mutex_t  *cc_mutex; // 0 before threads start
+
+#define CC_LOCK()       do { if(cc_mutex) hal_mutex_lock( cc_mutex ); } while(0)
+#define CC_UNLOCK()     do { if(cc_mutex) hal_mutex_unlock( cc_mutex ); } while(0)
+
+
+static int cc_capacity( pvm_object_t t )
+{
+    return (get_array_size( t.data ) - 1) / 2;
+}
+
+static int cc_count( pvm_object_t t )
+{
+    return pvm_get_int( pvm_get_array_ofield( t.data, 2 * cc_capacity( t ) ) );
+}
+
+static void cc_set_count( pvm_object_t t, int capacity, int count )
+{
+    pvm_set_array_ofield( t.data, 2 * capacity, pvm_create_int_object( count ) );
+}
+
+static unsigned int cc_hash( pvm_object_t name )
+{
+    const char *data = pvm_get_str_data( name );
+    return calc_hash( data, data + pvm_get_str_len( name ) );
+}
+
+
+// Returns index of entry with this name or of empty one to put it to
+static int cc_find( pvm_object_t t, pvm_object_t name )
+{
+    int capacity = cc_capacity( t );
+    int i = cc_hash( name ) % capacity;
+    int n;
+
+    for( n = 0; n < capacity; n++ )
+    {
+        pvm_object_t key = pvm_get_array_ofield( t.data, 2 * i );
+
+        if( pvm_is_null( key ) || pvm_streq( key, name ) )
+            return i;
+
+        i = (i + 1) % capacity;
+    }
+
+    return -1; // Can't be - we grow at half load
+}
+
+// Set count slot first, so that array is full size and the rest is null
+static pvm_object_t cc_create( int capacity )
+{
+    pvm_object_t t = pvm_create_object( pvm_get_array_class() );
+    cc_set_count( t, capacity, 0 );
+    return t;
+}
+
+static void cc_insert( pvm_object_t t, pvm_object_t name, pvm_object_t cls )
+{
+    int i = cc_find( t, name );
+    assert( i >= 0 );
+
+    if( pvm_is_null( pvm_get_array_ofield( t.data, 2 * i ) ) )
+        cc_set_count( t, cc_capacity( t ), cc_count( t ) + 1 );
+
+    pvm_set_array_ofield( t.data, 2 * i, ref_inc_o( name ) );
+    pvm_set_array_ofield( t.data, 2 * i + 1, ref_inc_o( cls ) );
+}
+
+// Old table is released by the root field update
+static void cc_install( pvm_object_t t )
+{
+    pvm_root.class_cache = t;
+    pvm_set_field( get_root_object_storage(), PVM_ROOT_OBJECT_CLASS_CACHE, t );
+}
+
+// Copy all but 'skip' entry to a new table of given capacity
+static void cc_rebuild( int capacity, pvm_object_t skip )
+{
+    pvm_object_t old = pvm_root.class_cache;
+    pvm_object_t t = cc_create( capacity );
+
+    int i, old_capacity = cc_capacity( old );
+    for( i = 0; i < old_capacity; i++ )
+    {
+        pvm_object_t key = pvm_get_array_ofield( old.data, 2 * i );
+
+        if( pvm_is_null( key ) )
+            continue;
+
+        if( !pvm_is_null( skip ) && pvm_streq( key, skip ) )
+            continue;
+
+        cc_insert( t, key, pvm_get_array_ofield( old.data, 2 * i + 1 ) );
+    }
+
+    cc_install( t );
+}
+
+
+
+pvm_object_t pvm_create_class_cache(void)
+{
+    return cc_create( CC_INITIAL_CAPACITY );
+}
+
+
+pvm_object_t pvm_class_cache_lookup( pvm_object_t name )
+{
+    pvm_object_t ret = pvm_get_null_object();
+
+    if( pvm_is_null( pvm_root.class_cache ) || pvm_is_null( name ) || !IS_PHANTOM_STRING( name ) )
+        return ret;
+
+    CC_LOCK();
+
+    pvm_object_t t = pvm_root.class_cache;
+    int i = cc_find( t, name );
+
+    if( i >= 0 && !pvm_is_null( pvm_get_array_ofield( t.data, 2 * i ) ) )
+        ret = ref_inc_o( pvm_get_array_ofield( t.data, 2 * i + 1 ) );
+
+    CC_UNLOCK();
+
+    return ret;
+}
+
+
+void pvm_class_cache_put( pvm_object_t name, pvm_object_t cls )
+{
+    if( pvm_is_null( pvm_root.class_cache ) || pvm_is_null( name ) || !IS_PHANTOM_STRING( name ) )
+        return;
+
+    if( pvm_is_null( cls ) || !(cls.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS) )
+        return;
+
+    // Lookup by name from code compares pointers then
+    pvm_object_t key = pvm_intern_string( ref_inc_o( name ) );
+
+    CC_LOCK();
+
+    int capacity = cc_capacity( pvm_root.class_cache );
+
+    if( (cc_count( pvm_root.class_cache ) + 1) * 2 > capacity )
+        cc_rebuild( capacity * 2, pvm_get_null_object() );
+
+    cc_insert( pvm_root.class_cache, key, cls );
+
+    CC_UNLOCK();
+
+    ref_dec_o( key );
+}
+
+
+void pvm_class_cache_remove( pvm_object_t name )
+{
+    if( pvm_is_null( pvm_root.class_cache ) || pvm_is_null( name ) || !IS_PHANTOM_STRING( name ) )
+        return;
+
+    CC_LOCK();
+
+    pvm_object_t t = pvm_root.class_cache;
+    int i = cc_find( t, name );
+
+    if( i >= 0 && !pvm_is_null( pvm_get_array_ofield( t.data, 2 * i ) ) )
+        cc_rebuild( cc_capacity( t ), name );
+
+    CC_UNLOCK();
+}
+
+
+void pvm_class_cache_clear(void)
+{
+    if( pvm_is_null( pvm_root.class_cache ) )
+        return;
+
+    CC_LOCK();
+    cc_install( pvm_create_class_cache() );
+    CC_UNLOCK();
+}
+
+
+
+static void class_cache_init(void)
+{
+    if( hal_mutex_init( &_cc_mutex, "ClassCache" ) )
+        panic("Can't init class cache mutex");
+
+    cc_mutex = &_cc_mutex;
+}
+
+INIT_ME( 0, class_cache_init, 0 )
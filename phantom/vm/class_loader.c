@@ -0,0 +1,510 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Userland class loader service.
+ *
+ * Class which is not in class cache and is not internal is loaded
+ * by userland class loader (pvm_root.class_loader), that is, by
+ * bytecode. It was run by the VM thread which needed the class in
+ * a nested pvm_exec() loop, which broke snapshot restart of that
+ * thread.
+ *
+ * Now request is queued and one of CL_N_THREADS loader threads runs
+ * loader for it. Requests for different classes run in parallel,
+ * requests for the class which is being loaded wait for the same
+ * request. Loader threads are counted as VM threads and are stopped
+ * for snapshot while run bytecode.
+ *
+ * VM thread waits for request out of VM (vm_syscall_block_begin()),
+ * so snapshot can be done meanwhile. Requests are not persistent,
+ * after restart thread repeats the lookup (see opcode_summon_by_name).
+ *
+ * Loader thread which needs one more class (base class, for example)
+ * registers request and loads it by itself, or takes over queued
+ * request for it. It waits for request which other loader thread runs,
+ * unless that thread waits (maybe through others) for this one - then
+ * it loads the class by itself, there is no better way out of cycle.
+ *
+ * Hosted VM runs loader in caller thread.
+ *
+ * Kernel debugger command: clload [test [class]]
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+#include <threads.h>
+#include <hal.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/internal_da.h>
+#include <vm/exec.h>
+#include <vm/syscall.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/stats.h>
+
+
+#define CL_N_THREADS            4
+
+#define CL_TEST_CLASS           ".ru.dz.phantom.system.thread_test"
+#define CL_TEST_WAIT_MSEC       (30*1000)
+
+
+struct cl_request
+{
+    struct cl_request *         next;
+    pvm_object_t                name;
+    pvm_object_t                result;         // valid if done
+    int                         done;
+    int                         users;          // waiters and loader thread
+    tid_t                       loader;         // thread which runs it
+};
+
+
+static int                      started = 0;
+
+static hal_mutex_t              cl_mutex;
+static hal_cond_t               cl_work_cond;   // request queued
+static hal_cond_t               cl_done_cond;   // request done
+
+static struct cl_request *      cl_queue;       // not taken yet
+static struct cl_request *      cl_running;     // being loaded
+
+static tid_t                    cl_tid[CL_N_THREADS];
+static struct cl_request *      cl_waiting[CL_N_THREADS]; // what loader thread waits for
+
+// Statistics
+static int                      cl_loads;
+static int                      cl_shared;
+static int                      cl_nested;
+static int                      cl_busy;
+
+
+static void class_loader_thread(void *arg);
+static void class_loader_dump_stats( int ac, char **av );
+
+
+// Loader thread index or -1
+static int loader_index( tid_t tid )
+{
+    int i;
+
+    for( i = 0; i < CL_N_THREADS; i++ )
+        if( cl_tid[i] == tid )
+            return i;
+
+    return -1;
+}
+
+static int is_loader_thread(void)
+{
+    return loader_index( get_current_tid() ) >= 0;
+}
+
+// Thread which is counted for snapshot
+static int is_vm_thread(void)
+{
+    void *owner;
+
+    if( t_get_owner( get_current_tid(), &owner ) || owner == 0 )
+        return 0;
+
+    return 1;
+}
+
+
+static pvm_object_t run_loader( pvm_object_t name )
+{
+    if( pvm_is_null(pvm_root.class_loader) )
+        return pvm_create_null_object();
+
+    struct pvm_object args[1] = { name };
+    return pvm_exec_run_method( pvm_root.class_loader, 8, 1, args );
+}
+
+
+// Under lock
+static struct cl_request * find_request( struct cl_request *r, pvm_object_t name )
+{
+    for( ; r; r = r->next )
+        if( pvm_streq( r->name, name ) )
+            return r;
+
+    return 0;
+}
+
+static void unlink_request( struct cl_request **list, struct cl_request *r )
+{
+    for( ; *list; list = &((*list)->next) )
+    {
+        if( *list == r )
+        {
+            *list = r->next;
+            return;
+        }
+    }
+}
+
+// Called out of lock by last user
+static void free_request( struct cl_request *r )
+{
+    ref_dec_o( r->name );
+    if( !pvm_is_null( r->result ) )
+        ref_dec_o( r->result );
+    free( r );
+}
+
+// Under lock
+static struct cl_request * new_request( pvm_object_t name )
+{
+    struct cl_request *r = calloc( 1, sizeof(struct cl_request) );
+    if( r == 0 )
+        return 0;
+
+    r->name = ref_inc_o( name );
+    r->result = pvm_create_null_object();
+    r->users = 1; // loader thread
+
+    return r;
+}
+
+// Under lock. Would loader thread me, waiting for r, wait for itself?
+static int wait_cycle( struct cl_request *r, int me )
+{
+    int n;
+
+    for( n = 0; r != 0; n++ )
+    {
+        int l = loader_index( r->loader );
+
+        if( l < 0 )
+            return 0;
+
+        if( l == me || n >= CL_N_THREADS )
+            return 1;
+
+        r = cl_waiting[l];
+    }
+
+    return 0;
+}
+
+// Out of lock, request is in cl_running. Load and wake up waiters.
+static void run_request( struct cl_request *r )
+{
+    pvm_object_t ret = run_loader( r->name );
+
+    // Next lookup will find it here
+    pvm_class_cache_put( r->name, ret );
+
+    STAT_INC_CNT(VM_CLASS_LOAD);
+
+    hal_mutex_lock( &cl_mutex );
+
+    unlink_request( &cl_running, r );
+    r->result = ret;
+    r->done = 1;
+    int last = (--r->users == 0);
+
+    cl_loads++;
+
+    hal_cond_broadcast( &cl_done_cond );
+    hal_mutex_unlock( &cl_mutex );
+
+    if( last )
+        free_request( r );
+}
+
+// Drop our use of done request, return new reference to result
+static pvm_object_t take_result( struct cl_request *r )
+{
+    hal_mutex_lock( &cl_mutex );
+    pvm_object_t ret = pvm_is_null( r->result ) ? r->result : ref_inc_o( r->result );
+    int last = (--r->users == 0);
+    hal_mutex_unlock( &cl_mutex );
+
+    if( last )
+        free_request( r );
+
+    return ret;
+}
+
+
+pvm_object_t pvm_class_loader_load( pvm_object_t name )
+{
+    if( !started )
+        return run_loader( name );
+
+    tid_t me_tid = get_current_tid();
+    int me = loader_index( me_tid );
+
+    hal_mutex_lock( &cl_mutex );
+
+    struct cl_request *r = find_request( cl_running, name );
+
+    if( me >= 0 && r == 0 )
+    {
+        // Nested load by loader thread, do it here and let others share it
+        r = find_request( cl_queue, name );
+        if( r != 0 )
+            unlink_request( &cl_queue, r );
+        else
+            r = new_request( name );
+
+        if( r == 0 )
+        {
+            hal_mutex_unlock( &cl_mutex );
+            return run_loader( name );
+        }
+
+        r->loader = me_tid;
+        r->next = cl_running;
+        cl_running = r;
+        r->users++; // we take result
+
+        cl_nested++;
+        hal_mutex_unlock( &cl_mutex );
+
+        run_request( r );
+        return take_result( r );
+    }
+
+    // Loading itself or waiting for somebody who waits for us
+    if( me >= 0 && (r->loader == me_tid || wait_cycle( r, me )) )
+    {
+        cl_nested++;
+        hal_mutex_unlock( &cl_mutex );
+        return run_loader( name );
+    }
+
+    if( r == 0 )
+        r = find_request( cl_queue, name );
+
+    if( r != 0 )
+    {
+        cl_shared++;
+        STAT_INC_CNT(VM_CLASS_LOAD_SHARED);
+    }
+    else
+    {
+        r = new_request( name );
+        if( r == 0 )
+        {
+            hal_mutex_unlock( &cl_mutex );
+            return run_loader( name );
+        }
+
+        struct cl_request **qp = &cl_queue;
+        while( *qp ) qp = &((*qp)->next);
+        *qp = r;
+
+        hal_cond_signal( &cl_work_cond );
+    }
+
+    r->users++;
+
+    if( me >= 0 )
+        cl_waiting[me] = r;
+
+    // Loader threads are counted too
+    int vm = is_vm_thread() || is_loader_thread();
+
+    // Let snapshot go while we wait
+    if( vm )
+    {
+        hal_mutex_unlock( &cl_mutex );
+        vm_syscall_block_begin();
+        hal_mutex_lock( &cl_mutex );
+    }
+
+    while( !r->done )
+        hal_cond_wait( &cl_done_cond, &cl_mutex );
+
+    if( me >= 0 )
+        cl_waiting[me] = 0;
+
+    hal_mutex_unlock( &cl_mutex );
+
+    if( vm )
+        vm_syscall_block_end();
+
+    return take_result( r );
+}
+
+
+static void class_loader_thread(void *arg)
+{
+    (void) arg;
+
+    t_current_set_name("ClassLoad");
+
+    // Runs bytecode, snapshot must wait for us then
+    phantom_vm_threads_add();
+    vm_syscall_block_begin();
+
+    while(1)
+    {
+        hal_mutex_lock( &cl_mutex );
+
+        while( cl_queue == 0 )
+            hal_cond_wait( &cl_work_cond, &cl_mutex );
+
+        struct cl_request *r = cl_queue;
+        cl_queue = r->next;
+
+        r->next = cl_running;
+        r->loader = get_current_tid();
+        cl_running = r;
+
+        cl_busy++;
+        hal_mutex_unlock( &cl_mutex );
+
+        vm_syscall_block_end();
+
+        run_request( r );
+
+        hal_mutex_lock( &cl_mutex );
+        cl_busy--;
+        hal_mutex_unlock( &cl_mutex );
+
+        vm_syscall_block_begin();
+    }
+}
+
+
+static void class_loader_init(void)
+{
+    dbg_add_command( class_loader_dump_stats, "clload", "class loader threads statistics: clload [test [class]]");
+
+    // Hosted VM can't stop the world
+    if( !phantom_is_a_real_kernel() )
+        return;
+
+    hal_mutex_init( &cl_mutex, "ClassLoad" );
+    hal_cond_init( &cl_work_cond, "ClassLoad" );
+    hal_cond_init( &cl_done_cond, "ClassDone" );
+
+    int i;
+    for( i = 0; i < CL_N_THREADS; i++ )
+    {
+        cl_tid[i] = hal_start_thread( class_loader_thread, 0, 0 );
+        assert( cl_tid[i] > 0 );
+    }
+
+    started = 1;
+}
+
+INIT_ME( 0, class_loader_init, 0 )
+
+
+
+// Self test: two threads load the same class at once
+
+struct cl_test
+{
+    pvm_object_t                result;
+    volatile int                done;
+};
+
+static char                     cl_test_name[256];
+static struct cl_test           cl_test[2];
+static volatile int             cl_test_running;
+
+static void class_loader_test_thread(void *arg)
+{
+    struct cl_test *t = arg;
+
+    t_current_set_name("ClassLdTest");
+
+    pvm_object_t name = pvm_create_string_object( cl_test_name );
+    t->result = pvm_class_loader_load( name );
+    ref_dec_o( name );
+
+    t->done = 1;
+}
+
+static void class_loader_self_test( const char *class_name )
+{
+    int i, wait;
+
+    if( cl_test_running )
+    {
+        printf("Class loader test is running\n");
+        return;
+    }
+
+    cl_test_running = 1;
+    strlcpy( cl_test_name, class_name, sizeof(cl_test_name) );
+
+    int loads = cl_loads;
+    int shared = cl_shared;
+
+    // Both threads stop on the lock, so that second one comes
+    // while first one's request is queued or running
+    hal_mutex_lock( &cl_mutex );
+
+    for( i = 0; i < 2; i++ )
+    {
+        cl_test[i].result = pvm_create_null_object();
+        cl_test[i].done = 0;
+        hal_start_thread( class_loader_test_thread, cl_test + i, 0 );
+    }
+
+    hal_sleep_msec( 100 );
+    hal_mutex_unlock( &cl_mutex );
+
+    for( wait = 0; wait < CL_TEST_WAIT_MSEC && !(cl_test[0].done && cl_test[1].done); wait += 100 )
+        hal_sleep_msec( 100 );
+
+    // Threads still use cl_test, leave it
+    if( !(cl_test[0].done && cl_test[1].done) )
+    {
+        printf("Class loader test FAILED: load of %s takes too long\n", cl_test_name );
+        return;
+    }
+
+    printf("Class loader test: %s, %d loads, %d shared\n",
+           cl_test_name, cl_loads - loads, cl_shared - shared );
+
+    if( pvm_is_null( cl_test[0].result ) || pvm_is_null( cl_test[1].result ) )
+        printf("Class loader test FAILED: no class\n");
+    else if( cl_test[0].result.data != cl_test[1].result.data )
+        printf("Class loader test FAILED: class is loaded twice\n");
+    else
+        printf("Class loader test PASSED\n");
+
+    for( i = 0; i < 2; i++ )
+        if( !pvm_is_null( cl_test[i].result ) )
+            ref_dec_o( cl_test[i].result );
+
+    cl_test_running = 0;
+}
+
+
+static void class_loader_dump_stats( int ac, char **av )
+{
+    if( !started )
+    {
+        printf("Classes are loaded by caller thread\n");
+        return;
+    }
+
+    if( ac > 1 )
+    {
+        if( 0 == strcmp( av[1], "test" ) )
+            class_loader_self_test( ac > 2 ? av[2] : CL_TEST_CLASS );
+        else
+            printf("usage: clload [test [class]]\n");
+        return;
+    }
+
+    printf("Class loader: %d threads, %d busy, %d loads, %d shared, %d nested\n",
+           CL_N_THREADS, cl_busy, cl_loads, cl_shared, cl_nested );
+}
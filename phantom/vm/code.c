@@ -118,8 +118,8 @@ struct pvm_object pvm_code_get_string(struct pvm_code_handler *code)
     code->IP += len;
     pvm_code_check_bounds( code, code->IP-1, "get_string" );
     // after we checked there is a real data accessible we can
-    // create string object
-    return pvm_create_string_object_binary( (const char *)sp, len );
+    // create string object. Names are interned.
+    return pvm_intern_binary( (const char *)sp, len );
 }
 
 
@@ -0,0 +1,614 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Pre-decoded bytecode cache.
+ *
+ * Code object is checked and decoded once, when first executed or
+ * loaded. Decoded form is a table of operands indexed by IP:
+ *
+ *   int32 operand at IP          - ops[IP] is its value
+ *   int64 operand at IP          - ops[IP] is high and ops[IP+4] low part
+ *   jump displacement at IP      - ops[IP] is absolute target IP
+ *   string operand at IP         - ops[IP-1] is constant index, ops[IP] length
+ *
+ * Byte operands are read from bytecode directly. All operands and jump
+ * targets are checked to be in code bounds and targets to point to the
+ * instruction start, so interpreter skips bounds checks. Strings are
+ * made once and saturated, GC reaches them through this cache.
+ *
+ * Exception catchers are static, if each push_catcher comes right after
+ * summon_by_name (that's what compiler does), nothing jumps to it and
+ * push/pop_catcher pairs nest properly. Then decoder makes a table of
+ * try body IP ranges and interpreter does not execute catcher
+ * instructions at all, throw looks up the table by IP. Otherwise
+ * catchers go to the exception stack at run time, as before.
+ *
+ * Bytecode itself and IP values are not changed, so snapshots and call
+ * frames don't know about this cache. It is not persistent and is empty
+ * after restart. Code which can't be checked is executed as before.
+ *
+ * Kernel debugger command: codecache
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+
+#include <vm/internal_da.h>
+#include <vm/object_flags.h>
+#include <vm/alloc.h>
+#include <vm/code.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+
+#include <malloc.h>
+#include <string.h>
+
+#include "ids/opcode_ids.h"
+#include "jit.h"
+
+
+#define CODE_CACHE_BUCKETS      1024                    // power of 2
+#define CODE_CACHE_MAX_BYTES    (4*1024*1024)           // decoded tables total
+
+
+static struct pvm_code_decoded *        cc_table[CODE_CACHE_BUCKETS];
+
+// Lookup, insert and remove. Decoding is done unlocked.
+static VM_SPIN_TYPE     cc_lock;
+
+static int              cc_bytes;
+static int              cc_entries;
+static int              cc_rejected;
+static int              cc_over_budget;
+static int              cc_consts;
+static int              cc_forgets;
+
+
+static inline unsigned cc_bucket( const unsigned char *code )
+{
+    addr_t a = (addr_t)code;
+    return (a ^ (a >> 12)) & (CODE_CACHE_BUCKETS-1);
+}
+
+
+
+/**
+ *
+ * Decoder
+ *
+**/
+
+#define CC_START                1               // is_start: instruction starts here
+#define CC_TARGET               2               // is_start: jump target
+
+#define CC_MAX_CATCH_DEPTH      32
+
+struct cc_decoder
+{
+    const unsigned char *       code;
+    unsigned int                size;
+    unsigned char *             is_start;       // CC_START and CC_TARGET flags by IP
+
+    struct pvm_code_decoded *   d;              // 0 on the first pass
+    int                         make_strings;   // last pass
+    int                         n_consts;
+    int                         n_catchers;     // push_catcher instructions
+};
+
+// Operand of n bytes at ip is in bounds
+#define NEED(__n) do { if( (ip) + (__n) > cd->size ) return -1; } while(0)
+
+
+static void cc_set_int32( struct cc_decoder *cd, unsigned int ip )
+{
+    if( cd->d ) cd->d->ops[ip] = pvm_code_do_get_int( cd->code + ip );
+}
+
+// Returns nonzero if target is wrong
+static int cc_set_target( struct cc_decoder *cd, unsigned int ip )
+{
+    unsigned int target = ip + pvm_code_do_get_int( cd->code + ip );
+
+    if( !cd->d )
+        return 0;
+
+    if( target >= cd->size || !(cd->is_start[target] & CC_START) )
+        return -1;
+
+    cd->is_start[target] |= CC_TARGET;
+    cd->d->ops[ip] = target;
+    return 0;
+}
+
+// String is int32 length and bytes. Returns string size or -1.
+static int cc_string( struct cc_decoder *cd, unsigned int ip )
+{
+    int len;
+
+    NEED(4);
+    len = pvm_code_do_get_int( cd->code + ip );
+
+    if( len < 0 || (unsigned)len > cd->size - ip - 4 )
+        return -1;
+
+    if( cd->make_strings )
+    {
+        pvm_object_t s = pvm_intern_binary( (const char *)cd->code + ip + 4, len );
+        ref_saturate_o( s );
+
+        cd->d->consts[cd->n_consts] = s;
+        cd->d->ops[ip-1] = cd->n_consts;
+        cd->d->ops[ip] = len;
+    }
+
+    cd->n_consts++;
+    return 4 + len;
+}
+
+
+// Decodes one instruction. Returns its size or -1.
+static int cc_decode_insn( struct cc_decoder *cd, unsigned int ip )
+{
+    unsigned int start = ip;
+    unsigned char op = cd->code[ip++];
+    int n;
+
+    switch( op )
+    {
+    case opcode_iconst_8bit:
+    case opcode_os_load8:
+    case opcode_os_save8:
+    case opcode_is_load8:
+    case opcode_is_save8:
+    case opcode_sys_8bit:
+        NEED(1);
+        ip += 1;
+        break;
+
+    case opcode_iconst_32bit:
+    case opcode_os_pull32:
+    case opcode_os_load32:
+    case opcode_os_save32:
+    case opcode_os_get32:
+    case opcode_os_set32:
+    case opcode_is_get32:
+    case opcode_is_set32:
+        NEED(4);
+        cc_set_int32( cd, ip );
+        ip += 4;
+        break;
+
+    case opcode_iconst_64bit:
+        NEED(8);
+        cc_set_int32( cd, ip );
+        cc_set_int32( cd, ip+4 );
+        ip += 8;
+        break;
+
+    case opcode_call_8bit:
+        NEED(5);
+        cc_set_int32( cd, ip+1 );
+        ip += 5;
+        break;
+
+    case opcode_call_32bit:
+        NEED(8);
+        cc_set_int32( cd, ip );
+        cc_set_int32( cd, ip+4 );
+        ip += 8;
+        break;
+
+    case opcode_push_catcher:
+        cd->n_catchers++;
+        // fall through
+    case opcode_jmp:
+    case opcode_djnz:
+    case opcode_jz:
+        NEED(4);
+        if( cc_set_target( cd, ip ) ) return -1;
+        ip += 4;
+        break;
+
+    case opcode_switch:
+        {
+            NEED(12);
+            unsigned int tabsize = pvm_code_do_get_int( cd->code + ip );
+
+            cc_set_int32( cd, ip );
+            cc_set_int32( cd, ip+4 );
+            cc_set_int32( cd, ip+8 );
+
+            // Interpreter divides by it
+            if( pvm_code_do_get_int( cd->code + ip + 8 ) == 0 )
+                return -1;
+
+            ip += 12;
+
+            if( tabsize > (cd->size - ip) / 4 )
+                return -1;
+
+            for( ; tabsize > 0; tabsize-- )
+            {
+                if( cc_set_target( cd, ip ) ) return -1;
+                ip += 4;
+            }
+
+            // Default target is right after the table
+            if( ip >= cd->size )
+                return -1;
+        }
+        break;
+
+    case opcode_sconst_bin:
+    case opcode_summon_by_name:
+        n = cc_string( cd, ip );
+        if( n < 0 ) return -1;
+        ip += n;
+        break;
+
+    case opcode_debug:
+        {
+            NEED(1);
+            unsigned char type = cd->code[ip++];
+            if( type & 0x80 )
+            {
+                n = cc_string( cd, ip );
+                if( n < 0 ) return -1;
+                ip += n;
+            }
+        }
+        break;
+
+    default:
+        // call_00 to call_1F have method index in opcode and n_param byte
+        if( (op & 0xE0) == opcode_call_00 )
+        {
+            NEED(1);
+            ip += 1;
+        }
+        // The rest, including sys_0 to sys_F, has no operands
+        break;
+    }
+
+    return ip - start;
+}
+
+#undef NEED
+
+
+// One pass over the code. Returns nonzero if code is wrong.
+static int cc_decode_pass( struct cc_decoder *cd )
+{
+    unsigned int ip = 0;
+
+    cd->n_consts = 0;
+    cd->n_catchers = 0;
+
+    while( ip < cd->size )
+    {
+        cd->is_start[ip] |= CC_START;
+
+        int n = cc_decode_insn( cd, ip );
+        if( n <= 0 )
+            return -1;
+
+        ip += n;
+    }
+
+    return 0;
+}
+
+
+// Builds static catchers table, see top of file. Leaves n_catches
+// at -1 if catchers are not static.
+static void cc_build_catches( struct cc_decoder *cd, struct pvm_code_decoded *d )
+{
+    int open[CC_MAX_CATCH_DEPTH];
+    int depth = 0, n = 0;
+    unsigned int ip, prev = 0;
+
+    d->n_catches = -1;
+
+    for( ip = 0; ip < cd->size; ip++ )
+    {
+        if( !(cd->is_start[ip] & CC_START) )
+            continue;
+
+        if( cd->code[ip] == opcode_push_catcher )
+        {
+            if( ip == 0 || cd->code[prev] != opcode_summon_by_name )
+                return;
+
+            if( (cd->is_start[ip] & CC_TARGET) || depth >= CC_MAX_CATCH_DEPTH )
+                return;
+
+            struct pvm_code_catch *c = d->catches + n;
+
+            c->begin = ip + 5;
+            c->end = c->begin;
+            c->handler = d->ops[ip+1];
+            c->name = d->ops[prev];     // string operand at prev+1
+            c->parent = depth ? open[depth-1] : -1;
+
+            open[depth++] = n++;
+        }
+
+        if( cd->code[ip] == opcode_pop_catcher )
+        {
+            if( depth == 0 )
+                return;
+
+            d->catches[open[--depth]].end = ip;
+        }
+
+        prev = ip;
+    }
+
+    if( depth == 0 )
+        d->n_catches = n;
+}
+
+
+// First pass finds instruction starts and counts constants, second one
+// checks jump targets and fills tables, third one makes strings.
+static struct pvm_code_decoded * cc_decode( const unsigned char *code, unsigned int size, int check_budget )
+{
+    struct cc_decoder cd;
+
+    cd.code = code;
+    cd.size = size;
+    cd.d = 0;
+    cd.make_strings = 0;
+
+    cd.is_start = calloc( 1, size );
+    if( cd.is_start == 0 )
+        return 0;
+
+    struct pvm_code_decoded *d = 0;
+
+    if( cc_decode_pass( &cd ) )
+        goto done;
+
+    int n_consts = cd.n_consts;
+    int n_catchers = cd.n_catchers;
+
+    unsigned int total = sizeof(struct pvm_code_decoded) + size * sizeof(int) + n_consts * sizeof(pvm_object_t)
+        + n_catchers * sizeof(struct pvm_code_catch);
+
+    if( check_budget && cc_bytes + total > CODE_CACHE_MAX_BYTES )
+    {
+        cc_over_budget++;
+        goto done;
+    }
+
+    d = calloc( 1, total );
+    if( d == 0 )
+        goto done;
+
+    d->code = code;
+    d->size = size;
+    d->consts = (pvm_object_t *)(d->ops + size);
+    d->catches = (struct pvm_code_catch *)(d->consts + n_consts);
+    d->bytes = total;
+
+    cd.d = d;
+    if( cc_decode_pass( &cd ) )
+    {
+        free( d );
+        d = 0;
+        goto done;
+    }
+
+    // Whole thing is checked, no failures from now on
+    cd.make_strings = 1;
+    cc_decode_pass( &cd );
+
+    d->n_consts = cd.n_consts;
+
+    cc_build_catches( &cd, d );
+
+done:
+    free( cd.is_start );
+    return d;
+}
+
+
+
+// Size of instruction at ip of checked code
+int pvm_code_cache_insn_size( const struct pvm_code_decoded *d, unsigned int ip )
+{
+    struct cc_decoder cd;
+
+    memset( &cd, 0, sizeof(cd) );
+    cd.code = d->code;
+    cd.size = d->size;
+
+    return cc_decode_insn( &cd, ip );
+}
+
+
+// Binary search for the last catch which begins at or before ip,
+// then go out to the one which also ends after it.
+int pvm_code_cache_find_catch( const struct pvm_code_decoded *d, unsigned int ip )
+{
+    int lo = 0, hi = d->n_catches - 1, found = -1;
+
+    while( lo <= hi )
+    {
+        int mid = (lo + hi) / 2;
+
+        if( d->catches[mid].begin <= ip )
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+
+    while( found >= 0 && d->catches[found].end < ip )
+        found = d->catches[found].parent;
+
+    return found;
+}
+
+
+// Used if code is not in cache - we still have to know where catchers are
+struct pvm_code_decoded * pvm_code_cache_get_uncached( const unsigned char *code, unsigned int size )
+{
+    if( code == 0 || size == 0 )
+        return 0;
+
+    return cc_decode( code, size, 0 );
+}
+
+// Strings will go with GC
+void pvm_code_cache_free_uncached( struct pvm_code_decoded *d )
+{
+    free( d );
+}
+
+
+
+/**
+ *
+ * Table
+ *
+**/
+
+static struct pvm_code_decoded * cc_find_locked( const unsigned char *code )
+{
+    struct pvm_code_decoded *d;
+
+    for( d = cc_table[cc_bucket( code )]; d; d = d->next )
+        if( d->code == code )
+            return d;
+
+    return 0;
+}
+
+
+struct pvm_code_decoded * pvm_code_cache_get( const unsigned char *code, unsigned int size )
+{
+    struct pvm_code_decoded *d;
+
+    if( code == 0 || size == 0 )
+        return 0;
+
+    VM_SPIN_LOCK(cc_lock);
+    d = cc_find_locked( code );
+    VM_SPIN_UNLOCK(cc_lock);
+
+    if( d )
+        return d->size == size ? d : 0;
+
+    struct pvm_code_decoded *nd = cc_decode( code, size, 1 );
+
+    if( nd == 0 )
+    {
+        // Remember it to not to try again
+        nd = calloc( 1, sizeof(struct pvm_code_decoded) );
+        if( nd == 0 )
+            return 0;
+
+        nd->code = code;
+        nd->bytes = sizeof(struct pvm_code_decoded);
+        nd->invalid = 1;
+    }
+
+    VM_SPIN_LOCK(cc_lock);
+
+    d = cc_find_locked( code );
+    if( d == 0 )
+    {
+        d = nd;
+        nd = 0;
+
+        unsigned b = cc_bucket( code );
+        d->next = cc_table[b];
+        cc_table[b] = d;
+
+        cc_bytes += d->bytes;
+        cc_consts += d->n_consts;
+        if( d->invalid ) cc_rejected++; else cc_entries++;
+    }
+
+    VM_SPIN_UNLOCK(cc_lock);
+
+    // Other thread was first, our strings will go with GC
+    if( nd ) free( nd );
+
+    return (d->invalid || d->size != size) ? 0 : d;
+}
+
+
+void pvm_code_cache_forget( const unsigned char *code )
+{
+    struct pvm_code_decoded **pp, *d = 0;
+
+    VM_SPIN_LOCK(cc_lock);
+
+    for( pp = cc_table + cc_bucket( code ); *pp; pp = &((*pp)->next) )
+        if( (*pp)->code == code )
+        {
+            d = *pp;
+            *pp = d->next;
+
+            cc_bytes -= d->bytes;
+            cc_consts -= d->n_consts;
+            if( d->invalid ) cc_rejected--; else cc_entries--;
+            cc_forgets++;
+            break;
+        }
+
+    VM_SPIN_UNLOCK(cc_lock);
+
+    // Strings are not referenced now and will be collected by GC
+    if( d )
+    {
+        jit_free_method( d );
+        free( d );
+    }
+}
+
+
+void pvm_code_cache_gc_mark( void (*shade)( pvm_object_storage_t *p ) )
+{
+    int i, j;
+    struct pvm_code_decoded *d;
+
+    VM_SPIN_LOCK(cc_lock);
+
+    for( i = 0; i < CODE_CACHE_BUCKETS; i++ )
+        for( d = cc_table[i]; d; d = d->next )
+            for( j = 0; j < d->n_consts; j++ )
+                shade( d->consts[j].data );
+
+    VM_SPIN_UNLOCK(cc_lock);
+}
+
+
+
+static void cc_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    printf("Pre-decoded code cache:\n");
+    printf(" %d code objects decoded, %d rejected, %d forgotten\n", cc_entries, cc_rejected, cc_forgets );
+    printf(" %d string constants, %d of %d Kbytes used, %d over budget\n",
+           cc_consts, cc_bytes / 1024, CODE_CACHE_MAX_BYTES / 1024, cc_over_budget );
+}
+
+
+static void cc_init(void)
+{
+    dbg_add_command( cc_dump_stats, "codecache", "pre-decoded bytecode cache statistics");
+}
+
+INIT_ME( 0, cc_init, 0 )
@@ -55,6 +55,9 @@ pvm_object_create_dynamic( struct pvm_object object_class, int das )
 	//out->_da_size = das; // alloc does it
 	//out->_flags = flags; // alloc does it
 
+	if( pvm_alloc_prof_enabled )
+		pvm_alloc_prof_note_alloc( out );
+
 	struct pvm_object ret;
 	ret.data = out;
 	ret.interface = cda->object_default_interface.data;
@@ -116,7 +119,16 @@ void pvm_gc_iter_void(gc_iterator_call_t func, struct pvm_object_storage * os, v
 
 struct pvm_object     pvm_create_int_object(int _value)
 {
-	struct pvm_object	out = pvm_object_create_fixed( pvm_get_int_class() );
+	struct pvm_object	out;
+
+	if( pvm_tagged_int_fits( _value ) )
+	{
+		out.data = pvm_make_tagged_int_p( _value );
+		out.interface = pvm_object_da( pvm_get_int_class(), class )->object_default_interface.data;
+		return out;
+	}
+
+	out = pvm_object_create_fixed( pvm_get_int_class() );
 	((struct data_area_4_int*)&(out.data->da))->value = _value;
 	return out;
 }
@@ -218,29 +230,45 @@ void pvm_internal_init_string(struct pvm_object_storage * os)
 	data_area->length = 0;
 }
 
+// Called for ropes only, flat strings are CHILDFREE
 void pvm_gc_iter_string(gc_iterator_call_t func, struct pvm_object_storage * os, void *arg)
 {
-    (void)func;
-    (void)os;
-    (void)arg;
-    // Empty
+    struct data_area_4_rope *da = (struct data_area_4_rope *)os->da;
+
+    if( !(os->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE) )
+        return;
+
+    func( da->left, arg );
+    func( da->right, arg );
+    func( da->flat, arg );
 }
 
 
 
 
+// Orders by length first. Strings are binary, so memcmp, not strncmp.
 int pvm_strcmp(pvm_object_t s1, pvm_object_t s2)
 {
     int l1 = pvm_get_str_len( s1 );
     int l2 = pvm_get_str_len( s2 );
 
-    char *d1 = pvm_get_str_data( s1 );
-    char *d2 = pvm_get_str_data( s2 );
-
     if( l1 > l2 ) return 1;
     if( l2 > l1 ) return -1;
 
-    return strncmp( d1, d2, l1 );
+    if( s1.data == s2.data ) return 0;
+
+    return memcmp( pvm_get_str_data( s1 ), pvm_get_str_data( s2 ), l1 );
+}
+
+// Interned strings are equal if they are the same object
+int pvm_streq(pvm_object_t s1, pvm_object_t s2)
+{
+    if( s1.data == s2.data ) return 1;
+
+    if( (s1.data->_flags & s2.data->_flags) & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED )
+        return 0;
+
+    return pvm_strcmp( s1, s2 ) == 0;
 }
 
 
@@ -486,6 +514,7 @@ void pvm_internal_init_thread(struct pvm_object_storage * os)
 
 	da->owner.data = 0;
 	da->environment.data = 0;
+	da->frame_pool = 0;
 
 	da->code.code     			= 0;
 	da->code.IP 			= 0;
@@ -503,6 +532,8 @@ void pvm_gc_iter_thread(gc_iterator_call_t func, struct pvm_object_storage * os,
 	gc_fcall( func, arg, da->call_frame );
 	gc_fcall( func, arg, da->owner );
 	gc_fcall( func, arg, da->environment );
+	if( da->frame_pool )
+		gc_fcall( func, arg, pvm_storage_to_object( da->frame_pool ) );
 }
 
 
@@ -741,6 +772,10 @@ void pvm_gc_iter_weakref(gc_iterator_call_t func, struct pvm_object_storage * os
 
 struct pvm_object     pvm_create_weakref_object(struct pvm_object owned )
 {
+    // Tagged int has no storage and is never freed - can't be refd
+    if( pvm_is_tagged_int( owned ) )
+        return pvm_create_null_object();
+
     if(owned.data->_satellites.data != 0)
         return owned.data->_satellites;
 
@@ -949,28 +984,54 @@ void pvm_internal_init_directory(struct pvm_object_storage * os)
 {
     struct data_area_4_directory      *da = (struct data_area_4_directory *)os->da;
 
-    da->elSize = 256;
+    da->layout = PVM_DIR_LAYOUT_HASH;
     da->capacity = 16;
     da->nEntries = 0;
 
-    da->container = pvm_create_binary_object( da->elSize * da->capacity , 0 );
+    da->container = pvm_create_binary_object( sizeof(struct pvm_dir_container) + sizeof(struct pvm_dir_slot) * da->capacity , 0 );
 }
 
 
 void pvm_gc_iter_directory(gc_iterator_call_t func, struct pvm_object_storage * os, void *arg)
 {
     struct data_area_4_directory      *da = (struct data_area_4_directory *)os->da;
+    u_int32_t i;
 
-    struct data_area_4_binary *bin = pvm_object_da( da->container, binary );
+    if( da->layout != PVM_DIR_LAYOUT_HASH )
+    {
+        // Old snapshot, not converted yet - list of entries, layout field is entry size
+        char *bp = (char *)pvm_object_da( da->container, binary )->data;
+        for( i = 0; i < da->nEntries; i++, bp += da->layout )
+            gc_fcall( func, arg, *((pvm_object_t*)bp) );
 
-    void *bp = bin->data;
-    int i;
-    for( i = 0; i < da->nEntries; i++, bp += da->elSize )
+        gc_fcall( func, arg, da->container );
+        return;
+    }
+
+    struct pvm_dir_container *c = (struct pvm_dir_container *)pvm_object_da( da->container, binary )->data;
+    struct pvm_dir_slot *s = c->slot;
+    for( i = 0; i < da->capacity; i++ )
     {
-        gc_fcall( func, arg, *((pvm_object_t*)bp) );
+        if( s[i].name.data == 0 ) continue;
+        gc_fcall( func, arg, s[i].name );
+        gc_fcall( func, arg, s[i].value );
     }
 
     gc_fcall( func, arg, da->container );
+
+    if( c->old_container.data == 0 )
+        return;
+
+    // Old container owns its names until released, values until moved
+    s = ((struct pvm_dir_container *)pvm_object_da( c->old_container, binary )->data)->slot;
+    for( i = 0; i < c->old_capacity; i++ )
+    {
+        if( s[i].name.data == 0 ) continue;
+        gc_fcall( func, arg, s[i].name );
+        if( s[i].value.data ) gc_fcall( func, arg, s[i].value );
+    }
+
+    gc_fcall( func, arg, c->old_container );
 }
 
 
@@ -999,6 +1060,54 @@ void pvm_restart_directory( pvm_object_t o )
 
 
 
+void pvm_internal_init_hashmap(struct pvm_object_storage * os)
+{
+    struct data_area_4_hashmap      *da = (struct data_area_4_hashmap *)os->da;
+
+    da->nEntries = 0;
+    da->nBuckets = 16;
+
+    da->buckets = pvm_create_binary_object( sizeof(struct pvm_object) * da->nBuckets, 0 );
+}
+
+
+void pvm_gc_iter_hashmap(gc_iterator_call_t func, struct pvm_object_storage * os, void *arg)
+{
+    struct data_area_4_hashmap      *da = (struct data_area_4_hashmap *)os->da;
+    u_int32_t i;
+    int j;
+
+    struct pvm_object *b = (struct pvm_object *)pvm_object_da( da->buckets, binary )->data;
+    for( i = 0; i < da->nBuckets; i++ )
+    {
+        if( b[i].data == 0 ) continue;
+
+        // Bucket contents first, bucket itself can go away on refcount path
+        struct data_area_4_binary *bda = pvm_object_da( b[i], binary );
+        struct pvm_hashmap_entry *e = (struct pvm_hashmap_entry *)bda->data;
+        int n = bda->data_size / sizeof(struct pvm_hashmap_entry);
+
+        for( j = 0; j < n; j++ )
+        {
+            gc_fcall( func, arg, e[j].key );
+            gc_fcall( func, arg, e[j].value );
+        }
+
+        gc_fcall( func, arg, b[i] );
+    }
+
+    gc_fcall( func, arg, da->buckets );
+}
+
+
+struct pvm_object     pvm_create_hashmap_object(void)
+{
+    return pvm_object_create_fixed( pvm_get_hashmap_class() );
+}
+
+
+
+
 
 
 
@@ -0,0 +1,425 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Directory object: name string to object map.
+ *
+ * Persistent open addressing hash table with linear probing, kept
+ * in a binary object as an array of struct pvm_dir_slot after resize
+ * state (struct pvm_dir_container, see internal_da.h). Capacity is a power of 2, table grows at 3/4 load.
+ * Removal shifts following entries back, so there are no tombstones
+ * in the current table.
+ *
+ * Resize is incremental - new container is allocated and each
+ * following operation moves DIR_MOVE_STEP slots of the old one.
+ * Moved or removed entries stay in the old container with value
+ * cleared, so that old probe chains are not broken. When all is moved,
+ * old container names are released with the same step, and old
+ * container is dropped. Old container is referenced by new one and
+ * traced by directory gc iterator, so snapshot can catch directory in
+ * any state.
+ *
+ * Directories of snapshots made before were linear lists of 256 byte
+ * entries with put as a stub, so they are empty. Such directory is
+ * given an empty hash container on first access - directories are not
+ * in restart list, so it can't be done on restart.
+ *
+**/
+
+#include <phantom_libc.h>
+#include <hashfunc.h>
+#include <hal.h>
+#include <stdlib.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/internal_da.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+
+
+#define DIR_MOVE_STEP   16
+
+
+static hal_mutex_t  _dir_mutex;
+static hal_mutex_t  *dir_mutex; // 0 before threads start
+
+#define DIR_LOCK()      do { if(dir_mutex) hal_mutex_lock( dir_mutex ); } while(0)
+#define DIR_UNLOCK()    do { if(dir_mutex) hal_mutex_unlock( dir_mutex ); } while(0)
+
+
+static struct pvm_dir_container * dir_cont( pvm_object_t container )
+{
+    return (struct pvm_dir_container *)pvm_object_da( container, binary )->data;
+}
+
+static struct pvm_dir_slot * dir_slots( pvm_object_t container )
+{
+    return dir_cont( container )->slot;
+}
+
+static pvm_object_t dir_create_container( u_int32_t capacity )
+{
+    return pvm_create_binary_object( sizeof(struct pvm_dir_container) + sizeof(struct pvm_dir_slot) * capacity, 0 );
+}
+
+// Old layout, see top of file. Container is set before layout for gc iterator.
+static void dir_convert( struct data_area_4_directory *da )
+{
+    if( da->layout == PVM_DIR_LAYOUT_HASH )
+        return;
+
+    pvm_object_t old = da->container;
+
+    da->nEntries = 0;
+    da->capacity = 16;
+    da->container = dir_create_container( da->capacity );
+
+    __sync_synchronize();
+    da->layout = PVM_DIR_LAYOUT_HASH;
+
+    ref_dec_o( old );
+}
+
+// Reference is overwritten - let snapshot marker see old one
+static void dir_slot_set( struct pvm_dir_slot *to, const struct pvm_dir_slot *from )
+{
+    gc_write_barrier( to->name.data );
+    gc_write_barrier( to->value.data );
+    *to = *from;
+}
+
+
+// Index of slot with this name or of free one to put it to, -1 if table is full
+static int dir_find( struct pvm_dir_slot *s, u_int32_t capacity, u_int32_t hash, const char *name, int len )
+{
+    u_int32_t mask = capacity - 1;
+    u_int32_t i = hash & mask;
+    u_int32_t n;
+
+    for( n = 0; n < capacity; n++, i = (i + 1) & mask )
+    {
+        pvm_object_t key = s[i].name;
+
+        if( key.data == 0 )
+            return i;
+
+        if( s[i].hash == hash && pvm_get_str_len( key ) == len &&
+            0 == memcmp( pvm_get_str_data( key ), name, len ) )
+            return i;
+    }
+
+    return -1;
+}
+
+// Found in old container and not moved yet
+static int dir_find_old( struct data_area_4_directory *da, u_int32_t hash, const char *name, int len )
+{
+    struct pvm_dir_container *c = dir_cont( da->container );
+
+    if( c->old_container.data == 0 || c->move_pos >= c->old_capacity )
+        return -1;
+
+    struct pvm_dir_slot *s = dir_slots( c->old_container );
+    int i = dir_find( s, c->old_capacity, hash, name, len );
+
+    if( i < 0 || s[i].name.data == 0 || s[i].value.data == 0 )
+        return -1;
+
+    return i;
+}
+
+// Remove slot i and move back following entries of its probe chain
+static void dir_delete_slot( struct pvm_dir_slot *s, u_int32_t capacity, u_int32_t i )
+{
+    static const struct pvm_dir_slot empty;
+    u_int32_t mask = capacity - 1;
+    u_int32_t j = i;
+
+    for(;;)
+    {
+        j = (j + 1) & mask;
+
+        if( s[j].name.data == 0 )
+            break;
+
+        // Entry at j can fill the hole if its home slot is not in (i, j]
+        u_int32_t home = s[j].hash & mask;
+        if( ((j - home) & mask) >= ((j - i) & mask) )
+        {
+            dir_slot_set( s + i, s + j );
+            i = j;
+        }
+    }
+
+    dir_slot_set( s + i, &empty );
+}
+
+
+// Do a few steps of resize, if any
+static void dir_move( struct data_area_4_directory *da, u_int32_t steps )
+{
+    struct pvm_dir_container *c = dir_cont( da->container );
+
+    if( c->old_container.data == 0 )
+        return;
+
+    struct pvm_dir_slot *old = dir_slots( c->old_container );
+    struct pvm_dir_slot *s = c->slot;
+
+    for( ; steps > 0 && c->move_pos < c->old_capacity; steps--, c->move_pos++ )
+    {
+        struct pvm_dir_slot *e = old + c->move_pos;
+
+        if( e->name.data == 0 || e->value.data == 0 )
+            continue;
+
+        int i = dir_find( s, da->capacity, e->hash, pvm_get_str_data( e->name ), pvm_get_str_len( e->name ) );
+        assert( i >= 0 && s[i].name.data == 0 );
+
+        // Value reference is moved, name is shared till release pass
+        s[i].hash = e->hash;
+        s[i].name = ref_inc_o( e->name );
+        s[i].value = e->value;
+
+        gc_write_barrier( e->value.data );
+        e->value.data = 0;
+    }
+
+    for( ; steps > 0 && c->move_pos < 2 * c->old_capacity; steps--, c->move_pos++ )
+    {
+        struct pvm_dir_slot *e = old + (c->move_pos - c->old_capacity);
+
+        if( e->name.data == 0 )
+            continue;
+
+        ref_dec_o( e->name );
+        e->name.data = 0;
+    }
+
+    if( c->move_pos < 2 * c->old_capacity )
+        return;
+
+    ref_dec_o( c->old_container );
+    c->old_container.data = 0;
+    c->old_capacity = 0;
+    c->move_pos = 0;
+}
+
+
+static void dir_grow( struct data_area_4_directory *da )
+{
+    struct pvm_dir_container *c = dir_cont( da->container );
+
+    // Finish previous resize first
+    while( c->old_container.data != 0 )
+        dir_move( da, c->old_capacity );
+
+    pvm_object_t nc = dir_create_container( da->capacity * 2 );
+    struct pvm_dir_container *n = dir_cont( nc );
+
+    // Current container reference is moved to new one
+    n->old_container = da->container;
+    n->old_capacity = da->capacity;
+    n->move_pos = 0;
+
+    da->capacity *= 2;
+    da->container = nc;
+}
+
+
+
+errno_t directory_put( pvm_object_t dir, const char *name, pvm_object_t o )
+{
+    struct data_area_4_directory *da = pvm_object_da( dir, directory );
+    int len = strlen( name );
+    u_int32_t hash = calc_hash( name, name + len );
+
+    if( o.data == 0 )
+        return EINVAL;
+
+    DIR_LOCK();
+
+    dir_convert( da );
+    dir_move( da, DIR_MOVE_STEP );
+
+    // Before old copy lookup - grow makes current container old
+    if( (da->nEntries + 1) * 4 > da->capacity * 3 )
+        dir_grow( da );
+
+    // Drop old copy, new one goes to current container
+    int oi = dir_find_old( da, hash, name, len );
+    if( oi >= 0 )
+    {
+        struct pvm_dir_slot *old = dir_slots( dir_cont( da->container )->old_container );
+        ref_dec_o( old[oi].value );
+        old[oi].value.data = 0;
+        da->nEntries--;
+    }
+
+    struct pvm_dir_slot *s = dir_slots( da->container );
+    int i = dir_find( s, da->capacity, hash, name, len );
+    assert( i >= 0 );
+
+    if( s[i].name.data != 0 )
+    {
+        ref_dec_o( s[i].value );
+        s[i].value = ref_inc_o( o );
+    }
+    else
+    {
+        s[i].hash = hash;
+        s[i].name = pvm_create_string_object( name );
+        s[i].value = ref_inc_o( o );
+        da->nEntries++;
+    }
+
+    DIR_UNLOCK();
+
+    return 0;
+}
+
+
+pvm_object_t directory_get( pvm_object_t dir, const char *name )
+{
+    struct data_area_4_directory *da = pvm_object_da( dir, directory );
+    int len = strlen( name );
+    u_int32_t hash = calc_hash( name, name + len );
+    pvm_object_t ret = pvm_create_null_object();
+
+    DIR_LOCK();
+
+    dir_convert( da );
+
+    // Reads move resize too, or read mostly directory would keep two containers
+    dir_move( da, DIR_MOVE_STEP );
+
+    struct pvm_dir_slot *s = dir_slots( da->container );
+    int i = dir_find( s, da->capacity, hash, name, len );
+
+    if( i >= 0 && s[i].name.data != 0 )
+        ret = ref_inc_o( s[i].value );
+    else if( (i = dir_find_old( da, hash, name, len )) >= 0 )
+        ret = ref_inc_o( dir_slots( dir_cont( da->container )->old_container )[i].value );
+
+    DIR_UNLOCK();
+
+    return ret;
+}
+
+
+errno_t directory_remove( pvm_object_t dir, const char *name )
+{
+    struct data_area_4_directory *da = pvm_object_da( dir, directory );
+    int len = strlen( name );
+    u_int32_t hash = calc_hash( name, name + len );
+    errno_t ret = ENOENT;
+
+    DIR_LOCK();
+
+    dir_convert( da );
+    dir_move( da, DIR_MOVE_STEP );
+
+    struct pvm_dir_slot *s = dir_slots( da->container );
+    int i = dir_find( s, da->capacity, hash, name, len );
+
+    if( i >= 0 && s[i].name.data != 0 )
+    {
+        pvm_object_t oname = s[i].name;
+        pvm_object_t ovalue = s[i].value;
+
+        dir_delete_slot( s, da->capacity, i );
+        ref_dec_o( oname );
+        ref_dec_o( ovalue );
+
+        da->nEntries--;
+        ret = 0;
+    }
+    else if( (i = dir_find_old( da, hash, name, len )) >= 0 )
+    {
+        struct pvm_dir_slot *old = dir_slots( dir_cont( da->container )->old_container );
+        ref_dec_o( old[i].value );
+        old[i].value.data = 0;
+
+        da->nEntries--;
+        ret = 0;
+    }
+
+    DIR_UNLOCK();
+
+    return ret;
+}
+
+
+
+static int dir_name_cmp( const void *a, const void *b )
+{
+    return pvm_strcmp( *(const pvm_object_t *)a, *(const pvm_object_t *)b );
+}
+
+static int dir_collect( pvm_object_t *out, struct pvm_dir_slot *s, u_int32_t capacity )
+{
+    u_int32_t i;
+    int n = 0;
+
+    for( i = 0; i < capacity; i++ )
+        if( s[i].name.data != 0 && s[i].value.data != 0 )
+            out[n++] = s[i].name;
+
+    return n;
+}
+
+// Returns array of names, which is a snapshot of directory contents
+pvm_object_t directory_iterate( pvm_object_t dir, int sorted )
+{
+    struct data_area_4_directory *da = pvm_object_da( dir, directory );
+    pvm_object_t ret = pvm_create_object( pvm_get_array_class() );
+    int i, n = 0;
+
+    DIR_LOCK();
+
+    dir_convert( da );
+
+    pvm_object_t *names = calloc( da->nEntries + 1, sizeof(pvm_object_t) );
+    if( names == 0 )
+    {
+        DIR_UNLOCK();
+        return ret;
+    }
+
+    struct pvm_dir_container *c = dir_cont( da->container );
+
+    n += dir_collect( names + n, c->slot, da->capacity );
+
+    if( c->old_container.data != 0 && c->move_pos < c->old_capacity )
+        n += dir_collect( names + n, dir_slots( c->old_container ), c->old_capacity );
+
+    assert( n == (int)da->nEntries );
+
+    if( sorted )
+        qsort( names, n, sizeof(pvm_object_t), dir_name_cmp );
+
+    for( i = 0; i < n; i++ )
+        pvm_append_array( ret.data, ref_inc_o( names[i] ) );
+
+    DIR_UNLOCK();
+
+    free( names );
+
+    return ret;
+}
+
+
+
+static void directory_init(void)
+{
+    if( hal_mutex_init( &_dir_mutex, "Directory" ) )
+        panic("Can't init directory mutex");
+
+    dir_mutex = &_dir_mutex;
+}
+
+INIT_ME( 0, directory_init, 0 )
@@ -27,11 +27,14 @@
 #include <vm/syscall.h>
 
 #include "ids/opcode_ids.h"
+#include "jit.h"
 
 #include <kernel/snap_sync.h>
+#include <kernel/stats.h>
 
 
-static errno_t find_dynamic_method( dynamic_method_info_t *mi );
+static errno_t find_dynamic_method( dynamic_method_info_t *mi, const void *site );
+static struct pvm_object pvm_exec_find_loaded_class_by_name(struct pvm_object name);
 
 
 /*
@@ -43,6 +46,9 @@ static errno_t find_dynamic_method( dynamic_method_info_t *mi );
 
 #define DEB_CALLRET 0
 
+// Max number of released call frames kept in thread for reuse
+#define PVM_FRAME_POOL_SIZE 32
+
 //static int debug_print_instr = 1;
 int debug_print_instr = 0;
 
@@ -76,7 +82,10 @@ int debug_print_instr = 0;
 #define ls_push( i ) 	pvm_lstack_push( da->_istack, i )
 #define ls_pop() 	pvm_lstack_pop( da->_istack )
 #define ls_top() 	pvm_lstack_top( da->_istack )
-#define ls_empty() 	pvm_lstack_empty( da->_istack )
+
+#define ds_push( d ) 	pvm_dstack_push( da->_istack, d )
+#define ds_pop() 	pvm_dstack_pop( da->_istack )
+#define ds_top() 	pvm_dstack_top( da->_istack )
 
 
 #define es_push( i ) 	pvm_estack_push( da->_estack, i )
@@ -84,7 +93,103 @@ int debug_print_instr = 0;
 #define es_empty()      pvm_estack_empty( da->_estack )
 
 
-#define this_object()   (da->_this_object)
+#define this_object()   (((struct data_area_4_call_frame *)&(da->call_frame.data->da))->this_object)
+
+
+/**
+ *
+ * Opcode dispatch. Threaded code jumps from one opcode handler right
+ * to the next one through the labels table, plain switch is used
+ * otherwise. Handler which ends with 'break' goes the long way through
+ * the loop.
+ *
+**/
+
+#if PVM_EXEC_THREADED
+#  define OPCODE(op)        case op: L_##op
+#  define OPCODE_DEFAULT    default: L_default
+#  define DISPATCH()        goto *dispatch[ (instruction = exec_get_opcode(da)) ]
+#else
+#  define OPCODE(op)        case op
+#  define OPCODE_DEFAULT    default
+#  define DISPATCH()        break
+#endif
+
+
+/**
+ *
+ * Bytecode read. Pre-decoded code (see code_cache.c) was checked when
+ * decoded, its operands are taken from the decoded table with no bounds
+ * checks. Other code is read and checked by code.c functions.
+ *
+**/
+
+static inline unsigned char exec_get_opcode( struct data_area_4_thread *da )
+{
+    if( da->code.IP < da->code.IP_max )
+        return da->code.code[da->code.IP++];
+
+    return pvm_code_get_byte(&(da->code));
+}
+
+static inline unsigned char exec_get_byte( struct data_area_4_thread *da )
+{
+    if( da->_decoded )
+        return da->code.code[da->code.IP++];
+
+    return pvm_code_get_byte(&(da->code));
+}
+
+static inline int exec_get_int32( struct data_area_4_thread *da )
+{
+    if( da->_decoded )
+    {
+        int v = da->_decoded->ops[da->code.IP];
+        da->code.IP += 4;
+        return v;
+    }
+
+    return pvm_code_get_int32(&(da->code));
+}
+
+static inline int64_t exec_get_int64( struct data_area_4_thread *da )
+{
+    if( da->_decoded )
+    {
+        const int *op = da->_decoded->ops + da->code.IP;
+        da->code.IP += 8;
+        return (int64_t)( (((u_int64_t)(unsigned)op[0]) << 32) | (unsigned)op[4] );
+    }
+
+    return pvm_code_get_int64(&(da->code));
+}
+
+// Decoded table has absolute target
+static inline unsigned int exec_get_rel_IP_as_abs( struct data_area_4_thread *da )
+{
+    if( da->_decoded )
+    {
+        unsigned int target = da->_decoded->ops[da->code.IP];
+        da->code.IP += 4;
+        return target;
+    }
+
+    return pvm_code_get_rel_IP_as_abs(&(da->code));
+}
+
+// Decoded code has string made already
+static inline pvm_object_t exec_get_string( struct data_area_4_thread *da )
+{
+    if( da->_decoded )
+    {
+        const int *op = da->_decoded->ops + da->code.IP;
+        da->code.IP += 4 + op[0];
+        return ref_inc_o( da->_decoded->consts[op[-1]] );
+    }
+
+    return pvm_code_get_string(&(da->code));
+}
+
 
 
 /**
@@ -95,6 +200,49 @@ int debug_print_instr = 0;
 
 
 
+// Snapshot safepoint
+static inline void pvm_exec_snap_poll( struct data_area_4_thread *da )
+{
+#if NEW_SNAP_SYNC
+    (void) da;
+    touch_snap_catch();
+#else
+    if(phantom_virtual_machine_snap_request)
+    {
+        pvm_exec_save_fast_acc(da); // Before snap
+        phantom_thread_wait_4_snap();
+        //pvm_exec_load_fast_acc(da); // We don't need this, if we die, we will enter again from above :)
+    }
+#endif
+}
+
+// Refdec thread is behind, let it catch up. Keep polling for snapshot,
+// refdec thread stops us to drain.
+static void pvm_exec_refdec_wait( struct data_area_4_thread *da )
+{
+    STAT_INC_CNT( VM_REFDEC_WAIT );
+
+    while( refdec_backpressure )
+    {
+        pvm_exec_snap_poll(da);
+        hal_sleep_msec( 1 );
+    }
+}
+
+// Safepoint: poll for snapshot and go on in compiled code, if any.
+// IP must be final - compiled code starts from it.
+static inline void pvm_exec_safepoint( struct data_area_4_thread *da )
+{
+    pvm_exec_snap_poll(da);
+    if( refdec_backpressure )
+        pvm_exec_refdec_wait(da);
+#if PVM_JIT
+    if( da->_decoded && da->_decoded->jit_entry )
+        jit_run( da );
+#endif
+}
+
+
 void pvm_exec_load_fast_acc(struct data_area_4_thread *da)
 {
     struct data_area_4_call_frame *cf = (struct data_area_4_call_frame *)&(da->call_frame.data->da);
@@ -104,7 +252,8 @@ void pvm_exec_load_fast_acc(struct data_area_4_thread *da)
 
     da->code.IP      = cf->IP;  /* Instruction Pointer */
 
-    da->_this_object = cf->this_object;
+    da->_decoded     = pvm_code_cache_get( cf->code, cf->IP_max );
+
     da->_istack = (struct data_area_4_integer_stack*)(& cf->istack.data->da);
     da->_ostack = (struct data_area_4_object_stack*)(& cf->ostack.data->da);
     da->_estack = (struct data_area_4_exception_stack*)(& cf->estack.data->da);
@@ -116,6 +265,15 @@ void pvm_exec_save_fast_acc(struct data_area_4_thread *da)
     cf->IP = da->code.IP;
 }
 
+void pvm_exec_restart_thread(struct pvm_object thread)
+{
+    struct data_area_4_thread *da = pvm_object_da( thread, thread );
+
+    // Frames of dropped pool are reachable from nowhere, GC will free them
+    da->frame_pool = 0;
+    da->_decoded = 0;
+}
+
 
 
 /**
@@ -179,12 +337,419 @@ static void pvm_exec_iset( struct data_area_4_thread *da, unsigned abs_stack_pos
 }
 
 
+/**
+ *
+ * Long and double ops. Prefixed instruction works on two cell slots
+ * of the integer stack (see stacks.h), comparisons push int.
+ *
+**/
+
+static void pvm_exec_long_op( struct data_area_4_thread *da, unsigned char instruction )
+{
+    switch(instruction)
+    {
+    case opcode_is_dup:
+        LISTI("l-is dup");
+        pvm_istack_push64( da->_istack, pvm_istack_top64( da->_istack ) );
+        return;
+
+    case opcode_is_drop:
+        LISTI("l-is drop");
+        pvm_istack_pop64( da->_istack );
+        return;
+
+    case opcode_iconst_0:       LISTI("l-iconst 0");    ls_push( 0 ); return;
+    case opcode_iconst_1:       LISTI("l-iconst 1");    ls_push( 1 ); return;
+    case opcode_iconst_8bit:    LISTI("l-iconst8");     ls_push( exec_get_byte(da) ); return;
+    case opcode_iconst_32bit:   LISTI("l-iconst32");    ls_push( exec_get_int32(da) ); return;
+    case opcode_iconst_64bit:   LISTI("l-iconst64");    ls_push( exec_get_int64(da) ); return;
+
+    case opcode_is_get32:
+        {
+            int pos = exec_get_int32(da);
+            LISTIA("l-is stack get %d", pos);
+            pvm_istack_push64( da->_istack, pvm_istack_abs_get64( da->_istack, pos ) );
+        }
+        return;
+
+    case opcode_is_set32:
+        {
+            int pos = exec_get_int32(da);
+            LISTIA("l-is stack set %d", pos);
+            pvm_istack_abs_set64( da->_istack, pos, pvm_istack_pop64( da->_istack ) );
+        }
+        return;
+
+    case opcode_ishl:
+        LISTI("l-ishl");
+        {
+            int64_t val = ls_pop();
+            ls_push( val << is_pop() );
+        }
+        return;
+
+    case opcode_ishr:
+        LISTI("l-ishr");
+        {
+            int64_t val = ls_pop();
+            ls_push( val >> is_pop() );
+        }
+        return;
+
+    case opcode_ushr:
+        LISTI("l-ushr");
+        {
+            u_int64_t val = ls_pop();
+            ls_push( val >> is_pop() );
+        }
+        return;
+
+    case opcode_isum:
+        LISTI("l-isum");
+        {
+            int64_t add = ls_pop();
+            ls_push( ls_pop() + add );
+        }
+        return;
+
+    case opcode_imul:
+        LISTI("l-imul");
+        {
+            int64_t mul = ls_pop();
+            ls_push( ls_pop() * mul );
+        }
+        return;
+
+    case opcode_isubul:
+        LISTI("l-isubul");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(u-l);
+        }
+        return;
+
+    case opcode_isublu:
+        LISTI("l-isublu");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(l-u);
+        }
+        return;
+
+    case opcode_idivul:
+        LISTI("l-idivul");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(u/l);
+        }
+        return;
+
+    case opcode_idivlu:
+        LISTI("l-idivlu");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(l/u);
+        }
+        return;
+
+    case opcode_iremul:
+        LISTI("l-iremul");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(u%l);
+        }
+        return;
+
+    case opcode_iremlu:
+        LISTI("l-iremlu");
+        {
+            int64_t u = ls_pop();
+            int64_t l = ls_pop();
+            ls_push(l%u);
+        }
+        return;
+
+    case opcode_ior:
+        LISTI("l-ior");
+        { int64_t operand = ls_pop();	ls_push( ls_pop() | operand ); }
+        return;
+
+    case opcode_iand:
+        LISTI("l-iand");
+        { int64_t operand = ls_pop();	ls_push( ls_pop() & operand ); }
+        return;
+
+    case opcode_ixor:
+        LISTI("l-ixor");
+        { int64_t operand = ls_pop();	ls_push( ls_pop() ^ operand ); }
+        return;
+
+    case opcode_inot:
+        LISTI("l-inot");
+        { int64_t operand = ls_pop();	ls_push( ~operand ); }
+        return;
+
+    case opcode_log_or:
+        LISTI("l-lor");
+        {
+            int64_t o1 = ls_pop();
+            int64_t o2 = ls_pop();
+            ls_push( o1 || o2 );
+        }
+        return;
+
+    case opcode_log_and:
+        LISTI("l-land");
+        {
+            int64_t o1 = ls_pop();
+            int64_t o2 = ls_pop();
+            ls_push( o1 && o2 );
+        }
+        return;
+
+    case opcode_log_xor:
+        LISTI("l-lxor");
+        {
+            int64_t o1 = ls_pop() ? 1 : 0;
+            int64_t o2 = ls_pop() ? 1 : 0;
+            ls_push( o1 ^ o2 );
+        }
+        return;
+
+    case opcode_log_not:
+        LISTI("l-lnot");
+        {
+            int64_t operand = ls_pop();
+            ls_push( !operand );
+        }
+        return;
+
+        // NB! Returns int!
+    case opcode_ige:	// >=
+        LISTI("l-ige");
+        { int64_t operand = ls_pop();	is_push( ls_pop() >= operand ); }
+        return;
+    case opcode_ile:	// <=
+        LISTI("l-ile");
+        { int64_t operand = ls_pop();	is_push( ls_pop() <= operand ); }
+        return;
+    case opcode_igt:	// >
+        LISTI("l-igt");
+        { int64_t operand = ls_pop();	is_push( ls_pop() > operand ); }
+        return;
+    case opcode_ilt:	// <
+        LISTI("l-ilt");
+        { int64_t operand = ls_pop();	is_push( ls_pop() < operand ); }
+        return;
+
+    case opcode_i2o:
+        LISTI("l-i2o");
+        os_push(pvm_create_long_object(ls_pop()));
+        return;
+
+    case opcode_o2i:
+        LISTI("l-o2i");
+        {
+            struct pvm_object o = os_pop();
+            if( o.data == 0 ) pvm_exec_panic("l-o2i(null)");
+            ls_push( pvm_get_long( o ) );
+            ref_dec_o(o);
+        }
+        return;
+    }
+
+    printf("Unknown long op code 0x%X\n", instruction );
+    pvm_exec_panic( "thread exec: unknown long opcode" );
+}
+
+
+static void pvm_exec_double_op( struct data_area_4_thread *da, unsigned char instruction )
+{
+    switch(instruction)
+    {
+    case opcode_is_dup:
+        LISTI("d-is dup");
+        pvm_istack_push64( da->_istack, pvm_istack_top64( da->_istack ) );
+        return;
+
+    case opcode_is_drop:
+        LISTI("d-is drop");
+        pvm_istack_pop64( da->_istack );
+        return;
+
+    case opcode_iconst_0:       LISTI("d-iconst 0");    ds_push( 0 ); return;
+    case opcode_iconst_1:       LISTI("d-iconst 1");    ds_push( 1 ); return;
+    case opcode_iconst_8bit:    LISTI("d-iconst8");     ds_push( exec_get_byte(da) ); return;
+    case opcode_iconst_32bit:   LISTI("d-iconst32");    ds_push( exec_get_int32(da) ); return;
+
+    case opcode_iconst_64bit:   // IEEE 754 bits
+        LISTI("d-iconst64");
+        ls_push( exec_get_int64(da) );
+        return;
+
+    case opcode_is_get32:
+        {
+            int pos = exec_get_int32(da);
+            LISTIA("d-is stack get %d", pos);
+            pvm_istack_push64( da->_istack, pvm_istack_abs_get64( da->_istack, pos ) );
+        }
+        return;
+
+    case opcode_is_set32:
+        {
+            int pos = exec_get_int32(da);
+            LISTIA("d-is stack set %d", pos);
+            pvm_istack_abs_set64( da->_istack, pos, pvm_istack_pop64( da->_istack ) );
+        }
+        return;
+
+    case opcode_isum:
+        LISTI("d-isum");
+        {
+            double add = ds_pop();
+            ds_push( ds_pop() + add );
+        }
+        return;
+
+    case opcode_imul:
+        LISTI("d-imul");
+        {
+            double mul = ds_pop();
+            ds_push( ds_pop() * mul );
+        }
+        return;
+
+    case opcode_isubul:
+        LISTI("d-isubul");
+        {
+            double u = ds_pop();
+            double l = ds_pop();
+            ds_push(u-l);
+        }
+        return;
+
+    case opcode_isublu:
+        LISTI("d-isublu");
+        {
+            double u = ds_pop();
+            double l = ds_pop();
+            ds_push(l-u);
+        }
+        return;
+
+    case opcode_idivul:
+        LISTI("d-idivul");
+        {
+            double u = ds_pop();
+            double l = ds_pop();
+            ds_push(u/l);
+        }
+        return;
+
+    case opcode_idivlu:
+        LISTI("d-idivlu");
+        {
+            double u = ds_pop();
+            double l = ds_pop();
+            ds_push(l/u);
+        }
+        return;
+
+    case opcode_log_not:
+        LISTI("d-lnot");
+        ds_push( !ds_pop() );
+        return;
+
+        // NB! Returns int!
+    case opcode_ige:	// >=
+        LISTI("d-ige");
+        { double operand = ds_pop();	is_push( ds_pop() >= operand ); }
+        return;
+    case opcode_ile:	// <=
+        LISTI("d-ile");
+        { double operand = ds_pop();	is_push( ds_pop() <= operand ); }
+        return;
+    case opcode_igt:	// >
+        LISTI("d-igt");
+        { double operand = ds_pop();	is_push( ds_pop() > operand ); }
+        return;
+    case opcode_ilt:	// <
+        LISTI("d-ilt");
+        { double operand = ds_pop();	is_push( ds_pop() < operand ); }
+        return;
+    }
+
+    // No double objects yet, so no i2o/o2i
+    printf("Unknown double op code 0x%X\n", instruction );
+    pvm_exec_panic( "thread exec: unknown double opcode" );
+}
+
+
+/*
+ * Call frames are not freed on return but put to the per thread
+ * pool (da->frame_pool) with stacks emptied. Stack pages are kept
+ * too, so usual call does no allocation at all. Pool is a list of
+ * objects hanging off the thread object. It is a cache only and is
+ * dropped on restart, as its place in old thread objects has other
+ * data (see internal_da.h); dropped frames are garbage for GC. Pool
+ * length is kept in IP of head frame, which is 0 in pooled frame.
+ */
+
+static struct pvm_object get_call_frame(struct data_area_4_thread *da)
+{
+    if( da->frame_pool == 0 )
+        return pvm_create_call_frame_object();
+
+    struct pvm_object cf = pvm_storage_to_object( da->frame_pool );
+    struct data_area_4_call_frame *cfda = pvm_object_da( cf, call_frame );
+
+    da->frame_pool = cfda->prev.data;
+
+    cfda->IP = 0;
+    cfda->prev = pvm_get_null_object();
+
+    STAT_INC_CNT( VM_CALL_FRAME_REUSE );
+    return cf;
+}
+
+
 static void free_call_frame(struct pvm_object cf, struct data_area_4_thread *da)
 {
-    pvm_object_da( cf, call_frame )->prev.data = 0; // Or else refcounter will follow this link
-    ref_dec_o( cf ); // we are erasing reference to old call frame - release it!
+    struct data_area_4_call_frame *cfda = pvm_object_da( cf, call_frame );
+
+    cfda->prev.data = 0; // Or else refcounter will follow this link
 
     da->stack_depth--;
+
+    unsigned int pool_size = da->frame_pool ? ((struct data_area_4_call_frame *)da->frame_pool->da)->IP : 0;
+
+    // Somebody else refers to it or pool is full - release
+    if( cf.data->_ah.refCount != 1 || pool_size >= PVM_FRAME_POOL_SIZE )
+    {
+        ref_dec_o( cf ); // we are erasing reference to old call frame - release it!
+        return;
+    }
+
+    // Do what refcount release would do, but keep frame and stacks
+    ref_dec_o( cfda->this_object );
+    cfda->this_object = pvm_get_null_object();
+
+    pvm_ostack_reset( pvm_object_da( cfda->ostack, object_stack ) );
+    pvm_istack_reset( pvm_object_da( cfda->istack, integer_stack ) );
+    pvm_estack_reset( pvm_object_da( cfda->estack, exception_stack ) );
+
+    cfda->code = 0;
+    cfda->IP = pool_size + 1;
+    cfda->IP_max = 0;
+
+    cfda->prev.data = da->frame_pool;
+    cfda->prev.interface = 0;
+    da->frame_pool = cf.data;
 }
 
 
@@ -204,7 +769,7 @@ static void pvm_exec_do_return(struct data_area_4_thread *da)
 
 
 static int pvm_exec_find_catch(
-                               struct data_area_4_exception_stack* stack,
+                               struct data_area_4_thread *da,
                                unsigned int *jump_to,
                                struct pvm_object thrown_obj );
 
@@ -215,7 +780,7 @@ static void pvm_exec_do_throw(struct data_area_4_thread *da)
     unsigned int jump_to = (unsigned int)-1; // to cause fault
     struct pvm_object thrown_obj = os_pop();
     // call_frame.catch_found( &jump_to, thrown_obj )
-    while( !(pvm_exec_find_catch( da->_estack, &jump_to, thrown_obj )) )
+    while( !(pvm_exec_find_catch( da, &jump_to, thrown_obj )) )
     {
         // like ret here
         LISTI("except does unwind, ");
@@ -254,7 +819,7 @@ static void pvm_exec_sys( struct data_area_4_thread *da, unsigned int syscall_in
     // which object's syscall we'll call
     struct pvm_object o = this_object();
 
-    syscall_func_t func = pvm_exec_find_syscall( o.data->_class, syscall_index );
+    syscall_func_t func = pvm_exec_find_syscall( pvm_object_class( o ), syscall_index );
 
     if( func == 0 )
     {
@@ -303,7 +868,8 @@ static void init_cfda(struct data_area_4_thread *da, struct data_area_4_call_fra
     if( pvm_is_null(new_this) )
         new_this = os_pop();
 
-    struct pvm_object_storage *code = pvm_exec_find_method( new_this, method_index );
+    // Caller's IP is past the call instruction, use it as call site id
+    struct pvm_object_storage *code = pvm_ic_find_method( da->code.code + da->code.IP, new_this, method_index );
     assert(code != 0);
     pvm_exec_set_cs( cfda, code );
     cfda->this_object = new_this;
@@ -338,7 +904,7 @@ static void pvm_exec_call( struct data_area_4_thread *da, unsigned int method_in
 
     pvm_exec_save_fast_acc(da);  // not needed for optimized stack in fact
 
-    struct pvm_object new_cf = pvm_create_call_frame_object();
+    struct pvm_object new_cf = get_call_frame(da);
     struct data_area_4_call_frame* cfda = pvm_object_da( new_cf, call_frame );
 
     init_cfda(da, cfda, method_index, n_param, new_this);
@@ -358,6 +924,11 @@ static void pvm_exec_call( struct data_area_4_thread *da, unsigned int method_in
     da->call_frame = new_cf;
     pvm_exec_load_fast_acc(da);
 
+#if PVM_JIT
+    if( da->_decoded && ++(da->_decoded->calls) == PVM_JIT_THRESHOLD )
+        jit_compile_method( da->_decoded );
+#endif
+
     if( DEB_CALLRET || debug_print_instr ) printf( "%d); ", da->stack_depth );
 }
 
@@ -389,13 +960,6 @@ static void pvm_exec_call( struct data_area_4_thread *da, unsigned int method_in
 
 void pvm_exec(pvm_object_t current_thread)
 {
-    int prefix_long = 0;
-    int prefix_float = 0;
-    int prefix_double = 0;
-
-#define DO_TWICE  (prefix_long || prefix_double)
-#define DO_FPOINT (prefix_float || prefix_double)
-
     if( !pvm_object_class_is( current_thread, pvm_get_thread_class() ))
         panic("attempt to run not a thread");
 
@@ -411,20 +975,108 @@ void pvm_exec(pvm_object_t current_thread)
 #warning resleep?
 #endif
 
-    while(1)
-    {
+    unsigned char instruction;
 
-#if NEW_SNAP_SYNC
-        touch_snap_catch();
-#else
-        if(phantom_virtual_machine_snap_request)
-        {
-            pvm_exec_save_fast_acc(da); // Before snap
-            phantom_thread_wait_4_snap();
-            //pvm_exec_load_fast_acc(da); // We don't need this, if we die, we will enter again from above :)
-        }
+#if PVM_EXEC_THREADED
+    // Opcode handler labels, see OPCODE(). Ones not listed here are
+    // decoded by the default handler.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void * const dispatch[256] =
+    {
+        [0 ... 255] = &&L_default,
+        [opcode_nop]                    = &&L_opcode_nop,
+        [opcode_debug]                  = &&L_opcode_debug,
+        [opcode_prefix_long]            = &&L_opcode_prefix_long,
+        [opcode_prefix_float]           = &&L_opcode_prefix_float,
+        [opcode_prefix_double]          = &&L_opcode_prefix_double,
+        [opcode_general_lock]           = &&L_opcode_general_lock,
+        [opcode_general_unlock]         = &&L_opcode_general_unlock,
+        [opcode_is_dup]                 = &&L_opcode_is_dup,
+        [opcode_is_drop]                = &&L_opcode_is_drop,
+        [opcode_iconst_0]               = &&L_opcode_iconst_0,
+        [opcode_iconst_1]               = &&L_opcode_iconst_1,
+        [opcode_iconst_8bit]            = &&L_opcode_iconst_8bit,
+        [opcode_iconst_32bit]           = &&L_opcode_iconst_32bit,
+        [opcode_iconst_64bit]           = &&L_opcode_iconst_64bit,
+        [opcode_ishl]                   = &&L_opcode_ishl,
+        [opcode_ishr]                   = &&L_opcode_ishr,
+        [opcode_ushr]                   = &&L_opcode_ushr,
+        [opcode_isum]                   = &&L_opcode_isum,
+        [opcode_imul]                   = &&L_opcode_imul,
+        [opcode_isubul]                 = &&L_opcode_isubul,
+        [opcode_isublu]                 = &&L_opcode_isublu,
+        [opcode_idivul]                 = &&L_opcode_idivul,
+        [opcode_idivlu]                 = &&L_opcode_idivlu,
+        [opcode_ior]                    = &&L_opcode_ior,
+        [opcode_iand]                   = &&L_opcode_iand,
+        [opcode_ixor]                   = &&L_opcode_ixor,
+        [opcode_inot]                   = &&L_opcode_inot,
+        [opcode_log_or]                 = &&L_opcode_log_or,
+        [opcode_log_and]                = &&L_opcode_log_and,
+        [opcode_log_xor]                = &&L_opcode_log_xor,
+        [opcode_log_not]                = &&L_opcode_log_not,
+        [opcode_ige]                    = &&L_opcode_ige,
+        [opcode_ile]                    = &&L_opcode_ile,
+        [opcode_igt]                    = &&L_opcode_igt,
+        [opcode_ilt]                    = &&L_opcode_ilt,
+        [opcode_i2o]                    = &&L_opcode_i2o,
+        [opcode_o2i]                    = &&L_opcode_o2i,
+        [opcode_os_eq]                  = &&L_opcode_os_eq,
+        [opcode_os_neq]                 = &&L_opcode_os_neq,
+        [opcode_os_isnull]              = &&L_opcode_os_isnull,
+        [opcode_summon_null]            = &&L_opcode_summon_null,
+        [opcode_summon_thread]          = &&L_opcode_summon_thread,
+        [opcode_summon_this]            = &&L_opcode_summon_this,
+        [opcode_summon_class_class]     = &&L_opcode_summon_class_class,
+        [opcode_summon_interface_class] = &&L_opcode_summon_interface_class,
+        [opcode_summon_code_class]      = &&L_opcode_summon_code_class,
+        [opcode_summon_int_class]       = &&L_opcode_summon_int_class,
+        [opcode_summon_string_class]    = &&L_opcode_summon_string_class,
+        [opcode_summon_array_class]     = &&L_opcode_summon_array_class,
+        [opcode_summon_by_name]         = &&L_opcode_summon_by_name,
+        [opcode_new]                    = &&L_opcode_new,
+        [opcode_copy]                   = &&L_opcode_copy,
+        [opcode_sconst_bin]             = &&L_opcode_sconst_bin,
+        [opcode_jmp]                    = &&L_opcode_jmp,
+        [opcode_djnz]                   = &&L_opcode_djnz,
+        [opcode_jz]                     = &&L_opcode_jz,
+        [opcode_switch]                 = &&L_opcode_switch,
+        [opcode_ret]                    = &&L_opcode_ret,
+        [opcode_throw]                  = &&L_opcode_throw,
+        [opcode_push_catcher]           = &&L_opcode_push_catcher,
+        [opcode_pop_catcher]            = &&L_opcode_pop_catcher,
+        [opcode_short_call_0]           = &&L_opcode_short_call_0,
+        [opcode_short_call_1]           = &&L_opcode_short_call_1,
+        [opcode_short_call_2]           = &&L_opcode_short_call_2,
+        [opcode_short_call_3]           = &&L_opcode_short_call_3,
+        [opcode_call_8bit]              = &&L_opcode_call_8bit,
+        [opcode_call_32bit]             = &&L_opcode_call_32bit,
+        [opcode_dynamic_invoke]         = &&L_opcode_dynamic_invoke,
+        [opcode_os_dup]                 = &&L_opcode_os_dup,
+        [opcode_os_drop]                = &&L_opcode_os_drop,
+        [opcode_os_pull32]              = &&L_opcode_os_pull32,
+        [opcode_os_load8]               = &&L_opcode_os_load8,
+        [opcode_os_load32]              = &&L_opcode_os_load32,
+        [opcode_os_save8]               = &&L_opcode_os_save8,
+        [opcode_os_save32]              = &&L_opcode_os_save32,
+        [opcode_is_load8]               = &&L_opcode_is_load8,
+        [opcode_is_save8]               = &&L_opcode_is_save8,
+        [opcode_os_get32]               = &&L_opcode_os_get32,
+        [opcode_os_set32]               = &&L_opcode_os_set32,
+        [opcode_is_get32]               = &&L_opcode_is_get32,
+        [opcode_is_set32]               = &&L_opcode_is_set32,
+    };
+#pragma GCC diagnostic pop
 #endif
 
+    // Snapshot safepoint is polled here, on backward jumps, calls and
+    // returns. Straight code always comes to one of these soon.
+    pvm_exec_safepoint(da);
+
+    while(1)
+    {
+
 #if 0 // GC_ENABLED  // GC can be enabled here for test purposes only.
         static int gcc = 0;
         gcc++;
@@ -435,214 +1087,29 @@ void pvm_exec(pvm_object_t current_thread)
         }
 #endif // GC_ENABLED
 
-        unsigned char instruction = pvm_code_get_byte(&(da->code));
+        instruction = exec_get_opcode(da);
         //printf("instr 0x%02X ", instruction);
 
-        if( prefix_long )
-            switch(instruction)
-            {
-            case opcode_ishl:
-                LISTI("l-ishl");
-                {
-                    int64_t val = ls_pop();
-                    ls_push( val << is_pop() );
-                }
-                break;
-
-            case opcode_ishr:
-                LISTI("l-ishr");
-                {
-                    int64_t val = ls_pop();
-                    ls_push( val >> is_pop() );
-                }
-                break;
-
-            case opcode_ushr:
-                LISTI("l-ushr");
-                {
-                    u_int64_t val = ls_pop();
-                    ls_push( val >> is_pop() );
-                }
-                break;
-
-
-            case opcode_isum:
-                LISTI("l-isum");
-                {
-                    int64_t add = ls_pop();
-                    ls_push( ls_pop() + add );
-                }
-                break;
-
-            case opcode_imul:
-                LISTI("l-imul");
-                {
-                    int64_t mul = ls_pop();
-                    ls_push( ls_pop() * mul );
-                }
-                break;
-
-            case opcode_isubul:
-                LISTI("l-isubul");
-                {
-                    int64_t u = ls_pop();
-                    int64_t l = ls_pop();
-                    ls_push(u-l);
-                }
-                break;
-
-            case opcode_isublu:
-                LISTI("l-isublu");
-                {
-                    int64_t u = ls_pop();
-                    int64_t l = ls_pop();
-                    ls_push(l-u);
-                }
-                break;
-
-            case opcode_idivul:
-                LISTI("l-idivul");
-                {
-                    int64_t u = ls_pop();
-                    int64_t l = ls_pop();
-                    ls_push(u/l);
-                }
-                break;
-
-            case opcode_idivlu:
-                LISTI("l-idivlu");
-                {
-                    int64_t u = ls_pop();
-                    int64_t l = ls_pop();
-                    ls_push(l/u);
-                }
-                break;
-
-            case opcode_ior:
-                LISTI("l-ior");
-                { int64_t operand = ls_pop();	ls_push( ls_pop() | operand ); }
-                break;
-
-            case opcode_iand:
-                LISTI("l-iand");
-                { int64_t operand = ls_pop();	ls_push( ls_pop() & operand ); }
-                break;
-
-            case opcode_ixor:
-                LISTI("l-ixor");
-                { int64_t operand = ls_pop();	ls_push( ls_pop() ^ operand ); }
-                break;
-
-            case opcode_inot:
-                LISTI("l-inot");
-                { int64_t operand = ls_pop();	ls_push( ~operand ); }
-                break;
-
-
-
-            case opcode_log_or:
-                LISTI("l-lor");
-                {
-                    int64_t o1 = ls_pop();
-                    int64_t o2 = ls_pop();
-                    ls_push( o1 || o2 );
-                }
-                break;
-
-            case opcode_log_and:
-                LISTI("l-land");
-                {
-                    int64_t o1 = ls_pop();
-                    int64_t o2 = ls_pop();
-                    ls_push( o1 && o2 );
-                }
-                break;
-
-            case opcode_log_xor:
-                LISTI("l-lxor");
-                {
-                    int64_t o1 = ls_pop() ? 1 : 0;
-                    int64_t o2 = ls_pop() ? 1 : 0;
-                    ls_push( o1 ^ o2 );
-                }
-                break;
-
-            case opcode_log_not:
-                LISTI("l-lnot");
-                {
-                    int64_t operand = ls_pop();
-                    ls_push( !operand );
-                }
-                break;
-
-                // NB! Returns int!
-            case opcode_ige:	// >=
-                LISTI("l-ige");
-                { int64_t operand = ls_pop();	is_push( ls_pop() >= operand ); }
-                break;
-            case opcode_ile:	// <=
-                LISTI("l-ile");
-                { int64_t operand = ls_pop();	is_push( ls_pop() <= operand ); }
-                break;
-            case opcode_igt:	// >
-                LISTI("l-igt");
-                { int64_t operand = ls_pop();	is_push( ls_pop() > operand ); }
-                break;
-            case opcode_ilt:	// <
-                LISTI("l-ilt");
-                { int64_t operand = ls_pop();	is_push( ls_pop() < operand ); }
-                break;
-
-
-
-            case opcode_i2o:
-                LISTI("l-i2o");
-                os_push(pvm_create_long_object(ls_pop()));
-                break;
-
-            case opcode_o2i:
-                LISTI("l-o2i");
-                {
-                    struct pvm_object o = os_pop();
-                    if( o.data == 0 ) pvm_exec_panic("l-o2i(null)");
-                    ls_push( pvm_get_long( o ) );
-                    ref_dec_o(o);
-                }
-                break;
-            }
-        // End of long ops
-
-        if( prefix_float )
-            switch(instruction)
-            {
-            }
-        // End of float ops
-
-        if( prefix_double )
-            switch(instruction)
-            {
-            }
-        // End of double ops
 
 
 
 
         switch(instruction)
         {
-        case opcode_nop:
+        OPCODE(opcode_nop):
             LISTI("nop");
-            break;
+            DISPATCH();
 
-        case opcode_debug:
+        OPCODE(opcode_debug):
             {
-                int type = pvm_code_get_byte(&(da->code)); //cf->cs.get_instr( cf->IP );
+                int type = exec_get_byte(da); //cf->cs.get_instr( cf->IP );
                 printf("\n\nDebug 0x%02X", type );
                 if( type & 0x80 )
                 {
                     printf(" (" );
                     //cf->cs.get_string( cf->IP ).my_data()->print();
                     //get_string().my_data()->print();
-                    pvm_object_t o = pvm_code_get_string(&(da->code));
+                    pvm_object_t o = exec_get_string(da);
                     pvm_object_print(o);
                     ref_dec_o(o);
                     printf(")" );
@@ -663,254 +1130,253 @@ void pvm_exec(pvm_object_t current_thread)
                 }
                 printf(";\n\n");
             }
-            break;
+            DISPATCH();
 
             // type switch prefixes --------------------------------
 
-        case opcode_prefix_long:   prefix_long   = 1; break;
-        case opcode_prefix_float:  prefix_float  = 1; break;
-        case opcode_prefix_double: prefix_double = 1; break;
+        // Prefix and the prefixed instruction are executed together
+
+        OPCODE(opcode_prefix_long):
+            pvm_exec_long_op( da, exec_get_opcode(da) );
+            DISPATCH();
+
+        OPCODE(opcode_prefix_float):
+            LISTI("f-prefix");
+            pvm_exec_panic( "thread exec: float ops are not implemented" );
+            DISPATCH();
+
+        OPCODE(opcode_prefix_double):
+            pvm_exec_double_op( da, exec_get_opcode(da) );
+            DISPATCH();
 
             // sync ops ---------------------------------------
 
-        case opcode_general_lock:
+        OPCODE(opcode_general_lock):
             LISTI("lock");
             {
                 // This is java monitor, arbitrary object
                 struct pvm_object lock_obj = os_pop();
                 // TODO impl me
             }
-            break;
+            DISPATCH();
 
-        case opcode_general_unlock:
+        OPCODE(opcode_general_unlock):
             LISTI("unlock");
             {
                 // This is java monitor, arbitrary object
                 struct pvm_object lock_obj = os_pop();
                 // TODO impl me
             }
-            break;
+            DISPATCH();
 
             // int stack ops ---------------------------------------
 
-        case opcode_is_dup:
+        OPCODE(opcode_is_dup):
             LISTI("is dup");
-            {
-                if(DO_TWICE)
-                {
-                    int i1 = is_pop();
-                    int i2 = is_pop();
-                    is_push(i1); is_push(i2);
-                    is_push(i1); is_push(i2);
-                }
-                else
-                    is_push(is_top());
-            }
-            break;
+            is_push(is_top());
+            DISPATCH();
 
-        case opcode_is_drop:
+        OPCODE(opcode_is_drop):
             LISTI("is drop");
-            is_pop(); if(DO_TWICE) is_pop();
-            break;
+            is_pop();
+            DISPATCH();
 
-        case opcode_iconst_0:
+        OPCODE(opcode_iconst_0):
             LISTI("iconst 0");
-            is_push(0); if(DO_TWICE) is_push(0);
-            break;
+            is_push(0);
+            DISPATCH();
 
-        case opcode_iconst_1:
+        OPCODE(opcode_iconst_1):
             LISTI("iconst 1");
-            is_push(1); if(DO_TWICE) is_push(1);
-            break;
+            is_push(1);
+            DISPATCH();
 
-        case opcode_iconst_8bit:
+        OPCODE(opcode_iconst_8bit):
             {
-                int v = pvm_code_get_byte(&(da->code));
-                if(DO_TWICE) ls_push(v);
-                else is_push(v);
+                int v = exec_get_byte(da);
+                is_push(v);
                 LISTIA("iconst8 = %d", v);
-                break;
+                DISPATCH();
             }
 
-        case opcode_iconst_32bit:
+        OPCODE(opcode_iconst_32bit):
             {
-                int v = pvm_code_get_int32(&(da->code));
-                if(DO_TWICE) ls_push(v);
-                else         is_push(v);
+                int v = exec_get_int32(da);
+                is_push(v);
                 LISTIA("iconst32 = %d", v);
-                break;
+                DISPATCH();
             }
 
-        case opcode_iconst_64bit:
+        OPCODE(opcode_iconst_64bit):
             {
-                int64_t v = pvm_code_get_int64(&(da->code));
+                int64_t v = exec_get_int64(da);
                 ls_push(v);
                 LISTIA("iconst64 = %Ld", v);
-                break;
+                DISPATCH();
             }
 
-        case opcode_ishl:
+        OPCODE(opcode_ishl):
             LISTI("ishl");
             {
                 int val = is_pop();
                 is_push( val << is_pop() );
             }
-            break;
+            DISPATCH();
 
-        case opcode_ishr:
+        OPCODE(opcode_ishr):
             LISTI("ishr");
             {
                 int val = is_pop();
                 is_push( val >> is_pop() );
             }
-            break;
+            DISPATCH();
 
-        case opcode_ushr:
+        OPCODE(opcode_ushr):
             LISTI("ushr");
             {
                 unsigned val = is_pop();
                 is_push( val >> is_pop() );
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_isum:
+        OPCODE(opcode_isum):
             LISTI("isum");
             {
                 int add = is_pop();
                 //is_top() += add;
                 is_push( is_pop() + add );
             }
-            break;
+            DISPATCH();
 
-        case opcode_imul:
+        OPCODE(opcode_imul):
             LISTI("imul");
             {
                 int mul = is_pop();
                 //is_top() *= mul;
                 is_push( is_pop() * mul );
             }
-            break;
+            DISPATCH();
 
-        case opcode_isubul:
+        OPCODE(opcode_isubul):
             LISTI("isubul");
             {
                 int u = is_pop();
                 int l = is_pop();
                 is_push(u-l);
             }
-            break;
+            DISPATCH();
 
-        case opcode_isublu:
+        OPCODE(opcode_isublu):
             LISTI("isublu");
             {
                 int u = is_pop();
                 int l = is_pop();
                 is_push(l-u);
             }
-            break;
+            DISPATCH();
 
-        case opcode_idivul:
+        OPCODE(opcode_idivul):
             LISTI("idivul");
             {
                 int u = is_pop();
                 int l = is_pop();
                 is_push(u/l);
             }
-            break;
+            DISPATCH();
 
-        case opcode_idivlu:
+        OPCODE(opcode_idivlu):
             LISTI("idivlu");
             {
                 int u = is_pop();
                 int l = is_pop();
                 is_push(l/u);
             }
-            break;
+            DISPATCH();
 
-        case opcode_ior:
+        OPCODE(opcode_ior):
             LISTI("ior");
             { int operand = is_pop();	is_push( is_pop() | operand ); }
-            break;
+            DISPATCH();
 
-        case opcode_iand:
+        OPCODE(opcode_iand):
             LISTI("iand");
             { int operand = is_pop();	is_push( is_pop() & operand ); }
-            break;
+            DISPATCH();
 
-        case opcode_ixor:
+        OPCODE(opcode_ixor):
             LISTI("ixor");
             { int operand = is_pop();	is_push( is_pop() ^ operand ); }
-            break;
+            DISPATCH();
 
-        case opcode_inot:
+        OPCODE(opcode_inot):
             LISTI("inot");
             { int operand = is_pop();	is_push( ~operand ); }
-            break;
+            DISPATCH();
 
 
 
-        case opcode_log_or:
+        OPCODE(opcode_log_or):
             LISTI("lor");
             {
                 int o1 = is_pop();
                 int o2 = is_pop();
                 is_push( o1 || o2 );
             }
-            break;
+            DISPATCH();
 
-        case opcode_log_and:
+        OPCODE(opcode_log_and):
             LISTI("land");
             {
                 int o1 = is_pop();
                 int o2 = is_pop();
                 is_push( o1 && o2 );
             }
-            break;
+            DISPATCH();
 
-        case opcode_log_xor:
+        OPCODE(opcode_log_xor):
             LISTI("lxor");
             {
                 int o1 = is_pop() ? 1 : 0;
                 int o2 = is_pop() ? 1 : 0;
                 is_push( o1 ^ o2 );
             }
-            break;
+            DISPATCH();
 
-        case opcode_log_not:
+        OPCODE(opcode_log_not):
             LISTI("lnot");
             {
                 int operand = is_pop();
                 is_push( !operand );
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_ige:	// >=
+        OPCODE(opcode_ige):	// >=
             LISTI("ige");
             { int operand = is_pop();	is_push( is_pop() >= operand ); }
-            break;
-        case opcode_ile:	// <=
+            DISPATCH();
+        OPCODE(opcode_ile):	// <=
             LISTI("ile");
             { int operand = is_pop();	is_push( is_pop() <= operand ); }
-            break;
-        case opcode_igt:	// >
+            DISPATCH();
+        OPCODE(opcode_igt):	// >
             LISTI("igt");
             { int operand = is_pop();	is_push( is_pop() > operand ); }
-            break;
-        case opcode_ilt:	// <
+            DISPATCH();
+        OPCODE(opcode_ilt):	// <
             LISTI("ilt");
             { int operand = is_pop();	is_push( is_pop() < operand ); }
-            break;
+            DISPATCH();
 
 
 
-        case opcode_i2o:
+        OPCODE(opcode_i2o):
             LISTI("i2o");
             os_push(pvm_create_int_object(is_pop()));
-            break;
+            DISPATCH();
 
-        case opcode_o2i:
+        OPCODE(opcode_o2i):
             LISTI("o2i");
             {
                 struct pvm_object o = os_pop();
@@ -918,10 +1384,10 @@ void pvm_exec(pvm_object_t current_thread)
                 is_push( pvm_get_int( o ) );
                 ref_dec_o(o);
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_os_eq:
+        OPCODE(opcode_os_eq):
             LISTI("os eq");
             {
                 struct pvm_object o1 = os_pop();
@@ -929,10 +1395,10 @@ void pvm_exec(pvm_object_t current_thread)
                 is_push( o1.data == o2.data );
                 ref_dec_o(o1);
                 ref_dec_o(o2);
-                break;
+                DISPATCH();
             }
 
-        case opcode_os_neq:
+        OPCODE(opcode_os_neq):
             LISTI("os neq");
             {
                 struct pvm_object o1 = os_pop();
@@ -940,16 +1406,16 @@ void pvm_exec(pvm_object_t current_thread)
                 is_push( o1.data != o2.data );
                 ref_dec_o(o1);
                 ref_dec_o(o2);
-                break;
+                DISPATCH();
             }
 
-        case opcode_os_isnull:
+        OPCODE(opcode_os_isnull):
             LISTI("isnull");
             {
                 struct pvm_object o1 = os_pop();
                 is_push( pvm_is_null( o1 ) );
                 ref_dec_o(o1);
-                break;
+                DISPATCH();
             }
 /*
         case opcode_os_push_null:
@@ -962,62 +1428,79 @@ void pvm_exec(pvm_object_t current_thread)
 
             // summoning, special ----------------------------------------------------
 
-        case opcode_summon_null:
+        OPCODE(opcode_summon_null):
             LISTI("push null");
             os_push( pvm_get_null_object() ); // so what opcode_os_push_null is for then?
-            break;
+            DISPATCH();
 
-        case opcode_summon_thread:
+        OPCODE(opcode_summon_thread):
             LISTI("summon thread");
             os_push( ref_inc_o( current_thread ) );
             //printf("ERROR: summon thread");
-            break;
+            DISPATCH();
 
-        case opcode_summon_this:
+        OPCODE(opcode_summon_this):
             LISTI("summon this");
             os_push( ref_inc_o( this_object() ) );
-            break;
+            DISPATCH();
 
-        case opcode_summon_class_class:
+        OPCODE(opcode_summon_class_class):
             LISTI("summon class class");
             // it has locked refcount
             os_push( pvm_get_class_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_interface_class:
+        OPCODE(opcode_summon_interface_class):
             LISTI("summon interface class");
             // locked refcnt
             os_push( pvm_get_interface_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_code_class:
+        OPCODE(opcode_summon_code_class):
             LISTI("summon code class");
         	// locked refcnt
             os_push( pvm_get_code_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_int_class:
+        OPCODE(opcode_summon_int_class):
             LISTI("summon int class");
         	// locked refcnt
             os_push( pvm_get_int_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_string_class:
+        OPCODE(opcode_summon_string_class):
             LISTI("summon string class");
         	// locked refcnt
             os_push( pvm_get_string_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_array_class:
+        OPCODE(opcode_summon_array_class):
             LISTI("summon array class");
         	// locked refcnt
             os_push( pvm_get_array_class() );
-            break;
+            DISPATCH();
 
-        case opcode_summon_by_name:
+        OPCODE(opcode_summon_by_name):
             {
                 LISTI("summon by name");
-                struct pvm_object name = pvm_code_get_string(&(da->code));
+                unsigned int summon_IP = da->code.IP - 1;
+                struct pvm_object name = exec_get_string(da);
+
+                // Class for static catcher, which is looked up on throw (see code_cache.c).
+                // Skip both.
+                if( da->_decoded && da->_decoded->n_catches > 0 &&
+                    da->code.IP < da->code.IP_max && da->code.code[da->code.IP] == opcode_push_catcher )
+                {
+                    LISTI("static catcher");
+                    ref_dec_o(name);
+                    da->code.IP += 5;
+                    DISPATCH();
+                }
+
+                // Class loader can block us and let snapshot go. Restart will
+                // redo this instruction, nothing is changed by it yet.
+                pvm_object_da( da->call_frame, call_frame )->IP = summon_IP;
+
                 struct pvm_object cl = pvm_exec_lookup_class_by_name( name );
                 ref_dec_o(name);
                 // TODO: Need throw here?
@@ -1029,7 +1512,7 @@ void pvm_exec(pvm_object_t current_thread)
                 }
                 os_push( cl );  // cl popped from stack - don't increment
             }
-            break;
+            DISPATCH();
 
             /**
              * TODO A BIG NOTE for object creation
@@ -1041,38 +1524,38 @@ void pvm_exec(pvm_object_t current_thread)
              **/
 
 
-        case opcode_new:
+        OPCODE(opcode_new):
             LISTI("new");
             {
                 pvm_object_t cl = os_pop();
                 os_push( pvm_create_object( cl ) );
                 //ref_dec_o( cl );  // object keep class ref
             }
-            break;
+            DISPATCH();
 
-        case opcode_copy:
+        OPCODE(opcode_copy):
             LISTI("copy");
             {
                 pvm_object_t o = os_pop();
                 os_push( pvm_copy_object( o ) );
                 ref_dec_o(o);
             }
-            break;
+            DISPATCH();
 
             // if you want to enable these, work out refcount
             // and security issues first!
             // compose/decompose
 #if 0
-        case opcode_os_compose32:
+        OPCODE(opcode_os_compose32):
             LISTI(" compose32");
             {
-                int num = pvm_code_get_int32(&(da->code));
+                int num = exec_get_int32(da);
                 struct pvm_object in_class = os_pop();
                 os_push( pvm_exec_compose_object( in_class, da->_ostack, num ) );
             }
-            break;
+            DISPATCH();
 
-        case opcode_os_decompose:
+        OPCODE(opcode_os_decompose):
             LISTI(" decompose");
             {
                 struct pvm_object to_decomp = os_pop();
@@ -1086,53 +1569,67 @@ void pvm_exec(pvm_object_t current_thread)
                 }
                 os_push(to_decomp.data->_class);
             }
-            break;
+            DISPATCH();
 #endif
             // string ----------------------------------------------------------------
 
-        case opcode_sconst_bin:
+        OPCODE(opcode_sconst_bin):
             LISTI("sconst bin");
-            os_push(pvm_code_get_string(&(da->code)));
-            break;
+            os_push(exec_get_string(da));
+            DISPATCH();
 
 
             // flow ------------------------------------------------------------------
 
-        case opcode_jmp:
+        OPCODE(opcode_jmp):
             LISTIA("jmp %d", da->code.IP);
-            da->code.IP = pvm_code_get_rel_IP_as_abs(&(da->code));
-            break;
+            {
+                unsigned int old_IP = da->code.IP;
+                da->code.IP = exec_get_rel_IP_as_abs(da);
+                if( da->code.IP <= old_IP ) pvm_exec_safepoint(da); // loop
+            }
+            DISPATCH();
 
 
-        case opcode_djnz:
+        OPCODE(opcode_djnz):
             {
-                int new_IP = pvm_code_get_rel_IP_as_abs(&(da->code));
+                int new_IP = exec_get_rel_IP_as_abs(da);
                 //is_top()--;
                 is_push( is_pop() - 1 );
-                if( is_top() ) da->code.IP = new_IP;
+                if( is_top() )
+                {
+                    int loop = new_IP <= da->code.IP;
+                    da->code.IP = new_IP;
+                    if( loop ) pvm_exec_safepoint(da);
+                }
 
                 LISTIA("djnz (%d)", is_top() );
                 LISTIA("djnz -> %d", new_IP );
             }
-            break;
+            DISPATCH();
 
-        case opcode_jz:
+        OPCODE(opcode_jz):
             {
-                int new_IP = pvm_code_get_rel_IP_as_abs(&(da->code));
+                int new_IP = exec_get_rel_IP_as_abs(da);
                 int test = is_pop();
-                if( !test ) da->code.IP = new_IP;
+                if( !test )
+                {
+                    int loop = new_IP <= da->code.IP;
+                    da->code.IP = new_IP;
+                    if( loop ) pvm_exec_safepoint(da);
+                }
 
                 LISTIA("jz (%d)", test );
                 LISTIA("jz -> %d",  new_IP );
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_switch:
+        OPCODE(opcode_switch):
             {
-                unsigned int tabsize    = pvm_code_get_int32(&(da->code));
-                int shift               = pvm_code_get_int32(&(da->code));
-                unsigned int divisor    = pvm_code_get_int32(&(da->code));
+                unsigned int tabsize    = exec_get_int32(da);
+                int shift               = exec_get_int32(da);
+                unsigned int divisor    = exec_get_int32(da);
                 int stack_top = is_pop();
 
                 //LISTIA("switch (%d+%d)/%d, ", stack_top, shift, divisor );
@@ -1150,17 +1647,19 @@ void pvm_exec(pvm_object_t current_thread)
                 {
                     da->code.IP = start_table_IP+(displ*4); // TODO BUG! 4!
                     LISTIA("load from %d, ", da->code.IP );
-                    new_IP = pvm_code_get_rel_IP_as_abs(&(da->code));
+                    new_IP = exec_get_rel_IP_as_abs(da);
                 }
                 da->code.IP = new_IP;
 
+                if( new_IP < start_table_IP ) pvm_exec_safepoint(da); // loop
+
                 //LISTIA("switch(%d) ->%d", displ, new_IP );
                 LISTIA("switch ->%d", new_IP );
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_ret:
+        OPCODE(opcode_ret):
             {
                 if( DEB_CALLRET || debug_print_instr ) printf( "\nret     (stack_depth %d -> ", da->stack_depth );
                 struct pvm_object ret = pvm_object_da( da->call_frame, call_frame )->prev;
@@ -1172,20 +1671,22 @@ void pvm_exec(pvm_object_t current_thread)
                 }
                 pvm_exec_do_return(da);
                 if( DEB_CALLRET || debug_print_instr ) printf( "%d)", da->stack_depth );
+                pvm_exec_safepoint(da);
             }
-            break;
+            DISPATCH();
 
             // exceptions are like ret ---------------------------------------------------
 
-        case opcode_throw:
+        OPCODE(opcode_throw):
             if( DEB_CALLRET || debug_print_instr ) printf( "\nthrow     (stack_depth %d -> ", da->stack_depth );
             pvm_exec_do_throw(da);
             if( DEB_CALLRET || debug_print_instr ) printf( "%d)", da->stack_depth );
-            break;
+            pvm_exec_safepoint(da);
+            DISPATCH();
 
-        case opcode_push_catcher:
+        OPCODE(opcode_push_catcher):
             {
-                unsigned addr = pvm_code_get_rel_IP_as_abs(&(da->code));
+                unsigned addr = exec_get_rel_IP_as_abs(da);
                 LISTIA("push catcher %u", addr );
                 //cf->push_catcher( addr, os_pop() );
                 //call_frame.estack().push(exception_handler(os_pop(),addr));
@@ -1199,40 +1700,55 @@ void pvm_exec(pvm_object_t current_thread)
 
                 es_push( eh );
             }
-            break;
+            DISPATCH();
 
-        case opcode_pop_catcher:
+        OPCODE(opcode_pop_catcher):
             LISTI("pop catcher");
             //cf->pop_catcher();
             //call_frame.estack().pop();
+
+            // Code was not in cache when try was entered, or vice versa - it
+            // happens if cache is over budget. Pop only what was pushed.
+            if( es_empty() )
+                DISPATCH();
+
+            if( da->_decoded && da->_decoded->n_catches >= 0 )
+            {
+                int c = pvm_code_cache_find_catch( da->_decoded, da->code.IP - 1 );
+                if( c < 0 || pvm_estack_top( da->_estack ).jump != da->_decoded->catches[c].handler )
+                    DISPATCH();
+            }
+
             ref_dec_o( es_pop().object );
-            break;
+            DISPATCH();
 
             // ok, now method calls ------------------------------------------------------
 
             // these 4 are parameter-less calls!
-        case opcode_short_call_0:           pvm_exec_call(da,0,0,1,pvm_get_null_object());   break;
-        case opcode_short_call_1:           pvm_exec_call(da,1,0,1,pvm_get_null_object());   break;
-        case opcode_short_call_2:           pvm_exec_call(da,2,0,1,pvm_get_null_object());   break;
-        case opcode_short_call_3:           pvm_exec_call(da,3,0,1,pvm_get_null_object());   break;
+        OPCODE(opcode_short_call_0):           pvm_exec_call(da,0,0,1,pvm_get_null_object());   pvm_exec_safepoint(da); DISPATCH();
+        OPCODE(opcode_short_call_1):           pvm_exec_call(da,1,0,1,pvm_get_null_object());   pvm_exec_safepoint(da); DISPATCH();
+        OPCODE(opcode_short_call_2):           pvm_exec_call(da,2,0,1,pvm_get_null_object());   pvm_exec_safepoint(da); DISPATCH();
+        OPCODE(opcode_short_call_3):           pvm_exec_call(da,3,0,1,pvm_get_null_object());   pvm_exec_safepoint(da); DISPATCH();
 
-        case opcode_call_8bit:
+        OPCODE(opcode_call_8bit):
             {
-                unsigned int method_index = pvm_code_get_byte(&(da->code));
-                unsigned int n_param = pvm_code_get_int32(&(da->code));
+                unsigned int method_index = exec_get_byte(da);
+                unsigned int n_param = exec_get_int32(da);
                 pvm_exec_call(da,method_index,n_param,1,pvm_get_null_object());
+                pvm_exec_safepoint(da);
             }
-            break;
-        case opcode_call_32bit:
+            DISPATCH();
+        OPCODE(opcode_call_32bit):
             {
-                unsigned int method_index = pvm_code_get_int32(&(da->code));
-                unsigned int n_param = pvm_code_get_int32(&(da->code));
+                unsigned int method_index = exec_get_int32(da);
+                unsigned int n_param = exec_get_int32(da);
                 pvm_exec_call(da,method_index,n_param,1,pvm_get_null_object());
+                pvm_exec_safepoint(da);
             }
-            break;
+            DISPATCH();
 
 
-        case opcode_dynamic_invoke:
+        OPCODE(opcode_dynamic_invoke):
             {
                 dynamic_method_info_t mi;
 
@@ -1240,52 +1756,53 @@ void pvm_exec(pvm_object_t current_thread)
                 mi.new_this = os_pop();
                 mi.n_param = pvm_get_int( os_pop() );
 
-                if( find_dynamic_method( &mi ) )
+                if( find_dynamic_method( &mi, da->code.code + da->code.IP ) )
                     pvm_exec_panic("dynamic invoke failed");
                     
                 pvm_exec_call(da,mi.method_ordinal,mi.n_param,1,mi.new_this);
+                pvm_exec_safepoint(da);
             }
-            break;
+            DISPATCH();
 
             // object stack --------------------------------------------------------------
 
-        case opcode_os_dup:
+        OPCODE(opcode_os_dup):
             LISTI("os dup");
             {
                 pvm_object_t o = os_top();
                 os_push( ref_inc_o( o ) );
             }
-            break;
+            DISPATCH();
 
-        case opcode_os_drop:
+        OPCODE(opcode_os_drop):
             LISTI("os drop");
             ref_dec_o( os_pop() );
-            break;
+            DISPATCH();
 
-        case opcode_os_pull32:
+        OPCODE(opcode_os_pull32):
             LISTI("os pull");
             {
-                pvm_object_t o = os_pull(pvm_code_get_int32(&(da->code)));
+                pvm_object_t o = os_pull(exec_get_int32(da));
                 os_push( ref_inc_o( o ) );
             }
-            break;
+            DISPATCH();
 
-        case opcode_os_load8:       pvm_exec_load(da, pvm_code_get_byte(&(da->code)));	break;
-        case opcode_os_load32:      pvm_exec_load(da, pvm_code_get_int32(&(da->code)));	break;
+        OPCODE(opcode_os_load8):       pvm_exec_load(da, exec_get_byte(da));	DISPATCH();
+        OPCODE(opcode_os_load32):      pvm_exec_load(da, exec_get_int32(da));	DISPATCH();
 
-        case opcode_os_save8:       pvm_exec_save(da, pvm_code_get_byte(&(da->code)));	break;
-        case opcode_os_save32:      pvm_exec_save(da, pvm_code_get_int32(&(da->code)));	break;
+        OPCODE(opcode_os_save8):       pvm_exec_save(da, exec_get_byte(da));	DISPATCH();
+        OPCODE(opcode_os_save32):      pvm_exec_save(da, exec_get_int32(da));	DISPATCH();
 
-        case opcode_is_load8:       pvm_exec_iload(da, pvm_code_get_byte(&(da->code)));	break;
-        case opcode_is_save8:       pvm_exec_isave(da, pvm_code_get_byte(&(da->code)));	break;
+        OPCODE(opcode_is_load8):       pvm_exec_iload(da, exec_get_byte(da));	DISPATCH();
+        OPCODE(opcode_is_save8):       pvm_exec_isave(da, exec_get_byte(da));	DISPATCH();
 
-        case opcode_os_get32:        pvm_exec_get(da, pvm_code_get_int32(&(da->code)));	break;
-        case opcode_os_set32:        pvm_exec_set(da, pvm_code_get_int32(&(da->code)));	break;
+        OPCODE(opcode_os_get32):        pvm_exec_get(da, exec_get_int32(da));	DISPATCH();
+        OPCODE(opcode_os_set32):        pvm_exec_set(da, exec_get_int32(da));	DISPATCH();
 
-        case opcode_is_get32:        pvm_exec_iget(da, pvm_code_get_int32(&(da->code)));	break;
-        case opcode_is_set32:        pvm_exec_iset(da, pvm_code_get_int32(&(da->code)));	break;
+        OPCODE(opcode_is_get32):        pvm_exec_iget(da, exec_get_int32(da));	DISPATCH();
+        OPCODE(opcode_is_set32):        pvm_exec_iset(da, exec_get_int32(da));	DISPATCH();
 
-        default:
+        OPCODE_DEFAULT:
             if( (instruction & 0xF0 ) == opcode_sys_0 )
             {
                 pvm_exec_sys(da,instruction & 0x0F);
@@ -1301,21 +1818,22 @@ void pvm_exec(pvm_object_t current_thread)
                     phantom_thread_sleep_worker( da );
                 }
 #endif
-                break;
+                DISPATCH();
             }
 
             if( instruction  == opcode_sys_8bit )
             {
-                pvm_exec_sys(da,pvm_code_get_byte(&(da->code))); //cf->cs.get_byte( cf->IP ));
+                pvm_exec_sys(da,exec_get_byte(da)); //cf->cs.get_byte( cf->IP ));
                 goto sys_sleep;
                 //break;
             }
 
             if( (instruction & 0xE0 ) == opcode_call_00 )
             {
-                unsigned n_param = pvm_code_get_byte(&(da->code));
+                unsigned n_param = exec_get_byte(da);
                 pvm_exec_call(da,instruction & 0x1F,n_param,0,pvm_get_null_object()); //no optimization for soon return
-                break;
+                pvm_exec_safepoint(da);
+                DISPATCH();
             }
 
             printf("Unknown op code 0x%X\n", instruction );
@@ -1323,13 +1841,6 @@ void pvm_exec(pvm_object_t current_thread)
             //exit(33);
         }
 
-        if( prefix_long || prefix_float || prefix_double )
-            printf("Unused type prefix on op code 0x%X\n", instruction );
-
-        prefix_long   = 0;
-        prefix_float  = 0;
-        prefix_double = 0;
-
     }
 }
 
@@ -1350,6 +1861,44 @@ static syscall_func_t pvm_exec_find_syscall( struct pvm_object _class, unsigned
     return tab[syscall_index];
 }
 
+
+// Zero for non-internal class, which has no syscall table
+syscall_func_t pvm_exec_get_syscall( struct pvm_object o, unsigned int syscall_index )
+{
+    struct pvm_object c = pvm_object_class( o );
+
+    if( c.data == 0 || pvm_object_da( c, class )->sys_table_id >= (unsigned)pvm_n_internal_classes )
+        return 0;
+
+    return pvm_exec_find_syscall( c, syscall_index );
+}
+
+
+int pvm_exec_run_syscall( struct data_area_4_thread *da, struct pvm_object o, unsigned int syscall_index, int n_args, struct pvm_object args[], struct pvm_object *ret )
+{
+    syscall_func_t func = pvm_exec_get_syscall( o, syscall_index );
+
+    if( func == 0 )
+        pvm_exec_panic( "pvm_exec_run_syscall: no syscall" );
+
+    // Some syscalls (hashcode) do not pop args count
+    struct data_area_4_integer_stack *is = da->_istack;
+    int is_depth = is->curr_da->common.free_cell_ptr;
+
+    int i;
+    for( i = n_args; i > 0; i-- )
+        pvm_ostack_push( da->_ostack, ref_inc_o( args[i-1] ) );
+
+    pvm_istack_push( is, n_args );
+
+    int rc = func( o, da );
+
+    is->curr_da->common.free_cell_ptr = is_depth;
+    *ret = pvm_ostack_pop( da->_ostack );
+
+    return rc;
+}
+
 /*
  *
  * Returns code object
@@ -1393,7 +1942,7 @@ static int catch_comparator( void *backptr, struct pvm_exception_handler *test )
     struct pvm_exception_handler *thrown = (struct pvm_exception_handler *)backptr;
 
 //printf(" (exc cls cmp) ");
-    if( pvm_object_class_is( thrown->object, test->object) )
+    if( pvm_ic_class_is( thrown->object, test->object) )
     {
         thrown->jump = test->jump;
         return 1;
@@ -1401,8 +1950,54 @@ static int catch_comparator( void *backptr, struct pvm_exception_handler *test )
     return 0;
 }
 
+// Catchers from the table made by decoder, see code_cache.c
+static int pvm_exec_find_static_catch(
+                               struct data_area_4_thread *da,
+                               unsigned int *jump_to,
+                               struct pvm_object thrown_obj )
+{
+    struct pvm_code_decoded *d = da->_decoded;
+    struct pvm_code_decoded *uncached = 0;
+    int found = 0;
+    int i;
+
+    // Not in cache - try could be entered before restart
+    if( d == 0 )
+        d = uncached = pvm_code_cache_get_uncached( da->code.code, da->code.IP_max );
+
+    if( d == 0 || d->n_catches <= 0 )
+        goto done;
+
+    for( i = pvm_code_cache_find_catch( d, da->code.IP ); i >= 0; i = d->catches[i].parent )
+    {
+        // Thrown object is in C locals only, no loading (and snapshot) here.
+        // Class which is not loaded has no instances, so can't match.
+        struct pvm_object cl = pvm_exec_find_loaded_class_by_name( d->consts[d->catches[i].name] );
+
+        if( pvm_is_null( cl ) )
+            continue;
+
+        int match = pvm_ic_class_is( thrown_obj, cl );
+        ref_dec_o( cl );
+
+        if( match )
+        {
+            *jump_to = d->catches[i].handler;
+            found = 1;
+            break;
+        }
+    }
+
+done:
+    if( uncached )
+        pvm_code_cache_free_uncached( uncached );
+
+    return found;
+}
+
+
 static int pvm_exec_find_catch(
-                               struct data_area_4_exception_stack* stack,
+                               struct data_area_4_thread *da,
                                unsigned int *jump_to,
                                struct pvm_object thrown_obj )
 {
@@ -1411,13 +2006,14 @@ static int pvm_exec_find_catch(
     topass.jump = 0;
 
 //printf(" (exc lookup catch) ");
-    if( pvm_estack_foreach( stack, &topass, &catch_comparator ) )
+    // Catchers pushed at run time
+    if( pvm_estack_foreach( da->_estack, &topass, &catch_comparator ) )
     {
         *jump_to = topass.jump;
         return 1;
     }
 
-    return 0;
+    return pvm_exec_find_static_catch( da, jump_to, thrown_obj );
 }
 
 
@@ -1487,31 +2083,37 @@ void pvm_exec_set_cs( struct data_area_4_call_frame* cfda, struct pvm_object_sto
 }
 
 
-// TODO: implement!
-struct pvm_object pvm_exec_lookup_class_by_name(struct pvm_object name)
+// Class which is loaded already, null if none. Never runs class loader.
+static struct pvm_object pvm_exec_find_loaded_class_by_name(struct pvm_object name)
 {
-    // Try internal
-    struct pvm_object ret = pvm_lookup_internal_class(name);
+    struct pvm_object ret = pvm_class_cache_lookup(name);
     if( !pvm_is_null(ret) )
         return ret;
 
-    /*
-     *
-     * TODO BUG! This executes code in a tight loop. It will prevent
-     * snaps from being done. Redo with a separate thread start.
-     *
-     * Run class loader in the main pvm_exec() loop? Hmmm.
-     *
-     */
-//printf("lookup_class_by_name\n");
+    return pvm_lookup_internal_class(name);
+}
 
 
-    if( pvm_is_null(pvm_root.class_loader) )
-        return pvm_create_null_object();
+struct pvm_object pvm_exec_lookup_class_by_name(struct pvm_object name)
+{
+    // Seen before?
+    struct pvm_object ret = pvm_class_cache_lookup(name);
+    if( !pvm_is_null(ret) )
+        return ret;
 
-    // Try userland loader
-    struct pvm_object args[1] = { name };
-    return pvm_exec_run_method( pvm_root.class_loader, 8, 1, args );
+    // Try internal
+    ret = pvm_lookup_internal_class(name);
+    if( !pvm_is_null(ret) )
+    {
+        pvm_class_cache_put( name, ret );
+        return ret;
+    }
+
+    // Try userland loader, on loader thread, see class_loader.c
+    ret = pvm_class_loader_load( name );
+
+    pvm_class_cache_put( name, ret );
+    return ret;
 }
 
 
@@ -1557,7 +2159,7 @@ pvm_exec_run_method(
 }
 
 // Find a method for a dynamic invoke
-static errno_t find_dynamic_method( dynamic_method_info_t *mi )
+static errno_t find_dynamic_method( dynamic_method_info_t *mi, const void *site )
 {
     int is_global = 0;
     if( pvm_is_null( mi->new_this ) )
@@ -1573,7 +2175,7 @@ static errno_t find_dynamic_method( dynamic_method_info_t *mi )
         return ENOENT;
 
 
-    int ord = pvm_get_method_ordinal( mi->target_class, mi->method_name );
+    int ord = pvm_ic_find_method_ordinal( site, mi->target_class, mi->method_name );
     if( ord < 0 )
     {
         printf("dyn method not found '");
@@ -0,0 +1,294 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Bytecode interpreter microbenchmark. Runs hand made loops of
+ * one kind of opcode and reports per opcode cost. Compare builds
+ * with PVM_EXEC_THREADED set to 1 and 0. Each loop is run by
+ * interpreter and then compiled by JIT, if there is one.
+ *
+ * Numeric cases do long and double (prefixed) arithmetic,
+ * prefix and instruction are counted as one op.
+ *
+ * Kernel debugger command: opbench [iterations]
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/exec.h>
+#include <vm/code.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+
+#include <hal.h>
+#include <time.h>
+
+#include "ids/opcode_ids.h"
+#include "jit.h"
+
+
+#define BENCH_CODE_SIZE         1024
+#define BENCH_UNROLL            16      // op groups per loop iteration
+#define BENCH_ITERATIONS        20000
+
+#define BENCH_METHOD_RUN        0
+#define BENCH_METHOD_CALLEE     1
+
+struct bench_code
+{
+    unsigned char       code[BENCH_CODE_SIZE];
+    int                 size;
+};
+
+struct bench_case
+{
+    const char *        name;
+    int                 n_ops;          // opcodes in one group
+    const unsigned char *ops;
+    int                 ops_size;
+    int                 need_object;    // group works with an object on ostack top
+    int                 need_local;     // group works with local in istack slot 0, number of cells
+};
+
+
+static void put_byte( struct bench_code *c, unsigned char b )
+{
+    assert( c->size < BENCH_CODE_SIZE );
+    c->code[c->size++] = b;
+}
+
+// Bytecode is big endian, see pvm_code_do_get_int()
+static void put_int32( struct bench_code *c, int v )
+{
+    put_byte( c, (v >> 24) & 0xFF );
+    put_byte( c, (v >> 16) & 0xFF );
+    put_byte( c, (v >> 8) & 0xFF );
+    put_byte( c, v & 0xFF );
+}
+
+
+// Groups are stack neutral
+static const unsigned char ops_nop[]    = { opcode_nop };
+static const unsigned char ops_iconst[] = { opcode_iconst_1, opcode_is_drop };
+static const unsigned char ops_isum[]   = { opcode_iconst_1, opcode_iconst_1, opcode_isum, opcode_is_drop };
+static const unsigned char ops_os[]     = { opcode_os_dup, opcode_os_drop };
+static const unsigned char ops_i2o[]    = { opcode_iconst_1, opcode_i2o, opcode_o2i, opcode_is_drop };
+static const unsigned char ops_call[]   = { opcode_summon_this, opcode_call_8bit, BENCH_METHOD_CALLEE, 0, 0, 0, 0, opcode_os_drop };
+static const unsigned char ops_ilt[]    = { opcode_iconst_1, opcode_iconst_8bit, 2, opcode_ilt, opcode_is_drop };
+static const unsigned char ops_local[]  = { opcode_is_get32, 0, 0, 0, 0, opcode_iconst_1, opcode_isum, opcode_is_set32, 0, 0, 0, 0 };
+
+#define L       opcode_prefix_long
+#define D       opcode_prefix_double
+
+static const unsigned char ops_lsum[]   = { L, opcode_iconst_1, L, opcode_iconst_1, L, opcode_isum, L, opcode_is_drop };
+static const unsigned char ops_lmul[]   = { L, opcode_iconst_8bit, 3, L, opcode_iconst_8bit, 5, L, opcode_imul, L, opcode_is_drop };
+static const unsigned char ops_ldiv[]   = { L, opcode_iconst_8bit, 3, L, opcode_iconst_8bit, 15, L, opcode_idivul, L, opcode_is_drop };
+static const unsigned char ops_llt[]    = { L, opcode_iconst_1, L, opcode_iconst_8bit, 2, L, opcode_ilt, opcode_is_drop };
+static const unsigned char ops_llocal[] = { L, opcode_is_get32, 0, 0, 0, 0, L, opcode_iconst_1, L, opcode_isum, L, opcode_is_set32, 0, 0, 0, 0 };
+static const unsigned char ops_dsum[]   = { D, opcode_iconst_1, D, opcode_iconst_1, D, opcode_isum, D, opcode_is_drop };
+static const unsigned char ops_dmul[]   = { D, opcode_iconst_8bit, 3, D, opcode_iconst_8bit, 5, D, opcode_imul, D, opcode_is_drop };
+static const unsigned char ops_ddiv[]   = { D, opcode_iconst_8bit, 3, D, opcode_iconst_8bit, 15, D, opcode_idivul, D, opcode_is_drop };
+static const unsigned char ops_dlt[]    = { D, opcode_iconst_1, D, opcode_iconst_8bit, 2, D, opcode_ilt, opcode_is_drop };
+static const unsigned char ops_dlocal[] = { D, opcode_is_get32, 0, 0, 0, 0, D, opcode_iconst_1, D, opcode_isum, D, opcode_is_set32, 0, 0, 0, 0 };
+
+#undef L
+#undef D
+
+static struct bench_case cases[] =
+{
+    { "loop",           0, 0,           0,                      0, 0 },
+    { "nop",            1, ops_nop,     sizeof(ops_nop),        0, 0 },
+    { "iconst/drop",    2, ops_iconst,  sizeof(ops_iconst),     0, 0 },
+    { "isum",           4, ops_isum,    sizeof(ops_isum),       0, 0 },
+    { "ilt",            4, ops_ilt,     sizeof(ops_ilt),        0, 0 },
+    { "int local",      4, ops_local,   sizeof(ops_local),      0, 1 },
+    { "os dup/drop",    2, ops_os,      sizeof(ops_os),         1, 0 },
+    { "i2o/o2i",        4, ops_i2o,     sizeof(ops_i2o),        0, 0 },
+    { "call/ret",       5, ops_call,    sizeof(ops_call),       0, 0 }, // + summon null and ret in callee
+
+    { "long sum",       4, ops_lsum,    sizeof(ops_lsum),       0, 0 },
+    { "long mul",       4, ops_lmul,    sizeof(ops_lmul),       0, 0 },
+    { "long div",       4, ops_ldiv,    sizeof(ops_ldiv),       0, 0 },
+    { "long lt",        4, ops_llt,     sizeof(ops_llt),        0, 0 },
+    { "long local",     4, ops_llocal,  sizeof(ops_llocal),     0, 2 },
+    { "double sum",     4, ops_dsum,    sizeof(ops_dsum),       0, 0 },
+    { "double mul",     4, ops_dmul,    sizeof(ops_dmul),       0, 0 },
+    { "double div",     4, ops_ddiv,    sizeof(ops_ddiv),       0, 0 },
+    { "double lt",      4, ops_dlt,     sizeof(ops_dlt),        0, 0 },
+    { "double local",   4, ops_dlocal,  sizeof(ops_dlocal),     0, 2 },
+};
+
+#define N_CASES (sizeof(cases)/sizeof(struct bench_case))
+
+
+//   [summon null]
+//   [iconst 0] * need_local
+//   iconst32 iterations
+// loop:
+//   group * BENCH_UNROLL
+//   djnz loop
+//   is drop
+//   [is drop] * need_local
+//   [os drop]
+//   summon null
+//   ret
+static void bench_gen( struct bench_code *c, struct bench_case *bc, int iterations )
+{
+    int i;
+
+    c->size = 0;
+
+    if( bc->need_object )
+        put_byte( c, opcode_summon_null );
+
+    for( i = 0; i < bc->need_local; i++ )
+        put_byte( c, opcode_iconst_0 );
+
+    put_byte( c, opcode_iconst_32bit );
+    put_int32( c, iterations );
+
+    int loop = c->size;
+
+    for( i = 0; bc->ops_size && i < BENCH_UNROLL; i++ )
+    {
+        assert( c->size + bc->ops_size < BENCH_CODE_SIZE - 16 );
+        memcpy( c->code + c->size, bc->ops, bc->ops_size );
+        c->size += bc->ops_size;
+    }
+
+    put_byte( c, opcode_djnz );
+    put_int32( c, loop - c->size ); // relative to displacement itself
+
+    put_byte( c, opcode_is_drop );
+    for( i = 0; i < bc->need_local; i++ )
+        put_byte( c, opcode_is_drop );
+    if( bc->need_object )
+        put_byte( c, opcode_os_drop );
+
+    put_byte( c, opcode_summon_null );
+    put_byte( c, opcode_ret );
+}
+
+
+// No class needed - 'this' is a null object with our own interface
+static pvm_object_t bench_make_iface( struct bench_code *run )
+{
+    static const unsigned char callee[] = { opcode_summon_null, opcode_ret };
+
+    pvm_object_t iface = pvm_create_interface_object( 2, pvm_get_null_class() );
+
+    pvm_set_ofield( iface, BENCH_METHOD_RUN, pvm_create_code_object( run->size, run->code ) );
+    pvm_set_ofield( iface, BENCH_METHOD_CALLEE, pvm_create_code_object( sizeof(callee), (void *)callee ) );
+
+    return iface;
+}
+
+// Compile now, not after PVM_JIT_THRESHOLD calls
+static void bench_compile( pvm_object_t iface, int method )
+{
+    pvm_object_t code = pvm_get_ofield( iface, method );
+    struct data_area_4_code *cda = (struct data_area_4_code *)&(code.data->da);
+
+    jit_compile_method( pvm_code_cache_get( cda->code, cda->code_size ) );
+}
+
+// Returns run time in microseconds
+static bigtime_t bench_run( struct bench_case *bc, int iterations, int use_jit )
+{
+    struct bench_code c;
+
+    bench_gen( &c, bc, iterations );
+
+    pvm_object_t iface = bench_make_iface( &c );
+    pvm_object_t this;
+
+    // Interpreter run must not compile callee
+    int jit_was = jit_enable( use_jit );
+
+    if( use_jit )
+    {
+        bench_compile( iface, BENCH_METHOD_RUN );
+        bench_compile( iface, BENCH_METHOD_CALLEE );
+    }
+
+    this.data = pvm_create_null_object().data;
+    this.interface = iface.data;
+
+    bigtime_t start = hal_system_time();
+    pvm_object_t ret = pvm_exec_run_method( this, BENCH_METHOD_RUN, 0, 0 );
+    bigtime_t time = hal_system_time() - start;
+
+    jit_enable( jit_was );
+
+    ref_dec_o( ret );
+    ref_dec_o( iface );
+
+    return time;
+}
+
+
+static void exec_bench( int ac, char **av )
+{
+    int iterations = BENCH_ITERATIONS;
+    unsigned i;
+
+    if( ac > 1 )
+        iterations = atoi( av[1] );
+
+    if( iterations <= 0 )
+    {
+        printf("usage: opbench [iterations]\n");
+        return;
+    }
+
+    printf("Bytecode dispatch: %s, %d iterations of %d groups\n",
+           PVM_EXEC_THREADED ? "threaded" : "switch", iterations, BENCH_UNROLL );
+
+    int n_modes = PVM_JIT ? 2 : 1;
+    int mode;
+
+    printf("%-14s %23s %23s\n", "", "interpreter", PVM_JIT ? "JIT" : "" );
+
+    // Empty loop cost is subtracted from the rest
+    bigtime_t loop_time[2];
+
+    printf("%-14s", cases[0].name );
+    for( mode = 0; mode < n_modes; mode++ )
+    {
+        loop_time[mode] = bench_run( cases, iterations, mode );
+        printf(" %8lld us %11s", (long long)loop_time[mode], "" );
+    }
+    printf("\n");
+
+    for( i = 1; i < N_CASES; i++ )
+    {
+        struct bench_case *bc = cases+i;
+        long long n_ops = (long long)iterations * BENCH_UNROLL * bc->n_ops;
+
+        printf("%-14s", bc->name );
+        for( mode = 0; mode < n_modes; mode++ )
+        {
+            bigtime_t time = bench_run( bc, iterations, mode );
+            long long ns = time > loop_time[mode] ? (long long)(time - loop_time[mode]) * 1000 : 0;
+
+            printf(" %8lld us, %5lld ns/op", (long long)time, ns / n_ops );
+        }
+        printf("\n");
+    }
+}
+
+
+static void exec_bench_init(void)
+{
+    dbg_add_command( exec_bench, "opbench", "bytecode interpreter per opcode cost");
+}
+
+INIT_ME( 0, exec_bench_init, 0 )
@@ -13,13 +13,25 @@
 
 
 //#include <kernel/snap_sync.h>
+#include <kernel/atomic.h>
 
 
 #include <vm/alloc.h>
 #include <vm/internal.h>
 #include <vm/object_flags.h>
+#include <vm/exec.h>
+#include <vm/code.h>
 
 #include <kernel/stats.h>
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/snap_sync.h>
+
+#include <threads.h>
+#include <hal.h>
+#include <time.h>
+#include <malloc.h>
+#include <string.h>
 
 
 #define debug_memory_leaks 0
@@ -35,55 +47,797 @@
 // -----------------------------------------------------------------------
 // Collect cycles --  refcounter-based full GC
 // see Bacon algorithm (US Patent number 6879991, issued April 12, 2005) or (US Patent number 7216136 issued 8 May 2007)
-// TODO: not implemented,
-// Need persistent cycles_root_buffer not collected by usual gc/refcount - new internal object type?
+//
+// Synchronous variant of Bacon & Rajan cycle collection. Object which
+// refcount went down to nonzero value is a possible cycle root (purple,
+// PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN) and is put to root buffer. Collector
+// does trial deletion of subgraphs of roots (mark gray), gives refs back to
+// anything that is still referenced from outside (scan black) and frees
+// the rest (white).
+//
+// Root buffer lives in persistent binary object (see root.c), it is not
+// seen by GC or refcount, so it holds weak pointers. Object is removed
+// from buffer when freed or saturated. run_gc() just empties it.
+//
+// World must be stopped when collecting, see cycle_collector_thread().
+// -----------------------------------------------------------------------
+
+static void cycle_mark_roots(int n);
+static void cycle_scan_roots(int n);
+static void cycle_collect_roots(int n);
+static void cycle_dump_stats( int ac, char **av );
+
+static void gc_refcount_children( pvm_object_storage_t *p, gc_iterator_call_t f, void *arg );
+static void gc_clear_weakrefs(pvm_object_storage_t *p);
+
+static struct cycle_root_buffer *cycle_buf = 0;
+static int                      cycle_buf_size = 0; // capacity
+
+static hal_mutex_t              _cycle_mutex;
+static hal_mutex_t              *cycle_mutex = 0; // 0 before threads start
+
+static hal_mutex_t              cycle_thread_mutex;
+static hal_cond_t               cycle_start_cond;
+static int                      cycle_thread_started = 0;
+
+// Statistics
+static int                      cycle_runs;
+static int                      cycle_lost;             // buffer was full
+static int                      cycle_last_candidates;  // last run
+static int                      cycle_last_traced;
+static int                      cycle_last_freed;
+static long                     cycle_total_freed;
+
+// Current run counters
+static int                      cycle_traced;
+static int                      cycle_freed;
+
+#define CYCLE_LOCK()   do { if(cycle_mutex) hal_mutex_lock( cycle_mutex ); } while(0)
+#define CYCLE_UNLOCK() do { if(cycle_mutex) hal_mutex_unlock( cycle_mutex ); } while(0)
+
+// Wake collector when buffer is that full
+#define CYCLE_BUFFER_HIGH_WATER(size) ((size) - (size)/4)
+
+
+// VM threads, refdec thread and collectors change flags of the same
+// object, any object can be reached by other thread - always atomic
+static inline void ah_flags_set( pvm_object_storage_t *p, unsigned char f )
+{
+    __sync_fetch_and_or( &p->_ah.alloc_flags, f );
+}
+
+static inline void ah_flags_clear( pvm_object_storage_t *p, unsigned char f )
+{
+    __sync_fetch_and_and( &p->_ah.alloc_flags, (unsigned char)~f );
+}
+
+
+void gc_set_cycle_root_buffer( void *data, size_t size )
+{
+    if( size < sizeof(struct cycle_root_buffer) )
+        return;
+
+    cycle_buf = data;
+    cycle_buf_size = (size - sizeof(struct cycle_root_buffer)) / sizeof(pvm_object_storage_t *);
+
+    if( cycle_buf->count > cycle_buf_size )
+        cycle_buf->count = cycle_buf_size;
+}
+
 
 static void cycle_root_buffer_add_candidate(pvm_object_storage_t *p)
 {
-    (void)p;
+    if( cycle_buf == 0 )
+        return;
+
+    int count;
+
+    CYCLE_LOCK();
+
+    // Recheck - could be added by other thread
+    if( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER )
+    {
+        CYCLE_UNLOCK();
+        return;
+    }
+
+    count = cycle_buf->count;
+    if( count >= cycle_buf_size )
+    {
+        // Will be picked by big GC
+        cycle_lost++;
+        CYCLE_UNLOCK();
+        return;
+    }
+
+    cycle_buf->roots[count] = p;
+    cycle_buf->count = count+1;
+    ah_flags_set( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER );
+
+    CYCLE_UNLOCK();
+
+    if( cycle_thread_started && (count+1 >= CYCLE_BUFFER_HIGH_WATER(cycle_buf_size)) )
+        hal_cond_signal( &cycle_start_cond );
 }
+
 static void cycle_root_buffer_rm_candidate(pvm_object_storage_t *p)
 {
-    (void)p;
+    if( cycle_buf == 0 )
+        return;
+
+    CYCLE_LOCK();
+
+    // Recently added ones die first
+    int i;
+    for( i = cycle_buf->count-1; i >= 0; i-- )
+    {
+        if( cycle_buf->roots[i] == p )
+        {
+            cycle_buf->roots[i] = 0;
+            break;
+        }
+    }
+
+    CYCLE_UNLOCK();
 }
+
 static void cycle_root_buffer_clear()
 {
     //just set size to zero, so regular GC will ignore it gracefully
+    if( cycle_buf == 0 )
+        return;
+
+    CYCLE_LOCK();
+
+    int i;
+    for( i = 0; i < cycle_buf->count; i++ )
+    {
+        pvm_object_storage_t *p = cycle_buf->roots[i];
+        if( p )
+            ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER|PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );
+    }
+
+    cycle_buf->count = 0;
+
+    CYCLE_UNLOCK();
 }
+
+
+// Caller must stop the world. Allocator lock is taken here.
 void gc_collect_cycles()
 {
+    if( cycle_buf == 0 )
+        return;
+
+    // Trial deletion changes counts
+    pvm_refdec_pause();
+    if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );  // TODO avoid Giant lock
+
+    // Marker can hold pointers to garbage we'd free
+    if( gc_marking )
+    {
+        if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );
+        pvm_refdec_resume();
+        return;
+    }
+
+    // New candidates can come from finalizers while we collect,
+    // they go after n and are kept for the next run.
+    int n = cycle_buf->count;
+
+    cycle_traced = 0;
+    cycle_freed = 0;
+
+    cycle_mark_roots( n );
+    cycle_scan_roots( n );
+    cycle_collect_roots( n );
+
+    // Compact
+    CYCLE_LOCK();
+    int i, out = 0;
+    for( i = 0; i < cycle_buf->count; i++ )
+    {
+        if( cycle_buf->roots[i] )
+            cycle_buf->roots[out++] = cycle_buf->roots[i];
+    }
+    cycle_buf->count = out;
+    CYCLE_UNLOCK();
+
+    cycle_runs++;
+    cycle_last_candidates = n;
+    cycle_last_traced = cycle_traced;
+    cycle_last_freed = cycle_freed;
+    cycle_total_freed += cycle_freed;
+
+    STAT_INC_CNT_N( OBJECT_CYCLE_CANDIDATES, n );
+    STAT_INC_CNT_N( OBJECT_CYCLE_FREE, cycle_freed );
+
+    if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );  // TODO avoid Giant lock
+    pvm_refdec_resume();
+
+    if (debug_memory_leaks) printf("gc: %d cycle candidates, %d objects freed\n", n, cycle_freed );
+}
+
+
+#define CYCLE_COLOR_MASK (PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY|PVM_OBJECT_AH_ALLOCATOR_FLAG_WHITE)
+
+static inline int cycle_skip( pvm_object_storage_t *p )
+{
+    // Saturated ones are never freed by refcount and keep children alive
+    return (p == 0) || pvm_is_tagged_int_p( p ) || (p->_ah.refCount == INT_MAX);
+}
+
+
+// FIXME recursion, same as mark_tree()
+
+static void cycle_mark_gray( pvm_object_storage_t *p );
+
+static void cycle_mark_gray_o( pvm_object_t o, void *arg )
+{
+    (void)arg;
+    pvm_object_storage_t *p = o.data;
+
+    if( cycle_skip( p ) )
+        return;
+
+    assert( p->_ah.refCount > 0 );
+    p->_ah.refCount--;
+    cycle_mark_gray( p );
+}
+
+static void cycle_mark_gray( pvm_object_storage_t *p )
+{
+    if( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY )
+        return;
+
+    assert( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
+
+    ah_flags_set( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY );
+    cycle_traced++;
+
+    gc_refcount_children( p, cycle_mark_gray_o, 0 );
+}
+
+
+static void cycle_scan_black( pvm_object_storage_t *p );
+
+static void cycle_scan_black_o( pvm_object_t o, void *arg )
+{
+    (void)arg;
+    pvm_object_storage_t *p = o.data;
+
+    if( cycle_skip( p ) )
+        return;
+
+    p->_ah.refCount++;
+    if( p->_ah.alloc_flags & CYCLE_COLOR_MASK )
+        cycle_scan_black( p );
+}
+
+static void cycle_scan_black( pvm_object_storage_t *p )
+{
+    ah_flags_clear( p, CYCLE_COLOR_MASK );
+    gc_refcount_children( p, cycle_scan_black_o, 0 );
+}
+
+
+static void cycle_scan( pvm_object_storage_t *p );
+
+static void cycle_scan_o( pvm_object_t o, void *arg )
+{
+    (void)arg;
+    if( !cycle_skip( o.data ) )
+        cycle_scan( o.data );
+}
+
+static void cycle_scan( pvm_object_storage_t *p )
+{
+    if( !(p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY) )
+        return;
+
+    if( p->_ah.refCount > 0 )
+    {
+        // Referenced from outside
+        cycle_scan_black( p );
+        return;
+    }
+
+    ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_GRAY );
+    ah_flags_set( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_WHITE );
+
+    gc_refcount_children( p, cycle_scan_o, 0 );
+}
+
+
+static void cycle_collect_white( pvm_object_storage_t *p );
+
+static void cycle_collect_white_o( pvm_object_t o, void *arg )
+{
+    (void)arg;
+    if( !cycle_skip( o.data ) )
+        cycle_collect_white( o.data );
+}
+
+static void cycle_collect_white( pvm_object_storage_t *p )
+{
+    if( !(p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_WHITE) )
+        return;
+
+    // Buffered ones are collected from cycle_collect_roots()
+    if( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER )
+        return;
+
+    ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_WHITE );
+
+    gc_refcount_children( p, cycle_collect_white_o, 0 );
+
+    // Children refcounts are already accounted for by trial deletion
+
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_HAS_WEAKREF )
+        gc_clear_weakrefs(p);
+
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED )
+        pvm_intern_forget_dead(p);
+
+    // Inline caches are keyed by class and interface address
+    if( p->_flags & (PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS|PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERFACE) )
+        pvm_ic_flush();
+
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_FINALIZER )
+    {
+        gc_finalizer_func_t  func = pvm_internal_classes[pvm_object_da( p->_class, class )->sys_table_id].finalizer;
+        if (func != 0) func(p);
+    }
+
+    if( pvm_alloc_prof_enabled )
+        pvm_alloc_prof_note_free(p);
+
+    debug_catch_object("cycle", p);
+    p->_ah.refCount = 0;
+    p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+    pvm_alloc_note_free(p);
+
+    cycle_freed++;
+}
+
+
+static void cycle_mark_roots(int n)
+{
+    int i;
+    for( i = 0; i < n; i++ )
+    {
+        pvm_object_storage_t *p = cycle_buf->roots[i];
+        if( p == 0 )
+            continue;
+
+        // Purple?
+        if( (p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN) && (p->_ah.refCount > 0) )
+        {
+            cycle_mark_gray( p );
+            continue;
+        }
+
+        // Got a ref since - not a root anymore
+        ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER|PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );
+        cycle_buf->roots[i] = 0;
+    }
+}
+
+static void cycle_scan_roots(int n)
+{
+    int i;
+    for( i = 0; i < n; i++ )
+    {
+        pvm_object_storage_t *p = cycle_buf->roots[i];
+        if( p != 0 )
+            cycle_scan( p );
+    }
 }
 
+static void cycle_collect_roots(int n)
+{
+    int i;
+    for( i = 0; i < n; i++ )
+    {
+        pvm_object_storage_t *p = cycle_buf->roots[i];
+        if( p == 0 )
+            continue;
 
+        cycle_buf->roots[i] = 0;
+        ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER|PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );
+
+        cycle_collect_white( p );
+    }
+}
+
+
+static void cycle_collector_thread(void *a)
+{
+    (void) a;
+
+    t_current_set_name("CycleGC");
+
+    while(1)
+    {
+        hal_mutex_lock( &cycle_thread_mutex );
+        hal_cond_wait( &cycle_start_cond, &cycle_thread_mutex );
+        hal_mutex_unlock( &cycle_thread_mutex );
+
+        phantom_snapper_wait_4_threads();
+        gc_collect_cycles();
+        phantom_snapper_reenable_threads();
+    }
+}
+
+
+static void cycle_collector_init(void)
+{
+    if( hal_mutex_init( &_cycle_mutex, "CycleBuf" ) )
+        panic("Can't init cycle buffer mutex");
+
+    cycle_mutex = &_cycle_mutex;
+
+    dbg_add_command( cycle_dump_stats, "cycles", "cycle collector statistics");
+
+    // Hosted VM can't stop the world
+    if( !phantom_is_a_real_kernel() )
+        return;
+
+    hal_mutex_init( &cycle_thread_mutex, "CycleGC" );
+    hal_cond_init( &cycle_start_cond, "CycleGC" );
+
+    tid_t tid = hal_start_thread( cycle_collector_thread, 0, 0 );
+    assert( tid > 0 );
+    cycle_thread_started = 1;
+}
+
+
+static void cycle_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    printf("Cycle collector: %d runs, %ld objects freed total\n", cycle_runs, cycle_total_freed );
+    printf(" buffer: %d of %d used, %d candidates lost\n", cycle_buf ? cycle_buf->count : 0, cycle_buf_size, cycle_lost );
+    printf(" last run: %d candidates, %d objects traced, %d freed\n", cycle_last_candidates, cycle_last_traced, cycle_last_freed );
+}
 
 
 
 
 // -----------------------------------------------------------------------
-// Ok, poor man's GC:  stop-the-world mark/sweep
-// implement some more serious GC
+// Mark/sweep GC.
+//
+// Incremental snapshot-at-the-beginning marker. Cycle is started with
+// VM threads stopped: generation is bumped, root object is shaded and
+// objects of the stack arena (call frames and stacks, which are changed
+// with no write barrier) are scanned right away. Then marker runs along
+// with VM threads. Reference which is overwritten or dropped is shaded
+// by write barrier (pvm_set_field(), pvm_set_ofield() and refcount
+// decrement), so everything reachable at cycle start gets marked.
+// Objects allocated during the cycle get current generation, ie are born
+// black.
+//
+// Refcount does not give memory back while marking is in progress -
+// marker can hold pointers to these objects. They are released when
+// marking is finished.
+//
+// Sweep is lazy, allocator does it per arena, see alloc.c.
+// run_gc() does it all synchronously.
 // -----------------------------------------------------------------------
 
 
-//static void init_gc() {};
+static void gc_process_children(gc_iterator_call_t f, pvm_object_storage_t *p, void *arg);
+static void gc_scan_object( pvm_object_storage_t *p );
+static void gc_account_pause( bigtime_t start );
+static void gc_dump_stats( int ac, char **av );
 
-static int free_unmarked();
-static void mark_tree(pvm_object_storage_t * root);
+static volatile int             gc_n_run = 0;
 
-//typedef void (*gc_iterator_call_t)( struct pvm_object o, void *arg );
-//typedef void (*gc_iterator_func_t)( gc_iterator_call_t func, struct pvm_object_storage * os, void *arg );
+volatile int                    gc_marking = 0;
 
-static void mark_tree_o(pvm_object_t o, void *arg);
-static void gc_process_children(gc_iterator_call_t f, pvm_object_storage_t *p, void *arg);
+static hal_mutex_t              _gc_mutex;
+static hal_mutex_t              *gc_mutex = 0; // 0 before threads start
+
+#define GC_LOCK()   do { if(gc_mutex) hal_mutex_lock( gc_mutex ); } while(0)
+#define GC_UNLOCK() do { if(gc_mutex) hal_mutex_unlock( gc_mutex ); } while(0)
+
+// Gray objects
+#define MARK_STACK_SIZE (32*1024)
+static pvm_object_storage_t *   mark_stack[MARK_STACK_SIZE];
+static int                      mark_sp = 0;
+static volatile int             mark_overflow = 0;      // marked object is not scanned
+static int                      mark_overflows = 0;     // heap rescans
+
+// Objects refcount freed during marking
+#define DEFERRED_RELEASE_SIZE (16*1024)
+static pvm_object_storage_t *   deferred_release[DEFERRED_RELEASE_SIZE];
+static int                      deferred_release_n = 0;
+static int                      deferred_release_lost = 0;
+
+// How many objects marker scans between lock acquisitions
+#define MARK_BATCH 64
+
+// Mark bits are kept in volatile side bitmap, one bit per possible object
+// start (objects are 4 bytes aligned, see round_size() in alloc.c). GC does
+// not write to object pages, so they are not dirty for the next snapshot.
+#define MARK_GRAIN_SHIFT 2
+
+static int *                    mark_bits = 0;
+static unsigned int             mark_bits_words = 0;
+static void *                   mark_bits_base = 0;
+
+
+// Called by allocator on start, before any object is allocated
+void gc_mark_bitmap_init( void *start, unsigned int size )
+{
+    mark_bits_base = start;
+    mark_bits_words = ((size >> MARK_GRAIN_SHIFT) + 31) / 32;
+
+    mark_bits = calloc( mark_bits_words, sizeof(int) );
+    if( mark_bits == 0 )
+        panic("Can't allocate GC mark bitmap");
+}
 
+static inline unsigned int mark_bit_index( pvm_object_storage_t *p )
+{
+    return ((void *)p - mark_bits_base) >> MARK_GRAIN_SHIFT;
+}
+
+static void gc_set_mark( pvm_object_storage_t *p )
+{
+    unsigned int i = mark_bit_index( p );
+    // Allocator sets bits under its own lock, so be atomic
+    atomic_or( mark_bits + (i / 32), (int)(1u << (i % 32)) );
+}
+
+int gc_is_marked( pvm_object_storage_t *p )
+{
+    unsigned int i = mark_bit_index( p );
+    return mark_bits[i / 32] & (int)(1u << (i % 32));
+}
+
+void gc_mark_new_object( pvm_object_storage_t *p )
+{
+    gc_set_mark( p );
+}
+
+
+// Make object gray
+void gc_shade_object( pvm_object_storage_t *p )
+{
+    if( gc_is_marked( p ) )
+        return;
+
+    GC_LOCK();
+
+    if( gc_is_marked( p ) )
+    {
+        GC_UNLOCK();
+        return;
+    }
+
+    gc_set_mark( p );
+
+    if( mark_sp < MARK_STACK_SIZE )
+    {
+        mark_stack[mark_sp++] = p;
+        GC_UNLOCK();
+        return;
+    }
+
+    // No room - it is marked, but not scanned. Marked objects are
+    // rescanned at the end of marking, see gc_mark_rescan().
+    mark_overflow = 1;
+    GC_UNLOCK();
+}
+
+static void gc_shade_child( pvm_object_t o, void *arg )
+{
+    (void)arg;
+
+    if(o.data == 0) // Don't try to process null objects
+        return;
+
+    if( !pvm_is_tagged_int( o ) ) gc_shade_object( o.data );
+    if( o.interface ) gc_shade_object( o.interface );
+}
+
+static void gc_scan_object( pvm_object_storage_t *p )
+{
+    assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
+    assert( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
+
+    // Fast skip if no children -
+    if( !(p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE) )
+        gc_process_children( gc_shade_child, p, 0 /*unused cookie*/ );
+}
+
+// Stack arena object - scan now, it is changed with no barrier
+static void gc_scan_stack_object( pvm_object_storage_t *p )
+{
+    gc_set_mark( p );
+    gc_scan_object( p );
+}
+
+
+static void gc_rescan_one( pvm_object_storage_t *p )
+{
+    if( gc_is_marked( p ) )
+        gc_scan_object( p );
+}
+
+// Allocator lock must be taken, VM threads must be stopped. Scan
+// all marked objects, as some were not pushed to the mark stack.
+static void gc_mark_rescan(void)
+{
+    mark_overflow = 0;
+    mark_overflows++;
+
+    pvm_alloc_scan_objects( gc_rescan_one );
+}
+
+// Returns nonzero if there's more work to do
+static int gc_mark_step( int budget )
+{
+    pvm_object_storage_t *batch[MARK_BATCH];
+
+    while( budget > 0 )
+    {
+        int n = 0;
+
+        GC_LOCK();
+        while( (n < MARK_BATCH) && (mark_sp > 0) )
+            batch[n++] = mark_stack[--mark_sp];
+        GC_UNLOCK();
+
+        if( n == 0 )
+            return 0;
+
+        int i;
+        for( i = 0; i < n; i++ )
+            gc_scan_object( batch[i] );
+
+        budget -= n;
+    }
+
+    return 1;
+}
+
+
+// Allocator lock must be taken, refdec paused. VM threads must be stopped
+// or not run yet (no barrier before gc_marking is set).
+static void gc_mark_start(void)
+{
+    if( gc_marking )
+        return;
+
+    // Finish lazy sweep of the previous cycle
+    pvm_alloc_sweep_finish();
+
+    // Everything is white. Objects allocated from now on are born black.
+    memset( mark_bits, 0, mark_bits_words * sizeof(int) );
+
+    if (debug_memory_leaks) pvm_memcheck();  // visualization
+    if (debug_memory_leaks) printf("gc started...  ");
+
+    cycle_root_buffer_clear(); // so two types of gc could coexists
+
+    mark_sp = 0;
+    mark_overflow = 0;
+    gc_marking = 1;
+
+    // Root is always used. All other objects, including pvm_root and pvm_root.threads_list, should be reached from root...
+    gc_shade_object( get_root_object_storage() );
+
+    pvm_alloc_scan_stacks( gc_scan_stack_object );
+
+    // String constants of pre-decoded code
+    pvm_code_cache_gc_mark( gc_shade_object );
+
+    // Objects with pending decrement, caller paused refdec
+    pvm_refdec_gc_mark( gc_shade_object );
+}
+
+// Allocator lock must be taken, VM threads must be stopped.
+static void gc_mark_finish(void)
+{
+    if( !gc_marking )
+        return;
+
+    do {
+        while( gc_mark_step( MARK_STACK_SIZE ) )
+            ;
+
+        if( mark_overflow )
+            gc_mark_rescan();
+
+    } while( mark_sp > 0 );
+
+    GC_LOCK();
+    gc_marking = 0;
+    int n = deferred_release_n;
+    deferred_release_n = 0;
+    GC_UNLOCK();
+
+    int i;
+    for( i = 0; i < n; i++ )
+    {
+        pvm_object_storage_t *p = deferred_release[i];
+        p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+        pvm_alloc_note_free(p);
+    }
+
+    pvm_alloc_sweep_start();
+
+    if (debug_memory_leaks) printf("gc marked\n");
+}
+
+
+// Called by refcount code when object is to be freed. Returns nonzero
+// if we keep it till the end of marking.
+static int gc_defer_release( pvm_object_storage_t *p )
+{
+    if( !gc_marking )
+        return 0;
+
+    GC_LOCK();
+
+    if( !gc_marking )
+    {
+        GC_UNLOCK();
+        return 0;
+    }
+
+    if( deferred_release_n < DEFERRED_RELEASE_SIZE )
+        deferred_release[deferred_release_n++] = p;
+    else
+    {
+        // Next cycle will sweep it. Finalizer is already called.
+        deferred_release_lost++;
+        p->_flags &= ~PHANTOM_OBJECT_STORAGE_FLAG_IS_FINALIZER;
+    }
 
-static volatile int  gc_n_run = 0;
-static unsigned char  gc_flags_last_generation = 0;
+    GC_UNLOCK();
+    return 1;
+}
+
+
+// Sweep an unmarked object, allocator lock is taken
+int gc_sweep_object( pvm_object_storage_t *p )
+{
+    // Inline caches are keyed by class and interface address
+    if( p->_flags & (PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS|PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERFACE) )
+        pvm_ic_flush();
+
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED )
+        pvm_intern_forget_dead(p);
+
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_FINALIZER )
+    {
+        // based on the assumption that finalizer is only valid for some internal childfree objects - is it correct?
+        gc_finalizer_func_t  func = pvm_internal_classes[pvm_object_da( p->_class, class )->sys_table_id].finalizer;
+        if (func != 0) func(p);
+    }
+
+    if( pvm_alloc_prof_enabled )
+        pvm_alloc_prof_note_free(p);
 
+    debug_catch_object("gc", p);
+    p->_ah.refCount = 0;  // free now
+    p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE; // free now
+    pvm_alloc_note_free(p);
+
+    return 1;
+}
+
+
+// Synchronous full GC
 void run_gc()
 {
     int my_run = gc_n_run;
 
+    pvm_refdec_pause();
     //hal_mutex_lock( &alloc_mutex );
     if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );  // TODO avoid Giant lock
 
@@ -91,32 +845,26 @@ void run_gc()
     {
         if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );  // TODO avoid Giant lock
         //hal_mutex_unlock( &alloc_mutex );
+        pvm_refdec_resume();
         return;
     }
     gc_n_run++;
 
-    gc_flags_last_generation++; // bump generation
-    if (gc_flags_last_generation == 0)  gc_flags_last_generation++;  // != 0 'cause allocation reset gc_flags to zero
+    bigtime_t start = hal_system_time();
 
     //phantom_virtual_machine_threads_stopped++; // pretend we are stopped
     //TODO: refine sinchronization
 
-    if (debug_memory_leaks) pvm_memcheck();  // visualization
-    if (debug_memory_leaks) printf("gc started...  ");
-
+    // Thread allocation buffers will be given back on next allocation
+    pvm_alloc_retire_all_tlabs();
 
-    cycle_root_buffer_clear(); // so two types of gc could coexists
+    // Will just finish incremental one if it is running
+    gc_mark_start();
+    gc_mark_finish();
 
+    int freed = pvm_alloc_sweep_finish();
 
-    // First pass - tree walk, mark visited.
-    //
-    // Root is always used. All other objects, including pvm_root and pvm_root.threads_list, should be reached from root...
-    mark_tree( get_root_object_storage() );
-
-
-    // Second pass - linear walk to free unused objects.
-    //
-    int freed = free_unmarked();
+    gc_account_pause( start );
 
     if ( freed > 0 )
        printf("\ngc: %i objects freed\n", freed);
@@ -128,63 +876,161 @@ void run_gc()
     //phantom_virtual_machine_threads_stopped--;
     //hal_mutex_unlock( &alloc_mutex );
     if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );  // TODO avoid Giant lock
+    pvm_refdec_resume();
 }
 
 
-static int free_unmarked()
+// -----------------------------------------------------------------------
+// Incremental GC thread. Started in kernel only, hosted VM can't stop
+// the world and uses run_gc().
+// -----------------------------------------------------------------------
+
+static hal_mutex_t              gc_thread_mutex;
+static hal_cond_t               gc_start_cond;
+static int                      gc_thread_started = 0;
+
+// Marker gives CPU away after that much objects
+#define GC_MARK_STEP 4096
+
+
+static int                      gc_pauses;
+static bigtime_t                gc_pause_total;
+static bigtime_t                gc_pause_max;
+
+static void gc_account_pause( bigtime_t start )
 {
-    void * start = get_pvm_object_space_start();
-    void * end = get_pvm_object_space_end();
-    void * curr;
-    int freed = 0;
-    for( curr = start; curr < end ; curr += ((pvm_object_storage_t *)curr)->_ah.exact_size )
-    {
-        pvm_object_storage_t * p = (pvm_object_storage_t *)curr;
-        assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
+    bigtime_t pause = hal_system_time() - start;
+
+    gc_pauses++;
+    gc_pause_total += pause;
+    if( pause > gc_pause_max ) gc_pause_max = pause;
+
+    if( pause < 100 )
+        STAT_INC_CNT( GC_PAUSE_100US );
+    else if( pause < 1000 )
+        STAT_INC_CNT( GC_PAUSE_1MS );
+    else if( pause < 10000 )
+        STAT_INC_CNT( GC_PAUSE_10MS );
+    else if( pause < 100000 )
+        STAT_INC_CNT( GC_PAUSE_100MS );
+    else
+        STAT_INC_CNT( GC_PAUSE_LONG );
+}
 
-        if ( (p->_ah.gc_flags != gc_flags_last_generation) && ( p->_ah.alloc_flags != PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE ) )  //touch not accessed but allocated objects
-        {
-            if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_FINALIZER )
-            {
-                // based on the assumption that finalizer is only valid for some internal childfree objects - is it correct?
-                gc_finalizer_func_t  func = pvm_internal_classes[pvm_object_da( p->_class, class )->sys_table_id].finalizer;
-                if (func != 0) func(p);
-            }
 
-            freed++;
-            debug_catch_object("gc", p);
-            p->_ah.refCount = 0;  // free now
-            p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE; // free now
-        }
-    }
-    return freed;
+void gc_get_pause_stats( struct pvm_alloc_stats *s )
+{
+    s->gc_pauses = gc_pauses;
+    s->gc_pause_total = gc_pause_total;
+    s->gc_pause_max = gc_pause_max;
 }
 
-static void mark_tree(pvm_object_storage_t * p)
+void gc_reset_pause_max(void)
 {
-    p->_ah.gc_flags = gc_flags_last_generation;  // set
+    gc_pause_max = 0;
+}
 
 
-    assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
-    assert( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
+// Called by allocator
+void gc_request_run(void)
+{
+    if( gc_thread_started )
+        hal_cond_signal( &gc_start_cond );
+}
 
 
-    // Fast skip if no children -
-    if( !(p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE) )
+static void gc_run_incremental(void)
+{
+    bigtime_t start;
+
+    // Most of the previous sweep is done here, out of pause
+    if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );
+    pvm_alloc_sweep_finish();
+    if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );
+
+    phantom_snapper_wait_4_threads();
+    start = hal_system_time();
+
+    pvm_refdec_pause();
+    if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );
+    gc_n_run++;
+    gc_mark_start();
+    if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );
+    pvm_refdec_resume();
+
+    gc_account_pause( start );
+    phantom_snapper_reenable_threads();
+
+    while( gc_mark_step( GC_MARK_STEP ) )
+        hal_sleep_msec( 0 );
+
+    phantom_snapper_wait_4_threads();
+    start = hal_system_time();
+
+    if(vm_alloc_mutex) hal_mutex_lock( vm_alloc_mutex );
+    gc_mark_finish();
+    if(vm_alloc_mutex) hal_mutex_unlock( vm_alloc_mutex );
+
+    gc_account_pause( start );
+    phantom_snapper_reenable_threads();
+}
+
+
+static void gc_thread(void *a)
+{
+    (void) a;
+
+    t_current_set_name("GC");
+
+    while(1)
     {
-        gc_process_children( mark_tree_o, p, 0 /*unused cookie*/ );
+        hal_mutex_lock( &gc_thread_mutex );
+        hal_cond_wait( &gc_start_cond, &gc_thread_mutex );
+        hal_mutex_unlock( &gc_thread_mutex );
+
+        gc_run_incremental();
     }
 }
 
-static void mark_tree_o(pvm_object_t o, void *arg)
+
+static void gc_thread_init(void)
 {
-    (void)arg;
+    if( hal_mutex_init( &_gc_mutex, "GCMark" ) )
+        panic("Can't init GC mutex");
 
-    if(o.data == 0) // Don't try to process null objects
+    gc_mutex = &_gc_mutex;
+
+    dbg_add_command( gc_dump_stats, "gc", "mark/sweep GC statistics");
+
+    if( !phantom_is_a_real_kernel() )
         return;
 
-    if (o.data->_ah.gc_flags != gc_flags_last_generation)  mark_tree( o.data );
-    if (o.interface->_ah.gc_flags != gc_flags_last_generation)  mark_tree( o.interface );
+    hal_mutex_init( &gc_thread_mutex, "GC" );
+    hal_cond_init( &gc_start_cond, "GC" );
+
+    tid_t tid = hal_start_thread( gc_thread, 0, 0 );
+    assert( tid > 0 );
+    gc_thread_started = 1;
+}
+
+
+static void gc_init(void)
+{
+    gc_thread_init();
+    cycle_collector_init();
+}
+
+INIT_ME( 0, gc_init, 0 )
+
+
+static void gc_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    printf("GC: %d runs, %s, mark bitmap %d Kb\n", gc_n_run, gc_marking ? "marking" : "idle", (int)(mark_bits_words * sizeof(int) / 1024) );
+    printf(" mark stack: %d used, %d overflow rescans\n", mark_sp, mark_overflows );
+    printf(" deferred release: %d waiting, %d lost\n", deferred_release_n, deferred_release_lost );
 }
 
 
@@ -245,17 +1091,27 @@ void refzero_process_children( pvm_object_storage_t *p )
     if ( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER )
         cycle_root_buffer_rm_candidate( p );
 
-    p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
-
     debug_catch_object("del", p);
     DEBUG_PRINT("x");
+
+    if( gc_defer_release( p ) )
+        return;
+
+    p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+    pvm_alloc_note_free(p);
 }
 
 static void do_refzero_process_children( pvm_object_storage_t *p )
+{
+    gc_refcount_children( p, refzero_add_from_internal, 0 );
+}
+
+// Call f for each child which is counted in refcount
+static void gc_refcount_children( pvm_object_storage_t *p, gc_iterator_call_t f, void *arg )
 {
     // Fast skip if no children - done!
-    //if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE )
-    //    return;
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE )
+        return;
 
     // plain non internal objects -
     if( !(p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL) )
@@ -264,7 +1120,7 @@ static void do_refzero_process_children( pvm_object_storage_t *p )
 
         for( i = 0; i < da_po_limit(p); i++ )
         {
-            ref_dec_o( da_po_ptr(p->da)[i] );
+            f( da_po_ptr(p->da)[i], arg );
         }
         //don't touch classes yet
         //ref_dec_o( p->_class );  // Why? a kind of mismatch in the compiler, in opcode_os_save8
@@ -289,7 +1145,7 @@ static void do_refzero_process_children( pvm_object_storage_t *p )
 
     gc_iterator_func_t  func = pvm_internal_classes[pvm_object_da( p->_class, class )->sys_table_id].iter;
 
-    func( refzero_add_from_internal, p, 0 );
+    func( f, p, arg );
 
 
     //don't touch classes yet
@@ -327,8 +1183,8 @@ static void ref_dec_proccess_zero(pvm_object_storage_t *p)
 #else
     // postpone for delayed inspection (bug or feature?)
     DEBUG_PRINT("(X)");
-    p->_ah.alloc_flags |= PVM_OBJECT_AH_ALLOCATOR_FLAG_REFZERO; //beware of  PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER
-    p->_ah.alloc_flags &= ~PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED; //beware of  PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER
+    ah_flags_set( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_REFZERO ); //beware of  PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER
+    ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED ); //beware of  PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER
     pvm_collapse_free(p);
 #endif
 }
@@ -351,15 +1207,15 @@ void debug_catch_object(const char *msg, pvm_object_storage_t *p )
     printf("\n"); // for GDB to break here
 }
 
-static void gc_clear_weakrefs(pvm_object_storage_t *p);
-
-
 //static inline
 void do_ref_dec_p(pvm_object_storage_t *p)
 {
-    if( p == 0 ) return;
+    if( p == 0 || pvm_is_tagged_int_p( p ) ) return;
     debug_catch_object("--", p);
 
+    // Reference goes away - snapshot marker must see it
+    gc_write_barrier( p );
+
     assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
     assert( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
     assert( p->_ah.refCount > 0 );
@@ -373,7 +1229,12 @@ void do_ref_dec_p(pvm_object_storage_t *p)
 
     if(p->_ah.refCount < INT_MAX) // Do we really need this check? Sure, we see many decrements for saturated objects!
     {
-        if( 0 == ( --(p->_ah.refCount) ) )
+        int count;
+
+        // Object can be seen by other thread, see ah_flags_set()
+        count = __sync_sub_and_fetch( &(p->_ah.refCount), 1 );
+
+        if( 0 == count )
         {
             if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_HAS_WEAKREF )
             {
@@ -388,6 +1249,21 @@ void do_ref_dec_p(pvm_object_storage_t *p)
                     goto nonzero;
             }
 
+            if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED )
+            {
+                // Intern table lookup could take it back
+                pvm_intern_forget(p);
+
+                if( 0 != p->_ah.refCount )
+                    goto nonzero;
+            }
+
+            // Inline caches are keyed by class and interface address
+            if( p->_flags & (PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS|PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERFACE) )
+                pvm_ic_flush();
+
+            if( pvm_alloc_prof_enabled )
+                pvm_alloc_prof_note_free(p);
 
             // Fast way if no children
             if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE )
@@ -399,10 +1275,17 @@ void do_ref_dec_p(pvm_object_storage_t *p)
                     if (func != 0) func(p);
                 }
 
-                p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+                if ( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER )
+                    cycle_root_buffer_rm_candidate( p );
+
                 debug_catch_object("del", p);
                 DEBUG_PRINT("-");
-                pvm_collapse_free(p); 
+                if( !gc_defer_release( p ) )
+                {
+                    p->_ah.alloc_flags = PVM_OBJECT_AH_ALLOCATOR_FLAG_FREE;
+                    pvm_collapse_free(p); 
+                    pvm_alloc_note_free(p);
+                }
             } else
                 ref_dec_proccess_zero(p);
         STAT_INC_CNT( OBJECT_FREE );
@@ -415,11 +1298,8 @@ void do_ref_dec_p(pvm_object_storage_t *p)
             if ( !(p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL) )
             {
                 if ( !(p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER) )
-                {
-                    cycle_root_buffer_add_candidate(p);
-                    p->_ah.alloc_flags |= PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER ;
-                }
-                p->_ah.alloc_flags |= PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN ;  // set down flag
+                    cycle_root_buffer_add_candidate(p); // sets PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER
+                ah_flags_set( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );  // set down flag
             }
         }
     //nokill:;
@@ -428,8 +1308,7 @@ void do_ref_dec_p(pvm_object_storage_t *p)
 
 void ref_dec_p(pvm_object_storage_t *p)
 {
-    do_ref_dec_p(p);
-    //deferred_refdec(p);
+    deferred_refdec(p);
 }
 
 
@@ -437,7 +1316,7 @@ void ref_dec_p(pvm_object_storage_t *p)
 //static inline
 void ref_inc_p(pvm_object_storage_t *p)
 {
-    if( p == 0 ) return;
+    if( p == 0 || pvm_is_tagged_int_p( p ) ) return;
     debug_catch_object("++", p);
 
     assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
@@ -451,10 +1330,10 @@ void ref_inc_p(pvm_object_storage_t *p)
 
     if( p->_ah.refCount < INT_MAX )
     {
-        (p->_ah.refCount)++;
+        __sync_fetch_and_add( &(p->_ah.refCount), 1 );
 
         if ( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER )
-            p->_ah.alloc_flags &= ~PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN ;  //clear down flag
+            ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );  //clear down flag
     }
 }
 
@@ -471,12 +1350,12 @@ void ref_saturate_p(pvm_object_storage_t *p)
     if ( p->_ah.alloc_flags & PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER ) {
         cycle_root_buffer_rm_candidate( p );
 
-        p->_ah.alloc_flags &= ~PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER;
-        p->_ah.alloc_flags &= ~PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN;
+        ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_IN_BUFFER );
+        ah_flags_clear( p, PVM_OBJECT_AH_ALLOCATOR_FLAG_WENT_DOWN );
     }
 
     assert( p->_ah.object_start_marker == PVM_OBJECT_START_MARKER );
-    assert( p->_ah.alloc_flags == PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
+    assert( (p->_ah.alloc_flags & ~PVM_OBJECT_AH_ALLOCATOR_FLAG_SHARED) == PVM_OBJECT_AH_ALLOCATOR_FLAG_ALLOCATED );
     assert( p->_ah.refCount > 0 );
 
     p->_ah.refCount = INT_MAX;
@@ -486,7 +1365,7 @@ void ref_saturate_p(pvm_object_storage_t *p)
 //external calls:
 void ref_saturate_o(pvm_object_t o)
 {
-    if(!(o.data)) return;
+    if(!(o.data) || pvm_is_tagged_int( o )) return;
     ref_saturate_p(o.data);
 }
 void ref_dec_o(pvm_object_t o)
@@ -113,7 +113,7 @@ static void get_regs(gdb_pt_regs *r, struct data_area_4_thread *da)
     r->r_estack = da->_estack;
 
     r->r_ip	= da->code.IP;
-    r->r_this	= da->_this_object;
+    r->r_this	= pvm_object_da( da->call_frame, call_frame )->this_object;
     r->r_frame	= da->call_frame;
 }
 
@@ -125,7 +125,6 @@ static void set_regs(gdb_pt_regs *r, struct data_area_4_thread *da)
      da->_estack          = r->r_estack;
 
      da->code.IP          = r->r_ip;
-     da->_this_object     = r->r_this;
      da->call_frame       = r->r_frame;
 
     pvm_exec_load_fast_acc(da);
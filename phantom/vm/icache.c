@@ -0,0 +1,365 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Inline caches for method lookup.
+ *
+ * Call site (address in bytecode) is hashed into the volatile table
+ * (one for static calls and one for dynamic invoke),
+ * each table slot keeps a few (receiver, method) -> result entries,
+ * so call site is monomorphic or polymorphic up to IC_WAYS receiver
+ * classes. Table is not persistent and is empty after restart.
+ *
+ * Site address is just a hint - two sites can share a slot and code
+ * object can be freed and replaced. Entry result is a pure function
+ * of its key, so any matching entry is correct:
+ *
+ *   static call:     (interface, method index) -> code object
+ *   dynamic invoke:  (class) -> ordinal, name is checked on hit
+ *
+ * One more table caches class hierarchy checks done on throw:
+ *
+ *   (object class, catch class) -> pvm_object_class_is() result
+ *
+ * Classes and interfaces can be freed by refcount, cycle collector or
+ * GC sweep, each of them flushes the tables before address is reused.
+ *
+ * Kernel debugger command: icache
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+
+#include <vm/internal_da.h>
+#include <vm/internal.h>
+#include <vm/object_flags.h>
+#include <vm/exec.h>
+#include <vm/reflect.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/stats.h>
+
+#include <spinlock.h>
+
+
+#define IC_SITES        512     // power of 2
+#define IC_WAYS         4       // receivers per site
+
+#define IC_STATIC       0
+#define IC_DYNAMIC      1
+#define IC_KINDS        2
+
+struct ic_entry
+{
+    void * volatile                     key;            // interface or class storage, 0 if unused
+    int                                 ordinal;
+    struct pvm_object_storage *         code;           // static call only
+};
+
+struct ic_site
+{
+    const void * volatile               site;
+    int                                 next_way;       // round robin replacement
+    struct ic_entry                     way[IC_WAYS];
+};
+
+static struct ic_site   ic_table[IC_KINDS][IC_SITES];
+
+// Held on update only, lookup is lock free
+static VM_SPIN_TYPE     ic_lock;
+
+static int              ic_hits[IC_KINDS];
+static int              ic_misses[IC_KINDS];
+static int              ic_site_evicts;
+static int              ic_way_replaces;
+static int              ic_flushes;
+
+
+#define IC_CLASS_IS_SIZE        256     // power of 2
+
+struct ic_class_is
+{
+    void * volatile                     oclass;         // 0 if unused
+    void *                              tclass;
+    int                                 result;
+};
+
+static struct ic_class_is ic_class_is_table[IC_CLASS_IS_SIZE];
+
+static int              ic_class_is_hits;
+static int              ic_class_is_misses;
+
+
+static inline struct ic_site * ic_get_site( int kind, const void *site )
+{
+    addr_t a = (addr_t)site;
+    return ic_table[kind] + ((a ^ (a >> 9)) & (IC_SITES-1));
+}
+
+
+// Lock free lookup. Writer clears key before changing the entry,
+// so key is rechecked after reading the values.
+static struct ic_entry * ic_lookup( struct ic_site *s, const void *site, void *key, int ordinal, int check_ordinal, struct ic_entry *out )
+{
+    int i;
+
+    if( s->site != site )
+        return 0;
+
+    for( i = 0; i < IC_WAYS; i++ )
+    {
+        struct ic_entry *e = s->way + i;
+
+        if( e->key != key )
+            continue;
+
+        out->ordinal = e->ordinal;
+        out->code = e->code;
+        __sync_synchronize();
+
+        if( e->key != key )
+            continue;
+
+        if( check_ordinal && out->ordinal != ordinal )
+            continue;
+
+        return e;
+    }
+
+    return 0;
+}
+
+
+static void ic_update( struct ic_site *s, const void *site, void *key, int ordinal, struct pvm_object_storage *code )
+{
+    int i;
+
+    VM_SPIN_LOCK(ic_lock);
+
+    if( s->site != site )
+    {
+        if( s->site != 0 )
+            ic_site_evicts++;
+
+        for( i = 0; i < IC_WAYS; i++ )
+            s->way[i].key = 0;
+
+        __sync_synchronize();
+        s->site = site;
+        s->next_way = 0;
+    }
+
+    // Free way or the oldest one
+    for( i = 0; i < IC_WAYS; i++ )
+        if( s->way[i].key == 0 )
+            break;
+
+    if( i >= IC_WAYS )
+    {
+        i = s->next_way;
+        s->next_way = (i + 1) % IC_WAYS;
+        ic_way_replaces++;
+    }
+
+    struct ic_entry *e = s->way + i;
+
+    e->key = 0;
+    __sync_synchronize();
+    e->ordinal = ordinal;
+    e->code = code;
+    __sync_synchronize();
+    e->key = key;
+
+    VM_SPIN_UNLOCK(ic_lock);
+}
+
+
+// Same as pvm_exec_find_method does
+static void * ic_interface_of( struct pvm_object o )
+{
+    if( o.data == 0 )
+        return 0;
+
+    if( o.interface != 0 )
+        return o.interface;
+
+    if( o.data->_class.data == 0 )
+        return 0;
+
+    return pvm_object_da( o.data->_class, class )->object_default_interface.data;
+}
+
+
+struct pvm_object_storage * pvm_ic_find_method( const void *site, struct pvm_object o, unsigned int method_index )
+{
+    struct ic_site *s = ic_get_site( IC_STATIC, site );
+    void *iface = ic_interface_of( o );
+    struct ic_entry e;
+
+    if( iface != 0 && ic_lookup( s, site, iface, method_index, 1, &e ) )
+    {
+        ic_hits[IC_STATIC]++;
+        STAT_INC_CNT( VM_IC_HIT );
+        return e.code;
+    }
+
+    ic_misses[IC_STATIC]++;
+    STAT_INC_CNT( VM_IC_MISS );
+
+    // Does all the checks and panics if something is wrong
+    struct pvm_object_storage *code = pvm_exec_find_method( o, method_index );
+
+    if( iface != 0 )
+        ic_update( s, site, iface, method_index, code );
+
+    return code;
+}
+
+
+int pvm_ic_find_method_ordinal( const void *site, pvm_object_t tclass, pvm_object_t mname )
+{
+    struct ic_site *s = ic_get_site( IC_DYNAMIC, site );
+    struct ic_entry e;
+
+    if( ic_lookup( s, site, tclass.data, 0, 0, &e ) &&
+        pvm_object_class_is( mname, pvm_get_string_class() ) )
+    {
+        // Same class may be called with other name from this site
+        pvm_object_t mnames = pvm_object_da( tclass, class )->method_names;
+
+        if( !pvm_is_null( mnames ) &&
+            e.ordinal < get_array_size( mnames.data ) &&
+            pvm_streq( pvm_get_ofield( mnames, e.ordinal ), mname ) )
+        {
+            ic_hits[IC_DYNAMIC]++;
+            STAT_INC_CNT( VM_IC_HIT );
+            return e.ordinal;
+        }
+    }
+
+    ic_misses[IC_DYNAMIC]++;
+    STAT_INC_CNT( VM_IC_MISS );
+
+    int ord = pvm_get_method_ordinal( tclass, mname );
+    if( ord >= 0 )
+        ic_update( s, site, tclass.data, ord, 0 );
+
+    return ord;
+}
+
+
+// Same lock free read and update scheme as above
+int pvm_ic_class_is( pvm_object_t o, pvm_object_t tclass )
+{
+    void *oclass = pvm_object_class( o ).data;
+    addr_t a = ((addr_t)oclass) ^ ((addr_t)tclass.data >> 4);
+    struct ic_class_is *e = ic_class_is_table + ((a ^ (a >> 9)) & (IC_CLASS_IS_SIZE-1));
+
+    if( oclass != 0 && e->oclass == oclass )
+    {
+        void *tc = e->tclass;
+        int result = e->result;
+        __sync_synchronize();
+
+        if( e->oclass == oclass && tc == tclass.data )
+        {
+            ic_class_is_hits++;
+            return result;
+        }
+    }
+
+    ic_class_is_misses++;
+
+    int result = pvm_object_class_is( o, tclass );
+
+    if( oclass != 0 )
+    {
+        VM_SPIN_LOCK(ic_lock);
+
+        e->oclass = 0;
+        __sync_synchronize();
+        e->tclass = tclass.data;
+        e->result = result;
+        __sync_synchronize();
+        e->oclass = oclass;
+
+        VM_SPIN_UNLOCK(ic_lock);
+    }
+
+    return result;
+}
+
+
+void pvm_ic_flush(void)
+{
+    int k, i, j;
+
+    VM_SPIN_LOCK(ic_lock);
+
+    for( i = 0; i < IC_CLASS_IS_SIZE; i++ )
+        ic_class_is_table[i].oclass = 0;
+
+    for( k = 0; k < IC_KINDS; k++ )
+        for( i = 0; i < IC_SITES; i++ )
+        {
+            for( j = 0; j < IC_WAYS; j++ )
+                ic_table[k][i].way[j].key = 0;
+            ic_table[k][i].site = 0;
+        }
+
+    ic_flushes++;
+
+    VM_SPIN_UNLOCK(ic_lock);
+}
+
+
+
+static void ic_dump_stats( int ac, char **av )
+{
+    static const char *names[IC_KINDS] = { "static calls:  ", "dynamic invoke:" };
+    int k, i, j;
+
+    (void) ac;
+    (void) av;
+
+    printf("Inline caches, %d sites of %d entries per kind:\n", IC_SITES, IC_WAYS );
+
+    for( k = 0; k < IC_KINDS; k++ )
+    {
+        int used = 0, poly = 0, full = 0;
+
+        for( i = 0; i < IC_SITES; i++ )
+        {
+            int n = 0;
+
+            if( ic_table[k][i].site == 0 )
+                continue;
+
+            for( j = 0; j < IC_WAYS; j++ )
+                if( ic_table[k][i].way[j].key != 0 )
+                    n++;
+
+            used++;
+            if( n > 1 ) poly++;
+            if( n == IC_WAYS ) full++;
+        }
+
+        printf(" %s %d hits, %d misses; %d sites used, %d polymorphic, %d full\n",
+               names[k], ic_hits[k], ic_misses[k], used, poly, full );
+    }
+
+    printf(" %d site evictions, %d entry replacements, %d flushes\n", ic_site_evicts, ic_way_replaces, ic_flushes );
+    printf(" catch class checks: %d hits, %d misses\n", ic_class_is_hits, ic_class_is_misses );
+}
+
+
+static void ic_init(void)
+{
+    dbg_add_command( ic_dump_stats, "icache", "method lookup inline caches statistics");
+}
+
+INIT_ME( 0, ic_init, 0 )
@@ -0,0 +1,411 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Interned strings.
+ *
+ * Names and short string constants read from code are interned:
+ * there is one string object per value, marked with
+ * PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED, so that two interned
+ * strings are equal if they are the same object (see pvm_streq).
+ *
+ * Table is persistent binary object in root, open addressing hash
+ * of object pointers, linear probing, backward shift removal, grows
+ * at 3/4 load. GC and refcount do not see these pointers, so the
+ * table is weak: object is removed when refcount, cycle collector
+ * or GC sweep frees it.
+ *
+ * Lookup can meet an object which refcount just went to zero and
+ * take it back, refcount code checks it after pvm_intern_forget().
+ * Object which is not marked after GC marking is garbage to be
+ * swept, lookup skips it. During marking found object is shaded.
+ *
+ * Nothing is allocated or freed under the lock, as GC sweep comes
+ * here with allocator lock taken.
+ *
+ * Kernel debugger command: intern
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+#include <hashfunc.h>
+#include <hal.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/object_flags.h>
+#include <vm/internal_da.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/stats.h>
+
+
+#define INTERN_INITIAL_CAPACITY         1024    // power of 2
+#define INTERN_MAX_LENGTH               256     // longer strings are not interned
+
+
+struct intern_slot
+{
+    u_int32_t                   hash;
+    pvm_object_storage_t *      str;            // weak, 0 if free
+};
+
+struct intern_table
+{
+    u_int32_t                   capacity;
+    u_int32_t                   nEntries;
+    struct intern_slot          slot[];
+};
+
+
+static hal_mutex_t  _intern_mutex;
+static hal_mutex_t  *intern_mutex; // 0 before threads start
+
+#define INTERN_LOCK()      do { if(intern_mutex) hal_mutex_lock( intern_mutex ); } while(0)
+#define INTERN_UNLOCK()    do { if(intern_mutex) hal_mutex_unlock( intern_mutex ); } while(0)
+
+static int              intern_hits;
+static int              intern_misses;
+static int              intern_dead;
+static int              intern_grows;
+
+
+static struct intern_table * intern_table( pvm_object_t t )
+{
+    return (struct intern_table *)pvm_object_da( t, binary )->data;
+}
+
+// 0 before root is loaded
+static struct intern_table * intern_current(void)
+{
+    if( pvm_is_null( pvm_root.intern_table ) )
+        return 0;
+
+    return intern_table( pvm_root.intern_table );
+}
+
+static pvm_object_t intern_create( u_int32_t capacity )
+{
+    pvm_object_t t = pvm_create_binary_object( sizeof(struct intern_table) + capacity * sizeof(struct intern_slot), 0 );
+    struct intern_table *it = intern_table( t );
+
+    memset( it, 0, sizeof(struct intern_table) + capacity * sizeof(struct intern_slot) );
+    it->capacity = capacity;
+
+    return t;
+}
+
+
+// Not marked after marking - will be swept
+static int intern_is_dead( pvm_object_storage_t *p )
+{
+    if( gc_is_marked( p ) )
+        return 0;
+
+    if( gc_marking )
+    {
+        gc_shade_object( p );
+        return 0;
+    }
+
+    return pvm_alloc_sweep_pending();
+}
+
+// Live entry with this value, 0 if none. Under lock.
+static pvm_object_storage_t * intern_find( struct intern_table *it, u_int32_t hash, const char *data, int len )
+{
+    u_int32_t mask = it->capacity - 1;
+    u_int32_t i = hash & mask;
+    u_int32_t n;
+
+    for( n = 0; n < it->capacity; n++, i = (i + 1) & mask )
+    {
+        pvm_object_storage_t *p = it->slot[i].str;
+
+        if( p == 0 )
+            return 0;
+
+        if( it->slot[i].hash != hash )
+            continue;
+
+        struct data_area_4_string *da = (struct data_area_4_string *)&(p->da);
+
+        if( da->length != len || memcmp( da->data, data, len ) )
+            continue;
+
+        if( intern_is_dead( p ) )
+        {
+            intern_dead++;
+            continue;
+        }
+
+        return p;
+    }
+
+    return 0;
+}
+
+// New reference to found object. Under lock.
+static pvm_object_t intern_take( pvm_object_storage_t *p )
+{
+    pvm_object_t o;
+
+    // Refcount went to zero, but pvm_intern_forget() did not remove it yet
+    if( p->_ah.refCount == 0 )
+        p->_ah.refCount = 1;
+    else
+        ref_inc_p( p );
+
+    o.data = p;
+    o.interface = pvm_object_da( p->_class, class )->object_default_interface.data;
+
+    intern_hits++;
+    STAT_INC_CNT( VM_INTERN_HIT );
+
+    return o;
+}
+
+static void intern_put( struct intern_table *it, u_int32_t hash, pvm_object_storage_t *p )
+{
+    u_int32_t mask = it->capacity - 1;
+    u_int32_t i = hash & mask;
+
+    while( it->slot[i].str != 0 )
+        i = (i + 1) & mask;
+
+    it->slot[i].hash = hash;
+    it->slot[i].str = p;
+    it->nEntries++;
+}
+
+static void intern_remove( pvm_object_storage_t *p )
+{
+    struct intern_table *it = intern_current();
+
+    p->_flags &= ~PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED;
+
+    if( it == 0 )
+        return;
+
+    struct data_area_4_string *da = (struct data_area_4_string *)&(p->da);
+    u_int32_t hash = calc_hash( (char *)da->data, (char *)da->data + da->length );
+    u_int32_t mask = it->capacity - 1;
+    u_int32_t i = hash & mask;
+    u_int32_t n;
+
+    for( n = 0; n < it->capacity; n++, i = (i + 1) & mask )
+    {
+        if( it->slot[i].str == 0 )
+            return;
+
+        if( it->slot[i].str == p )
+            break;
+    }
+
+    if( n >= it->capacity )
+        return;
+
+    // Move back following entries of the probe chain
+    u_int32_t j = i;
+    for(;;)
+    {
+        j = (j + 1) & mask;
+
+        if( it->slot[j].str == 0 )
+            break;
+
+        u_int32_t home = it->slot[j].hash & mask;
+        if( ((j - home) & mask) >= ((j - i) & mask) )
+        {
+            it->slot[i] = it->slot[j];
+            i = j;
+        }
+    }
+
+    it->slot[i].str = 0;
+    it->slot[i].hash = 0;
+    it->nEntries--;
+}
+
+
+// Put s to table or return existing equal one. Consumes s.
+static pvm_object_t intern_insert( pvm_object_t s, u_int32_t hash )
+{
+    const char *data = (const char *)pvm_object_da( s, string )->data;
+    int len = pvm_get_str_len( s );
+    pvm_object_t grown = pvm_get_null_object();
+    pvm_object_t old = pvm_get_null_object();
+    pvm_object_t ret = s;
+
+    for(;;)
+    {
+        INTERN_LOCK();
+
+        struct intern_table *it = intern_current();
+
+        pvm_object_storage_t *p = intern_find( it, hash, data, len );
+        if( p != 0 )
+        {
+            ret = intern_take( p );
+            INTERN_UNLOCK();
+            ref_dec_o( s );
+            break;
+        }
+
+        if( (it->nEntries + 1) * 4 > it->capacity * 3 )
+        {
+            if( pvm_is_null( grown ) || intern_table( grown )->capacity <= it->capacity )
+            {
+                u_int32_t capacity = it->capacity * 2;
+                INTERN_UNLOCK();
+
+                if( !pvm_is_null( grown ) )
+                    ref_dec_o( grown );
+                grown = intern_create( capacity );
+                continue;
+            }
+
+            struct intern_table *nt = intern_table( grown );
+            u_int32_t i;
+
+            for( i = 0; i < it->capacity; i++ )
+                if( it->slot[i].str != 0 )
+                    intern_put( nt, it->slot[i].hash, it->slot[i].str );
+
+            // Root field update would release old table here
+            old = ref_inc_o( pvm_root.intern_table );
+            pvm_root.intern_table = grown;
+            pvm_set_field( get_root_object_storage(), PVM_ROOT_OBJECT_INTERN_TABLE, grown );
+            grown = pvm_get_null_object();
+            it = nt;
+
+            intern_grows++;
+        }
+
+        intern_put( it, hash, s.data );
+        s.data->_flags |= PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED;
+
+        intern_misses++;
+        STAT_INC_CNT( VM_INTERN_MISS );
+
+        INTERN_UNLOCK();
+        break;
+    }
+
+    if( !pvm_is_null( grown ) )
+        ref_dec_o( grown );
+
+    if( !pvm_is_null( old ) )
+        ref_dec_o( old );
+
+    return ret;
+}
+
+
+pvm_object_t pvm_intern_binary( const char *data, int len )
+{
+    struct intern_table *it = intern_current();
+
+    if( it == 0 || len > INTERN_MAX_LENGTH )
+        return pvm_create_string_object_binary( data, len );
+
+    u_int32_t hash = calc_hash( data, data + len );
+
+    INTERN_LOCK();
+    pvm_object_storage_t *p = intern_find( intern_current(), hash, data, len );
+    if( p != 0 )
+    {
+        pvm_object_t ret = intern_take( p );
+        INTERN_UNLOCK();
+        return ret;
+    }
+    INTERN_UNLOCK();
+
+    return intern_insert( pvm_create_string_object_binary( data, len ), hash );
+}
+
+
+pvm_object_t pvm_intern_string( pvm_object_t s )
+{
+    if( s.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNED )
+        return s;
+
+    int len = pvm_get_str_len( s );
+
+    if( intern_current() == 0 || len > INTERN_MAX_LENGTH )
+        return s;
+
+    // Rope object can't be interned, its flat copy can
+    if( s.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE )
+    {
+        pvm_object_t ret = pvm_intern_binary( pvm_get_str_data( s ), len );
+        ref_dec_o( s );
+        return ret;
+    }
+
+    const char *data = pvm_get_str_data( s );
+    return intern_insert( s, calc_hash( data, data + len ) );
+}
+
+
+// Refcount is zero. Lookup can take it back, so we check and caller checks again.
+void pvm_intern_forget( pvm_object_storage_t *p )
+{
+    INTERN_LOCK();
+
+    if( p->_ah.refCount == 0 )
+        intern_remove( p );
+
+    INTERN_UNLOCK();
+}
+
+// Found to be garbage by cycle collector or GC
+void pvm_intern_forget_dead( pvm_object_storage_t *p )
+{
+    INTERN_LOCK();
+    intern_remove( p );
+    INTERN_UNLOCK();
+}
+
+
+pvm_object_t pvm_create_intern_table(void)
+{
+    return intern_create( INTERN_INITIAL_CAPACITY );
+}
+
+
+
+static void intern_dump_stats( int ac, char **av )
+{
+    (void) ac;
+    (void) av;
+
+    struct intern_table *it = intern_current();
+
+    if( it == 0 )
+    {
+        printf("No intern table\n");
+        return;
+    }
+
+    printf("Interned strings: %d in table of %d\n", it->nEntries, it->capacity );
+    printf(" %d hits, %d misses, %d dead skipped, %d grows\n", intern_hits, intern_misses, intern_dead, intern_grows );
+}
+
+
+static void intern_init(void)
+{
+    if( hal_mutex_init( &_intern_mutex, "Intern" ) )
+        panic("Can't init intern mutex");
+
+    intern_mutex = &_intern_mutex;
+
+    dbg_add_command( intern_dump_stats, "intern", "interned strings table statistics");
+}
+
+INIT_ME( 0, intern_init, 0 )
@@ -106,7 +106,7 @@ struct internal_class pvm_internal_classes[] =
         PVM_ROOT_OBJECT_STRING_CLASS,
         syscall_table_4_string, // n_syscall_table_4_string,
         pvm_internal_init_string,
-        0 /*pvm_gc_iter_string*/,
+        pvm_gc_iter_string, // ropes only
         0, // no finalizer
         0, // no restart func
         sizeof(struct data_area_4_string), // Dynamic!
@@ -371,6 +371,18 @@ struct internal_class pvm_internal_classes[] =
         {0,0}
     },
 
+    // Keep it last - class object keeps index in this table (sys_table_id)
+    {
+        ".internal.container.hashmap",
+        PVM_ROOT_OBJECT_HASHMAP_CLASS,
+        IINIT(hashmap),
+        0, // no finalizer
+        0, // no restart func
+        sizeof(struct data_area_4_hashmap),
+        PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL,
+        {0,0}
+    },
+
 
 };
 
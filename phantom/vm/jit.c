@@ -1,787 +1,767 @@
-#if 0
 /**
  *
  * Phantom OS
  *
  * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
  *
- * Minimalistic JIT - supposed to be based on libjit
+ * Minimalistic JIT - template compiler for x86 (ia32 and amd64).
  *
+ * Method is compiled after PVM_JIT_THRESHOLD calls. Integer stack
+ * operations, integer locals and jumps are compiled to native code
+ * working on the integer stack array. Anything else - calls, returns,
+ * objects, stack overflow or underflow - is an exit: native code stores
+ * IP of the instruction and returns, interpreter executes it and
+ * enters native code again on the next safepoint.
+ *
+ * So state is always in the thread and stacks, native code keeps
+ * nothing in registers between bytecode instructions. Backward jumps
+ * check for snapshot request and exit to let interpreter do the snap.
+ * GC is not affected, objects are touched by interpreter only.
+ *
+ * Compiled code is volatile, it hangs on pre-decoded code cache entry
+ * (see code_cache.c), which is empty after restart, and is compiled
+ * again when method gets hot.
+ *
+ * Code is put to kernel heap, which is executable. Hosted VM heap is
+ * not, so JIT is off there.
+ *
+ * Kernel debugger command: jit
  *
 **/
 
+#include <phantom_libc.h>
 #include <phantom_assert.h>
 #include <errno.h>
+#include <malloc.h>
+#include <string.h>
 
-#include "vm/root.h"
 #include "vm/internal_da.h"
-#include "vm/internal.h"
-#include "vm/object_flags.h"
-#include "vm/exception.h"
-#include "vm/alloc.h"
-
 #include "vm/exec.h"
 #include "vm/code.h"
 
-#include "vm/stacks.h"
-#include "vm/syscall.h"
+#include <kernel/init.h>
+#include <kernel/debug.h>
+#include <kernel/snap_sync.h>
+
+#include <hal.h>
 
 #include "ids/opcode_ids.h"
 
 #include "jit.h"
 
-static int debug_print_instr = 0;
+#if PVM_JIT
+
+
+#define JIT_CODE_MAX_BYTES      (4*1024*1024)   // all compiled code
+
+struct jit_patch
+{
+    unsigned int        pos;    // rel32 to patch
+    unsigned int        ip;     // bytecode target
+    int                 exit;   // jump to exit stub for ip, not to ip code
+};
+
+
+static hal_mutex_t  _jit_mutex;
+static hal_mutex_t  *jit_mutex; // 0 before threads start
+
+#define JIT_LOCK()      do { if(jit_mutex) hal_mutex_lock( jit_mutex ); } while(0)
+#define JIT_UNLOCK()    do { if(jit_mutex) hal_mutex_unlock( jit_mutex ); } while(0)
+
+static int              jit_enabled = 1;
+
+static int              jit_bytes;
+static int              jit_methods;
+static int              jit_failed;
+
+
+// Thread and stack fields we access
+
+#define OFF_IP          (__offsetof(struct data_area_4_thread, code) + __offsetof(struct pvm_code_handler, IP))
+#define OFF_ISTACK      __offsetof(struct data_area_4_thread, _istack)
+#define OFF_CURR_DA     __offsetof(struct data_area_4_integer_stack, curr_da)
+#define OFF_FCP         (__offsetof(struct data_area_4_integer_stack, common) + __offsetof(struct pvm_stack_da_common, free_cell_ptr))
+#define OFF_SSIZE       (__offsetof(struct data_area_4_integer_stack, common) + __offsetof(struct pvm_stack_da_common, __sSize))
+#define OFF_STACK       __offsetof(struct data_area_4_integer_stack, stack)
+
+
+
+// --------------------------------------------------------------------------
+// Emitter
+// --------------------------------------------------------------------------
+
+static void jit_grow( jit_out_t *j, unsigned int need )
+{
+    if( j->pos + need <= j->bufsize )
+        return;
+
+    unsigned int nsize = j->bufsize * 2 + need;
+    unsigned char *nbuf = malloc( nsize );
+    if( nbuf == 0 )
+    {
+        j->error = ENOMEM;
+        return;
+    }
+
+    memcpy( nbuf, j->buf, j->pos );
+    free( j->buf );
+    j->buf = nbuf;
+    j->bufsize = nsize;
+}
+
+// Does nothing after error, result is dropped anyway
+static void emit8( jit_out_t *j, unsigned char b )
+{
+    if( j->error )
+        return;
+
+    jit_grow( j, 1 );
+    if( j->error )
+        return;
+
+    j->buf[j->pos++] = b;
+}
+
+static void emit32( jit_out_t *j, u_int32_t v )
+{
+    emit8( j, v & 0xFF );
+    emit8( j, (v >> 8) & 0xFF );
+    emit8( j, (v >> 16) & 0xFF );
+    emit8( j, (v >> 24) & 0xFF );
+}
+
+static void emit_addr( jit_out_t *j, addr_t a )
+{
+    emit32( j, (u_int32_t)a );
+#if ARCH_amd64
+    emit32( j, (u_int32_t)(((u_int64_t)a) >> 32) );
+#endif
+}
+
+// REX.W for pointer sized operations
+static void emit_rexw( jit_out_t *j )
+{
+#if ARCH_amd64
+    emit8( j, 0x48 );
+#else
+    (void) j;
+#endif
+}
+
+
+static void jit_add_patch( jit_out_t *j, unsigned int ip, int exit )
+{
+    if( j->n_patch >= j->max_patch )
+    {
+        int nmax = j->max_patch * 2 + 16;
+        struct jit_patch *np = malloc( nmax * sizeof(struct jit_patch) );
+        if( np == 0 )
+        {
+            j->error = ENOMEM;
+            return;
+        }
+
+        if( j->patch )
+        {
+            memcpy( np, j->patch, j->n_patch * sizeof(struct jit_patch) );
+            free( j->patch );
+        }
+        j->patch = np;
+        j->max_patch = nmax;
+    }
+
+    if( j->error )
+        return;
+
+    j->patch[j->n_patch].pos = j->pos;
+    j->patch[j->n_patch].ip = ip;
+    j->patch[j->n_patch].exit = exit;
+    j->n_patch++;
+
+    emit32( j, 0 );
+}
+
+static void patch32( jit_out_t *j, unsigned int pos, unsigned int to )
+{
+    u_int32_t rel = to - (pos + 4);
+
+    j->buf[pos]   = rel & 0xFF;
+    j->buf[pos+1] = (rel >> 8) & 0xFF;
+    j->buf[pos+2] = (rel >> 16) & 0xFF;
+    j->buf[pos+3] = (rel >> 24) & 0xFF;
+}
+
 
+#define CC_B    0x2     // unsigned <
+#define CC_AE   0x3     // unsigned >=
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xC
+#define CC_GE   0xD
+#define CC_LE   0xE
+#define CC_G    0xF
 
-void jit_binary_op(
-                   struct jit_out *j,
-                   jit_value_t (*func)( struct jit_out *j, jit_value_t r_src, jit_value_t r_dst ) )
+// jcc rel32 to exit stub for ip
+static void jit_jcc_exit( jit_out_t *j, int cc, unsigned int ip )
 {
-    jit_value_t a1 = jit_is_pop( j );
-    jit_value_t a2 = jit_is_pop( j );
-    jit_value_t r = func( j, a1, a2 );
-    jit_is_push( j, r );
+    emit8( j, 0x0F ); emit8( j, 0x80 | cc );
+    jit_add_patch( j, ip, 1 );
 }
 
-void jit_unary_op(
-                   struct jit_out *j,
-                   jit_value_t  (*func)( struct jit_out *j, jit_value_t  r_src ) )
+static void jit_jmp_exit( jit_out_t *j, unsigned int ip )
 {
-    jit_is_push( j, func( j, jit_is_pop( j ) ) );
+    emit8( j, 0xE9 );
+    jit_add_patch( j, ip, 1 );
 }
 
+static void jit_jcc_ip( jit_out_t *j, int cc, unsigned int ip )
+{
+    emit8( j, 0x0F ); emit8( j, 0x80 | cc );
+    jit_add_patch( j, ip, 0 );
+}
+
+static void jit_jmp_ip( jit_out_t *j, unsigned int ip )
+{
+    emit8( j, 0xE9 );
+    jit_add_patch( j, ip, 0 );
+}
+
+// Forward jcc inside template, returns position to fix with jit_fix_here()
+static unsigned int jit_jcc_fwd( jit_out_t *j, int cc )
+{
+    emit8( j, 0x0F ); emit8( j, 0x80 | cc );
+    unsigned int pos = j->pos;
+    emit32( j, 0 );
+    return pos;
+}
+
+static void jit_fix_here( jit_out_t *j, unsigned int pos )
+{
+    if( !j->error )
+        patch32( j, pos, j->pos );
+}
+
+
+// cmp eax, imm32
+static void jit_cmp_eax_imm( jit_out_t *j, int v )
+{
+    emit8( j, 0x3D ); emit32( j, v );
+}
+
+// op reg, [ecx+disp32] - mod 10, rm ecx
+static void jit_op_ecx( jit_out_t *j, unsigned char op, int reg, int disp )
+{
+    emit8( j, op ); emit8( j, 0x81 | (reg << 3) ); emit32( j, disp );
+}
 
-errno_t jit_compile_method(struct pvm_code_handler *code)
+// op reg, [ecx+eax*4+disp32] - mod 10, rm SIB, SIB scale 4, index eax, base ecx
+static void jit_op_slot( jit_out_t *j, unsigned char op, int reg, int disp )
 {
+    emit8( j, op ); emit8( j, 0x84 | (reg << 3) ); emit8( j, 0x81 ); emit32( j, disp );
+}
+
+#define R_AX    0
+#define R_CX    1
+#define R_DX    2
+#define R_BX    3
+
+// Top of integer stack is [ecx+eax*4+TOP], next is [ecx+eax*4+TOP-4]
+#define TOP     (OFF_STACK-4)
+
+
+
+// --------------------------------------------------------------------------
+// Templates
+// --------------------------------------------------------------------------
 
-    struct jit_out      jo;
-    struct jit_out      *j = &jo;
 
-    //struct data_area_4_thread *da = (struct data_area_4_thread *)&(current_thread.data->da);
-    // TODO: check for current_thread to be thread for real
+// ecx = integer stack current page, eax = its free cell ptr
+static void jit_load_istack( jit_out_t *j )
+{
+    emit_rexw( j ); emit8( j, 0x8B ); emit8( j, 0x8B ); emit32( j, OFF_ISTACK );     // mov ecx, [ebx+_istack]
+    emit_rexw( j ); jit_op_ecx( j, 0x8B, R_CX, OFF_CURR_DA );                        // mov ecx, [ecx+curr_da]
+    jit_op_ecx( j, 0x8B, R_AX, OFF_FCP );                                            // mov eax, [ecx+fcp]
+}
 
-    // JITted code supposed to be called with da in BX
+static void jit_store_fcp( jit_out_t *j )
+{
+    jit_op_ecx( j, 0x89, R_AX, OFF_FCP );                                            // mov [ecx+fcp], eax
+}
 
-    //jit_gen_push( j, JIT_R_BX );
-    //jit_gen_call( j, JIT_F_LOAD_F_ACC );
-    //pvm_exec_load_fast_acc(da); // For any case
+// At least n cells on stack
+static void jit_need( jit_out_t *j, unsigned int ip, int n )
+{
+    jit_cmp_eax_imm( j, n );
+    jit_jcc_exit( j, CC_B, ip );
+}
 
+// Free cell on stack, page is replaced by interpreter if not
+static void jit_need_room( jit_out_t *j, unsigned int ip )
+{
+    jit_op_ecx( j, 0x3B, R_AX, OFF_SSIZE );                                          // cmp eax, [ecx+size]
+    jit_jcc_exit( j, CC_AE, ip );
+}
+
+static void jit_inc_eax( jit_out_t *j ) { emit8( j, 0xFF ); emit8( j, 0xC0 ); }
+static void jit_dec_eax( jit_out_t *j ) { emit8( j, 0xFF ); emit8( j, 0xC8 ); }
+
+
+static void jit_iconst( jit_out_t *j, unsigned int ip, int v )
+{
+    jit_load_istack( j );
+    jit_need_room( j, ip );
+    emit8( j, 0xC7 ); emit8( j, 0x84 ); emit8( j, 0x81 ); emit32( j, OFF_STACK ); emit32( j, v ); // mov [ecx+eax*4+stack], imm32
+    jit_inc_eax( j );
+    jit_store_fcp( j );
+}
+
+static void jit_is_dup( jit_out_t *j, unsigned int ip )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, 1 );
+    jit_need_room( j, ip );
+    jit_op_slot( j, 0x8B, R_DX, TOP );                                               // mov edx, top
+    jit_op_slot( j, 0x89, R_DX, OFF_STACK );                                         // mov [free cell], edx
+    jit_inc_eax( j );
+    jit_store_fcp( j );
+}
+
+// Pops n cells, then top is the last popped one
+static void jit_pop( jit_out_t *j, unsigned int ip, int n )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, n );
+    while( n-- > 0 )
+        jit_dec_eax( j );
+    jit_store_fcp( j );
+}
+
+// Binary op: b is popped to edx, result goes to a
+static void jit_binary_start( jit_out_t *j, unsigned int ip )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, 2 );
+    jit_dec_eax( j );
+    jit_store_fcp( j );
+    jit_op_slot( j, 0x8B, R_DX, OFF_STACK );                                         // mov edx, b
+}
+
+// a = a op b, op is one of add/sub/and/or/xor r/m32, r32
+static void jit_binary_rm( jit_out_t *j, unsigned int ip, unsigned char op )
+{
+    jit_binary_start( j, ip );
+    jit_op_slot( j, op, R_DX, TOP );                                                 // op a, edx
+}
+
+// a = b op a
+static void jit_binary_r( jit_out_t *j, unsigned int ip, unsigned char op1, unsigned char op2 )
+{
+    jit_binary_start( j, ip );
+    if( op1 ) emit8( j, op1 );
+    jit_op_slot( j, op2, R_DX, TOP );                                                // op edx, a
+    jit_op_slot( j, 0x89, R_DX, TOP );                                               // mov a, edx
+}
+
+// a = (a cc b)
+static void jit_compare( jit_out_t *j, unsigned int ip, int cc )
+{
+    jit_binary_start( j, ip );
+    jit_op_slot( j, 0x39, R_DX, TOP );                                               // cmp a, edx
+    emit8( j, 0x0F ); emit8( j, 0x90 | cc ); emit8( j, 0xC2 );                       // setcc dl
+    emit8( j, 0x0F ); emit8( j, 0xB6 ); emit8( j, 0xD2 );                            // movzx edx, dl
+    jit_op_slot( j, 0x89, R_DX, TOP );                                               // mov a, edx
+}
+
+static void jit_inot( jit_out_t *j, unsigned int ip )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, 1 );
+    jit_op_slot( j, 0xF7, 2, TOP );                                                  // not top
+}
+
+static void jit_is_get( jit_out_t *j, unsigned int ip, unsigned int pos )
+{
+    jit_load_istack( j );
+    jit_need_room( j, ip );
+    jit_op_ecx( j, 0x8B, R_DX, OFF_STACK + pos*4 );                                  // mov edx, [ecx+stack+pos*4]
+    jit_op_slot( j, 0x89, R_DX, OFF_STACK );                                         // mov [free cell], edx
+    jit_inc_eax( j );
+    jit_store_fcp( j );
+}
+
+static void jit_is_set( jit_out_t *j, unsigned int ip, unsigned int pos )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, 1 );
+    jit_dec_eax( j );
+    jit_store_fcp( j );
+    jit_op_slot( j, 0x8B, R_DX, OFF_STACK );                                         // mov edx, popped
+    jit_op_ecx( j, 0x89, R_DX, OFF_STACK + pos*4 );                                  // mov [ecx+stack+pos*4], edx
+}
+
+
+// Backward jump - exit to interpreter with IP = target if snapshot is requested
+static void jit_safepoint( jit_out_t *j, unsigned int target )
+{
+#if NEW_SNAP_SYNC
+    // Interpreter touches snap catch page, let it do
+    jit_jmp_exit( j, target );
+#else
+#  if ARCH_amd64
+    emit8( j, 0x48 ); emit8( j, 0xB8 ); emit_addr( j, (addr_t)&phantom_virtual_machine_snap_request ); // mov rax, imm64
+    emit8( j, 0x83 ); emit8( j, 0x38 ); emit8( j, 0x00 );                            // cmp dword [rax], 0
+#  else
+    emit8( j, 0x83 ); emit8( j, 0x3D ); emit_addr( j, (addr_t)&phantom_virtual_machine_snap_request ); emit8( j, 0x00 ); // cmp dword [addr], 0
+#  endif
+    jit_jcc_exit( j, CC_NE, target );
+#endif
+}
+
+static void jit_jump( jit_out_t *j, unsigned int ip, unsigned int target )
+{
+    if( target <= ip )
+        jit_safepoint( j, target );
+
+    jit_jmp_ip( j, target );
+}
+
+// Jump to target if flags are cc
+static void jit_branch( jit_out_t *j, unsigned int ip, unsigned int target, int cc )
+{
+    if( target > ip )
     {
-#warning resleep?
-    // Thread was snapped sleeping - resleep it
-        //if(da->sleep_flag)        phantom_thread_sleep_worker( da );
-        /*
-        jit_load_thread_field( j, offsetof(da->sleep_flag) ); // to AX, gen flags
-        jit_label jl = jit_get_label( j );
-        jit_jz( jl );
-
-        jit_gen_push( j, JIT_R_BX );
-        jit_gen_call( j, JIT_F_THREAD_SLEEP_WORKER );
-        jit_mark_label( j, jl );
-        */
+        jit_jcc_ip( j, cc, target );
+        return;
     }
 
-    while(1)
-    {
+    unsigned int skip = jit_jcc_fwd( j, cc ^ 1 ); // inverted condition
+    jit_jump( j, ip, target );
+    jit_fix_here( j, skip );
+}
 
-        /*
-        if(phantom_virtual_machine_snap_request)
-        {
-            pvm_exec_save_fast_acc(da); // Before snap
-            phantom_thread_wait_4_snap();
-            //pvm_exec_load_fast_acc(da); // We don't need this, if we die, we will enter again from above :)
-        }
-        */
+static void jit_jz( jit_out_t *j, unsigned int ip, unsigned int target )
+{
+    jit_pop( j, ip, 1 );
+    jit_op_slot( j, 0x8B, R_DX, OFF_STACK );                                         // mov edx, popped
+    emit8( j, 0x85 ); emit8( j, 0xD2 );                                              // test edx, edx
+    jit_branch( j, ip, target, CC_E );
+}
+
+static void jit_djnz( jit_out_t *j, unsigned int ip, unsigned int target )
+{
+    jit_load_istack( j );
+    jit_need( j, ip, 1 );
+    jit_op_slot( j, 0xFF, 1, TOP );                                                  // dec top
+    jit_branch( j, ip, target, CC_NE );
+}
+
+
+// Leave to interpreter, it will do this instruction
+static void jit_exit( jit_out_t *j, unsigned int ip )
+{
+    jit_jmp_exit( j, ip );
+}
+
+
+
+// --------------------------------------------------------------------------
+// Compiler
+// --------------------------------------------------------------------------
+
+
+static int jit_byte( jit_out_t *j, unsigned int ip ) { return j->d->code[ip]; }
+static int jit_int32( jit_out_t *j, unsigned int ip ) { return j->d->ops[ip]; }
+
+// Compiles one instruction, returns its size. Code is checked by
+// pre-decoder, so sizes and targets are correct.
+static unsigned int jit_compile_insn( jit_out_t *j, unsigned int ip )
+{
+    unsigned char op = jit_byte( j, ip );
 
+    switch( op )
+    {
+    case opcode_nop:            return 1;
+
+    case opcode_iconst_0:       jit_iconst( j, ip, 0 );                         return 1;
+    case opcode_iconst_1:       jit_iconst( j, ip, 1 );                         return 1;
+    case opcode_iconst_8bit:    jit_iconst( j, ip, jit_byte( j, ip+1 ) );       return 2;
+    case opcode_iconst_32bit:   jit_iconst( j, ip, jit_int32( j, ip+1 ) );      return 5;
+
+    case opcode_is_dup:         jit_is_dup( j, ip );                            return 1;
+    case opcode_is_drop:        jit_pop( j, ip, 1 );                            return 1;
+
+    case opcode_isum:           jit_binary_rm( j, ip, 0x01 );                   return 1;
+    case opcode_isublu:         jit_binary_rm( j, ip, 0x29 );                   return 1;
+    case opcode_isubul:         jit_binary_r( j, ip, 0, 0x2B );                 return 1;
+    case opcode_imul:           jit_binary_r( j, ip, 0x0F, 0xAF );              return 1;
+    case opcode_ior:            jit_binary_rm( j, ip, 0x09 );                   return 1;
+    case opcode_iand:           jit_binary_rm( j, ip, 0x21 );                   return 1;
+    case opcode_ixor:           jit_binary_rm( j, ip, 0x31 );                   return 1;
+    case opcode_inot:           jit_inot( j, ip );                              return 1;
+
+    case opcode_ige:            jit_compare( j, ip, CC_GE );                    return 1;
+    case opcode_ile:            jit_compare( j, ip, CC_LE );                    return 1;
+    case opcode_igt:            jit_compare( j, ip, CC_G );                     return 1;
+    case opcode_ilt:            jit_compare( j, ip, CC_L );                     return 1;
+
+    case opcode_is_get32:
+    case opcode_is_set32:
         {
-            jit_check_snap_request( j );
-            /*
-            jit_label jl = jit_get_label( j );
-            jit_jz( jl );
-
-            //jit_gen_push( j, JIT_R_BX );
-            jit_gen_call( j, JIT_F_WAIT_SNAP );
-            jit_mark_label( j, jl );
-            */
+            unsigned int pos = jit_int32( j, ip+1 );
+
+            // Page is never smaller, let interpreter check bigger ones
+            if( pos >= PVM_INTEGER_STACK_SIZE )
+                jit_exit( j, ip );
+            else if( op == opcode_is_get32 )
+                jit_is_get( j, ip, pos );
+            else
+                jit_is_set( j, ip, pos );
         }
+        return 5;
 
+    case opcode_jmp:            jit_jump( j, ip, jit_int32( j, ip+1 ) );        return 5;
+    case opcode_jz:             jit_jz( j, ip, jit_int32( j, ip+1 ) );          return 5;
+    case opcode_djnz:           jit_djnz( j, ip, jit_int32( j, ip+1 ) );        return 5;
+    }
 
-        jit_mark_possible_label(j);
+    jit_exit( j, ip );
+    return pvm_code_cache_insn_size( j->d, ip );
+}
 
-        unsigned char instruction = pvm_code_get_byte(code);
-        //printf("instr 0x%02X ", instruction);
 
+static void jit_prologue( jit_out_t *j )
+{
+    emit8( j, 0x53 );                                                                // push ebx
+#if ARCH_amd64
+    emit8( j, 0x48 ); emit8( j, 0x83 ); emit8( j, 0xEC ); emit8( j, 0x20 );          // sub rsp, 32 - keep alignment
+#  ifdef _WIN64
+    emit8( j, 0x48 ); emit8( j, 0x89 ); emit8( j, 0xCB );                            // mov rbx, rcx
+#  else
+    emit8( j, 0x48 ); emit8( j, 0x89 ); emit8( j, 0xFB );                            // mov rbx, rdi
+#  endif
+#else
+    emit8( j, 0x8B ); emit8( j, 0x5C ); emit8( j, 0x24 ); emit8( j, 0x08 );          // mov ebx, [esp+8]
+#endif
+}
 
-        switch(instruction)
-        {
-        case opcode_nop:
-            //if( debug_print_instr ) printf("nop; ");
-            break;
-
-        case opcode_debug:
-
-            {
-                int type = pvm_code_get_byte(code); //cf->cs.get_instr( cf->IP );
-
-                //printf("\n\nDebug 0x%02X", type );
-                if( type & 0x80 )
-                {
-                    //printf(" (" );
-                    pvm_object_t o = pvm_code_get_string(code);
-                    //pvm_object_print(o);
-                    ref_dec_o(o);
-                    //printf(")" );
-                }
-
-                if( type & 0x01 ) debug_print_instr = 1;
-                if( type & 0x02 ) debug_print_instr = 0;
-
-                /*
-                if( is_empty() ) printf(", istack empty");
-                else                    printf(",\n\tistack top = %d", is_top() );
-                if( os_empty() ) printf(", ostack empty");
-                else
-                {
-                    printf(",\n\tostack top = {" );
-                    pvm_object_print( os_top() );
-                    printf("}" );
-                }
-                printf(";\n\n");
-                */
-            }
-
-            break;
-
-
-            // int stack ops ---------------------------------------
-
-        case opcode_is_dup:
-            if( debug_print_instr ) printf("is dup; ");
-            jit_is_push( j, jit_is_top( j ) );
-            break;
-
-        case opcode_is_drop:
-            if( debug_print_instr ) printf("is drop; ");
-            jit_is_pop( j );
-            break;
-
-        case opcode_iconst_0:
-            if( debug_print_instr ) printf("iconst 0; ");
-            jit_is_push( j, jit_iconst( j, 0 ) );
-            break;
-
-        case opcode_iconst_1:
-            if( debug_print_instr ) printf("iconst 1; ");
-            jit_is_push( j, jit_iconst( j, 1 ) );
-            break;
-
-        case opcode_iconst_8bit:
-            {
-                int v = pvm_code_get_byte(code);
-                jit_is_push( j, jit_iconst( j, v ) );
-                if( debug_print_instr ) printf("iconst8 = %d; ", v);
-                break;
-            }
-
-        case opcode_iconst_32bit:
-            {
-                int v = pvm_code_get_int32(code);
-                jit_is_push( j, jit_iconst( j, v ) );
-                if( debug_print_instr ) printf("iconst32 = %d; ", v);
-                break;
-            }
-
-
-        case opcode_isum:
-            if( debug_print_instr ) printf("isum; ");
-            jit_binary_op( j, jit_gen_add );
-            break;
-
-        case opcode_imul:
-            if( debug_print_instr ) printf("imul; ");
-            {
-                //int mul = is_pop();
-                //is_push( is_pop() * mul );
-                jit_binary_op( j, jit_gen_mul );
-            }
-            break;
-
-        case opcode_isubul:
-            if( debug_print_instr ) printf("isubul; ");
-            {
-                jit_value_t u = jit_is_pop( j );
-                jit_value_t l = jit_is_pop( j );
-                jit_value_t r = jit_gen_sub( j, u, l );
-                jit_is_push( j, r );
-            }
-            break;
-
-        case opcode_isublu:
-            if( debug_print_instr ) printf("isublu; ");
-            {
-                jit_value_t u = jit_is_pop( j );
-                jit_value_t l = jit_is_pop( j );
-                jit_value_t r = jit_gen_sub( j, l, u );
-                jit_is_push( j, r );
-            }
-            break;
-
-        case opcode_idivul:
-            if( debug_print_instr ) printf("idivul; ");
-            {
-                jit_value_t u = jit_is_pop( j );
-                jit_value_t l = jit_is_pop( j );
-                jit_value_t r = jit_gen_div( j, u, l );
-                jit_is_push( j, r );
-            }
-            break;
-
-        case opcode_idivlu:
-            if( debug_print_instr ) printf("idivlu; ");
-            {
-                jit_value_t u = jit_is_pop( j );
-                jit_value_t l = jit_is_pop( j );
-                jit_value_t r = jit_gen_div( j, l, u );
-                jit_is_push( j, r );
-            }
-            break;
-
-        case opcode_ior:
-            if( debug_print_instr ) printf("ior; ");
-            //{ int operand = is_pop();	is_push( is_pop() | operand ); }
-            jit_binary_op( j, jit_gen_binor );
-            break;
-
-        case opcode_iand:
-            if( debug_print_instr ) printf("iand; ");
-            //{ int operand = is_pop();	is_push( is_pop() & operand ); }
-            jit_binary_op( j, jit_gen_binand );
-            break;
-
-        case opcode_ixor:
-            if( debug_print_instr ) printf("ixor; ");
-            //{ int operand = is_pop();	is_push( is_pop() ^ operand ); }
-            jit_binary_op( j, jit_gen_binxor );
-            break;
-
-        case opcode_inot:
-            if( debug_print_instr ) printf("inot; ");
-            jit_unary_op( j, jit_gen_binnot );
-            break;
-
-
-
-        case opcode_log_or:
-            if( debug_print_instr ) printf("lor; ");
-            jit_binary_op( j, jit_gen_logor );
-            break;
-
-        case opcode_log_and:
-            if( debug_print_instr ) printf("land; ");
-            jit_binary_op( j, jit_gen_logand );
-            break;
-
-        case opcode_log_xor:
-            if( debug_print_instr ) printf("lxor; ");
-            jit_binary_op( j, jit_gen_logxor );
-            break;
-
-        case opcode_log_not:
-            if( debug_print_instr ) printf("lnot; ");
-            jit_unary_op( j, jit_gen_lognot );
-            break;
-
-
-        case opcode_ige:	// >=
-            if( debug_print_instr ) printf("ige; ");
-            jit_binary_op( j, jit_gen_ige );
-            break;
-        case opcode_ile:	// <=
-            if( debug_print_instr ) printf("ile; ");
-            jit_binary_op( j, jit_gen_ile );
-            break;
-        case opcode_igt:	// >
-            if( debug_print_instr ) printf("igt; ");
-            jit_binary_op( j, jit_gen_igt );
-            break;
-        case opcode_ilt:	// <
-            if( debug_print_instr ) printf("ilt; ");
-            jit_binary_op( j, jit_gen_ilt );
-            break;
-
-
-
-        case opcode_i2o:
-            if( debug_print_instr ) printf("i2o; ");
-            jit_push_arg( j, jit_is_pop( j ) );
-            jit_os_push( j, jit_gen_call( j, JIT_F_CREATE_INT_OBJ ) );
-            break;
-
-        case opcode_o2i:
-            if( debug_print_instr ) printf("o2i; ");
-            {
-                jit_is_push( j, jit_o2int( j, jit_os_pop( j ) ) );// push AX
-                //jit_refdec( j ); // TODO jit_o2int must refdec?
-            }
-            break;
-
-
-        case opcode_os_eq:
-            if( debug_print_instr ) printf("os eq; ");
-            {
-                jit_value_t v1 = jit_os_pop( j );
-                jit_value_t v2 = jit_os_pop( j );
-
-                jit_is_push( j, jit_gen_cmp( j, v1, v2 ) );
-
-                jit_refdec( j, v1 );
-                jit_refdec( j, v2 );
-
-                break;
-            }
-
-        case opcode_os_neq:
-            if( debug_print_instr ) printf("os neq; ");
-            {
-                jit_value_t v1 = jit_os_pop( j );
-                jit_value_t v2 = jit_os_pop( j );
-
-                jit_is_push( j, jit_gen_lognot( j, jit_gen_cmp( j, v1, v2 )) );
-
-                jit_refdec( j, v1 );
-                jit_refdec( j, v2 );
-
-                break;
-            }
-
-        case opcode_os_isnull:
-            if( debug_print_instr ) printf("isnull; ");
-            {
-                jit_value_t o1 = jit_os_pop( j );
-                jit_is_push( j, jit_is_null( j, o1 ) );
-                jit_refdec( j, o1 );
-                break;
-            }
-
-        case opcode_os_push_null:
-        case opcode_summon_null:
-            if( debug_print_instr ) printf("push null; ");
-            {
-                jit_os_push( j, jit_get_null( j ) );
-                break;
-            }
-
-            // summoning, special ----------------------------------------------------
-
-        case opcode_summon_thread:
-            if( debug_print_instr ) printf("summon thread; ");
-            jit_os_push( j, jit_get_thread( j ) );
-            break;
-
-        case opcode_summon_this:
-            if( debug_print_instr ) printf("summon this; ");
-            jit_os_push( j, jit_refinc( j, jit_get_this( j ) ) );
-            break;
-
-        case opcode_summon_class_class:
-            if( debug_print_instr ) printf("summon class class; ");
-            jit_os_push( j, jit_get_class_class( j ) );
-            break;
-
-        case opcode_summon_interface_class:
-            if( debug_print_instr ) printf("summon interface class; ");
-            // locked refcnt
-            jit_os_push( j, jit_get_iface_class( j ) );
-            break;
-
-        case opcode_summon_code_class:
-            if( debug_print_instr ) printf("summon code class; ");
-            // locked refcnt
-            jit_os_push( j, jit_get_code_class( j ) );
-            break;
-
-        case opcode_summon_int_class:
-            if( debug_print_instr ) printf("summon int class; ");
-            // locked refcnt
-            jit_os_push( j, jit_get_int_class( j ) );
-            break;
-
-        case opcode_summon_string_class:
-            if( debug_print_instr ) printf("summon string class; ");
-            // locked refcnt
-            jit_os_push( j, jit_get_string_class( j ) );
-            break;
-
-        case opcode_summon_array_class:
-            if( debug_print_instr ) printf("summon array class; ");
-            // locked refcnt
-            jit_os_push( j, jit_get_array_class( j ) );
-            break;
-
-            // TODO we can turn class to const, but the we have to keep refcount for it in
-            // const space and release when we release compiled code
-            // TODO const list is just an array? easy to release all
-
-        case opcode_summon_by_name:
-            {
-                if( debug_print_instr ) printf("summon by name; ");
-
-                struct pvm_object name = pvm_code_get_string(code);
-                struct pvm_object cl = pvm_exec_lookup_class_by_name( name ); // TODO XXX must inc ref
-                ref_dec_o(name);
-
-                // Need throw here?
-
-                if( pvm_is_null( cl ) ) {
-                    printf("JIT: summon by name: null class\n");
-                    return ENOENT;
-
-                    // TODO XXX generate summon in run time?
-
-                }
-                int cid = jit_alloc_const( j, cl );
-                jit_os_push( j, jit_get_const( j, cid ) );
-
-            }
-            break;
-
-            /**
-             * A BIG NOTE for object creation
-             *
-             * We must be SURE that it is NOT ever possible to pass
-             * non-internal object as init data to internal and vice versa!
-             * It would be a securily hole!
-             *
-             **/
-
-
-        case opcode_new:
-            if( debug_print_instr ) printf("new; ");
-            {
-                //pvm_object_t cl = os_pop();
-                //os_push( pvm_create_object( cl ) );
-                //ref_dec_o( cl );  // object keep class ref
-
-                jit_os_pop( j );// pop AX, DX
-                jit_os_push( j, jit_gen_call( j, JIT_F_CREATE_OBJ ) );// push AX, DX
-            }
-            break;
-
-        case opcode_copy:
-            if( debug_print_instr ) printf("copy; ");
-            {
-                jit_push_arg( j, jit_os_pop( j ) );
-                jit_os_push( j, jit_gen_call( j, JIT_F_COPY_OBJ ) );
-                // jit_refdec( j, JIT_R_CX ); XXX TODO need?
-            }
-            break;
-
-            // if you want to enable these, work out refcount
-            // and security issues first!
-            // compose/decompose
-#if 0
-        case opcode_os_compose32:
-            if( debug_print_instr ) printf(" compose32; ");
-            {
-                int num = pvm_code_get_int32(code);
-                struct pvm_object in_class = os_pop();
-                os_push( pvm_exec_compose_object( in_class, da->_ostack, num ) );
-            }
-            break;
-
-        case opcode_os_decompose:
-            if( debug_print_instr ) printf(" decompose; ");
-            {
-                struct pvm_object to_decomp = os_pop();
-                int num = da_po_limit(to_decomp.data);
-                is_push( num );
-                while( num )
-                {
-                    num--;
-                    struct pvm_object o = pvm_get_ofield( to_decomp, num);
-                    os_push( ref_inc_o( o ) );
-                }
-                os_push(to_decomp.data->_class);
-            }
-            break;
+static void jit_epilogue( jit_out_t *j )
+{
+#if ARCH_amd64
+    emit8( j, 0x48 ); emit8( j, 0x83 ); emit8( j, 0xC4 ); emit8( j, 0x20 );          // add rsp, 32
 #endif
-            // string ----------------------------------------------------------------
-
-        case opcode_sconst_bin:
-            if( debug_print_instr ) printf("sconst bin; ");
-            //os_push(pvm_code_get_string(code));
-            {
-                int constid = jit_alloc_const( j, pvm_code_get_string( code ) );
-                jit_os_push( j, jit_get_const( j, constid ) );
-            }
-            break;
-
-
-            // flow ------------------------------------------------------------------
-
-        case opcode_jmp:
-            {
-                int newip = pvm_code_get_rel_IP_as_abs(code);
-                if( debug_print_instr ) printf("jmp %d; ", newip );
-                //da->code.IP = pvm_code_get_rel_IP_as_abs(code);
-                jit_jump( j, newip );
-            }
-            break;
-
-
-        case opcode_djnz:
-            {
-                if( debug_print_instr ) printf("djnz " );
-                int newip = pvm_code_get_rel_IP_as_abs(code);
-
-                //is_push( is_pop() - 1 );
-                jit_decrement( j, jit_is_top(j) );
-                jit_jnz( j, newip, jit_is_top(j) );
-
-                //if( debug_print_instr ) printf("(%d) -> %d; ", is_top() , new_IP );
-            }
-            break;
-
-        case opcode_jz:
-            {
-                if( debug_print_instr ) printf("jz " );
-                int newip = pvm_code_get_rel_IP_as_abs(code);
-                jit_jz( j, newip, jit_is_pop(j) );
-            }
-            break;
-
-
-        case opcode_switch:
-            {
-#warning impl
-                /*
-                if( debug_print_instr ) printf("switch ");
-                unsigned int tabsize    = pvm_code_get_int32(code);
-                int shift               = pvm_code_get_int32(code);
-                unsigned int divisor    = pvm_code_get_int32(code);
-                int stack_top = is_pop();
-
-                if( debug_print_instr ) printf("(%d+%d)/%d, ", stack_top, shift, divisor );
-
-
-                unsigned int start_table_IP = da->code.IP;
-                unsigned int displ = (stack_top+shift)/divisor;
-                unsigned int new_IP = start_table_IP+(tabsize*4); // default
-
-                if( debug_print_instr ) printf("displ %d, etab addr %d ", displ, new_IP );
-
-
-                if( displ < tabsize )
-                {
-                    da->code.IP = start_table_IP+(displ*4); // BUG! 4!
-                    if( debug_print_instr ) printf("load from %d, ", da->code.IP );
-                    new_IP = pvm_code_get_rel_IP_as_abs(code);
-                }
-                da->code.IP = new_IP;
-
-                if( debug_print_instr ) printf("switch(%d) ->%d; ", displ, new_IP );
-                */
-                printf("no switch yet");
-                return ENXIO;
-            }
-            break;
-
-
-        case opcode_ret:
-            {
-                if( debug_print_instr ) printf( "\nret\n" );
-                jit_ret(j);
-            }
-            break;
-
-            // exceptions are like ret ---------------------------------------------------
-
-        case opcode_throw:
-            if( debug_print_instr ) printf( "\nthrow\n" );
-            jit_throw(j, jit_os_pop(j) );
-            break;
-
-        case opcode_push_catcher:
-            {
-                unsigned addr = pvm_code_get_rel_IP_as_abs(code);
-                if( debug_print_instr ) printf("push catcher %u; ", addr );
-                jit_es_push( j, jit_os_pop(j), addr );
-            }
-            break;
-
-        case opcode_pop_catcher:
-            if( debug_print_instr ) printf("pop catcher; ");
-            jit_refdec( j, jit_es_pop(j) );
-            break;
-
-            // ok, now method calls ------------------------------------------------------
-
-            // these 4 are parameter-less calls!
-        case opcode_short_call_0:
-            jit_os_push( j, jit_call_method( j, 0, 0, 1) );
-            break;
-        case opcode_short_call_1:
-            jit_os_push( j, jit_call_method( j, 1, 0, 1) );
-            break;
-        case opcode_short_call_2:
-            jit_os_push( j, jit_call_method( j, 2, 0, 1) );
-            break;
-        case opcode_short_call_3:
-            jit_os_push( j, jit_call_method( j, 3, 0, 1) );
-            break;
-
-        case opcode_call_8bit:
-            {
-                unsigned int method_index = pvm_code_get_byte(code);
-                unsigned int n_param = pvm_code_get_int32(code);
-                jit_os_push( j, jit_call_method( j, method_index, n_param, 1) ); // optimization for soon return
-            }
-            break;
-        case opcode_call_32bit:
-            {
-                unsigned int method_index = pvm_code_get_int32(code);
-                unsigned int n_param = pvm_code_get_int32(code);
-                jit_os_push( j, jit_call_method( j, method_index, n_param, 1) ); // optimization for soon return
-            }
-            break;
-
-
-            // object stack --------------------------------------------------------------
-
-        case opcode_os_dup:
-            if( debug_print_instr ) printf("os dup; ");
-            jit_os_push( j, jit_refinc( j, jit_os_top( j ) ) );
-            break;
-
-        case opcode_os_drop:
-            if( debug_print_instr ) printf("os drop; ");
-            jit_refdec( j, jit_os_pop( j ) );
-            break;
-
-        case opcode_os_pull32:
-            if( debug_print_instr ) printf("os pull; ");
-            {
-                int pos = pvm_code_get_int32(code);
-                jit_os_push( j, jit_refinc( j, jit_os_pull( j, pos ) )  ); // TODO XXX load must refinc!
-            }
-            break;
-
-        case opcode_os_load8:
-            {
-                int slot = pvm_code_get_byte(code);
-                jit_os_push( j, jit_os_load( j, slot ) ); // TODO XXX load must refinc!
-            }
-            break;
-
-        case opcode_os_load32:
-            {
-                int slot = pvm_code_get_int32(code);
-                jit_os_push( j, jit_os_load( j, slot ) ); // TODO XXX load must refinc!
-                break;
-            }
-
-        case opcode_os_save8:
-            {
-                int slot = pvm_code_get_byte(code);
-                jit_os_save( j, slot, jit_os_pop( j ) );
-            }
-            break;
-
-        case opcode_os_save32:
-            {
-                int slot = pvm_code_get_int32(code);
-                jit_os_save( j, slot, jit_os_pop( j ) );
-            }
-            break;
-
-        case opcode_is_load8:
-            //pvm_exec_iload(da, pvm_code_get_byte(code));
-            {
-                int slot = pvm_code_get_byte(code);
-                jit_value_t ov = jit_os_load( j, slot );
-                jit_value_t iv = jit_o2int( j, ov ); // TODO XXX jit_o2int must gen refdec
-                jit_is_push( j, iv );
-            }
-            break;
-
-        case opcode_is_save8:
-            {
-                int slot = pvm_code_get_byte(code);
-                jit_push_arg( j, jit_is_pop( j ) ); // TODO arg is int?
-                // pvm_create_int_object
-                jit_os_save( j, slot, jit_gen_call( j, JIT_F_CREATE_INT_OBJ ) );
-            }
-            break;
-
-        case opcode_os_get32:
-            {
-                int pos = pvm_code_get_int32(code);
-                jit_value_t v = jit_os_absget( j, pos ); // AX, DX = obj
-                //jit_refinc( j, v ); // TODO XXX must not be needed - absget must inc!
-                jit_os_push( j, v );
-            }
-            break;
-
-        case opcode_os_set32:
-            {
-                int pos = pvm_code_get_int32(code);
-                jit_os_absset( j, pos, jit_os_pop( j ) );
-            }
-            break;
-
-        case opcode_is_get32:
-            {
-                int pos = pvm_code_get_int32(code);
-                jit_is_push( j, jit_is_absget( j, pos ) );
-            }
-            break;
-        case opcode_is_set32:
-            {
-                int pos = pvm_code_get_int32(code);
-                jit_is_absset( j, pos, jit_is_pop( j ) );
-            }
-            break;
-
-        default:
-            if( (instruction & 0xF0 ) == opcode_sys_0 )
-            {
-                jit_sys( j, instruction & 0x0F);
-                /*
-    sys_sleep:
-                // Only sys can put thread asleep
-                // If we are snapped here we, possibly, will continue from
-                // the entry to this func. So save fasc acc and recheck
-                // sleep condition on the func entry.
-                if(da->sleep_flag)
-                {
-                    pvm_exec_save_fast_acc(da); // Before snap
-                    phantom_thread_sleep_worker( da );
-                }
-                break;
-                */
-            }
-
-            if( instruction  == opcode_sys_8bit )
-            {
-                jit_sys( j, pvm_code_get_byte(code)); 
-                //goto sys_sleep;
-                break;
-            }
-
-            if( (instruction & 0xE0 ) == opcode_call_00 )
-            {
-                unsigned int n_param = pvm_code_get_byte(code);
-                jit_os_push( j, jit_call_method( j, instruction & 0x1F, n_param, 0) ); //no optimization for soon return
-                break;
-            }
-
-            printf("JIT: Unknown op code 0x%X\n", instruction );
-
-            return ENOENT;
+    emit8( j, 0x5B );                                                                // pop ebx
+    emit8( j, 0xC3 );                                                                // ret
+}
+
+// Jump through the map of IP to native code address
+static unsigned int jit_dispatch( jit_out_t *j, void **map )
+{
+    emit8( j, 0x8B ); emit8( j, 0x83 ); emit32( j, OFF_IP );                         // mov eax, [ebx+IP]
+    jit_cmp_eax_imm( j, j->d->size );
+    unsigned int out = jit_jcc_fwd( j, CC_AE );
+#if ARCH_amd64
+    emit8( j, 0x48 ); emit8( j, 0xB9 ); emit_addr( j, (addr_t)map );                // mov rcx, imm64
+    emit8( j, 0xFF ); emit8( j, 0x24 ); emit8( j, 0xC1 );                            // jmp [rcx+rax*8]
+#else
+    emit8( j, 0xFF ); emit8( j, 0x24 ); emit8( j, 0x85 ); emit_addr( j, (addr_t)map ); // jmp [eax*4+map]
+#endif
+    return out;
+}
+
+
+static errno_t jit_do_compile( jit_out_t *j )
+{
+    struct pvm_code_decoded *d = j->d;
+    unsigned int ip;
+
+    // Map is allocated first, as dispatch code has its address
+    void **map = malloc( d->size * sizeof(void *) );
+    if( map == 0 )
+        return ENOMEM;
+
+    jit_prologue( j );
+    unsigned int out = jit_dispatch( j, map );
+
+    for( ip = 0; ip < d->size && !j->error; )
+    {
+        j->label[ip] = j->pos;
+        ip += jit_compile_insn( j, ip );
+    }
+
+    // Falls off the end of code - interpreter will complain
+    jit_exit( j, d->size );
+
+    // Exit stubs, one per jump, not worth sharing
+    unsigned int epilogue = j->pos;
+    jit_fix_here( j, out );
+    jit_epilogue( j );
+
+    int i;
+    for( i = 0; i < j->n_patch && !j->error; i++ )
+    {
+        struct jit_patch *p = j->patch + i;
+
+        if( !p->exit )
+        {
+            patch32( j, p->pos, j->label[p->ip] );
+            continue;
         }
+
+        patch32( j, p->pos, j->pos );
+        emit8( j, 0xC7 ); emit8( j, 0x83 ); emit32( j, OFF_IP ); emit32( j, p->ip );  // mov dword [ebx+IP], ip
+        emit8( j, 0xE9 ); emit32( j, 0 );                                            // jmp epilogue
+        if( !j->error ) patch32( j, j->pos - 4, epilogue );
+    }
+
+    if( j->error || jit_bytes + j->pos > JIT_CODE_MAX_BYTES )
+    {
+        free( map );
+        return j->error ? j->error : ENOMEM;
     }
+
+    // Code is position independent but for the map
+    unsigned char *code = malloc( j->pos );
+    if( code == 0 )
+    {
+        free( map );
+        return ENOMEM;
+    }
+
+    memcpy( code, j->buf, j->pos );
+
+    // Not an instruction start - just leave
+    for( ip = 0; ip < d->size; ip++ )
+        map[ip] = code + (j->label[ip] >= 0 ? (unsigned)j->label[ip] : epilogue);
+
+    // Free is not under JIT lock
+    __sync_fetch_and_add( &jit_bytes, j->pos );
+
+    d->jit_bytes = j->pos;
+    d->jit_mem = map;
+    __sync_synchronize();
+    d->jit_entry = (void *)code;
+
+    return 0;
 }
 
 
+errno_t jit_compile_method( struct pvm_code_decoded *d )
+{
+    jit_out_t jo;
+    errno_t rc;
+    unsigned int ip;
 
-#endif
+    if( d == 0 || d->invalid )
+        return EINVAL;
+
+    if( !jit_enabled || !phantom_is_a_real_kernel() )
+        return ENXIO;
+
+    JIT_LOCK();
+
+    if( d->jit_entry )
+    {
+        JIT_UNLOCK();
+        return 0;
+    }
+
+    memset( &jo, 0, sizeof(jo) );
+    jit_init_unit( &jo );
+    jo.d = d;
+    jo.bufsize = d->size * 32 + 256;
+    jo.buf = malloc( jo.bufsize );
+    jo.label = malloc( d->size * sizeof(int) );
+
+    if( jo.buf == 0 || jo.label == 0 )
+        rc = ENOMEM;
+    else
+    {
+        for( ip = 0; ip < d->size; ip++ )
+            jo.label[ip] = -1;
+
+        rc = jit_do_compile( &jo );
+    }
+
+    if( rc ) jit_failed++; else __sync_fetch_and_add( &jit_methods, 1 );
+
+    JIT_UNLOCK();
+
+    if( jo.buf ) free( jo.buf );
+    if( jo.label ) free( jo.label );
+    if( jo.patch ) free( jo.patch );
+
+    return rc;
+}
+
+
+void jit_free_method( struct pvm_code_decoded *d )
+{
+    if( d->jit_entry == 0 )
+        return;
+
+    __sync_fetch_and_sub( &jit_bytes, d->jit_bytes );
+
+    free( (void *)d->jit_entry );
+    free( d->jit_mem );
+
+    d->jit_entry = 0;
+    d->jit_mem = 0;
+    __sync_fetch_and_sub( &jit_methods, 1 );
+}
+
+
+int jit_enable( int on )
+{
+    int was = jit_enabled;
+    jit_enabled = on;
+    return was;
+}
+
+
+// jit [on|off]
+static void jit_dump_stats( int ac, char **av )
+{
+    if( ac > 1 )
+        jit_enable( 0 == strcmp( av[1], "on" ) );
+
+    printf("JIT %s: %d methods compiled, %d failed, %d of %d Kbytes used, threshold %d calls\n",
+           jit_enabled ? "on" : "off",
+           jit_methods, jit_failed, jit_bytes / 1024, JIT_CODE_MAX_BYTES / 1024, PVM_JIT_THRESHOLD );
+}
+
+
+static void jit_module_init(void)
+{
+    if( hal_mutex_init( &_jit_mutex, "JIT" ) )
+        panic("Can't init JIT mutex");
+
+    jit_mutex = &_jit_mutex;
+
+    dbg_add_command( jit_dump_stats, "jit", "JIT compiler statistics, jit on|off to switch it");
+}
+
+INIT_ME( 0, jit_module_init, 0 )
+
+
+#else // PVM_JIT
+
+
+errno_t jit_compile_method( struct pvm_code_decoded *d )
+{
+    (void) d;
+    return ENXIO;
+}
+
+void jit_free_method( struct pvm_code_decoded *d )
+{
+    (void) d;
+}
+
+int jit_enable( int on )
+{
+    (void) on;
+    return 0;
+}
+
+
+#endif // PVM_JIT
@@ -14,34 +14,39 @@
 #define JIT_H
 
 #include <sys/types.h>
+#include <errno.h>
 #include "vm/internal_da.h"
+#include "vm/code.h"
 
 void jit_init(void);
 
-//! Compile JIT code for class
-//void jit_compile_class(struct data_area_4_class *da);
+//! Compile JIT code for method, code must be pre-decoded (see code_cache.c)
+errno_t jit_compile_method( struct pvm_code_decoded *d );
 
-//! Compile JIT code for method
-errno_t jit_compile_method(struct pvm_code_handler *code);
+//! Release compiled code, code object is freed
+void jit_free_method( struct pvm_code_decoded *d );
 
-/*!
- *
- * struct data_area_4_class *da - class
- * void *b_code                 - method bytecode
- * int bc_size                  - size of bytecode
- * pvm_object_t out             - output (binary) variable to put binary code to
- *
- */
-//void jit_compile_method( struct data_area_4_class *da, void *b_code, int bc_size, pvm_object_t out );
+//! Switch compilation of new methods on or off, returns previous state
+int jit_enable( int on );
 
 // --------------------------------------------------------------------------
 // Enter/leave JIT code
 // --------------------------------------------------------------------------
 
 
+// JIT code is entered with thread da as the only argument, starts at
+// da->code.IP and returns with da->code.IP set to the first bytecode
+// instruction it does not compile, or after a backward jump if snapshot
+// is requested. Interpreter continues from there.
+//
 // JIT code runs with:
 // BX = thread da
-// ?? = this
+// CX = integer stack current page, AX = its free cell ptr, DX = scratch
+
+static inline void jit_run( struct data_area_4_thread *da )
+{
+    da->_decoded->jit_entry( da );
+}
 
 
 
@@ -83,166 +88,30 @@ enum jit_callable
 
 struct jit_out
 {
-    //! Next label id
-    //int 	nextLabel;
+    //! Native code buffer
+    unsigned char *	buf;
+    unsigned int        pos;    // Current put pos
+    unsigned int        bufsize;
 
-    // Code buffer
-    //char *	buf;
-    //char *	bufp; // Current put pos
-    //int   	bufsize;
+    //! Bytecode being compiled
+    struct pvm_code_decoded *   d;
 
-    // map of interpreted IP to asm instr offset
-
-    // map of callable kernel funcs - id to func
-};
-
-
-typedef struct jit_out jit_out_t;
+    //! Map of interpreted IP to native code offset, -1 if not an instruction start
+    int *               label;
 
+    //! Jumps to patch: rel32 position and bytecode target
+    struct jit_patch *  patch;
+    int                 n_patch;
+    int                 max_patch;
 
-struct jit_value
-{
+    int                 error;
 };
 
-typedef struct jit_value jit_value_t;
-
-
-
-// --------------------------------------------------------------------------
-// Misc
-// --------------------------------------------------------------------------
-
-// Store curr IP as possible jump target
-void  jit_mark_possible_label(jit_out_t *j);
-
-
-jit_value_t jit_o2int( jit_out_t *j, jit_value_t v );
-jit_value_t jit_gen_isnull( jit_out_t *j, jit_value_t ); // dst = (dst == 0)
-void jit_check_snap_request( jit_out_t *j );
-
-// TODO const list is just an array? easy to release all
-int jit_alloc_const( jit_out_t *j, pvm_object_t s );
-jit_value_t jit_get_const( jit_out_t *j, int id );
-
-
-void jit_push_arg( jit_out_t *j, jit_value_t v );
-jit_value_t jit_gen_call( jit_out_t *, enum jit_callable );
-
-jit_value_t jit_call_method( jit_out_t *j, int n_method, int n_param, int flags );
-
-
-void jit_ret( jit_out_t *j );
-void jit_throw( jit_out_t *j, jit_value_t v );
-
-jit_value_t jit_sys( jit_out_t *, int nsys ); // TODO fall asleep there
-
-
-void jit_jump( jit_out_t *j, int newip );
-void jit_jnz( jit_out_t *j, int newip, jit_value_t v );
-void jit_jz( jit_out_t *j, int newip, jit_value_t v );
-
-void jit_decrement( jit_out_t *j, jit_value_t v );
-
-
-
-
-// --------------------------------------------------------------------------
-// I Stack
-// --------------------------------------------------------------------------
-
-
-jit_value_t jit_is_pop( jit_out_t *j );
-void        jit_is_push( jit_out_t *j, jit_value_t );
-jit_value_t jit_is_top( jit_out_t *j );
-jit_value_t jit_iconst( jit_out_t *j, int const);
 
-jit_value_t jit_is_load( jit_out_t *j, int slot );
-jit_value_t jit_is_pull( jit_out_t *j, int slot );
-jit_value_t jit_is_absget( jit_out_t *j, int slot );
-
-jit_value_t jit_is_save( jit_out_t *j, int slot, jit_value_t  );
-jit_value_t jit_is_absset( jit_out_t *j, int slot, jit_value_t );
-
-
-// --------------------------------------------------------------------------
-// O Stack
-// --------------------------------------------------------------------------
-
-void        jit_os_push( jit_out_t *j, jit_value_t );
-jit_value_t jit_os_pop( jit_out_t *j );
-jit_value_t jit_os_top( jit_out_t *j );
-
-jit_value_t jit_os_load( jit_out_t *j, int slot );
-jit_value_t jit_os_pull( jit_out_t *j, int slot );
-jit_value_t jit_os_absget( jit_out_t *j, int slot );
-
-jit_value_t jit_os_save( jit_out_t *j, int slot, jit_value_t  );
-jit_value_t jit_os_absset( jit_out_t *j, int slot, jit_value_t );
-
-
-// --------------------------------------------------------------------------
-// E Stack
-// --------------------------------------------------------------------------
-
-void jit_es_push( jit_out_t *j, jit_value_t type, int addr );
-jit_value_t  jit_es_pop( jit_out_t *j );
-
-
-// --------------------------------------------------------------------------
-// Ref inc/dec
-// --------------------------------------------------------------------------
-
-
-jit_value_t jit_refinc( jit_out_t *j, jit_value_t );
-void jit_refdec( jit_out_t *j, jit_value_t );
-
-
-// --------------------------------------------------------------------------
-// Summon
-// --------------------------------------------------------------------------
-
-jit_value_t jit_get_null( jit_out_t *j );
-jit_value_t jit_get_thread( jit_out_t *j );
-jit_value_t jit_get_this( jit_out_t *j ); 
-jit_value_t jit_get_class_class( jit_out_t *j );
-jit_value_t jit_get_iface_class( jit_out_t *j );
-jit_value_t jit_get_code_class( jit_out_t *j );
-jit_value_t jit_get_int_class( jit_out_t *j );
-jit_value_t jit_get_string_class( jit_out_t *j );
-jit_value_t jit_get_array_class( jit_out_t *j );
-
-
-// --------------------------------------------------------------------------
-// ops
-// --------------------------------------------------------------------------
-
-
-
-jit_value_t jit_gen_binor( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_binand( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_binxor( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_logor( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_logand( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_logxor( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_ige( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_ile( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_igt( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_ilt( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_add( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_sub( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_mul( struct jit_out *j, jit_value_t a, jit_value_t b );
-jit_value_t jit_gen_div( struct jit_out *j, jit_value_t a, jit_value_t b );
-
-jit_value_t jit_gen_cmp( struct jit_out *j, jit_value_t a, jit_value_t b );
-//jit_value_t jit_gen_neg( struct jit_out *j, jit_value_t a );
-
-jit_value_t jit_gen_binnot( struct jit_out *j, jit_value_t a );
-jit_value_t jit_gen_lognot( struct jit_out *j, jit_value_t a );
+typedef struct jit_out jit_out_t;
 
-jit_value_t jit_is_null( struct jit_out *j, jit_value_t a );
+int jit_init_unit( jit_out_t *j );
 
 
 
 #endif // JIT_H
-
-
@@ -108,6 +108,10 @@ pvm_load_method( struct method_loader_handler *mh, const unsigned char *data, in
     //if(debug_print) printf("code size %d, IP = %d, in_size = %d\n", code_size, IP, in_size );
 
     mh->my_code = pvm_create_code_object( code_size, (void *)code_data );
+
+    // Decode now rather than on the first call
+    struct data_area_4_code *cda = (struct data_area_4_code *)&(mh->my_code.data->da);
+    pvm_code_cache_get( cda->code, cda->code_size );
 }
 
 
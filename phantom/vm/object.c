@@ -40,7 +40,7 @@ static inline void verify_p( pvm_object_storage_t *p )
 
 static inline void verify_o( pvm_object_t o )
 {
-    if( o.data )
+    if( o.data && !pvm_is_tagged_int( o ) )
     {
         verify_p( o.data );
         verify_p( o.interface );
@@ -55,9 +55,15 @@ static inline void verify_o( pvm_object_t o )
  *
  * Fields access for array.
  *
+ * Page grows twice when full, so append is amortized O(1), and
+ * shrinks twice when less than a quarter of it is used. Page
+ * replacement moves slots with no refcount.
+ *
 **/
 
-struct pvm_object  pvm_get_array_ofield(struct pvm_object_storage *o, unsigned int slot  )
+#define ARRAY_MIN_PAGE  16
+
+static struct data_area_4_array * array_da( struct pvm_object_storage *o )
 {
     verify_p(o);
     if(
@@ -66,19 +72,84 @@ struct pvm_object  pvm_get_array_ofield(struct pvm_object_storage *o, unsigned i
       )
         pvm_exec_panic( "attempt to do an array op to non-array" );
 
-    struct data_area_4_array *da = (struct data_area_4_array *)&(o->da);
+    return (struct data_area_4_array *)&(o->da);
+}
 
-    if( slot >= da->used_slots )
-        pvm_exec_panic( "load: array index out of bounds" );
+static struct pvm_object * array_slots( struct data_area_4_array *da )
+{
+    return da_po_ptr((da->page.data)->da);
+}
 
-    return pvm_get_ofield( da->page, slot);
+// Slots are moved within page, marker could miss moved reference
+static void array_shade( struct pvm_object *p, int n )
+{
+    if( !gc_marking ) return;
+
+    while( n-- > 0 )
+        gc_write_barrier( (p++)->data );
 }
 
-// TODO need semaphores here
-void pvm_set_array_ofield(struct pvm_object_storage *o, unsigned int slot, struct pvm_object value )
+static void array_null( struct pvm_object *p, int n )
+{
+    while( n-- > 0 )
+        *p++ = pvm_get_null_object();
+}
+
+// Old page contents are moved to the new one. Free it with no refcount
+// on contents. New page can be born black, so if marker runs, moved
+// contents are shaded here before old page is cleared. Page itself is
+// kept by GC till the end of marking, see gc_defer_release().
+static void array_drop_page( struct pvm_object page, int n_moved )
+{
+    gc_write_barrier( page.data );
+    array_shade( da_po_ptr(page.data->da), n_moved );
+
+    memset( da_po_ptr(page.data->da), 0, n_moved * sizeof(struct pvm_object) );
+    ref_dec_o( page );
+}
+
+static void array_set_page_size( struct data_area_4_array *da, int new_page_size )
+{
+    struct pvm_object old = da->page;
+
+    if( (!pvm_is_null(old)) && da->used_slots > 0 )
+        da->page = pvm_create_page_object( new_page_size, array_slots( da ), da->used_slots );
+    else
+        da->page = pvm_create_page_object( new_page_size, 0, 0 );
+
+    if( !pvm_is_null(old) )
+        array_drop_page( old, da->used_slots );
+
+    da->page_size = new_page_size;
+}
+
+static void array_reserve( struct data_area_4_array *da, int need )
+{
+    if( (!pvm_is_null(da->page)) && need <= da->page_size )
+        return;
+
+    int new_page_size = pvm_is_null(da->page) ? ARRAY_MIN_PAGE : da->page_size * 2;
+    if( new_page_size < need ) new_page_size = need;
+
+    array_set_page_size( da, new_page_size );
+}
+
+static void array_shrink( struct data_area_4_array *da )
+{
+    if( pvm_is_null(da->page) || da->page_size <= ARRAY_MIN_PAGE || da->used_slots >= da->page_size / 4 )
+        return;
+
+    // Halve till page is at most half full, in one reallocation
+    unsigned int size = da->page_size / 2;
+    while( size > ARRAY_MIN_PAGE && da->used_slots < size / 4 )
+        size /= 2;
+
+    array_set_page_size( da, size );
+}
+
+struct pvm_object  pvm_get_array_ofield(struct pvm_object_storage *o, unsigned int slot  )
 {
     verify_p(o);
-    verify_o(value);
     if(
        !(PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL & (o->_flags) ) ||
        !( PHANTOM_OBJECT_STORAGE_FLAG_IS_RESIZEABLE & (o->_flags) )
@@ -87,22 +158,20 @@ void pvm_set_array_ofield(struct pvm_object_storage *o, unsigned int slot, struc
 
     struct data_area_4_array *da = (struct data_area_4_array *)&(o->da);
 
-    // need resize?
-    if( pvm_is_null(da->page) || slot >= da->page_size )
-        {
-        const int step = 1024;
-        int new_page_size = slot < (step/2) ? (slot * 2) : (slot+step);
+    if( slot >= da->used_slots )
+        pvm_exec_panic( "load: array index out of bounds" );
 
-        if(new_page_size < 16) new_page_size = 16;
+    return pvm_get_ofield( da->page, slot);
+}
 
-        if( (!pvm_is_null(da->page)) && da->page_size > 0 )
-            //da->page = pvm_object_storage::create_page( new_page_size, da->page.data()->da_po_ptr(), da->page_size );
-            da->page = pvm_create_page_object( new_page_size, (void *)&(da->page.data->da), da->page_size );
-        else
-            da->page = pvm_create_page_object( new_page_size, 0, 0 );
+// TODO need semaphores here
+void pvm_set_array_ofield(struct pvm_object_storage *o, unsigned int slot, struct pvm_object value )
+{
+    verify_o(value);
+    struct data_area_4_array *da = array_da( o );
 
-        da->page_size = new_page_size;
-        }
+    // need resize?
+    array_reserve( da, slot + 1 );
 
     if( slot >= da->used_slots )
         {
@@ -141,8 +210,12 @@ void pvm_pop_array(struct pvm_object_storage *array, struct pvm_object value_to_
         if ( ( p[slot] ).data == value_to_pop.data )  //please don't leak refcnt
         {
             if (slot != da->used_slots-1) {
+                array_shade( p + slot, 1 );
                 p[slot] = p[da->used_slots-1];
             }
+            // Reference is moved or goes to caller
+            array_shade( p + da->used_slots-1, 1 );
+            p[da->used_slots-1] = pvm_get_null_object();
             da->used_slots--;
             return;
         }
@@ -152,6 +225,133 @@ void pvm_pop_array(struct pvm_object_storage *array, struct pvm_object value_to_
 }
 
 
+// Open a gap of n null slots at pos
+void pvm_array_insert_range(struct pvm_object_storage *array, unsigned int pos, unsigned int n )
+{
+    struct data_area_4_array *da = array_da( array );
+
+    if( pos > da->used_slots )
+        pvm_exec_panic( "array insert: index out of bounds" );
+
+    if( n == 0 )
+        return;
+
+    array_reserve( da, da->used_slots + n );
+
+    struct pvm_object *p = array_slots( da );
+    array_shade( p + pos, da->used_slots - pos );
+    memmove( p + pos + n, p + pos, (da->used_slots - pos) * sizeof(struct pvm_object) );
+    array_null( p + pos, n );
+
+    da->used_slots += n;
+}
+
+void pvm_array_remove_range(struct pvm_object_storage *array, unsigned int pos, unsigned int n )
+{
+    struct data_area_4_array *da = array_da( array );
+
+    if( pos > da->used_slots || n > da->used_slots - pos )
+        pvm_exec_panic( "array remove: index out of bounds" );
+
+    if( n == 0 )
+        return;
+
+    struct pvm_object *p = array_slots( da );
+    unsigned int i;
+
+    for( i = 0; i < n; i++ )
+        ref_dec_o( p[pos+i] );
+
+    array_shade( p + pos + n, da->used_slots - pos - n );
+    memmove( p + pos, p + pos + n, (da->used_slots - pos - n) * sizeof(struct pvm_object) );
+    array_null( p + da->used_slots - n, n );
+
+    da->used_slots -= n;
+
+    array_shrink( da );
+}
+
+// Overwrite dst slots starting at dst_pos, array grows if needed. Ranges can overlap.
+void pvm_array_copy_range(struct pvm_object_storage *dst, unsigned int dst_pos, struct pvm_object_storage *src, unsigned int src_pos, unsigned int n )
+{
+    struct data_area_4_array *dda = array_da( dst );
+    struct data_area_4_array *sda = array_da( src );
+    unsigned int i;
+
+    if( dst_pos > dda->used_slots || src_pos > sda->used_slots || n > sda->used_slots - src_pos )
+        pvm_exec_panic( "array copy: index out of bounds" );
+
+    if( n == 0 )
+        return;
+
+    array_reserve( dda, dst_pos + n );
+
+    // After reserve - src can be dst
+    struct pvm_object *s = array_slots( sda ) + src_pos;
+    struct pvm_object *d = array_slots( dda ) + dst_pos;
+
+    unsigned int n_over = dda->used_slots - dst_pos;
+    if( n_over > n ) n_over = n;
+
+    // Copies first, so that release of overwritten ones can't free them.
+    // Caller holds both arrays.
+    for( i = 0; i < n; i++ )
+        ref_inc_o( s[i] );
+
+    for( i = 0; i < n_over; i++ )
+        ref_dec_o( d[i] );
+
+    array_shade( s, n );
+    memmove( d, s, n * sizeof(struct pvm_object) );
+
+    if( dst_pos + n > dda->used_slots )
+        dda->used_slots = dst_pos + n;
+}
+
+void pvm_array_fill(struct pvm_object_storage *array, unsigned int pos, unsigned int n, struct pvm_object value )
+{
+    struct data_area_4_array *da = array_da( array );
+    unsigned int i;
+
+    if( pos > da->used_slots )
+        pvm_exec_panic( "array fill: index out of bounds" );
+
+    if( n == 0 )
+        return;
+
+    array_reserve( da, pos + n );
+
+    struct pvm_object *p = array_slots( da ) + pos;
+
+    unsigned int n_over = da->used_slots - pos;
+    if( n_over > n ) n_over = n;
+
+    // Caller holds value
+    for( i = 0; i < n_over; i++ )
+        ref_dec_o( p[i] );
+
+    for( i = 0; i < n; i++ )
+        p[i] = ref_inc_o( value );
+
+    if( pos + n > da->used_slots )
+        da->used_slots = pos + n;
+}
+
+struct pvm_object pvm_array_subarray(struct pvm_object_storage *array, unsigned int pos, unsigned int n )
+{
+    struct pvm_object ret = pvm_create_object( pvm_get_array_class() );
+    pvm_array_copy_range( ret.data, 0, array, pos, n );
+    return ret;
+}
+
+// Direct access to slots, valid until array is changed
+struct pvm_object * pvm_array_slots(struct pvm_object_storage *array)
+{
+    struct data_area_4_array *da = array_da( array );
+    return pvm_is_null(da->page) ? 0 : array_slots( da );
+}
+
+
 
 /**
  *
@@ -229,6 +429,7 @@ pvm_set_field( struct pvm_object_storage *o, unsigned int slot, struct pvm_objec
         pvm_exec_panic( "load: slot index out of bounds" );
     }
 
+    gc_write_barrier( da_po_ptr(o->da)[slot].data );
     if(da_po_ptr(o->da)[slot].data)     ref_dec_o(da_po_ptr(o->da)[slot]);  //decr old value
     da_po_ptr(o->da)[slot] = value;
 }
@@ -253,6 +454,7 @@ pvm_set_ofield( struct pvm_object op, unsigned int slot, struct pvm_object value
         pvm_exec_panic( "slot index out of bounds" );
     }
 
+    gc_write_barrier( da_po_ptr((op.data)->da)[slot].data );
     if(da_po_ptr((op.data)->da)[slot].data) ref_dec_o(da_po_ptr((op.data)->da)[slot]);  //decr old value
     da_po_ptr((op.data)->da)[slot] = value;
 }
@@ -267,7 +469,7 @@ pvm_set_ofield( struct pvm_object op, unsigned int slot, struct pvm_object value
 
 int pvm_object_class_is( struct pvm_object object, struct pvm_object tclass )
 {
-    struct pvm_object_storage *tested = object.data->_class.data;
+    struct pvm_object_storage *tested = pvm_object_class( object ).data;
     struct pvm_object_storage *nullc = pvm_get_null_class().data;
 
     while( !pvm_is_null( tclass ) )
@@ -293,6 +495,10 @@ int pvm_object_class_is( struct pvm_object object, struct pvm_object tclass )
 struct pvm_object
 pvm_copy_object( struct pvm_object in_object )
 {
+    // Immutable and has no storage
+    if( pvm_is_tagged_int( in_object ) )
+        return in_object;
+
     // TODO ERR throw!
     if(in_object.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL)
         panic("internal object copy?!");
@@ -341,7 +547,7 @@ static void pvm_puts(struct pvm_object o )
 {
     if(o.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_STRING)
     {
-        struct data_area_4_string *da = (struct data_area_4_string *)&(o.data->da);
+        struct data_area_4_string *da = pvm_string_da( o );
         int len = da->length;
         unsigned const char *sp = da->data;
         /* TODO BUG! From unicode! */
@@ -356,7 +562,7 @@ static void pvm_puts(struct pvm_object o )
 
 void pvm_object_print(struct pvm_object o )
 {
-    if(o.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INT)
+    if( pvm_is_tagged_int( o ) || (o.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INT) )
     {
         printf( "%d", pvm_get_int( o ) );
     }
@@ -382,6 +588,7 @@ void print_object_flags(struct pvm_object_storage *o)
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL )        printf("INTERNAL ");
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_RESIZEABLE )      printf("RESIZEABLE ");
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_STRING )          printf("STRING ");
+    if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE )            printf("ROPE ");
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_INT )             printf("INT ");
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_DECOMPOSEABLE )   printf("DECOMPOSEABLE ");
     if( o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS )           printf("CLASS ");
@@ -401,7 +608,13 @@ void dumpo( addr_t addr )
     printf("Da size: %ld\n", (long)(o->_da_size) );
 
 
-    if(o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_STRING)
+    // Don't flatten here, dump must not allocate
+    if(o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE)
+    {
+        struct data_area_4_rope *da = (struct data_area_4_rope *)&(o->da);
+        printf("Rope: length %d, depth %d, %s\n", da->length, da->depth, da->flat.data ? "flat" : "not flat" );
+    }
+    else if(o->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_STRING)
     {
         printf("String: '");
 
@@ -429,6 +642,11 @@ void dumpo( addr_t addr )
 
 void pvm_object_dump(struct pvm_object o )
 {
+    if( pvm_is_tagged_int( o ) )
+    {
+        printf("Tagged int: %d\n", pvm_get_int( o ) );
+        return;
+    }
 	dumpo((addr_t)o.data);
 }
 
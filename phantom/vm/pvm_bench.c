@@ -0,0 +1,333 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Hosted VM benchmark harness.
+ *
+ * Boots fresh object space from bulk class file with quiet boot
+ * class (.ru.dz.phantom.bench.boot, only sets up class loader), then
+ * runs given benchmark classes. Benchmark class method 8 gets number
+ * of iterations and returns number of operations done.
+ *
+ * Each benchmark is run once with 1/10 of iterations to load classes
+ * and warm caches, then measured. One JSON object per line is printed
+ * for each benchmark, it starts with '{'. Other lines are VM messages
+ * and harness comments, which start with '#'.
+ *
+ * Hosted VM has no GC thread, so measured iterations are split into
+ * chunks and full GC is run after each one. Harness holds no objects
+ * between chunks, so GC can't free anything in use. Time includes GC.
+ *
+ * Usage: pvm_bench [-n iterations] [-g chunks] [-m heap_mb] [-f classes] [name=value...] [bench...]
+ *
+**/
+
+#include <stdarg.h>
+
+#include <phantom_libc.h>
+#include <kernel/boot.h>
+#include <kernel/init.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/internal_da.h>
+#include <vm/exec.h>
+#include <vm/alloc.h>
+
+#include <hal.h>
+#include <time.h>
+#include <video/screen.h>
+#include "main.h"
+#include "win_bulk.h"
+
+
+#define BENCH_PACKAGE           ".ru.dz.phantom.bench."
+#define BENCH_BOOT_ENV          "root.boot=" BENCH_PACKAGE "boot"
+
+#define MAXENVBUF 128
+static char *envbuf[MAXENVBUF] = { BENCH_BOOT_ENV, 0 };
+
+static const char *default_benches[] =
+{
+    "calls", "alloc", "strings", "arrays", "exceptions", 0
+};
+
+// No video, benchmarks must not open windows
+struct drv_video_screen_t        *video_drv = 0;
+
+static int size = 40*1024*1024;
+static void *mem;
+
+static int iterations = 100000;
+static int gc_chunks = 10;      // 0 - no GC
+static const char *classes_fn = 0;
+
+static const char *benches[MAXENVBUF];
+static int n_benches = 0;
+
+
+static void args(int argc, char* argv[]);
+
+
+// Returns number of operations done, or -1 if class is not found
+static int run_bench( const char *class_name, int n )
+{
+    pvm_object_t name = pvm_create_string_object( class_name );
+    pvm_object_t bench_class = pvm_exec_lookup_class_by_name( name );
+    ref_dec_o( name );
+
+    if( pvm_is_null( bench_class ) )
+        return -1;
+
+    pvm_object_t bench = pvm_create_object( bench_class );
+    ref_dec_o( bench_class );
+
+    pvm_object_t arg[1] = { pvm_create_int_object( n ) };
+    pvm_object_t ret = pvm_exec_run_method( bench, 8, 1, arg );
+    ref_dec_o( bench );
+
+    int ops = pvm_is_null( ret ) ? 0 : pvm_get_int( ret );
+    ref_dec_o( ret );
+
+    return ops;
+}
+
+
+// Bench name is given by user
+static void print_json_string( const char *s )
+{
+    putchar('"');
+
+    for( ; *s; s++ )
+    {
+        unsigned char c = *s;
+
+        if( c == '"' || c == '\\' )
+            printf("\\%c", c );
+        else if( c < 0x20 )
+            printf("\\u%04x", c );
+        else
+            putchar( c );
+    }
+
+    putchar('"');
+}
+
+
+static int bench( const char *bname )
+{
+    char class_name[256];
+
+    if( *bname == '.' )
+        strlcpy( class_name, bname, sizeof(class_name) );
+    else
+        snprintf( class_name, sizeof(class_name), "%s%s", BENCH_PACKAGE, bname );
+
+    // Warm up - class load, inline caches, code cache
+    if( run_bench( class_name, iterations / 10 ) < 0 )
+    {
+        printf("# no class '%s'\n", class_name );
+        return 1;
+    }
+
+    struct pvm_alloc_stats s0, s1;
+
+    pvm_alloc_reset_peaks();
+    pvm_alloc_get_stats( &s0 );
+
+    int chunks = gc_chunks > 0 ? gc_chunks : 1;
+    int ops = 0;
+    int i;
+
+    bigtime_t start = hal_system_time();
+
+    for( i = 0; i < chunks; i++ )
+    {
+        // Last one does the rest
+        int n = (i < chunks - 1) ? iterations / chunks : iterations - (chunks - 1) * (iterations / chunks);
+
+        ops += run_bench( class_name, n );
+
+        if( gc_chunks > 0 )
+            run_gc();
+    }
+
+    bigtime_t time = hal_system_time() - start;
+
+    pvm_alloc_get_stats( &s1 );
+
+    if( time <= 0 ) time = 1;
+
+    printf("{\"bench\":");
+    print_json_string( bname );
+    printf(",\"iterations\":%d,\"ops\":%d,\"time_us\":%lld,\"ops_per_sec\":%lld,"
+           "\"allocs\":%ld,\"alloc_bytes\":%ld,\"gc_pauses\":%d,\"gc_pause_total_us\":%lld,\"gc_pause_max_us\":%lld,"
+           "\"peak_heap\":%ld}\n",
+           iterations, ops, (long long)time, (long long)ops * 1000000 / time,
+           s1.allocs - s0.allocs, s1.alloc_bytes - s0.alloc_bytes,
+           s1.gc_pauses - s0.gc_pauses, (long long)(s1.gc_pause_total - s0.gc_pause_total), (long long)s1.gc_pause_max,
+           s1.peak_bytes );
+
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    run_init_functions( INIT_LEVEL_PREPARE );
+
+    args(argc,argv);
+
+    pvm_bulk_init( bulk_seek_f, bulk_read_f );
+
+    mem = malloc(size+1024*10);
+    if( mem == 0 )
+    {
+        printf("# no memory for %d byte heap\n", size );
+        exit(22);
+    }
+
+    hal_init( mem, size );
+
+    run_init_functions( INIT_LEVEL_INIT );
+    run_init_functions( INIT_LEVEL_LATE );
+
+    char fn[1024];
+
+    if( classes_fn != 0 )
+        strlcpy( fn, classes_fn, sizeof(fn) );
+    else
+    {
+        char *dir = getenv("PHANTOM_HOME");
+        char *rest = "plib/bin/classes";
+
+        if( dir == NULL )
+        {
+            dir = "pcode";
+            rest = "classes";
+        }
+
+        snprintf( fn, sizeof(fn), "%s/%s", dir, rest );
+    }
+
+    if( load_code( &bulk_code, &bulk_size, fn ) )
+    {
+        printf("# no bulk classes file '%s'\n", fn );
+        exit(22);
+    }
+    bulk_read_pos = bulk_code;
+
+    // Fresh memory, runs boot class
+    pvm_root_init();
+
+    const char **bl = n_benches ? benches : default_benches;
+    int errors = 0;
+
+    for( ; *bl; bl++ )
+        errors += bench( *bl );
+
+    return errors ? 1 : 0;
+}
+
+
+
+
+static void usage()
+{
+    printf(
+           "Usage: pvm_bench [-flags] [name=value...] [bench...]\n\n"
+           "Flags:\n"
+           "-n N\t- iterations per benchmark, default 100000\n"
+           "-g N\t- split iterations to N chunks with full GC after each, default 10, 0 - no GC\n"
+           "-m MB\t- object space size, default 40\n"
+           "-f file\t- bulk classes file\n"
+           "-h\t- print this\n"
+           "\nBench is class name, short name is in " BENCH_PACKAGE "\n"
+           );
+}
+
+
+int main_envc;
+const char **main_env;
+
+
+static void args(int argc, char* argv[])
+{
+    main_envc = 1; // boot class
+    main_env = (const char **) &envbuf;
+
+    while(argc-- > 1)
+    {
+        char *arg = *++argv;
+
+        if( *arg != '-' && index( arg, '=' ) )
+        {
+            if( main_envc >= MAXENVBUF-1 )
+            {
+                printf("Env too big\n");
+                exit(22);
+            }
+            envbuf[main_envc++] = arg;
+            envbuf[main_envc] = 0;
+            continue;
+        }
+
+        if( *arg != '-' )
+        {
+            if( n_benches >= MAXENVBUF-1 )
+            {
+                printf("Too many benchmarks\n");
+                exit(22);
+            }
+            benches[n_benches++] = arg;
+            benches[n_benches] = 0;
+            continue;
+        }
+        arg++; // skip '-'
+
+        // Flags with value
+        if( (*arg == 'n' || *arg == 'g' || *arg == 'm' || *arg == 'f') && argc < 2 )
+        {
+            usage(); exit(22);
+        }
+
+        switch( *arg )
+        {
+        case 'n':
+            iterations = atoi( *++argv ); argc--;
+            if( iterations <= 0 ) { usage(); exit(22); }
+            break;
+
+        case 'g':
+            gc_chunks = atoi( *++argv ); argc--;
+            if( gc_chunks < 0 ) { usage(); exit(22); }
+            break;
+
+        case 'm':
+            size = atoi( *++argv ) * 1024 * 1024; argc--;
+            if( size <= 0 ) { usage(); exit(22); }
+            break;
+
+        case 'f':
+            classes_fn = *++argv; argc--;
+            break;
+
+        case 'h':
+        default:
+            usage(); exit(22);
+        }
+    }
+
+}
+
+
+void phantom_debug_register_stray_catch( void *a, int s, const char*n )
+{
+    // Ignore
+    (void) a;
+    (void) s;
+    (void) n;
+}
+
@@ -12,6 +12,24 @@
  * Here we make sure that we decrement refcount only after making
  * sure that all threads pass bytecode instruction boundary.
  *
+ * Decrement is put to buffer of current CPU with preemption disabled,
+ * no lock or atomic op is needed. Each CPU has two halves, one is
+ * filled while other one is drained by refdec thread in a batch. If
+ * half is full, decrement goes to spill list, which grows, so nothing
+ * is lost (if spill can't be allocated, decrement is done at once);
+ * VM threads then wait at safepoint till refdec thread catches up
+ * (see refdec_backpressure).
+ *
+ * Refcount of any object can be changed by VM threads and refdec
+ * thread at once, so increments and decrements are atomic.
+ *
+ * Pending decrements are GC roots, see pvm_refdec_gc_mark(). Cycle
+ * collector changes counts, it pauses refdec thread.
+ *
+ * Hosted VM can't stop the world and decrements at once.
+ *
+ * Kernel debugger command: refdec [test]
+ *
 **/
 
 #include <kernel/init.h>
@@ -19,53 +37,105 @@
 #include <kernel/stats.h>
 #include <kernel/atomic.h>
 #include <kernel/snap_sync.h>
+#include <kernel/smp.h>
+#include <kernel/debug.h>
 
+#include <phantom_libc.h>
 #include <threads.h>
+#include <hal.h>
 
 #include <vm/alloc.h>
 #include <vm/object.h>
 
-static int inited = 0;
+static int started = 0;
 static int stop = 0;
 
 
 static void deferred_refdec_init(void);
 static void deferred_refdec_thread(void *a);
+static void refdec_dump_stats( int ac, char **av );
 
 
 INIT_ME( 0, deferred_refdec_init, 0 )
 //STOP_ME( deferred_refdec_stop )
 
 
-#define REFDEC_BUFFER_SIZE (1024*16)
+#define REFDEC_BUFFER_SIZE (1024*4)
+
+    // Where to wake up refdec thread
+#define REFDEC_BUFFER_RED_ZONE (REFDEC_BUFFER_SIZE*3/4)
+
+#define REFDEC_SPILL_SIZE (1024*4)
+
+    // Drain that often if buffers are not filled
+#define REFDEC_PERIOD_MSEC 100
+
+
+struct refdec_half
+{
+    volatile int                        n;
+    pvm_object_storage_t * volatile     obj[REFDEC_BUFFER_SIZE];
+};
+
+struct refdec_cpu
+{
+    volatile int                        active; // half being filled
+    volatile int                        busy;   // put is in progress
+    struct refdec_half                  half[2];
+};
+
+struct refdec_spill
+{
+    struct refdec_spill *               next;
+    int                                 n;
+    pvm_object_storage_t *              obj[REFDEC_SPILL_SIZE];
+};
+
 
-    // Where to start agressive action
-#define REFDEC_BUFFER_RED_ZONE (REFDEC_BUFFER_SIZE/4)
+static struct refdec_cpu        refdec_cpu[MAX_CPUS];
 
-#define REFDEC_BUFFER_HALF (REFDEC_BUFFER_SIZE/2)
+static hal_mutex_t              spill_mutex;
+static struct refdec_spill *    spill_list;     // being filled
+static struct refdec_spill *    spill_drain;    // taken by refdec thread
 
+volatile int                    refdec_backpressure = 0;
 
+static hal_mutex_t              deferred_refdec_mutex; // counts are changed here
+static hal_mutex_t              start_refdec_mutex;
+static hal_cond_t               start_refdec_cond;
+static tid_t                    deferred_refdec_thread_id;
 
-static hal_mutex_t deferred_refdec_mutex;
-static hal_cond_t  start_refdec_cond, end_refdec_cond;
-static tid_t deferred_refdec_thread_id;
+// Statistics
+static int                      refdec_runs;
+static long                     refdec_done;
+static int                      refdec_last_batch;
+static int                      refdec_max_batch;
+static int                      refdec_spills;
 
 
 static void deferred_refdec_init(void)
 {
-    inited = 1;
+    dbg_add_command( refdec_dump_stats, "refdec", "deferred refcount decrement statistics: refdec [test]");
+
+    // Hosted VM can't stop the world
+    if( !phantom_is_a_real_kernel() )
+        return;
+
     hal_mutex_init( &deferred_refdec_mutex, "refdec");
+    hal_mutex_init( &spill_mutex, "refdec spl");
+    hal_mutex_init( &start_refdec_mutex, "refdec st");
 
     hal_cond_init(  &start_refdec_cond, "refdec st" );
-    hal_cond_init(  &end_refdec_cond, "refdec end" );
 
     deferred_refdec_thread_id = hal_start_thread( deferred_refdec_thread, 0, 0 );
     assert(deferred_refdec_thread_id > 0 );
 
+    started = 1;
 }
 
 
-static void deferred_refdec_stop(void) //__attribute__((unused))
+static void deferred_refdec_stop(void) __attribute__((unused));
+static void deferred_refdec_stop(void)
 {
     stop = 1;
     hal_cond_signal( &start_refdec_cond );
@@ -74,108 +144,317 @@ static void deferred_refdec_stop(void) //__attribute__((unused))
 
 
 
-// 2 pages
-static volatile pvm_object_storage_t *refdec_buffer[REFDEC_BUFFER_SIZE];
-static volatile int refdec_put_ptr = 0;
-//static volatile int npage = 0;
+// Current CPU half is full
+static void refdec_spill( pvm_object_storage_t *os )
+{
+    STAT_INC_CNT(VM_REFDEC_SPILL);
 
+    hal_mutex_lock( &spill_mutex );
 
-void deferred_refdec(pvm_object_storage_t *os)
-{
-    assert(inited);
-#if 0
-    if( os->_ah.refCount > 1 )
+    if( (spill_list == 0) || (spill_list->n >= REFDEC_SPILL_SIZE) )
     {
-        os->_ah.refCount--;
-        if( os->_ah.refCount <= 0 )
+        hal_mutex_unlock( &spill_mutex );
+
+        struct refdec_spill *s = malloc( sizeof(struct refdec_spill) );
+        if( s == 0 )
         {
-            os->_ah.refCount++;
-            goto long_way;
+            // No memory to defer - do it now rather than lose it
+            do_ref_dec_p( os );
+            return;
         }
+
+        s->n = 0;
+
+        hal_mutex_lock( &spill_mutex );
+        s->next = spill_list;
+        spill_list = s;
+    }
+
+    spill_list->obj[spill_list->n++] = os;
+    refdec_spills++;
+
+    refdec_backpressure = 1;
+    hal_mutex_unlock( &spill_mutex );
+
+    hal_cond_signal( &start_refdec_cond );
+}
+
+
+void deferred_refdec(pvm_object_storage_t *os)
+{
+    // Refdec thread itself releases children of dead object, nobody can read its slots
+    if( !started || get_current_tid() == deferred_refdec_thread_id )
+    {
+        do_ref_dec_p( os );
         return;
     }
-#endif
+
+    if( os == 0 || pvm_is_tagged_int_p( os ) ) return;
+
+    // Reference goes away - snapshot marker must see it now, not when we drain
+    gc_write_barrier( os );
+
+    if( os->_ah.refCount == INT_MAX )
+        return;
 
     STAT_INC_CNT(DEFERRED_REFDEC_REQS);
 
-    if(
-       ( (refdec_put_ptr <= REFDEC_BUFFER_HALF) && (refdec_put_ptr > REFDEC_BUFFER_RED_ZONE ) )
-       ||
-       ( refdec_put_ptr > REFDEC_BUFFER_RED_ZONE+REFDEC_BUFFER_HALF )
-      )
+    hal_disable_preemption();
+
+    struct refdec_cpu *rc = refdec_cpu + GET_CPU_ID();
+    rc->busy = 1;
+
+    // Pairs with refdec_drain(): it switches active and then checks busy,
+    // we set busy and then read active
+    __sync_synchronize();
+
+    struct refdec_half *h = rc->half + rc->active;
+    int pos = h->n;
+
+    if( pos < REFDEC_BUFFER_SIZE )
     {
-        //hal_mutex_lock(  &deferred_refdec_mutex );
+        h->obj[pos] = os;
+        h->n = pos + 1;
+    }
+
+    rc->busy = 0;
+    hal_enable_preemption();
 
+    if( pos == REFDEC_BUFFER_RED_ZONE )
         hal_cond_signal( &start_refdec_cond );
-        //hal_cond_wait(   &end_refdec_cond, &deferred_refdec_mutex );
 
-        //hal_mutex_unlock( &deferred_refdec_mutex );
-    }
+    if( pos >= REFDEC_BUFFER_SIZE )
+        refdec_spill( os );
+}
 
-    // Overflow
-    if( (refdec_put_ptr >= REFDEC_BUFFER_SIZE) || (refdec_put_ptr == REFDEC_BUFFER_HALF) )
-    {
-        STAT_INC_CNT(DEFERRED_REFDEC_LOST);
-        // We just loose refdec - big GC will pick it up
+
+
+void pvm_refdec_pause(void)
+{
+    if( started ) hal_mutex_lock( &deferred_refdec_mutex );
+}
+
+void pvm_refdec_resume(void)
+{
+    if( started ) hal_mutex_unlock( &deferred_refdec_mutex );
+}
+
+
+// Refdec must be paused
+void pvm_refdec_gc_mark( void (*func)( pvm_object_storage_t *op ) )
+{
+    int cpu, i, j;
+
+    if( !started )
         return;
+
+    for( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        for( i = 0; i < 2; i++ )
+        {
+            struct refdec_half *h = refdec_cpu[cpu].half + i;
+            int n = h->n;
+
+            if( n > REFDEC_BUFFER_SIZE ) n = REFDEC_BUFFER_SIZE;
+
+            for( j = 0; j < n; j++ )
+                func( (pvm_object_storage_t *)h->obj[j] );
+        }
     }
 
-//long_way:
-    int pos = atomic_add( (int *)&refdec_put_ptr, 1 );
-    refdec_buffer[pos] = os;
+    hal_mutex_lock( &spill_mutex );
+
+    struct refdec_spill *s;
+    for( s = spill_list; s; s = s->next )
+        for( j = 0; j < s->n; j++ )
+            func( s->obj[j] );
 
+    for( s = spill_drain; s; s = s->next )
+        for( j = 0; j < s->n; j++ )
+            func( s->obj[j] );
 
+    hal_mutex_unlock( &spill_mutex );
 }
 
+
 /**
  *
  * Now here we actially perform decrements.
  *
- * We divide buffer into 2 parts. First one is filled,
- * other is processed.
+ * Each CPU is switched to other half of its buffer and filled
+ * half is processed, as well as spill list.
  *
 **/
 
 
+// Nothing to drain? Racy, put which is missed goes to the next run.
+static int refdec_empty(void)
+{
+    int cpu;
+
+    for( cpu = 0; cpu < MAX_CPUS; cpu++ )
+        if( refdec_cpu[cpu].half[refdec_cpu[cpu].active].n )
+            return 0;
+
+    return spill_list == 0;
+}
+
+
+static void refdec_drain(void)
+{
+    int taken[MAX_CPUS];
+    int cpu, i, done = 0;
+
+    // Don't stop the world for nothing
+    if( refdec_empty() )
+        return;
+
+    for( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        taken[cpu] = refdec_cpu[cpu].active;
+        refdec_cpu[cpu].active = !taken[cpu];
+    }
+
+    hal_mutex_lock( &spill_mutex );
+    spill_drain = spill_list;
+    spill_list = 0;
+    hal_mutex_unlock( &spill_mutex );
+
+    // Check that all VM threads are either sleep or passed an bytecode instr boundary
+    phantom_check_threads_pass_bytecode_instr_boundary();
+
+    // Put which has seen old half must be finished by now. It runs with
+    // preemption disabled, so it can be on other CPU only and is short.
+    __sync_synchronize();
+    for( cpu = 0; cpu < MAX_CPUS; cpu++ )
+        while( refdec_cpu[cpu].busy )
+            ;
+
+    hal_mutex_lock( &deferred_refdec_mutex );
+
+    for( cpu = 0; cpu < MAX_CPUS; cpu++ )
+    {
+        struct refdec_half *h = refdec_cpu[cpu].half + taken[cpu];
+        int n = h->n;
+
+        for( i = 0; i < n; i++ )
+            do_ref_dec_p( (pvm_object_storage_t *)h->obj[i] );
+
+        h->n = 0;
+        done += n;
+    }
+
+    while( spill_drain )
+    {
+        struct refdec_spill *s = spill_drain;
+
+        for( i = 0; i < s->n; i++ )
+            do_ref_dec_p( s->obj[i] );
+
+        done += s->n;
+        spill_drain = s->next;
+
+        free( s );
+    }
+
+    hal_mutex_lock( &spill_mutex );
+    refdec_backpressure = (spill_list != 0);
+    hal_mutex_unlock( &spill_mutex );
+
+    hal_mutex_unlock( &deferred_refdec_mutex );
+
+    STAT_INC_CNT(DEFERRED_REFDEC_RUNS);
+
+    refdec_runs++;
+    refdec_done += done;
+    refdec_last_batch = done;
+    if( done > refdec_max_batch ) refdec_max_batch = done;
+}
+
+
 static void deferred_refdec_thread(void *a)
 {
+    (void) a;
+
     t_current_set_name("RefDec");
     t_current_set_priority( THREAD_PRIO_HIGH );
 
     while(!stop)
     {
-        hal_mutex_lock(  &deferred_refdec_mutex );
-        // TODO timed wait
-        hal_cond_wait( &start_refdec_cond, &deferred_refdec_mutex );
+        hal_mutex_lock( &start_refdec_mutex );
+        if( !refdec_backpressure )
+            hal_cond_timedwait( &start_refdec_cond, &start_refdec_mutex, REFDEC_PERIOD_MSEC );
+        hal_mutex_unlock( &start_refdec_mutex );
 
-        STAT_INC_CNT(DEFERRED_REFDEC_RUNS);
+        refdec_drain();
+    }
+}
 
-        // Decide where to switch put pointer
-        int new_put_ptr = REFDEC_BUFFER_HALF + 1; // first one used to check low half overflow
 
-        // Was in upper page?
-        if( refdec_put_ptr >= REFDEC_BUFFER_HALF )
-            new_put_ptr = 0;
 
-        int last_pos = atomic_set( &refdec_put_ptr, new_put_ptr);
-        int start_pos = (last_pos >= REFDEC_BUFFER_HALF) ? REFDEC_BUFFER_HALF+1 : 0;
+// Fills current CPU buffer of paused refdec till decrement is
+// spilled, then checks that drain applies each decrement once.
+static void refdec_self_test(void)
+{
+    pvm_object_t o = pvm_create_string_object( "refdec test" );
+    pvm_object_storage_t *os = o.data;
+    int base = os->_ah.refCount;
+    int spills = refdec_spills;
+    int n = 0, wait;
 
-        // Check that all VM threads are either sleep or passed an bytecode instr boundary
-        phantom_check_threads_pass_bytecode_instr_boundary();
+    pvm_refdec_pause();
 
-        int pos;
-        for( pos = start_pos; pos < last_pos; pos++ )
-        {
-            pvm_object_storage_t volatile *os;
-            os = refdec_buffer[pos];
+    // Drain can switch halves while we put, but can't apply
+    while( refdec_spills == spills && n < (2 * MAX_CPUS + 1) * REFDEC_BUFFER_SIZE )
+    {
+        ref_inc_p( os );
+        deferred_refdec( os );
+        n++;
+    }
 
-            assert( os->_ah.refCount > 0);
-            do_ref_dec_p((pvm_object_storage_t *)os);
-        }
+    int pending = os->_ah.refCount - base;
 
-        hal_cond_broadcast(   &end_refdec_cond );
-        hal_mutex_unlock( &deferred_refdec_mutex );
-    }
+    pvm_refdec_resume();
+    hal_cond_signal( &start_refdec_cond );
+
+    for( wait = 0; wait < 50 && os->_ah.refCount != base; wait++ )
+        hal_sleep_msec( REFDEC_PERIOD_MSEC );
+
+    printf("Refdec test: %d decrements, %d pending before drain, %d spilled\n",
+           n, pending, refdec_spills - spills );
+
+    if( refdec_spills == spills )
+        printf("Refdec test FAILED: no spill\n");
+    else if( pending != n )
+        printf("Refdec test FAILED: decrement applied while paused\n");
+    else if( os->_ah.refCount != base )
+        printf("Refdec test FAILED: refcount is %d, must be %d\n", os->_ah.refCount, base );
+    else
+        printf("Refdec test PASSED\n");
+
+    ref_dec_o( o );
 }
 
 
+static void refdec_dump_stats( int ac, char **av )
+{
+    if( !started )
+    {
+        printf("Refcount decrements are not deferred\n");
+        return;
+    }
+
+    if( ac > 1 )
+    {
+        if( 0 == strcmp( av[1], "test" ) )
+            refdec_self_test();
+        else
+            printf("usage: refdec [test]\n");
+        return;
+    }
+
+    printf("Deferred refdec: %d runs, %ld decrements, last batch %d, max batch %d\n",
+           refdec_runs, refdec_done, refdec_last_batch, refdec_max_batch );
+    printf(" %d spilled, back pressure %s\n",
+           refdec_spills, refdec_backpressure ? "on" : "off" );
+}
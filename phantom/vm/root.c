@@ -26,6 +26,7 @@
 #include "vm/object_flags.h"
 #include "vm/exception.h"
 #include "vm/bulk.h"
+#include "vm/stacks.h"
 
 #include <kernel/boot.h>
 #include <kernel/debug.h>
@@ -51,6 +52,9 @@ static void runclass(int, char **);
 
 static void process_generic_restarts(struct pvm_object_storage *root);
 static void process_specific_restarts(void);
+static void start_cycle_roots(void);
+static void create_cycle_roots(void);
+static void create_internal_class(int i);
 
 
 /**
@@ -124,6 +128,57 @@ void pvm_root_init(void)
 
     pvm_root.kernel_stats = pvm_get_field( root, PVM_ROOT_KERNEL_STATISTICS );
 
+    pvm_root.cycle_roots = pvm_get_field( root, PVM_ROOT_OBJECT_CYCLE_ROOTS );
+    if( pvm_is_null( pvm_root.cycle_roots ) )
+    {
+        // Snapshot made before cycle collector was introduced
+        create_cycle_roots();
+        pvm_set_field( root, PVM_ROOT_OBJECT_CYCLE_ROOTS, pvm_root.cycle_roots );
+    }
+    else
+        start_cycle_roots();
+
+    pvm_root.class_cache = pvm_get_field( root, PVM_ROOT_OBJECT_CLASS_CACHE );
+    if( pvm_is_null( pvm_root.class_cache ) )
+    {
+        // Snapshot made before class cache was introduced
+        pvm_root.class_cache = pvm_create_class_cache();
+        pvm_set_field( root, PVM_ROOT_OBJECT_CLASS_CACHE, pvm_root.class_cache );
+    }
+
+    pvm_root.intern_table = pvm_get_field( root, PVM_ROOT_OBJECT_INTERN_TABLE );
+    if( pvm_is_null( pvm_root.intern_table ) )
+    {
+        // Snapshot made before strings were interned
+        pvm_root.intern_table = pvm_create_intern_table();
+        pvm_set_field( root, PVM_ROOT_OBJECT_INTERN_TABLE, pvm_root.intern_table );
+    }
+
+    for( i = 0; i < pvm_n_internal_classes; i++ )
+    {
+        if( !pvm_is_null( pvm_internal_classes[i].class_object ) )
+            continue;
+
+        // Snapshot made before this internal class (such as hashmap) was introduced
+        printf("Creating internal class %s\n", pvm_internal_classes[i].name );
+        create_internal_class( i );
+        pvm_set_field( root, pvm_internal_classes[i].root_index, pvm_internal_classes[i].class_object );
+    }
+
+    set_root_from_table();
+
+    // Snapshot made before stacks were contiguous can have paged ones
+    int nthreads = get_array_size( pvm_root.threads_list.data );
+    for( i = 0; i < nthreads; i++ )
+    {
+        pvm_object_t th = pvm_get_array_ofield( pvm_root.threads_list.data, i );
+        if( pvm_is_null( th ) )
+            continue;
+
+        pvm_exec_restart_thread( th );
+        pvm_convert_thread_stacks( th );
+    }
+
 
     process_specific_restarts();
     process_generic_restarts(root);
@@ -186,6 +241,40 @@ static void start_persistent_stats(void)
     }
 }
 
+static void start_cycle_roots(void)
+{
+    struct data_area_4_binary *bda = pvm_data_area( pvm_root.cycle_roots, binary );
+    gc_set_cycle_root_buffer( bda->data, bda->data_size );
+}
+
+static void create_cycle_roots(void)
+{
+    pvm_root.cycle_roots = pvm_create_binary_object( CYCLE_ROOT_BUFFER_DA_SIZE, 0 );
+    ref_saturate_o(pvm_root.cycle_roots);
+    start_cycle_roots();
+}
+
+// Class object for internal class which is not in snapshot, rest of root is loaded
+static void create_internal_class(int i)
+{
+    unsigned int flags = PHANTOM_OBJECT_STORAGE_FLAG_IS_INTERNAL|PHANTOM_OBJECT_STORAGE_FLAG_IS_CLASS ;
+    struct pvm_object_storage *curr = pvm_object_alloc( sizeof( struct data_area_4_class ), flags, 1 );
+    struct data_area_4_class *da = (struct data_area_4_class *)curr->da;
+
+    da->sys_table_id 		= i;
+    da->object_flags 		= pvm_internal_classes[i].flags;
+    da->object_data_area_size       = pvm_internal_classes[i].da_size;
+
+    da->class_parent 		= pvm_root.null_class;
+    da->object_default_interface    = pvm_root.sys_interface_object;
+    da->class_name 			= pvm_create_string_object(pvm_internal_classes[i].name);
+
+    curr->_class = pvm_root.class_class;
+
+    pvm_internal_classes[i].class_object.data           = curr;
+    pvm_internal_classes[i].class_object.interface      = pvm_root.sys_interface_object.data;
+}
+
 static void process_specific_restarts(void)
 {
     start_persistent_stats();
@@ -233,6 +322,9 @@ static void pvm_save_root_objects()
     pvm_set_field( root, PVM_ROOT_OBJECT_ROOT_DIR, pvm_root.root_dir);
 
     pvm_set_field( root, PVM_ROOT_KERNEL_STATISTICS, pvm_root.kernel_stats );
+    pvm_set_field( root, PVM_ROOT_OBJECT_CYCLE_ROOTS, pvm_root.cycle_roots );
+    pvm_set_field( root, PVM_ROOT_OBJECT_CLASS_CACHE, pvm_root.class_cache );
+    pvm_set_field( root, PVM_ROOT_OBJECT_INTERN_TABLE, pvm_root.intern_table );
 
 }
 
@@ -328,6 +420,11 @@ static void pvm_create_root_objects()
     ref_saturate_o(pvm_root.kernel_stats);
     start_persistent_stats();
 
+    create_cycle_roots();
+
+    pvm_root.class_cache = pvm_create_class_cache();
+    pvm_root.intern_table = pvm_create_intern_table();
+
     //pvm_root.os_entry = pvm_get_null_object();
 }
 
@@ -367,6 +464,8 @@ static void set_root_from_table()
     SET_ROOT_CLASS(mutex,MUTEX);
     SET_ROOT_CLASS(cond,COND);
     SET_ROOT_CLASS(sema,SEMA);
+
+    SET_ROOT_CLASS(hashmap,HASHMAP);
 }
 
 
@@ -410,6 +509,8 @@ GCINLINE struct pvm_object     pvm_get_mutex_class() { return pvm_root.mutex_cla
 GCINLINE struct pvm_object     pvm_get_cond_class() { return pvm_root.cond_class; }
 GCINLINE struct pvm_object     pvm_get_sema_class() { return pvm_root.sema_class; }
 
+GCINLINE struct pvm_object     pvm_get_hashmap_class() { return pvm_root.hashmap_class; }
+
 
 #undef GCINLINE
 
@@ -0,0 +1,231 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * String concatenation.
+ *
+ * Long concatenation result is a rope node - string class object
+ * with PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE, which keeps references
+ * to both parts (see struct data_area_4_rope). Data is copied to flat
+ * string object on first access (pvm_string_da), which is kept in
+ * the node, and parts are released. So loop of concatenations
+ * copies each piece once, not once per iteration.
+ *
+ * Short piece appended to the node which ends with short flat part
+ * is merged with that part, so rope of small appends grows in depth
+ * once per ROPE_LEAF bytes. Deeper than ROPE_MAX_DEPTH result is
+ * flattened at once, this limits flattening stack.
+ *
+ * Node structure is changed on flattening only, which is done under
+ * the lock. Flat part reference is set last, so it can be read with
+ * no lock.
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+#include <hal.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/internal_da.h>
+#include <vm/internal.h>
+#include <vm/object_flags.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+
+
+#define ROPE_MIN_LENGTH         256     // shorter result is copied at once
+#define ROPE_LEAF               512     // merge short appends up to this size
+#define ROPE_MAX_DEPTH          48
+
+
+static hal_mutex_t  _rope_mutex;
+static hal_mutex_t  *rope_mutex; // 0 before threads start
+
+#define ROPE_LOCK()      do { if(rope_mutex) hal_mutex_lock( rope_mutex ); } while(0)
+#define ROPE_UNLOCK()    do { if(rope_mutex) hal_mutex_unlock( rope_mutex ); } while(0)
+
+
+// Node which is not flattened yet, or 0
+static struct data_area_4_rope * rope_node( pvm_object_t s )
+{
+    if( !(s.data->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE) )
+        return 0;
+
+    struct data_area_4_rope *da = (struct data_area_4_rope *)&(s.data->da);
+    return da->flat.data == 0 ? da : 0;
+}
+
+static int rope_depth( pvm_object_t s )
+{
+    struct data_area_4_rope *da = rope_node( s );
+    return da ? da->depth : 0;
+}
+
+
+// Copy node contents to out, no recursion. Stack never
+// gets deeper than the node.
+static void rope_copy( char *out, pvm_object_t s )
+{
+    pvm_object_storage_t *stack[ROPE_MAX_DEPTH + 1];
+    int sp = 0;
+
+    stack[sp++] = s.data;
+
+    while( sp > 0 )
+    {
+        pvm_object_storage_t *p = stack[--sp];
+
+        if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE )
+        {
+            struct data_area_4_rope *r = (struct data_area_4_rope *)&(p->da);
+
+            if( r->flat.data == 0 )
+            {
+                assert( sp + 2 <= ROPE_MAX_DEPTH + 1 );
+                stack[sp++] = r->right.data;
+                stack[sp++] = r->left.data;
+                continue;
+            }
+
+            p = r->flat.data;
+        }
+
+        struct data_area_4_string *f = (struct data_area_4_string *)&(p->da);
+        memcpy( out, f->data, f->length );
+        out += f->length;
+    }
+}
+
+// Under lock
+static void rope_flatten( pvm_object_t s )
+{
+    struct data_area_4_rope *da = rope_node( s );
+    if( da == 0 )
+        return;
+
+    pvm_object_t flat = pvm_create_string_object_binary( 0, da->length );
+    struct data_area_4_string *fda = pvm_object_da( flat, string );
+
+    rope_copy( (char *)fda->data, s );
+    fda->length = da->length;
+
+    // Unlocked readers see flat string filled
+    __sync_synchronize();
+    da->flat = flat;
+
+    pvm_object_t left = da->left;
+    pvm_object_t right = da->right;
+
+    da->left.data = 0;
+    da->right.data = 0;
+
+    ref_dec_o( left );
+    ref_dec_o( right );
+}
+
+
+struct data_area_4_string * pvm_string_flatten( pvm_object_t s )
+{
+    struct data_area_4_rope *da = pvm_object_da( s, rope );
+
+    if( da->flat.data == 0 )
+    {
+        ROPE_LOCK();
+        rope_flatten( s );
+        ROPE_UNLOCK();
+    }
+
+    return pvm_object_da( da->flat, string );
+}
+
+
+static pvm_object_t rope_create( pvm_object_t left, pvm_object_t right, int depth )
+{
+    pvm_object_t r = pvm_object_create_dynamic( pvm_get_string_class(), sizeof(struct data_area_4_rope) );
+    pvm_internal_init_string( r.data );
+
+    r.data->_flags |= PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE;
+    r.data->_flags &= ~PHANTOM_OBJECT_STORAGE_FLAG_IS_CHILDFREE;
+
+    struct data_area_4_rope *da = pvm_object_da( r, rope );
+
+    da->length = pvm_get_str_len( left ) + pvm_get_str_len( right );
+    da->depth = depth;
+    da->left = ref_inc_o( left );
+    da->right = ref_inc_o( right );
+
+    return r;
+}
+
+
+// Under lock. Both are flattened before data is taken, flattening
+// of one can release flat string of the other one.
+static pvm_object_t rope_cat_flat( pvm_object_t s1, pvm_object_t s2 )
+{
+    rope_flatten( s1 );
+    rope_flatten( s2 );
+
+    struct data_area_4_string *d1 = pvm_string_da( s1 );
+    struct data_area_4_string *d2 = pvm_string_da( s2 );
+
+    return pvm_create_string_object_binary_cat( (char *)d1->data, d1->length, (char *)d2->data, d2->length );
+}
+
+
+// Returns new reference, arguments are not consumed
+pvm_object_t pvm_string_concat( pvm_object_t s1, pvm_object_t s2 )
+{
+    int l1 = pvm_get_str_len( s1 );
+    int l2 = pvm_get_str_len( s2 );
+    pvm_object_t ret;
+
+    if( l2 == 0 ) return ref_inc_o( s1 );
+    if( l1 == 0 ) return ref_inc_o( s2 );
+
+    ROPE_LOCK();
+
+    struct data_area_4_rope *r1 = rope_node( s1 );
+
+    if( l1 + l2 <= ROPE_MIN_LENGTH )
+        ret = rope_cat_flat( s1, s2 );
+    else if( r1 != 0 && rope_node( r1->right ) == 0 && rope_node( s2 ) == 0 &&
+             pvm_get_str_len( r1->right ) + l2 <= ROPE_LEAF )
+    {
+        // Short flat append, replace last leaf with longer one
+        pvm_object_t leaf = rope_cat_flat( r1->right, s2 );
+        ret = rope_create( r1->left, leaf, r1->depth );
+        ref_dec_o( leaf );
+    }
+    else
+    {
+        int d1 = rope_depth( s1 );
+        int d2 = rope_depth( s2 );
+        int depth = 1 + ((d1 > d2) ? d1 : d2);
+
+        if( depth > ROPE_MAX_DEPTH )
+            ret = rope_cat_flat( s1, s2 );
+        else
+            ret = rope_create( s1, s2, depth );
+    }
+
+    ROPE_UNLOCK();
+
+    return ret;
+}
+
+
+
+static void rope_init(void)
+{
+    if( hal_mutex_init( &_rope_mutex, "Rope" ) )
+        panic("Can't init rope mutex");
+
+    rope_mutex = &_rope_mutex;
+}
+
+INIT_ME( 0, rope_init, 0 )
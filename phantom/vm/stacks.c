@@ -17,336 +17,288 @@
 #include "vm/exception.h"
 #include "vm/alloc.h"
 #include "vm/exec.h"
+#include "vm/stacks.h"
+
+#include <phantom_libc.h>
 
 // Ok. All these methods receive ptr to root stack object da,
 // which curr_da field points to the active page data area.
 // so rootda is root page da, and s is curr page da.
+//
+// Stack is contiguous - all the cells are in the current page.
+// Root page is used until it is full, then cells are moved to a new
+// page twice as big, which becomes current, and so on. Root page keeps
+// reference to the current one (common.curr), previous bigger page is
+// released. Page is allocated in persistent memory as usual object,
+// so it is paged in on touch and is saved in snapshot as is.
+//
+// Current page is never shrinked, reset keeps it for the next call
+// (see call frames pool in exec.c).
+//
+// common.prev/next are not used any more. In snapshots made before,
+// stack is a chain of pages linked by next and owned by previous page,
+// curr is not counted. Such stacks are converted on restart, see
+// pvm_convert_thread_stacks().
 
+#define PVM_STACK_MAX_CELLS     (64*1024)
 
-#define   	page_push(v) 		do { s->stack[s->common.free_cell_ptr++] = v; } while(0)
-#define 	page_pop() 		s->stack[--(s->common.free_cell_ptr)]
-#define		page_top() 		s->stack[(s->common.free_cell_ptr)-1]
+static struct pvm_object     pvm_create_general_stack_object(struct pvm_object object_class, int ssize, int da_size );
 
-#define 	page_is_empty()		(s->common.free_cell_ptr == 0)
-#define 	page_is_full() 		(s->common.free_cell_ptr >= s->common.__sSize)
 
-#define    	no_prev() 		pvm_is_null( s->common.prev )
-#define 	no_next() 		pvm_is_null( s->common.next )
+void pvm_stack_underflow( void )
+{
+    pvm_exec_panic( "stack underflow" );
+}
 
-#define    	set_me(to) 		do { rootda->common.curr = to; rootda->curr_da = s = (void *)&(to.data->da); } while(0)
 
+// We use only common and curr_da, so any stack da will do
+static void * general_stack_grow( void *_rootda, struct pvm_object stack_class, unsigned int cells_offset, unsigned int cell_size, unsigned int need )
+{
+    struct data_area_4_object_stack* rootda = _rootda;
+    struct data_area_4_object_stack* s = rootda->curr_da;
 
-#define check_underflow()     \
-    do {                      \
-        if( page_is_empty() ) \
-        {                     \
-            if( no_prev() ) pvm_exec_panic( "stack underflow" ); \
-            set_me( s->common.prev ); \
-        }                             \
-    } while(0);
+    unsigned int used = s->common.free_cell_ptr;
+    unsigned int ssize = s->common.__sSize;
 
-#define check_overflow()                             \
-    do {                                             \
-        if( page_is_full() )                         \
-        {                                            \
-            if( no_next() )                          \
-                {                                    \
-                s->common.next = make();             \
-                set_next_prev();     \
-                }                                    \
-            set_me( s->common.next );                \
-        }                                            \
-    } while(0);
+    while( ssize < used + need )
+        ssize *= 2;
 
+    if( ssize > PVM_STACK_MAX_CELLS )
+        pvm_exec_panic( "stack overflow" );
 
+    struct pvm_object next = pvm_create_general_stack_object( stack_class, ssize, cells_offset + ssize * cell_size );
+    struct data_area_4_object_stack* nda = pvm_object_da( next, object_stack );
 
+    nda->common.root = rootda->common.root;
 
-/**
- *
- * Object stack goes
- *
-**/
+    // Move, not copy - refcounts are not changed, old page gives them up
+    memcpy( ((char *)nda) + cells_offset, ((char *)s) + cells_offset, used * cell_size );
+    nda->common.free_cell_ptr = used;
+    s->common.free_cell_ptr = 0;
 
-#define make()  pvm_create_ostack_object()
-#define set_next_prev()  { pvm_object_da(s->common.next, object_stack)->common.prev = rootda->common.curr; pvm_object_da(s->common.next, object_stack)->common.root = rootda->common.root; }
+    struct pvm_object old = rootda->common.curr;
 
-void pvm_ostack_push( struct data_area_4_object_stack* rootda, struct pvm_object o )
-{
-    struct data_area_4_object_stack* s = rootda->curr_da;
-    check_overflow();
-    if( page_is_full() ) panic("opush page full after mkpage");
-    page_push(o);
-}
+    rootda->common.curr = next;
+    rootda->curr_da = (void *)nda;
 
-struct pvm_object pvm_ostack_pop( struct data_area_4_object_stack* rootda )
-{
-    struct data_area_4_object_stack* s = rootda->curr_da;
-    check_underflow();
-    if( page_is_empty() ) panic("opop page empty");
-    return page_pop();
-}
+    if( old.data != rootda->common.root.data )
+        ref_dec_o( old );
 
-struct pvm_object pvm_ostack_top( struct data_area_4_object_stack* rootda )
-{
-    struct data_area_4_object_stack* s = rootda->curr_da;
-    check_underflow();
-    if( page_is_empty() ) panic("otop page empty");
-    return page_top();
+    return nda;
 }
 
-int pvm_ostack_empty( struct data_area_4_object_stack* rootda )
-{
-    struct data_area_4_object_stack* s = rootda->curr_da;
-    return page_is_empty() && no_prev();
-}
 
 
-void pvm_ostack_abs_set( struct data_area_4_object_stack* rootda, int abs_pos, struct pvm_object val )
+
+
+// Old snapshot page chain, see top of file. Cells are moved to one page.
+static void general_stack_convert( void *_rootda, struct pvm_object stack_class, unsigned int cells_offset, unsigned int cell_size )
 {
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    struct data_area_4_object_stack* rootda = _rootda;
+    struct data_area_4_object_stack* s;
+    struct pvm_object p;
+
+    if( rootda->common.next.data == 0 )
+        return;
 
-    while( abs_pos >= pagesize )
+    unsigned int used = 0;
+    unsigned int ssize = rootda->common.__sSize;
+
+    for( p = rootda->common.root; p.data != 0; p = s->common.next )
     {
-        c = pvm_object_da(c,object_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "o abs_set: out of stack" );
-        abs_pos -= pagesize;
+        s = pvm_object_da( p, object_stack );
+        used += s->common.free_cell_ptr;
     }
 
-    //TODO: assert should be here instead of decrement - it is an error in bytecode compiler/implementation
-    if (pvm_object_da(c,object_stack)->stack[abs_pos].data != 0) ref_dec_o( pvm_object_da(c,object_stack)->stack[abs_pos] ); //decr prev value - avoid memory leak
+    // Pages before last used one are full, so if all fits, it is in root page
+    struct pvm_object curr = rootda->common.root;
+    struct data_area_4_object_stack* cda = rootda;
 
-    pvm_object_da(c,object_stack)->stack[abs_pos] = val;
-}
+    if( used > ssize )
+    {
+        while( ssize < used )
+            ssize *= 2;
+
+        curr = pvm_create_general_stack_object( stack_class, ssize, cells_offset + ssize * cell_size );
+        cda = pvm_object_da( curr, object_stack );
+        cda->common.root = rootda->common.root;
+
+        // Move, not copy - refcounts are not changed, old pages give them up
+        for( p = rootda->common.root; p.data != 0; p = s->common.next )
+        {
+            s = pvm_object_da( p, object_stack );
+
+            memcpy( ((char *)cda) + cells_offset + cda->common.free_cell_ptr * cell_size,
+                    ((char *)s) + cells_offset, s->common.free_cell_ptr * cell_size );
+            cda->common.free_cell_ptr += s->common.free_cell_ptr;
+            s->common.free_cell_ptr = 0;
+        }
+    }
 
-struct pvm_object pvm_ostack_abs_get( struct data_area_4_object_stack* rootda, int abs_pos )
-{
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    // Release pages after root, each one is referenced by next of previous
+    p = rootda->common.next;
+    rootda->common.next.data = 0;
 
-    while( abs_pos >= pagesize )
+    while( p.data != 0 )
     {
-        c = pvm_object_da(c,object_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "o abs_get: out of stack" );
-        abs_pos -= pagesize;
+        s = pvm_object_da( p, object_stack );
+
+        struct pvm_object next = s->common.next;
+        s->common.next.data = 0;
+        s->common.prev.data = 0;
+
+        ref_dec_o( p );
+        p = next;
     }
 
-    return pvm_object_da(c,object_stack)->stack[abs_pos];
+    rootda->common.curr = curr;
+    rootda->curr_da = (void *)cda;
 }
 
-struct pvm_object  pvm_ostack_pull( struct data_area_4_object_stack* rootda, int depth )
+// Convert old snapshot stacks of all the thread call frames
+void pvm_convert_thread_stacks( struct pvm_object thread )
 {
-    if( depth < 0 ) pvm_exec_panic( "stack pull: overflow" );
-
-    struct data_area_4_object_stack* s = rootda->curr_da;
-    // steps up to needed slot from the bottom of the current page
-    int displ = s->common.free_cell_ptr - depth - 1;
-
-    struct pvm_object c = s->common.curr;
+    struct data_area_4_thread *da = pvm_object_da( thread, thread );
+    struct pvm_object cfo;
 
-    while( displ < 0 )
+    for( cfo = da->call_frame; !pvm_is_null( cfo ); cfo = pvm_object_da( cfo, call_frame )->prev )
     {
-        c = pvm_object_da(c,object_stack)->common.prev;
-        if( pvm_is_null(c) ) pvm_exec_panic( "stack pull: underflow" );
-        displ += s->common.__sSize;
+        struct data_area_4_call_frame *cf = pvm_object_da( cfo, call_frame );
+
+        general_stack_convert( &(cf->ostack.data->da), pvm_get_ostack_class(),
+                               __offsetof(struct data_area_4_object_stack, stack), sizeof(struct pvm_object) );
+        general_stack_convert( &(cf->istack.data->da), pvm_get_istack_class(),
+                               __offsetof(struct data_area_4_integer_stack, stack), sizeof(int) );
+        general_stack_convert( &(cf->estack.data->da), pvm_get_estack_class(),
+                               __offsetof(struct data_area_4_exception_stack, stack), sizeof(struct pvm_exception_handler) );
     }
-
-    return pvm_object_da(c,object_stack)->stack[displ];
 }
 
 
+
+
 /**
  *
- * Integer stack goes
+ * Object stack goes
  *
 **/
 
-#undef make
-#undef set_next_prev
-#define make()  pvm_create_istack_object()
-#define set_next_prev()  { pvm_object_da(s->common.next, integer_stack)->common.prev = rootda->common.curr; pvm_object_da(s->common.next, integer_stack)->common.root = rootda->common.root; }
-
-
-
-void pvm_istack_push( struct data_area_4_integer_stack* rootda, int o )
+struct data_area_4_object_stack * pvm_ostack_grow( struct data_area_4_object_stack* rootda, unsigned int need )
 {
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    check_overflow();
-    page_push(o);
+    return general_stack_grow( rootda, pvm_get_ostack_class(),
+                               __offsetof(struct data_area_4_object_stack, stack), sizeof(struct pvm_object), need );
 }
 
-int pvm_istack_pop( struct data_area_4_integer_stack* rootda )
-{
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    check_underflow();
-    return page_pop();
-}
 
-int pvm_istack_top( struct data_area_4_integer_stack* rootda )
+void pvm_ostack_abs_set( struct data_area_4_object_stack* rootda, int abs_pos, struct pvm_object val )
 {
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    check_underflow();
-    return page_top();
-}
+    struct data_area_4_object_stack* s = rootda->curr_da;
 
-int pvm_istack_empty( struct data_area_4_integer_stack* rootda )
-{
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    return page_is_empty() && no_prev();
-}
+    if( abs_pos < 0 || (unsigned)abs_pos >= s->common.__sSize ) pvm_exec_panic( "o abs_set: out of stack" );
 
+    //TODO: assert should be here instead of decrement - it is an error in bytecode compiler/implementation
+    if (s->stack[abs_pos].data != 0) ref_dec_o( s->stack[abs_pos] ); //decr prev value - avoid memory leak
 
+    s->stack[abs_pos] = val;
+}
 
+struct pvm_object pvm_ostack_abs_get( struct data_area_4_object_stack* rootda, int abs_pos )
+{
+    struct data_area_4_object_stack* s = rootda->curr_da;
 
+    if( abs_pos < 0 || (unsigned)abs_pos >= s->common.__sSize ) pvm_exec_panic( "o abs_get: out of stack" );
 
+    return s->stack[abs_pos];
+}
 
-void pvm_istack_abs_set( struct data_area_4_integer_stack* rootda, int abs_pos, int val )
+struct pvm_object  pvm_ostack_pull( struct data_area_4_object_stack* rootda, int depth )
 {
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    if( depth < 0 ) pvm_exec_panic( "stack pull: overflow" );
 
-    while( abs_pos >= pagesize )
-    {
-        c = pvm_object_da(c,integer_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "i abs_set: out of stack" );
-        abs_pos -= pagesize;
-    }
+    struct data_area_4_object_stack* s = rootda->curr_da;
+    int displ = s->common.free_cell_ptr - depth - 1;
+
+    if( displ < 0 ) pvm_exec_panic( "stack pull: underflow" );
 
-    pvm_object_da(c,integer_stack)->stack[abs_pos] = val;
+    return s->stack[displ];
 }
 
-int pvm_istack_abs_get( struct data_area_4_integer_stack* rootda, int abs_pos )
+// Release all the objects on stack, used on call frame reuse.
+// Current page is kept - it will be needed again most likely.
+void pvm_ostack_reset( struct data_area_4_object_stack* rootda )
 {
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    struct data_area_4_object_stack* s = rootda->curr_da;
 
-    while( abs_pos >= pagesize )
-    {
-        c = pvm_object_da(c,integer_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "i abs_get: out of stack" );
-        abs_pos -= pagesize;
-    }
+    unsigned int i;
+    for( i = 0; i < s->common.free_cell_ptr; i++ )
+        ref_dec_o( s->stack[i] );
 
-    return pvm_object_da(c,integer_stack)->stack[abs_pos];
+    s->common.free_cell_ptr = 0;
 }
 
 
-
-
 /**
  *
- * Long stack goes - it's integer stack, but 64 bit access
+ * Integer stack goes
  *
 **/
 
-// NB! We don't redefine - re-use int stack defs above!
-
-//#undef make
-//#undef set_next_prev
-//#define make()  pvm_create_istack_object()
-//#define set_next_prev()  { pvm_object_da(s->common.next, integer_stack)->common.prev = rootda->common.curr; pvm_object_da(s->common.next, integer_stack)->common.root = rootda->common.root; }
-
-#define   	lpage_push(v) 		do { ((int64_t*)s->stack)[s->common.free_cell_ptr++] = v; } while(0)
-#define 	lpage_pop() 		((int64_t*)s->stack)[--(s->common.free_cell_ptr)]
-#define		lpage_top() 		((int64_t*)s->stack)[(s->common.free_cell_ptr)-1]
-
-#define 	lpage_is_empty()		(s->common.free_cell_ptr < 2)
-// -1 for one more element
-#define 	lpage_is_full() 		(s->common.free_cell_ptr >= (s->common.__sSize-1))
-
-
-#define lcheck_underflow()     \
-    do {                      \
-        if( lpage_is_empty() ) \
-        {                     \
-            if( no_prev() ) pvm_exec_panic( "stack underflow" ); \
-            set_me( s->common.prev ); \
-        }                             \
-    } while(0);
-
-#define lcheck_overflow()                             \
-    do {                                             \
-        if( lpage_is_full() )                         \
-        {                                            \
-            if( no_next() )                          \
-                {                                    \
-                s->common.next = make();             \
-                set_next_prev();     \
-                }                                    \
-            set_me( s->common.next );                \
-        }                                            \
-    } while(0);
-
-
-void pvm_lstack_push( struct data_area_4_integer_stack* rootda, int64_t o )
+struct data_area_4_integer_stack * pvm_istack_grow( struct data_area_4_integer_stack* rootda, unsigned int need )
 {
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    lcheck_overflow();
-    lpage_push(o);
-}
-
-int64_t pvm_lstack_pop( struct data_area_4_integer_stack* rootda )
-{
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    lcheck_underflow();
-    return lpage_pop();
+    return general_stack_grow( rootda, pvm_get_istack_class(),
+                               __offsetof(struct data_area_4_integer_stack, stack), sizeof(int), need );
 }
 
-int pvm_lstack_top( struct data_area_4_integer_stack* rootda )
+void pvm_istack_reset( struct data_area_4_integer_stack* rootda )
 {
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    lcheck_underflow();
-    return lpage_top();
+    rootda->curr_da->common.free_cell_ptr = 0;
 }
-/*
-int pvm_istack_empty( struct data_area_4_integer_stack* rootda )
-{
-    struct data_area_4_integer_stack* s = rootda->curr_da;
-    return page_is_empty() && no_prev();
-}
-*/
 
 
-/*
-void pvm_lstack_abs_set( struct data_area_4_integer_stack* rootda, int abs_pos, int val )
+void pvm_istack_abs_set( struct data_area_4_integer_stack* rootda, int abs_pos, int val )
 {
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    struct data_area_4_integer_stack* s = rootda->curr_da;
 
-    while( abs_pos >= pagesize )
-    {
-        c = pvm_object_da(c,integer_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "i abs_set: out of stack" );
-        abs_pos -= pagesize;
-    }
+    if( abs_pos < 0 || (unsigned)abs_pos >= s->common.__sSize ) pvm_exec_panic( "i abs_set: out of stack" );
 
-    pvm_object_da(c,integer_stack)->stack[abs_pos] = val;
+    s->stack[abs_pos] = val;
 }
 
 int pvm_istack_abs_get( struct data_area_4_integer_stack* rootda, int abs_pos )
 {
-    unsigned int pagesize = rootda->common.__sSize;
-    struct pvm_object c = rootda->common.root;
+    struct data_area_4_integer_stack* s = rootda->curr_da;
 
-    while( abs_pos >= pagesize )
-    {
-        c = pvm_object_da(c,integer_stack)->common.next;
-        if( pvm_is_null(c) ) pvm_exec_panic( "i abs_get: out of stack" );
-        abs_pos -= pagesize;
-    }
+    if( abs_pos < 0 || (unsigned)abs_pos >= s->common.__sSize ) pvm_exec_panic( "i abs_get: out of stack" );
 
-    return pvm_object_da(c,integer_stack)->stack[abs_pos];
+    return s->stack[abs_pos];
 }
-*/
 
 
 
 
+// Long and double slots, see stacks.h
 
+void pvm_istack_abs_set64( struct data_area_4_integer_stack* rootda, int abs_pos, union pvm_stack_slot64 val )
+{
+    struct data_area_4_integer_stack* s = rootda->curr_da;
 
+    if( abs_pos < 0 || (unsigned)abs_pos + 1 >= s->common.__sSize ) pvm_exec_panic( "i abs_set64: out of stack" );
+
+    s->stack[abs_pos]   = val.cell[0];
+    s->stack[abs_pos+1] = val.cell[1];
+}
 
+union pvm_stack_slot64 pvm_istack_abs_get64( struct data_area_4_integer_stack* rootda, int abs_pos )
+{
+    struct data_area_4_integer_stack* s = rootda->curr_da;
+    union pvm_stack_slot64 v;
 
+    if( abs_pos < 0 || (unsigned)abs_pos + 1 >= s->common.__sSize ) pvm_exec_panic( "i abs_get64: out of stack" );
 
+    v.cell[0] = s->stack[abs_pos];
+    v.cell[1] = s->stack[abs_pos+1];
+    return v;
+}
 
 
 
@@ -359,52 +311,21 @@ int pvm_istack_abs_get( struct data_area_4_integer_stack* rootda, int abs_pos )
  *
 **/
 
-#undef make
-#undef set_next_prev
-#define make()  pvm_create_estack_object()
-#define set_next_prev()  { pvm_object_da(s->common.next, exception_stack)->common.prev = rootda->common.curr; pvm_object_da(s->common.next, exception_stack)->common.root = rootda->common.root; }
-
-
-
-void pvm_estack_push( struct data_area_4_exception_stack* rootda, struct pvm_exception_handler e )
+struct data_area_4_exception_stack * pvm_estack_grow( struct data_area_4_exception_stack* rootda, unsigned int need )
 {
-    struct data_area_4_exception_stack* s = rootda->curr_da;
-    check_overflow();
-    page_push(e);
+    return general_stack_grow( rootda, pvm_get_estack_class(),
+                               __offsetof(struct data_area_4_exception_stack, stack), sizeof(struct pvm_exception_handler), need );
 }
 
-
-struct pvm_exception_handler pvm_estack_pop( struct data_area_4_exception_stack* rootda )
+void pvm_estack_reset( struct data_area_4_exception_stack* rootda )
 {
     struct data_area_4_exception_stack* s = rootda->curr_da;
-    check_underflow();
-    return page_pop();
-}
 
-struct pvm_exception_handler pvm_estack_top( struct data_area_4_exception_stack* rootda )
-{
-    struct data_area_4_exception_stack* s = rootda->curr_da;
-    check_underflow();
-    return page_top();
-}
+    unsigned int i;
+    for( i = 0; i < s->common.free_cell_ptr; i++ )
+        ref_dec_o( s->stack[i].object );
 
-int pvm_estack_empty( struct data_area_4_exception_stack* rootda )
-{
-    struct data_area_4_exception_stack* s = rootda->curr_da;
-    return page_is_empty() && no_prev();
-}
-
-
-int e_page_foreach( struct data_area_4_exception_stack* s,
-                    void *pass,
-                    int (*func)( void *pass, struct pvm_exception_handler *elem ) )
-{
-    int cell = s->common.free_cell_ptr;
-//printf("check %d estack cells", cell+1 );
-    while( --cell >= 0 )
-        if( func( pass, s->stack+cell ) )
-            return 1;
-    return 0;
+    s->common.free_cell_ptr = 0;
 }
 
 
@@ -414,14 +335,12 @@ int pvm_estack_foreach(
                        int (*func)( void *pass, struct pvm_exception_handler *elem ))
 {
     struct data_area_4_exception_stack* s = rootda->curr_da;
-    struct pvm_object c = s->common.curr;
-    while( !pvm_is_null( c ) )
-    {
-        if( e_page_foreach( pvm_data_area(c,exception_stack), pass, func ) )
+    int cell = s->common.free_cell_ptr;
+
+    while( --cell >= 0 )
+        if( func( pass, s->stack+cell ) )
             return 1;
-        //c = data_area(c)->prev;
-        c = pvm_object_da(c,exception_stack)->common.prev;
-    }
+
     return 0;
 }
 
@@ -429,35 +348,6 @@ int pvm_estack_foreach(
 
 
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
 /**
  *
  * Stack objects creation.
@@ -535,8 +425,12 @@ void pvm_gc_iter_ostack(gc_iterator_call_t func, struct pvm_object_storage * os,
         gc_fcall( func, arg, da->stack[i] );
     }
 
+    // Root page refers to the current one, if it is not the root itself.
+    // Not converted old stack pages are referenced by next.
     if ( da->common.next.data != 0 )
-        gc_fcall( func, arg, da->common.next );  //we are starting from root, so following next is enough. Tail recursion
+        gc_fcall( func, arg, da->common.next );
+    else if ( da->common.curr.data != os )
+        gc_fcall( func, arg, da->common.curr );
 }
 
 
@@ -562,10 +456,12 @@ void pvm_gc_iter_istack(gc_iterator_call_t func, struct pvm_object_storage * os,
 {
     struct data_area_4_object_stack *da = (struct data_area_4_object_stack *)&(os->da);
 
-    // No objects in the integer stack, but please visit linked list ifself
+    // No objects in the integer stack, but please visit current page
 
     if ( da->common.next.data != 0 )
-        gc_fcall( func, arg, da->common.next );  //we are starting from root, so following next is enough. Tail recursion
+        gc_fcall( func, arg, da->common.next );
+    else if ( da->common.curr.data != os )
+        gc_fcall( func, arg, da->common.curr );
 }
 
 
@@ -599,6 +495,8 @@ void pvm_gc_iter_estack(gc_iterator_call_t func, struct pvm_object_storage * os,
     }
 
     if ( da->common.next.data != 0 )
-        gc_fcall( func, arg, da->common.next );  //we are starting from root, so following next is enough. Tail recursion
+        gc_fcall( func, arg, da->common.next );
+    else if ( da->common.curr.data != os )
+        gc_fcall( func, arg, da->common.curr );
 }
 
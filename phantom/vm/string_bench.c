@@ -0,0 +1,191 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * String engine microbenchmark: concatenation in a loop with copy
+ * and with ropes, substring search with naive loop and with
+ * strnstrn (Two-Way), byte and memcmp compare of long strings.
+ *
+ * Kernel debugger command: strbench [pieces]
+ *
+**/
+
+#include <phantom_libc.h>
+#include <phantom_assert.h>
+
+#include <vm/root.h>
+#include <vm/object.h>
+#include <vm/internal_da.h>
+#include <vm/alloc.h>
+
+#include <kernel/init.h>
+#include <kernel/debug.h>
+
+#include <hal.h>
+#include <time.h>
+
+
+#define SB_PIECES               4096
+#define SB_PIECE_SIZE           16
+#define SB_FIND_SIZE            (64*1024)
+#define SB_NEEDLE_SIZE          64
+#define SB_REPEAT               16
+
+
+// What string.find did before
+static const char * sb_naive_find( const char *h, int hl, const char *n, int nl )
+{
+    for( ; hl >= nl; hl--, h++ )
+        if( 0 == memcmp( h, n, nl ) )
+            return h;
+    return 0;
+}
+
+// What string.equals did before
+static int sb_byte_cmp( const char *a, const char *b, int len )
+{
+    while( len-- > 0 )
+        if( *a++ != *b++ )
+            return 1;
+    return 0;
+}
+
+
+static bigtime_t sb_concat( pvm_object_t piece, int n, int use_rope, pvm_object_t *out )
+{
+    pvm_object_t s = pvm_create_string_object( "" );
+    int i;
+
+    bigtime_t start = hal_system_time();
+
+    for( i = 0; i < n; i++ )
+    {
+        pvm_object_t ns;
+
+        if( use_rope )
+            ns = pvm_string_concat( s, piece );
+        else
+            ns = pvm_create_string_object_binary_cat(
+                pvm_get_str_data( s ), pvm_get_str_len( s ),
+                pvm_get_str_data( piece ), pvm_get_str_len( piece ) );
+
+        ref_dec_o( s );
+        s = ns;
+    }
+
+    // Rope is flattened on first access, count it in
+    pvm_string_da( s );
+
+    bigtime_t time = hal_system_time() - start;
+
+    *out = s;
+    return time;
+}
+
+
+static void sb_report( const char *name, bigtime_t time, long long n_ops )
+{
+    printf("%-22s %8lld us, %7lld ns/op\n", name, (long long)time, n_ops ? (long long)time * 1000 / n_ops : 0 );
+}
+
+
+static void string_bench( int ac, char **av )
+{
+    int pieces = SB_PIECES;
+    int i;
+
+    if( ac > 1 )
+        pieces = atoi( av[1] );
+
+    if( pieces <= 0 )
+    {
+        printf("usage: strbench [pieces]\n");
+        return;
+    }
+
+    // Concatenation
+
+    pvm_object_t piece = pvm_create_string_object( "0123456789abcdef" );
+    pvm_object_t s_copy, s_rope;
+
+    printf("Concatenate %d pieces of %d bytes:\n", pieces, SB_PIECE_SIZE );
+    sb_report( " copy", sb_concat( piece, pieces, 0, &s_copy ), pieces );
+    sb_report( " rope", sb_concat( piece, pieces, 1, &s_rope ), pieces );
+
+    if( pvm_strcmp( s_copy, s_rope ) )
+        printf(" ERROR: results differ!\n");
+
+    ref_dec_o( s_copy );
+    ref_dec_o( s_rope );
+    ref_dec_o( piece );
+
+    // Search, worst case for naive loop: aaa...a in aaa...ab
+
+    char *h = malloc( SB_FIND_SIZE );
+    char *n = malloc( SB_NEEDLE_SIZE );
+    if( h == 0 || n == 0 )
+    {
+        printf("out of memory\n");
+        free( h );
+        free( n );
+        return;
+    }
+
+    memset( h, 'a', SB_FIND_SIZE );
+    memset( n, 'a', SB_NEEDLE_SIZE );
+    h[SB_FIND_SIZE-1] = 'b';
+    n[SB_NEEDLE_SIZE-1] = 'b';
+
+    printf("Find %d bytes in %d bytes, %d times:\n", SB_NEEDLE_SIZE, SB_FIND_SIZE, SB_REPEAT );
+
+    const char *r1 = 0, *r2 = 0;
+    bigtime_t start = hal_system_time();
+    for( i = 0; i < SB_REPEAT; i++ )
+        r1 = sb_naive_find( h, SB_FIND_SIZE, n, SB_NEEDLE_SIZE );
+    sb_report( " naive", hal_system_time() - start, SB_REPEAT );
+
+    start = hal_system_time();
+    for( i = 0; i < SB_REPEAT; i++ )
+        r2 = strnstrn( h, SB_FIND_SIZE, n, SB_NEEDLE_SIZE );
+    sb_report( " two way", hal_system_time() - start, SB_REPEAT );
+
+    if( r1 != r2 || r1 != h + SB_FIND_SIZE - SB_NEEDLE_SIZE )
+        printf(" ERROR: wrong position!\n");
+
+    // Compare of equal strings
+
+    pvm_object_t a = pvm_create_string_object_binary( h, SB_FIND_SIZE );
+    pvm_object_t b = pvm_create_string_object_binary( h, SB_FIND_SIZE );
+    int diff = 0;
+
+    printf("Compare equal %d byte strings, %d times:\n", SB_FIND_SIZE, SB_REPEAT );
+
+    start = hal_system_time();
+    for( i = 0; i < SB_REPEAT; i++ )
+        diff |= sb_byte_cmp( pvm_get_str_data( a ), pvm_get_str_data( b ), SB_FIND_SIZE );
+    sb_report( " bytes", hal_system_time() - start, SB_REPEAT );
+
+    start = hal_system_time();
+    for( i = 0; i < SB_REPEAT; i++ )
+        diff |= pvm_strcmp( a, b );
+    sb_report( " memcmp", hal_system_time() - start, SB_REPEAT );
+
+    if( diff )
+        printf(" ERROR: strings differ!\n");
+
+    ref_dec_o( a );
+    ref_dec_o( b );
+
+    free( h );
+    free( n );
+}
+
+
+static void string_bench_init(void)
+{
+    dbg_add_command( string_bench, "strbench", "string concatenation, search and compare cost");
+}
+
+INIT_ME( 0, string_bench_init, 0 )
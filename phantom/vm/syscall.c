@@ -123,7 +123,7 @@ int si_void_2_class(struct pvm_object this_obj, struct data_area_4_thread *tc )
 {
     DEBUG_INFO;
     //ref_inc_o( this_obj.data->_class );  //increment if class is refcounted
-    SYSCALL_RETURN(this_obj.data->_class);
+    SYSCALL_RETURN(pvm_object_class( this_obj ));
 }
 
 int si_void_3_clone(struct pvm_object o, struct data_area_4_thread *tc )
@@ -234,8 +234,9 @@ static int si_int_4_equals(struct pvm_object me, struct data_area_4_thread *tc )
 
     struct pvm_object him = POP_ARG;
 
-    int same_class = me.data->_class.data == him.data->_class.data;
-    int same_value = pvm_get_int(me) == pvm_get_int(him);
+    // Boxed and tagged ints of the same value are equal
+    int same_class = IS_PHANTOM_INT(him);
+    int same_value = same_class && (pvm_get_int(me) == pvm_get_int(him));
 
     SYS_FREE_O(him);
 
@@ -259,6 +260,14 @@ static int si_int_6_toXML(struct pvm_object me, struct data_area_4_thread *tc )
     SYSCALL_THROW_STRING( "int toXML called" );
 }
 
+// Must give the same for boxed and tagged int
+static int si_int_15_hashcode(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    int v = pvm_get_int(me);
+    SYSCALL_RETURN(pvm_create_int_object( calc_hash( (const char *)&v, (const char *)(&v + 1) ) ));
+}
+
 
 syscall_func_t	syscall_table_4_int[16] =
 {
@@ -270,7 +279,7 @@ syscall_func_t	syscall_table_4_int[16] =
     &si_void_8_def_op_1,            	&si_void_9_def_op_2,
     &invalid_syscall,               	&invalid_syscall,
     &invalid_syscall,               	&invalid_syscall,
-    &invalid_syscall,               	&si_void_15_hashcode
+    &invalid_syscall,               	&si_int_15_hashcode
 };
 //int	n_syscall_table_4_int =	(sizeof syscall_table_4_int) / sizeof(syscall_func_t);
 DECLARE_SIZE(int);
@@ -301,8 +310,8 @@ static int si_long_4_equals(struct pvm_object me, struct data_area_4_thread *tc
 
     struct pvm_object him = POP_ARG;
 
-    int same_class = me.data->_class.data == him.data->_class.data;
-    int same_value = pvm_get_long(me) == pvm_get_long(him);
+    int same_class = me.data->_class.data == pvm_object_class( him ).data;
+    int same_value = same_class && (pvm_get_long(me) == pvm_get_long(him));
 
     SYS_FREE_O(him);
 
@@ -360,7 +369,7 @@ static int si_string_3_clone(struct pvm_object me, struct data_area_4_thread *tc
 {
     DEBUG_INFO;
     ASSERT_STRING(me);
-    struct data_area_4_string *meda = pvm_object_da( me, string );
+    struct data_area_4_string *meda = pvm_string_da( me );
     SYSCALL_RETURN(pvm_create_string_object_binary( (char *)meda->data, meda->length ));
 }
 
@@ -378,14 +387,9 @@ static int si_string_4_equals(struct pvm_object me, struct data_area_4_thread *t
     {
         ASSERT_STRING(him);
 
-        struct data_area_4_string *meda = pvm_object_da( me, string );
-        struct data_area_4_string *himda = pvm_object_da( him, string );
-
         ret =
             me.data->_class.data == him.data->_class.data &&
-            meda->length == himda->length &&
-            0 == strncmp( (const char*)meda->data, (const char*)himda->data, meda->length )
-            ;
+            pvm_streq( me, him );
     }
     SYS_FREE_O(him);
 
@@ -403,7 +407,7 @@ static int si_string_8_substring(struct pvm_object me, struct data_area_4_thread
 {
     DEBUG_INFO;
     ASSERT_STRING(me);
-    struct data_area_4_string *meda = pvm_object_da( me, string );
+    struct data_area_4_string *meda = pvm_string_da( me );
 
     int n_param = POP_ISTACK;
     CHECK_PARAM_COUNT(n_param, 2);
@@ -431,7 +435,7 @@ static int si_string_9_charat(struct pvm_object me, struct data_area_4_thread *t
 {
     DEBUG_INFO;
     ASSERT_STRING(me);
-    struct data_area_4_string *meda = pvm_object_da( me, string );
+    struct data_area_4_string *meda = pvm_string_da( me );
 
     int n_param = POP_ISTACK;
     CHECK_PARAM_COUNT(n_param, 1);
@@ -458,12 +462,8 @@ static int si_string_10_concat(struct pvm_object me, struct data_area_4_thread *
     struct pvm_object him = POP_ARG;
     ASSERT_STRING(him);
 
-    struct data_area_4_string *meda = pvm_object_da( me, string );
-    struct data_area_4_string *himda = pvm_object_da( him, string );
-
-    pvm_object_t ret = pvm_create_string_object_binary_cat(
-    		(char *)meda->data, meda->length,
-                (char *)himda->data, himda->length );
+    // Long result is a rope, flattened on first access
+    pvm_object_t ret = pvm_string_concat( me, him );
 
     SYS_FREE_O(him);
 
@@ -475,12 +475,12 @@ static int si_string_11_length(struct pvm_object me, struct data_area_4_thread *
 {
     DEBUG_INFO;
     ASSERT_STRING(me);
-    struct data_area_4_string *meda = pvm_object_da( me, string );
 
     int n_param = POP_ISTACK;
     CHECK_PARAM_COUNT(n_param, 0);
 
-    SYSCALL_RETURN(pvm_create_int_object( meda->length ));
+    // Rope keeps length too, no need to flatten
+    SYSCALL_RETURN(pvm_create_int_object( pvm_get_str_len( me ) ));
 }
 
 static int si_string_12_find(struct pvm_object me, struct data_area_4_thread *tc )
@@ -493,8 +493,8 @@ static int si_string_12_find(struct pvm_object me, struct data_area_4_thread *tc
     struct pvm_object him = POP_ARG;
     ASSERT_STRING(him);
 
-    struct data_area_4_string *meda = pvm_object_da( me, string );
-    struct data_area_4_string *himda = pvm_object_da( him, string );
+    struct data_area_4_string *meda = pvm_string_da( me );
+    struct data_area_4_string *himda = pvm_string_da( him );
 
     unsigned char * ret = (unsigned char *)strnstrn(
     		(char *)meda->data, meda->length,
@@ -510,6 +510,20 @@ static int si_string_12_find(struct pvm_object me, struct data_area_4_thread *tc
     SYSCALL_RETURN(pvm_create_int_object( pos ));
 }
 
+// Equal strings must have equal hash, so rope is hashed as flat copy
+static int si_string_15_hashcode(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    pvm_string_da( me );
+
+    pvm_object_storage_t *p = me.data;
+    if( p->_flags & PHANTOM_OBJECT_STORAGE_FLAG_IS_ROPE )
+        p = pvm_object_da( me, rope )->flat.data;
+
+    void *oa = p->da;
+    SYSCALL_RETURN(pvm_create_int_object( calc_hash( oa, oa + p->_da_size ) ));
+}
+
 
 syscall_func_t	syscall_table_4_string[16] =
 {
@@ -521,7 +535,7 @@ syscall_func_t	syscall_table_4_string[16] =
     &si_string_8_substring, 		&si_string_9_charat,
     &si_string_10_concat, 		&si_string_11_length,
     &si_string_12_find,               &invalid_syscall,
-    &invalid_syscall,               &si_void_15_hashcode
+    &invalid_syscall,               &si_string_15_hashcode
 };
 DECLARE_SIZE(string);
 
@@ -600,7 +614,7 @@ static int si_thread_13_getUser(struct pvm_object me, struct data_area_4_thread
     DEBUG_INFO;
     struct data_area_4_thread *meda = pvm_object_da( me, thread );
 
-    SYSCALL_RETURN(meda->owner);
+    SYSCALL_RETURN(ref_inc_o(meda->owner));
 }
 
 
@@ -947,13 +961,16 @@ static int si_bootstrap_8_load_class(struct pvm_object me, struct data_area_4_th
     struct pvm_object name = POP_ARG;
     ASSERT_STRING(name);
 
-    struct data_area_4_string *nameda = pvm_object_da( name, string );
+    struct data_area_4_string *nameda = pvm_string_da( name );
 
 
     int len = nameda->length > bufs ? bufs : nameda->length;
     memcpy( buf, nameda->data, len );
     buf[len] = '\0';
 
+    // Class is (re)loaded, forget old one
+    pvm_class_cache_remove(name);
+
     SYS_FREE_O(name);
     }
 
@@ -996,7 +1013,7 @@ static int si_bootstrap_9_load_code(struct pvm_object me, struct data_area_4_thr
     char buf[bufs+1];
 
 
-    struct data_area_4_string *nameda = pvm_object_da( name, string );
+    struct data_area_4_string *nameda = pvm_string_da( name );
 
     int len = nameda->length > bufs ? bufs : nameda->length;
     memcpy( buf, nameda->data, len );
@@ -1044,6 +1061,9 @@ static int si_bootstrap_17_register_class_loader(struct pvm_object me, struct da
     pvm_object_storage_t *root = get_root_object_storage();
     pvm_set_field( root, PVM_ROOT_OBJECT_CLASS_LOADER, pvm_root.class_loader );
 
+    // Classes found by the old loader are not ours any more
+    pvm_class_cache_clear();
+
     // Don't need do SYS_FREE_O(loader) since we store it
 
     SYSCALL_RETURN_NOTHING;
@@ -1257,21 +1277,28 @@ static int si_array_8_get_iterator(struct pvm_object me, struct data_area_4_thre
 }
 
 
+// Range must be inside of used part of array
+#define ASSERT_ARRAY_RANGE(__da, __pos, __len) \
+    do { \
+    if( (__pos) < 0 || (__len) < 0 || (__pos) > (__da)->used_slots || (__len) > (__da)->used_slots - (__pos) ) \
+        SYSCALL_THROW_STRING( "array range is out of bounds" ); \
+    } while(0)
+
+
 static int si_array_9_get_subarray(struct pvm_object me, struct data_area_4_thread *tc )
 {
-    (void)me;
     DEBUG_INFO;
 
     int n_param = POP_ISTACK;
     CHECK_PARAM_COUNT(n_param, 2);
 
-    /*
     int len = POP_INT();
     int base = POP_INT();
-    SYSCALL_RETURN();
-    */
 
-    SYSCALL_THROW_STRING( "get subarray is not implemented yet" );
+    struct data_area_4_array *da = (struct data_area_4_array *)me.data->da;
+    ASSERT_ARRAY_RANGE( da, base, len );
+
+    SYSCALL_RETURN( pvm_array_subarray( me.data, base, len ) );
 }
 
 
@@ -1323,10 +1350,270 @@ static int si_array_12_size(struct pvm_object me, struct data_area_4_thread *tc
     SYSCALL_RETURN(pvm_create_int_object( da->used_slots ) );
 }
 
+// copy_range( dst_pos, src, src_pos, len ), dst grows if needed
+static int si_array_13_copy_range(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
 
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 4);
+
+    int len = POP_INT();
+    int src_pos = POP_INT();
+    struct pvm_object src = POP_ARG;
+    int dst_pos = POP_INT();
 
+    if( !pvm_object_class_is( src, pvm_get_array_class() ) )
+    {
+        SYS_FREE_O(src);
+        SYSCALL_THROW_STRING( "array copy_range: not an array" );
+    }
+
+    struct data_area_4_array *da = (struct data_area_4_array *)me.data->da;
+    struct data_area_4_array *sda = (struct data_area_4_array *)src.data->da;
+
+    if( dst_pos < 0 || dst_pos > da->used_slots ||
+        src_pos < 0 || len < 0 || src_pos > sda->used_slots || len > sda->used_slots - src_pos )
+    {
+        SYS_FREE_O(src);
+        SYSCALL_THROW_STRING( "array range is out of bounds" );
+    }
+
+    pvm_array_copy_range( me.data, dst_pos, src.data, src_pos, len );
+
+    SYS_FREE_O(src);
+    SYSCALL_RETURN_NOTHING;
+}
+
+// fill( value, pos, len ), array grows if needed
+static int si_array_14_fill(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 3);
+
+    int len = POP_INT();
+    int pos = POP_INT();
+    struct pvm_object value = POP_ARG;
+
+    struct data_area_4_array *da = (struct data_area_4_array *)me.data->da;
+
+    if( pos < 0 || len < 0 || pos > da->used_slots )
+    {
+        SYS_FREE_O(value);
+        SYSCALL_THROW_STRING( "array range is out of bounds" );
+    }
+
+    pvm_array_fill( me.data, pos, len, value );
+
+    SYS_FREE_O(value);
+    SYSCALL_RETURN_NOTHING;
+}
 
-syscall_func_t	syscall_table_4_array[16] =
+// insert_range( pos, src ) - insert all of src at pos
+static int si_array_16_insert_range(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 2);
+
+    struct pvm_object src = POP_ARG;
+    int pos = POP_INT();
+
+    if( !pvm_object_class_is( src, pvm_get_array_class() ) )
+    {
+        SYS_FREE_O(src);
+        SYSCALL_THROW_STRING( "array insert_range: not an array" );
+    }
+
+    struct data_area_4_array *da = (struct data_area_4_array *)me.data->da;
+    int len = get_array_size( src.data );
+
+    if( pos < 0 || pos > da->used_slots )
+    {
+        SYS_FREE_O(src);
+        SYSCALL_THROW_STRING( "array range is out of bounds" );
+    }
+
+    // Insert to itself: src slots move
+    if( src.data == me.data )
+    {
+        pvm_array_insert_range( me.data, pos, len );
+        pvm_array_copy_range( me.data, pos, me.data, 0, pos );
+        pvm_array_copy_range( me.data, 2*pos, me.data, pos+len, len-pos );
+    }
+    else
+    {
+        pvm_array_insert_range( me.data, pos, len );
+        pvm_array_copy_range( me.data, pos, src.data, 0, len );
+    }
+
+    SYS_FREE_O(src);
+    SYSCALL_RETURN_NOTHING;
+}
+
+// remove_range( pos, len )
+static int si_array_17_remove_range(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 2);
+
+    int len = POP_INT();
+    int pos = POP_INT();
+
+    struct data_area_4_array *da = (struct data_area_4_array *)me.data->da;
+    ASSERT_ARRAY_RANGE( da, pos, len );
+
+    pvm_array_remove_range( me.data, pos, len );
+
+    SYSCALL_RETURN_NOTHING;
+}
+
+
+// Ints and strings have natural order. Comparator object's
+// method 8 is called as compare( a, b ) and returns int.
+
+struct array_sort
+{
+    struct pvm_object           comparator;
+    struct pvm_object *         tmp;
+    int                         failed;
+};
+
+static int array_sort_cmp( struct array_sort *s, struct pvm_object a, struct pvm_object b )
+{
+    if( !pvm_is_null( s->comparator ) )
+    {
+        struct pvm_object args[2] = { a, b };
+        struct pvm_object r = pvm_exec_run_method( s->comparator, 8, 2, args );
+        int v = IS_PHANTOM_INT(r) ? pvm_get_int( r ) : 0;
+        ref_dec_o( r );
+        return v;
+    }
+
+    if( IS_PHANTOM_INT(a) && IS_PHANTOM_INT(b) )
+    {
+        int ia = pvm_get_int( a ), ib = pvm_get_int( b );
+        return (ia > ib) - (ia < ib);
+    }
+
+    if( IS_PHANTOM_STRING(a) && IS_PHANTOM_STRING(b) )
+        return pvm_strcmp( a, b );
+
+    s->failed = 1;
+    return 0;
+}
+
+// Stable merge sort
+static void array_sort( struct array_sort *s, struct pvm_object *p, int n )
+{
+    if( n < 2 || s->failed )
+        return;
+
+    int h = n / 2;
+    array_sort( s, p, h );
+    array_sort( s, p + h, n - h );
+
+    // Already in order
+    if( s->failed || array_sort_cmp( s, p[h-1], p[h] ) <= 0 )
+        return;
+
+    memcpy( s->tmp, p, h * sizeof(struct pvm_object) );
+
+    int i = 0, j = h, k = 0;
+    while( i < h && j < n )
+    {
+        if( array_sort_cmp( s, p[j], s->tmp[i] ) < 0 )
+            p[k++] = p[j++];
+        else
+            p[k++] = s->tmp[i++];
+    }
+
+    while( i < h )
+        p[k++] = s->tmp[i++];
+}
+
+// sort( comparator ), comparator can be null for ints and strings
+static int si_array_18_sort(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 1);
+
+    struct array_sort s;
+    s.comparator = POP_ARG;
+    s.failed = 0;
+
+    int n = get_array_size( me.data );
+    if( n < 2 )
+    {
+        SYS_FREE_O(s.comparator);
+        SYSCALL_RETURN_NOTHING;
+    }
+
+    struct pvm_object *p = calloc( n + n/2 + 1, sizeof(struct pvm_object) );
+    if( p == 0 )
+    {
+        SYS_FREE_O(s.comparator);
+        SYSCALL_THROW_STRING( "array sort: out of memory" );
+    }
+    s.tmp = p + n;
+
+    int i;
+    struct pvm_object *slots = pvm_array_slots( me.data );
+
+    if( pvm_is_null( s.comparator ) )
+    {
+        // No code is called, sort in place. Slots are moved.
+        for( i = 0; i < n; i++ )
+            gc_write_barrier( slots[i].data );
+
+        array_sort( &s, slots, n );
+    }
+    else
+    {
+        // Sort a copy - comparator code can change array
+        for( i = 0; i < n; i++ )
+            p[i] = ref_inc_o( slots[i] );
+
+        array_sort( &s, p, n );
+
+        if( !s.failed && get_array_size( me.data ) == n )
+        {
+            slots = pvm_array_slots( me.data );
+            for( i = 0; i < n; i++ )
+            {
+                struct pvm_object old = slots[i];
+                slots[i] = p[i];
+                ref_dec_o( old );
+            }
+        }
+        else
+        {
+            for( i = 0; i < n; i++ )
+                ref_dec_o( p[i] );
+        }
+    }
+
+    free( p );
+
+    SYS_FREE_O(s.comparator);
+
+    if( s.failed )
+        SYSCALL_THROW_STRING( "array sort: can't compare, need comparator" );
+
+    SYSCALL_RETURN_NOTHING;
+}
+
+
+
+
+syscall_func_t	syscall_table_4_array[20] =
 {
     &si_void_0_construct,           &si_void_1_destruct,
     &si_void_2_class,               &si_void_3_clone,
@@ -1335,9 +1622,11 @@ syscall_func_t	syscall_table_4_array[16] =
     // 8
     &si_array_8_get_iterator,       &si_array_9_get_subarray,
     &si_array_10_get,               &si_array_11_set,
-    &si_array_12_size,               &invalid_syscall,
-    &invalid_syscall,               &si_void_15_hashcode
+    &si_array_12_size,              &si_array_13_copy_range,
+    &si_array_14_fill,              &si_void_15_hashcode,
     // 16
+    &si_array_16_insert_range,      &si_array_17_remove_range,
+    &si_array_18_sort,              &invalid_syscall,
 
 };
 DECLARE_SIZE(array);
@@ -1535,7 +1824,7 @@ static int si_bitmap_8_fromstring(struct pvm_object me, struct data_area_4_threa
 
     pvm_object_t _s = POP_ARG;
 
-    if( drv_video_string2bmp( da, pvm_object_da( _s, string)->data ) )
+    if( drv_video_string2bmp( da, pvm_string_da( _s )->data ) )
     	SYSCALL_THROW_STRING("can not parse graphics data");
 
     SYS_FREE_O(_s);
@@ -1739,7 +2028,7 @@ DECLARE_SIZE(weakref);
 
 // --------- directory -------------------------------------------------------
 
-// TODO dir mutex!
+// See directory.c for implementation
 
 static int si_directory_5_tostring(struct pvm_object o, struct data_area_4_thread *tc )
 {
@@ -1748,34 +2037,127 @@ static int si_directory_5_tostring(struct pvm_object o, struct data_area_4_threa
     SYSCALL_RETURN(pvm_create_string_object( "(directory)" ));
 }
 
-errno_t directory_put( struct pvm_object dir, const char *name, struct pvm_object o )
+#define DIR_NAME_MAX 256
+
+// Directory functions get C string, returns 0 if arg is not a string or too long
+static int dir_name_arg( pvm_object_t _s, char *name )
+{
+    if(!IS_PHANTOM_STRING(_s))
+        return 0;
+
+    int slen = pvm_get_str_len(_s);
+    if( slen+1 > DIR_NAME_MAX )
+        return 0;
+
+    memcpy( name, pvm_get_str_data(_s), slen );
+    name[slen] = 0;
+
+    return 1;
+}
+
+// Returns value or null
+static int si_directory_8_get(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    char name[DIR_NAME_MAX];
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 1);
+
+    pvm_object_t _s = POP_ARG;
+
+    if( !dir_name_arg( _s, name ) )
+    {
+        SYS_FREE_O(_s);
+        SYSCALL_THROW_STRING( "directory.get: not a string or too long" );
+    }
+    SYS_FREE_O(_s);
+
+    SYSCALL_RETURN( directory_get( me, name ) );
+}
+
+static int si_directory_9_put(struct pvm_object me, struct data_area_4_thread *tc )
 {
-    struct data_area_4_directory *da = pvm_object_da( dir, directory );
-    (void)da;
-    return ENOMEM;
+    DEBUG_INFO;
+    char name[DIR_NAME_MAX];
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 2);
+
+    pvm_object_t value = POP_ARG;
+    pvm_object_t _s = POP_ARG;
+
+    if( !dir_name_arg( _s, name ) )
+    {
+        SYS_FREE_O(_s);
+        SYS_FREE_O(value);
+        SYSCALL_THROW_STRING( "directory.put: not a string or too long" );
+    }
+    SYS_FREE_O(_s);
+
+    // Directory takes own reference
+    errno_t rc = directory_put( me, name, value );
+    SYS_FREE_O(value);
+
+    if( rc )
+        SYSCALL_THROW_STRING( "directory.put: null value" );
+
+    SYSCALL_RETURN_NOTHING;
+}
+
+// Returns 1 if removed, 0 if there was no such name
+static int si_directory_10_remove(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    char name[DIR_NAME_MAX];
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 1);
+
+    pvm_object_t _s = POP_ARG;
+
+    if( !dir_name_arg( _s, name ) )
+    {
+        SYS_FREE_O(_s);
+        SYSCALL_THROW_STRING( "directory.remove: not a string or too long" );
+    }
+    SYS_FREE_O(_s);
+
+    SYSCALL_RETURN(pvm_create_int_object( 0 == directory_remove( me, name ) ));
 }
 
-pvm_object_t directory_get( struct pvm_object dir, const char *name )
+// Returns array of names
+static int si_directory_11_iterate(struct pvm_object me, struct data_area_4_thread *tc )
 {
-    struct data_area_4_directory *da = pvm_object_da( dir, directory );
-    (void)da;
-    return pvm_create_null_object();
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 0);
+
+    SYSCALL_RETURN( directory_iterate( me, 0 ) );
 }
 
-errno_t directory_remove( struct pvm_object dir, const char *name )
+static int si_directory_12_size(struct pvm_object me, struct data_area_4_thread *tc )
 {
-    struct data_area_4_directory *da = pvm_object_da( dir, directory );
-    (void)da;
-    return ENOMEM;
+    DEBUG_INFO;
+    struct data_area_4_directory *da = pvm_object_da( me, directory );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 0);
+
+    // Not converted old directory has nEntries too, and it is 0
+    SYSCALL_RETURN(pvm_create_int_object( da->nEntries ));
 }
 
-// Returns iterator
-pvm_object_t directory_iterate( struct pvm_object dir )
+// Returns array of names in sorted order
+static int si_directory_13_sorted(struct pvm_object me, struct data_area_4_thread *tc )
 {
-    struct data_area_4_directory *da = pvm_object_da( dir, directory );
-    (void)da;
-    // TODO implement dir iterator
-    return pvm_create_null_object();
+    DEBUG_INFO;
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 0);
+
+    SYSCALL_RETURN( directory_iterate( me, 1 ) );
 }
 
 
@@ -1786,9 +2168,9 @@ syscall_func_t	syscall_table_4_directory[16] =
     &si_void_4_equals,              &si_directory_5_tostring,
     &si_void_6_toXML,               &si_void_7_fromXML,
     // 8
-    &invalid_syscall, 	    	    &invalid_syscall,
-    &invalid_syscall, 	    	    &invalid_syscall,
-    &invalid_syscall,               &invalid_syscall,
+    &si_directory_8_get,            &si_directory_9_put,
+    &si_directory_10_remove,        &si_directory_11_iterate,
+    &si_directory_12_size,          &si_directory_13_sorted,
     &invalid_syscall,               &si_void_15_hashcode,
 
 };
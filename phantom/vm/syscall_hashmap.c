@@ -0,0 +1,474 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Hash map internal class: .internal.container.hashmap
+ *
+ * Any object can be a key. Keys are hashed and compared with their
+ * own hashcode (15) and equals (4) syscalls. Objects with default
+ * (identity) equals are hashed by address, as default hashcode hashes
+ * object contents, which can change. Non-internal classes have no
+ * syscalls and are compared by identity too.
+ *
+ * Persistent: table is a binary object with an array of bucket
+ * references, bucket is a binary object with an array of
+ * struct pvm_hashmap_entry, exactly sized. Bucket is replaced on
+ * insert and remove, chains are short. Table doubles when there
+ * are more entries than buckets. See pvm_gc_iter_hashmap().
+ *
+**/
+
+#include <phantom_libc.h>
+#include <hal.h>
+
+#include <vm/syscall.h>
+#include <vm/object.h>
+#include <vm/root.h>
+#include <vm/exec.h>
+#include <vm/alloc.h>
+
+#include <vm/p2c.h>
+
+#include <kernel/init.h>
+
+
+static int debug_print = 0;
+
+
+#define HM_SYS_EQUALS           4
+#define HM_SYS_HASHCODE         15
+
+
+static hal_mutex_t  _hm_mutex;
+static hal_mutex_t  *hm_mutex; // 0 before threads start
+
+#define HM_LOCK()       do { if(hm_mutex) hal_mutex_lock( hm_mutex ); } while(0)
+#define HM_UNLOCK()     do { if(hm_mutex) hal_mutex_unlock( hm_mutex ); } while(0)
+
+
+// --------- keys ------------------------------------------------------------
+
+static int hm_is_identity( pvm_object_t key )
+{
+    syscall_func_t f = pvm_exec_get_syscall( key, HM_SYS_EQUALS );
+    return f == 0 || f == si_void_4_equals;
+}
+
+// Returns 0 and exception in *ex if key's hashcode throws
+static int hm_hash( struct data_area_4_thread *tc, pvm_object_t key, int *hash, pvm_object_t *ex )
+{
+    if( hm_is_identity( key ) )
+    {
+        addr_t a = (addr_t)key.data;
+        *hash = (int)(a ^ (a >> 9));
+        return 1;
+    }
+
+    pvm_object_t r;
+    if( !pvm_exec_run_syscall( tc, key, HM_SYS_HASHCODE, 0, 0, &r ) )
+    {
+        *ex = r;
+        return 0;
+    }
+
+    if( !IS_PHANTOM_INT(r) )
+    {
+        ref_dec_o( r );
+        *ex = pvm_create_string_object( "hashmap: hashcode is not int" );
+        return 0;
+    }
+
+    *hash = pvm_get_int( r );
+    ref_dec_o( r );
+    return 1;
+}
+
+// Returns 0 and exception in *ex if key's equals throws
+static int hm_equals( struct data_area_4_thread *tc, pvm_object_t a, pvm_object_t b, int *eq, pvm_object_t *ex )
+{
+    *eq = 1;
+    if( a.data == b.data )
+        return 1;
+
+    // Equals of most classes can't take other class argument
+    *eq = 0;
+    if( hm_is_identity( a ) || pvm_object_class( a ).data != pvm_object_class( b ).data )
+        return 1;
+
+    pvm_object_t r;
+    if( !pvm_exec_run_syscall( tc, a, HM_SYS_EQUALS, 1, &b, &r ) )
+    {
+        *ex = r;
+        return 0;
+    }
+
+    *eq = IS_PHANTOM_INT(r) && pvm_get_int( r );
+    ref_dec_o( r );
+    return 1;
+}
+
+
+// --------- buckets ---------------------------------------------------------
+
+static pvm_object_t * hm_table( struct data_area_4_hashmap *da )
+{
+    return (pvm_object_t *)pvm_object_da( da->buckets, binary )->data;
+}
+
+static int hm_bucket_size( pvm_object_t b )
+{
+    if( b.data == 0 )
+        return 0;
+
+    return pvm_object_da( b, binary )->data_size / sizeof(struct pvm_hashmap_entry);
+}
+
+static struct pvm_hashmap_entry * hm_bucket_entries( pvm_object_t b )
+{
+    return (struct pvm_hashmap_entry *)pvm_object_da( b, binary )->data;
+}
+
+// Entry references are moved to new bucket - let snapshot marker see them
+static void hm_drop_bucket( pvm_object_t b )
+{
+    int i, n = hm_bucket_size( b );
+    struct pvm_hashmap_entry *e = hm_bucket_entries( b );
+
+    for( i = 0; i < n; i++ )
+    {
+        gc_write_barrier( e[i].key.data );
+        gc_write_barrier( e[i].value.data );
+    }
+
+    ref_dec_o( b );
+}
+
+// Returns entry index or -1, 0 and exception in *ex if key's equals throws
+static int hm_find( struct data_area_4_thread *tc, pvm_object_t b, int hash, pvm_object_t key, int *index, pvm_object_t *ex )
+{
+    int i, n = hm_bucket_size( b );
+
+    *index = -1;
+
+    for( i = 0; i < n; i++ )
+    {
+        struct pvm_hashmap_entry *e = hm_bucket_entries( b ) + i;
+        int eq;
+
+        if( e->hash != hash )
+            continue;
+
+        if( !hm_equals( tc, e->key, key, &eq, ex ) )
+            return 0;
+
+        if( eq )
+        {
+            *index = i;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+
+static void hm_rehash( struct data_area_4_hashmap *da, u_int32_t new_n )
+{
+    pvm_object_t *old = hm_table( da );
+    u_int32_t i, mask = new_n - 1;
+    int j;
+
+    int *fill = calloc( new_n, sizeof(int) );
+    if( fill == 0 )
+        return; // Just longer chains
+
+    pvm_object_t nb = pvm_create_binary_object( sizeof(pvm_object_t) * new_n, 0 );
+    pvm_object_t *t = (pvm_object_t *)pvm_object_da( nb, binary )->data;
+
+    // Exact bucket sizes first
+    for( i = 0; i < da->nBuckets; i++ )
+    {
+        int n = hm_bucket_size( old[i] );
+        for( j = 0; j < n; j++ )
+            fill[hm_bucket_entries( old[i] )[j].hash & mask]++;
+    }
+
+    for( i = 0; i < new_n; i++ )
+    {
+        if( fill[i] )
+            t[i] = pvm_create_binary_object( fill[i] * sizeof(struct pvm_hashmap_entry), 0 );
+        fill[i] = 0;
+    }
+
+    for( i = 0; i < da->nBuckets; i++ )
+    {
+        int n = hm_bucket_size( old[i] );
+        for( j = 0; j < n; j++ )
+        {
+            struct pvm_hashmap_entry *e = hm_bucket_entries( old[i] ) + j;
+            u_int32_t k = e->hash & mask;
+            hm_bucket_entries( t[k] )[fill[k]++] = *e;
+        }
+
+        if( old[i].data )
+            hm_drop_bucket( old[i] );
+    }
+
+    free( fill );
+
+    ref_dec_o( da->buckets );
+    da->buckets = nb;
+    da->nBuckets = new_n;
+}
+
+
+// --------- syscalls --------------------------------------------------------
+
+static int si_hashmap_5_tostring(struct pvm_object o, struct data_area_4_thread *tc )
+{
+    (void)o;
+    DEBUG_INFO;
+    SYSCALL_RETURN(pvm_create_string_object( "(hashmap)" ));
+}
+
+
+static int si_hashmap_8_get(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    struct data_area_4_hashmap *da = pvm_object_da( me, hashmap );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 1);
+
+    pvm_object_t key = POP_ARG;
+    pvm_object_t ex, ret = pvm_create_null_object();
+    int hash, i;
+
+    if( !hm_hash( tc, key, &hash, &ex ) )
+    {
+        SYS_FREE_O(key);
+        SYSCALL_THROW(ex);
+    }
+
+    HM_LOCK();
+
+    pvm_object_t b = hm_table( da )[hash & (da->nBuckets - 1)];
+
+    if( !hm_find( tc, b, hash, key, &i, &ex ) )
+    {
+        HM_UNLOCK();
+        SYS_FREE_O(key);
+        SYSCALL_THROW(ex);
+    }
+
+    if( i >= 0 )
+        ret = ref_inc_o( hm_bucket_entries( b )[i].value );
+
+    HM_UNLOCK();
+
+    SYS_FREE_O(key);
+    SYSCALL_RETURN(ret);
+}
+
+
+// Returns previous value or null
+static int si_hashmap_9_put(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    struct data_area_4_hashmap *da = pvm_object_da( me, hashmap );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 2);
+
+    pvm_object_t value = POP_ARG;
+    pvm_object_t key = POP_ARG;
+    pvm_object_t ex, ret = pvm_create_null_object();
+    int hash, i;
+
+    if( !hm_hash( tc, key, &hash, &ex ) )
+    {
+        SYS_FREE_O(key);
+        SYS_FREE_O(value);
+        SYSCALL_THROW(ex);
+    }
+
+    HM_LOCK();
+
+    pvm_object_t *slot = hm_table( da ) + (hash & (da->nBuckets - 1));
+
+    if( !hm_find( tc, *slot, hash, key, &i, &ex ) )
+    {
+        HM_UNLOCK();
+        SYS_FREE_O(key);
+        SYS_FREE_O(value);
+        SYSCALL_THROW(ex);
+    }
+
+    if( i >= 0 )
+    {
+        // Value reference goes to caller
+        ret = hm_bucket_entries( *slot )[i].value;
+        gc_write_barrier( ret.data );
+        hm_bucket_entries( *slot )[i].value = value;
+        SYS_FREE_O(key);
+    }
+    else
+    {
+        int n = hm_bucket_size( *slot );
+        pvm_object_t nb = pvm_create_binary_object( (n + 1) * sizeof(struct pvm_hashmap_entry), 0 );
+        struct pvm_hashmap_entry *e = hm_bucket_entries( nb );
+
+        if( n )
+        {
+            memcpy( e, hm_bucket_entries( *slot ), n * sizeof(struct pvm_hashmap_entry) );
+            hm_drop_bucket( *slot );
+        }
+
+        // Key and value references are passed to map
+        e[n].hash = hash;
+        e[n].key = key;
+        e[n].value = value;
+
+        *slot = nb;
+
+        if( ++da->nEntries > da->nBuckets )
+            hm_rehash( da, da->nBuckets * 2 );
+    }
+
+    HM_UNLOCK();
+
+    SYSCALL_RETURN(ret);
+}
+
+
+// Returns removed value or null
+static int si_hashmap_10_remove(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    struct data_area_4_hashmap *da = pvm_object_da( me, hashmap );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 1);
+
+    pvm_object_t key = POP_ARG;
+    pvm_object_t ex, ret = pvm_create_null_object();
+    int hash, i;
+
+    if( !hm_hash( tc, key, &hash, &ex ) )
+    {
+        SYS_FREE_O(key);
+        SYSCALL_THROW(ex);
+    }
+
+    HM_LOCK();
+
+    pvm_object_t *slot = hm_table( da ) + (hash & (da->nBuckets - 1));
+
+    if( !hm_find( tc, *slot, hash, key, &i, &ex ) )
+    {
+        HM_UNLOCK();
+        SYS_FREE_O(key);
+        SYSCALL_THROW(ex);
+    }
+
+    if( i >= 0 )
+    {
+        int n = hm_bucket_size( *slot );
+        struct pvm_hashmap_entry *old = hm_bucket_entries( *slot );
+        pvm_object_t nb = { 0, 0 };
+
+        if( n > 1 )
+        {
+            nb = pvm_create_binary_object( (n - 1) * sizeof(struct pvm_hashmap_entry), 0 );
+            struct pvm_hashmap_entry *e = hm_bucket_entries( nb );
+
+            memcpy( e, old, i * sizeof(struct pvm_hashmap_entry) );
+            memcpy( e + i, old + i + 1, (n - i - 1) * sizeof(struct pvm_hashmap_entry) );
+        }
+
+        // Value reference goes to caller
+        ret = old[i].value;
+        ref_dec_o( old[i].key );
+
+        hm_drop_bucket( *slot );
+        *slot = nb;
+
+        da->nEntries--;
+    }
+
+    HM_UNLOCK();
+
+    SYS_FREE_O(key);
+    SYSCALL_RETURN(ret);
+}
+
+
+// Returns array of keys
+static int si_hashmap_11_iterate(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    struct data_area_4_hashmap *da = pvm_object_da( me, hashmap );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 0);
+
+    pvm_object_t ret = pvm_create_object( pvm_get_array_class() );
+    u_int32_t i;
+    int j;
+
+    HM_LOCK();
+
+    pvm_object_t *t = hm_table( da );
+    for( i = 0; i < da->nBuckets; i++ )
+    {
+        int n = hm_bucket_size( t[i] );
+        for( j = 0; j < n; j++ )
+            pvm_append_array( ret.data, ref_inc_o( hm_bucket_entries( t[i] )[j].key ) );
+    }
+
+    HM_UNLOCK();
+
+    SYSCALL_RETURN(ret);
+}
+
+
+static int si_hashmap_12_size(struct pvm_object me, struct data_area_4_thread *tc )
+{
+    DEBUG_INFO;
+    struct data_area_4_hashmap *da = pvm_object_da( me, hashmap );
+
+    int n_param = POP_ISTACK;
+    CHECK_PARAM_COUNT(n_param, 0);
+
+    SYSCALL_RETURN(pvm_create_int_object( da->nEntries ));
+}
+
+
+syscall_func_t	syscall_table_4_hashmap[16] =
+{
+    &si_void_0_construct,           &si_void_1_destruct,
+    &si_void_2_class,               &si_void_3_clone,
+    &si_void_4_equals,              &si_hashmap_5_tostring,
+    &si_void_6_toXML,               &si_void_7_fromXML,
+    // 8
+    &si_hashmap_8_get,              &si_hashmap_9_put,
+    &si_hashmap_10_remove,          &si_hashmap_11_iterate,
+    &si_hashmap_12_size,            &invalid_syscall,
+    &invalid_syscall,               &si_void_15_hashcode,
+
+};
+DECLARE_SIZE(hashmap);
+
+
+
+static void hashmap_init(void)
+{
+    if( hal_mutex_init( &_hm_mutex, "HashMap" ) )
+        panic("Can't init hashmap mutex");
+
+    hm_mutex = &_hm_mutex;
+}
+
+INIT_ME( 0, hashmap_init, 0 )
@@ -231,6 +231,12 @@ int vm_syscall_block( pvm_object_t this, struct data_area_4_thread *tc, pvm_obje
     return 0; // throw!
 }
 
+void vm_syscall_block_begin(void) {}
+void vm_syscall_block_end(void) {}
+
+void phantom_vm_threads_add(void) {}
+void phantom_vm_threads_remove(void) {}
+
 int phantom_dev_keyboard_getc(void)
 {
     return getchar();
@@ -620,6 +626,11 @@ long fast_time(void)
     return time(0);
 }
 
+bigtime_t hal_system_time(void)
+{
+    return win_hal_system_time();
+}
+
 
 #warning stub
 struct _key_event;
@@ -41,6 +41,16 @@ void win_hal_sleep_msec( int miliseconds )
     Sleep(miliseconds);
 }
 
+long long win_hal_system_time(void)
+{
+    LARGE_INTEGER freq, now;
+
+    if( !QueryPerformanceFrequency( &freq ) || !QueryPerformanceCounter( &now ) )
+        return ((long long)GetTickCount()) * 1000;
+
+    return (now.QuadPart / freq.QuadPart) * 1000000 + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart;
+}
+
 
 
 
@@ -28,6 +28,8 @@ extern char * win_src_screen_image;
 void win_hal_init( void );
 
 void win_hal_sleep_msec( int miliseconds );
+// Microseconds since some moment in the past
+long long win_hal_system_time(void);
 
 void win_hal_disable_preemption(void);
 void win_hal_enable_preemption(void);
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include "../../include/vm/bulk.h"
+#include <stdint.h>
+#include <lzma.h>
+
+#include "mkbulk.h"
 
 FILE *outf;
 
@@ -33,62 +36,113 @@ int fn2cn( char *out, const char *in, int outsz )
     return 1;
 }
 
-/*
-void save_hdr( char *classnm, long size )
+// Normalize class name as loader compares it
+static void cnnorm( char *cn )
 {
-    struct pvm_bulk_class_head h;
-    strncpy( h.name, classnm, PVM_BULK_CN_LENGTH );
-    h.data_length = size;
+    char *p;
+
+    for( p = cn; *p; p++ )
+        if( *p == '/' ) *p = '.';
 
-    //return 1 ==
-    fwrite( &h, sizeof(h), 1, outf );
+    if( *cn == '.' )
+        memmove( cn, cn+1, strlen(cn) );
 }
-*/
 
-void copyf( FILE *outfp, FILE *infp, int lencheck )
+static int cncmp( const void *a, const void *b )
 {
-    fseek( infp, 0L, SEEK_SET );
+    const struct mkbulk_class *ca = a;
+    const struct mkbulk_class *cb = b;
+
+    int rc = strcmp( ca->name, cb->name );
+    return rc ? rc : ca->order - cb->order;
+}
+
+
+// Returns 0 if packed is not smaller
+static int pack( struct mkbulk_class *c )
+{
+    lzma_options_lzma opt;
+    lzma_stream strm = LZMA_STREAM_INIT;
 
-    const int bs = 8192;
-    char buf[bs];
+    if( lzma_lzma_preset( &opt, 9 | LZMA_PRESET_EXTREME ) )
+        return 0;
 
-    int len;
+    if( LZMA_OK != lzma_alone_encoder( &strm, &opt ) )
+        return 0;
 
-    while(!feof(infp))
+    size_t outsz = lzma_stream_buffer_bound( c->data_length );
+    uint8_t *out = malloc( outsz );
+    if( out == 0 )
     {
-        len = fread( buf, 1, bs, infp );
-        if( len < 0 )
-        {
-            printf("Read error\n");
-            exit(2);
-        }
+        lzma_end( &strm );
+        return 0;
+    }
 
-        int res = fwrite( buf, 1, len, outfp );
-        if( len != res )
-        {
-            printf("Write error\n");
-            exit(2);
-        }
+    strm.next_in = c->data;
+    strm.avail_in = c->data_length;
+    strm.next_out = out;
+    strm.avail_out = outsz;
+
+    lzma_ret rc = lzma_code( &strm, LZMA_FINISH );
+    long len = outsz - strm.avail_out;
 
-        lencheck -= res;
+    lzma_end( &strm );
+
+    if( rc != LZMA_STREAM_END || len >= c->data_length )
+    {
+        free( out );
+        return 0;
     }
 
-    if( lencheck != 0 )
-        {
-            printf("Length error\n");
-            exit(2);
-        }
+    free( c->data );
+    c->data = out;
+    c->stored_length = len;
+    c->packed = 1;
+
+    return 1;
+}
+
+
+static void *readf( FILE *infp, long size )
+{
+    char *buf = malloc( size ? size : 1 );
+
+    if( buf == 0 )
+    {
+        printf("Out of memory\n");
+        exit(2);
+    }
+
+    fseek( infp, 0L, SEEK_SET );
+
+    if( size != (long)fread( buf, 1, size, infp ) )
+    {
+        printf("Read error\n");
+        exit(2);
+    }
+
+    return buf;
 }
 
 int main( int ac, char **av )
 {
-    if( (ac < 3) || (av[0][0] == '-') )
+    int zflag = 0;
+
+    if( (ac > 1) && (0 == strcmp( av[1], "-z" )) )
+    {
+        zflag = 1;
+        ac--; av++;
+    }
+
+    if( (ac < 3) || (av[1][0] == '-') )
     {
         printf(
                "mkbulk: combine Phantom class files to a special\n"
                "bulk file to bundle with kernel (classes boot module)\n"
                "\n"
-               "Usage: mkbulk outfile infile [...]\n"
+               "Usage: mkbulk [-z] outfile infile [...]\n"
+               "\n"
+               "  -z   LZMA compress class files\n"
               );
         exit(1);
     }
@@ -99,40 +153,34 @@ int main( int ac, char **av )
     ac--;
     av++;
 
-    //printf("                       ----  Writing bulk\n");
-    //printf("                       ----  Writing bulk to %s: ", outfn);
-    //printf("                       ----  Writing bulk to %p: ", outfn);
+    struct mkbulk_class *classes = calloc( ac, sizeof(struct mkbulk_class) );
+    int n = 0, npacked = 0;
 
-    //outf = fopen( outfn, "wb" );
-    outf = fopen( outfn, "w" );
-    if( outf == NULL )
+    if( classes == 0 )
     {
-        printf("Can't open %s for write\n", outfn);
-        exit(1);
+        printf("Out of memory\n");
+        exit(2);
     }
 
-    //printf("Writing bulk to %s: ", outfn);
-
-
     while( ac-- )
     {
         const char *infn = *av++;
 
-        const cns = 1024;
+        const int cns = 1024;
         char cn[cns];
         int fail = fn2cn( cn, infn, cns );
 
         if(fail) continue;
 
+        cnnorm( cn );
+
         FILE *inf = fopen( infn, "rb" );
-        if( outf == NULL )
+        if( inf == NULL )
         {
             printf("can't open %s, skip%c ", infn, ac == 0 ? ' ' : ',');
             continue;
         }
 
-        //printf("%s%c ", infn, ac == 0 ? ' ' : ',' );
-
         if( fseek( inf, 0, SEEK_END ) )
         {
             printf("can't seek %s, skip%c ", infn, ac == 0 ? ' ' : ',');
@@ -143,20 +191,54 @@ int main( int ac, char **av )
         long size = ftell(inf);
 
         // TODO read class name from the class file!
-        save_hdr( cn, size );
-        copyf( outf, inf, (int)size );
+        struct mkbulk_class *c = classes + n++;
 
-        if(ferror(inf) || ferror(outf))
+        c->name = strdup( cn );
+        c->order = n;
+        c->data = readf( inf, size );
+        c->stored_length = size;
+        c->data_length = size;
+
+        if( zflag )
+            npacked += pack( c );
+
+        fclose( inf );
+    }
+
+    qsort( classes, n, sizeof(struct mkbulk_class), cncmp );
+
+    // Old format loader found first one of equally named
+    int i, j;
+    for( i = j = 0; i < n; i++ )
+    {
+        if( j > 0 && 0 == strcmp( classes[j-1].name, classes[i].name ) )
         {
-            printf("I/O error\n");
-            exit(2);
+            printf("duplicate class %s, skip, ", classes[i].name );
+            continue;
         }
+        classes[j++] = classes[i];
+    }
+    n = j;
 
-        fclose( inf );
+    outf = fopen( outfn, "wb" );
+    if( outf == NULL )
+    {
+        printf("Can't open %s for write\n", outfn);
+        exit(1);
+    }
+
+    save_bulk( n, classes );
+
+    if(ferror(outf))
+    {
+        printf("I/O error\n");
+        exit(2);
     }
 
     fclose(outf);
-    //printf("done\n");
+
+    if( zflag )
+        printf("%d of %d classes packed\n", npacked, n );
+
     return 0;
 }
-
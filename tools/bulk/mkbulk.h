@@ -0,0 +1,27 @@
+/**
+ *
+ * Phantom OS
+ *
+ * Copyright (C) 2005-2011 Dmitry Zavalishin, dz@dz.ru
+ *
+ * Bulk file maker: class to put to bulk.
+ *
+**/
+
+#ifndef MKBULK_H
+#define MKBULK_H
+
+struct mkbulk_class
+{
+    char *      name;           // '.' separated, no leading '.'
+    void *      data;           // as stored in file
+    long        stored_length;
+    long        data_length;    // class file size
+    int         packed;         // data is .lzma stream
+    int         order;          // on command line
+};
+
+// Write indexed bulk file, classes are sorted by name
+void save_bulk( int n, struct mkbulk_class *c );
+
+#endif // MKBULK_H
@@ -1,17 +1,64 @@
+
 #include <vm/bulk.h>
 
-int fwrite( void *, int, int, void * );
+#include "mkbulk.h"
+
+int fwrite( const void *, int, int, void * );
+void exit( int );
+int printf( const char *, ... );
 
 extern void *outf;
 
-void save_hdr( char *classnm, long size )
+static void save( const void *data, int size )
 {
-    struct pvm_bulk_class_head h;
-    strncpy( h.name, classnm, PVM_BULK_CN_LENGTH );
-    h.data_length = size;
-
-    //return 1 ==
-    fwrite( &h, sizeof(h), 1, outf );
+    if( size > 0 && 1 != fwrite( data, size, 1, outf ) )
+    {
+        printf("Write error\n");
+        exit(2);
+    }
 }
 
+void save_bulk( int n, struct mkbulk_class *c )
+{
+    struct pvm_bulk_head h;
+    int i;
+
+    u_int32_t names = n * sizeof(struct pvm_bulk_index_entry);
+    u_int32_t index_size = names;
+
+    for( i = 0; i < n; i++ )
+        index_size += strlen( c[i].name ) + 1;
+
+    h.magic = PVM_BULK_MAGIC;
+    h.version = PVM_BULK_VERSION;
+    h.n_classes = n;
+    h.index_size = index_size;
+
+    save( &h, sizeof(h) );
+
+    u_int32_t name_offset = names;
+    u_int32_t data_offset = sizeof(h) + index_size;
+
+    for( i = 0; i < n; i++ )
+    {
+        struct pvm_bulk_index_entry e;
+
+        e.name_offset = name_offset;
+        e.data_offset = data_offset;
+        e.stored_length = c[i].stored_length;
+        e.data_length = c[i].data_length;
+        e.flags = c[i].packed ? PVM_BULK_FLAG_LZMA : 0;
+
+        save( &e, sizeof(e) );
+
+        name_offset += strlen( c[i].name ) + 1;
+        data_offset += c[i].stored_length;
+    }
+
+    for( i = 0; i < n; i++ )
+        save( c[i].name, strlen( c[i].name ) + 1 );
+
+    for( i = 0; i < n; i++ )
+        save( c[i].data, c[i].stored_length );
+}
 